@@ -0,0 +1,858 @@
+/**
+ * TLS 1.3 load generator for server.c
+ *
+ * Keeps a fixed number of connections busy against the server, closing and
+ * reopening each one after its requests, and reports handshakes/sec,
+ * requests/sec and p50/p99/p999 latency. Every ciphersuite and group the
+ * server offers can be measured on its own, with full and resumed handshakes
+ * side by side.
+ */
+
+#define _GNU_SOURCE
+
+#include <mbedtls/build_info.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/x509_crt.h>
+#include <mbedtls/error.h>
+#include <psa/crypto.h>
+
+// Same Mbed TLS 4 API as the server
+#if !defined(MBEDTLS_VERSION_MAJOR) || MBEDTLS_VERSION_MAJOR < 4
+#error "Mbed TLS 4 is required (see Mbed_TLS_4_install.md)"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#define DEFAULT_HOST "localhost"
+#define DEFAULT_PORT "8443"
+#define DEFAULT_CONNECTIONS 64
+#define DEFAULT_DURATION 5 // seconds per run
+#define MAX_EVENTS 256
+#define RESPONSE_BUF_SIZE 16384
+
+/* --- Parameter Sets --- */
+
+// Same entries, in the same order, as ciphers[] and groups[] in server.c
+static const struct
+{
+    const char *name;
+    int id;
+} ciphers[] = {
+    {"TLS1-3-CHACHA20-POLY1305-SHA256", MBEDTLS_TLS1_3_CHACHA20_POLY1305_SHA256},
+    {"TLS1-3-AES-256-GCM-SHA384", MBEDTLS_TLS1_3_AES_256_GCM_SHA384},
+    {"TLS1-3-AES-128-GCM-SHA256", MBEDTLS_TLS1_3_AES_128_GCM_SHA256},
+};
+
+static const struct
+{
+    const char *name;
+    uint16_t id;
+} groups[] = {
+    {"secp256r1", MBEDTLS_SSL_IANA_TLS_GROUP_SECP256R1},
+    {"secp384r1", MBEDTLS_SSL_IANA_TLS_GROUP_SECP384R1},
+};
+
+#define NUM_CIPHERS (int)(sizeof(ciphers) / sizeof(ciphers[0]))
+#define NUM_GROUPS (int)(sizeof(groups) / sizeof(groups[0]))
+
+/* --- Types --- */
+
+typedef struct
+{
+    const char *host;
+    const char *port;
+    const char *cacert;
+    const char *path;
+    int connections;
+    int threads;
+    int duration;
+    int requests; // per connection; 0 measures handshakes only
+    int cipher;   // index into ciphers[], or -1 for every entry
+    int group;    // index into groups[], or -1 for every entry
+    int full;     // measure full handshakes
+    int resumed;  // measure ticket-resumed handshakes
+} bench_options_t;
+
+/**
+ * Latency samples in microseconds; sorted once at the end of a run
+ */
+typedef struct
+{
+    uint32_t *v;
+    size_t n;
+    size_t cap;
+} samples_t;
+
+typedef enum
+{
+    SLOT_CONNECTING,
+    SLOT_HANDSHAKE,
+    SLOT_TICKET, // handshake-only resumed runs still need the ticket for the next connection
+    SLOT_SEND,
+    SLOT_RECV
+} slot_state_t;
+
+struct bench_thread;
+
+/**
+ * One client connection, reopened as soon as it finishes so the offered
+ * load stays constant
+ */
+typedef struct
+{
+    struct bench_thread *thread;
+    mbedtls_net_context net;
+    mbedtls_ssl_context ssl;
+    mbedtls_ssl_session session; // ticket from the previous connection
+    int have_session;
+    int offered_session;
+    slot_state_t state;
+    int requests_left;
+    uint64_t started_ns;
+
+    unsigned char buf[RESPONSE_BUF_SIZE];
+    size_t len;
+    size_t sent;
+    size_t expected; // response head + body, once the head is complete
+} slot_t;
+
+typedef struct bench_thread
+{
+    pthread_t thread;
+    const bench_options_t *opt;
+    const mbedtls_ssl_config *conf;
+    const struct addrinfo *addr;
+    const char *request;
+    size_t request_len;
+    int resumed;
+    int epoll_fd;
+    slot_t *slots;
+    int slot_count;
+    uint64_t deadline_ns;
+
+    unsigned long handshakes_full;
+    unsigned long handshakes_resumed;
+    unsigned long requests;
+    unsigned long errors;
+    samples_t hs_full;
+    samples_t hs_resumed;
+    samples_t req;
+} bench_thread_t;
+
+/* --- Utility Functions --- */
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void samples_add(samples_t *s, uint64_t ns)
+{
+    if (s->n == s->cap)
+    {
+        size_t cap = s->cap ? s->cap * 2 : 4096;
+        uint32_t *v = realloc(s->v, cap * sizeof(*v));
+        if (v == NULL)
+            return;
+        s->v = v;
+        s->cap = cap;
+    }
+    uint64_t us = ns / 1000;
+    s->v[s->n++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+static void samples_merge(samples_t *into, samples_t *from)
+{
+    for (size_t i = 0; i < from->n; i++)
+        samples_add(into, (uint64_t)from->v[i] * 1000);
+    free(from->v);
+    memset(from, 0, sizeof(*from));
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Nearest-rank percentile in milliseconds; `s` must be sorted
+ */
+static double percentile_ms(const samples_t *s, double p)
+{
+    if (s->n == 0)
+        return 0.0;
+    size_t rank = (size_t)(p * (double)s->n + 0.999999);
+    if (rank == 0)
+        rank = 1;
+    if (rank > s->n)
+        rank = s->n;
+    return (double)s->v[rank - 1] / 1000.0;
+}
+
+/* --- Connection Engine --- */
+
+static int is_want_io(int ret)
+{
+    return ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE;
+}
+
+static int slot_connect(slot_t *slot)
+{
+    bench_thread_t *t = slot->thread;
+    const struct addrinfo *ai = t->addr;
+
+    slot->started_ns = now_ns();
+    int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+    if (fd < 0)
+        return -1;
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return -1;
+    }
+
+    slot->net.fd = fd;
+    slot->state = SLOT_CONNECTING;
+    slot->requests_left = t->opt->requests;
+    slot->len = slot->sent = slot->expected = 0;
+
+    mbedtls_ssl_session_reset(&slot->ssl);
+    slot->offered_session = 0;
+    if (t->resumed && slot->have_session && mbedtls_ssl_set_session(&slot->ssl, &slot->session) == 0)
+        slot->offered_session = 1;
+
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = slot};
+    if (epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+    {
+        mbedtls_net_free(&slot->net);
+        return -1;
+    }
+    return 0;
+}
+
+static void slot_disconnect(slot_t *slot)
+{
+    if (slot->net.fd < 0)
+        return;
+    if (slot->state != SLOT_CONNECTING)
+        mbedtls_ssl_close_notify(&slot->ssl); // best effort, never waited for
+    mbedtls_net_free(&slot->net);
+}
+
+/**
+ * Keep the newest ticket so the next connection on this slot can resume
+ */
+static void slot_save_session(slot_t *slot)
+{
+    mbedtls_ssl_session_free(&slot->session);
+    mbedtls_ssl_session_init(&slot->session);
+    slot->have_session = mbedtls_ssl_get_session(&slot->ssl, &slot->session) == 0;
+}
+
+/**
+ * Once the head is in, work out how long the whole response is.
+ * Returns 0 while the head is incomplete, -1 if it cannot be framed.
+ */
+static int frame_response(slot_t *slot)
+{
+    unsigned char *end = memmem(slot->buf, slot->len, "\r\n\r\n", 4);
+    if (end == NULL)
+        return slot->len == sizeof(slot->buf) ? -1 : 0;
+
+    size_t head_len = (size_t)(end - slot->buf) + 4;
+    *end = '\0';
+    const char *cl = strcasestr((const char *)slot->buf, "\r\nContent-Length:");
+    *end = '\r';
+    if (cl == NULL)
+        return -1;
+    slot->expected = head_len + strtoul(cl + 17, NULL, 10);
+    return 0;
+}
+
+/**
+ * Drive one connection as far as the socket allows.
+ * Returns 0 while waiting for I/O, 1 when it is done, -1 on error.
+ */
+static int slot_advance(slot_t *slot)
+{
+    bench_thread_t *t = slot->thread;
+    int ret;
+
+    for (;;)
+    {
+        switch (slot->state)
+        {
+        case SLOT_CONNECTING:
+        {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (getsockopt(slot->net.fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err == EINPROGRESS)
+                return 0;
+            if (err != 0)
+                return -1;
+            slot->state = SLOT_HANDSHAKE;
+            break;
+        }
+
+        case SLOT_HANDSHAKE:
+            ret = mbedtls_ssl_handshake(&slot->ssl);
+            if (is_want_io(ret))
+                return 0;
+            if (ret != 0)
+                return -1;
+
+            // Counted by what was offered; the server's SIGUSR1 stats show how many it accepted
+            if (slot->offered_session)
+            {
+                t->handshakes_resumed++;
+                samples_add(&t->hs_resumed, now_ns() - slot->started_ns);
+            }
+            else
+            {
+                t->handshakes_full++;
+                samples_add(&t->hs_full, now_ns() - slot->started_ns);
+            }
+
+            if (slot->requests_left > 0)
+                slot->state = SLOT_SEND;
+            else if (t->resumed)
+                slot->state = SLOT_TICKET;
+            else
+                return 1;
+            break;
+
+        case SLOT_TICKET:
+            ret = mbedtls_ssl_read(&slot->ssl, slot->buf, sizeof(slot->buf));
+            if (ret == MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET)
+            {
+                slot_save_session(slot);
+                return 1;
+            }
+            if (is_want_io(ret))
+                return 0;
+            return -1;
+
+        case SLOT_SEND:
+            if (slot->sent == 0)
+                slot->started_ns = now_ns();
+            while (slot->sent < t->request_len)
+            {
+                ret = mbedtls_ssl_write(&slot->ssl, (const unsigned char *)t->request + slot->sent,
+                                        t->request_len - slot->sent);
+                if (is_want_io(ret))
+                    return 0;
+                if (ret < 0)
+                    return -1;
+                slot->sent += (size_t)ret;
+            }
+            slot->len = slot->expected = 0;
+            slot->state = SLOT_RECV;
+            break;
+
+        case SLOT_RECV:
+            if (slot->expected > 0 && slot->len >= slot->expected)
+            {
+                t->requests++;
+                samples_add(&t->req, now_ns() - slot->started_ns);
+                slot->sent = 0;
+                if (--slot->requests_left == 0)
+                    return 1;
+                slot->state = SLOT_SEND;
+                break;
+            }
+
+            // Only the head is kept; body bytes are counted and overwritten
+            size_t keep = slot->expected ? 0 : slot->len;
+            ret = mbedtls_ssl_read(&slot->ssl, slot->buf + keep, sizeof(slot->buf) - keep);
+            if (ret == MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET)
+            {
+                slot_save_session(slot);
+                break;
+            }
+            if (is_want_io(ret))
+                return 0;
+            if (ret <= 0)
+                return -1;
+            slot->len += (size_t)ret;
+            if (slot->expected == 0 && frame_response(slot) != 0)
+                return -1;
+            break;
+        }
+    }
+}
+
+/**
+ * Finish or fail a connection and immediately open the next one on the slot
+ */
+static void slot_recycle(slot_t *slot, int ret)
+{
+    bench_thread_t *t = slot->thread;
+
+    if (ret < 0)
+    {
+        t->errors++;
+        slot->have_session = 0;
+    }
+    slot_disconnect(slot);
+
+    while (now_ns() < t->deadline_ns)
+    {
+        if (slot_connect(slot) != 0)
+        {
+            t->errors++;
+            return;
+        }
+        ret = slot_advance(slot);
+        if (ret == 0)
+            return;
+        if (ret < 0)
+            t->errors++;
+        slot_disconnect(slot);
+    }
+}
+
+static void *bench_thread_main(void *arg)
+{
+    bench_thread_t *t = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (int i = 0; i < t->slot_count; i++)
+    {
+        slot_t *slot = &t->slots[i];
+        if (slot_connect(slot) != 0)
+            t->errors++;
+    }
+
+    while (now_ns() < t->deadline_ns)
+    {
+        int timeout_ms = (int)((t->deadline_ns - now_ns()) / 1000000) + 1;
+        int n = epoll_wait(t->epoll_fd, events, MAX_EVENTS, timeout_ms);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            slot_t *slot = events[i].data.ptr;
+            int ret = (events[i].events & EPOLLERR) ? -1 : slot_advance(slot);
+            if (ret != 0)
+                slot_recycle(slot, ret);
+        }
+    }
+
+    // Connections still in flight at the deadline are not counted
+    for (int i = 0; i < t->slot_count; i++)
+        slot_disconnect(&t->slots[i]);
+    return NULL;
+}
+
+/* --- Runs --- */
+
+static int setup_client_config(mbedtls_ssl_config *conf, mbedtls_x509_crt *cacert, const int *suites,
+                               const uint16_t *curves)
+{
+    int ret = mbedtls_ssl_config_defaults(conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                          MBEDTLS_SSL_PRESET_DEFAULT);
+    if (ret != 0)
+        return ret;
+
+    mbedtls_ssl_conf_min_tls_version(conf, MBEDTLS_SSL_VERSION_TLS1_3);
+    mbedtls_ssl_conf_max_tls_version(conf, MBEDTLS_SSL_VERSION_TLS1_3);
+
+    // Offering a single entry forces the server to pick it
+    mbedtls_ssl_conf_ciphersuites(conf, suites);
+    mbedtls_ssl_conf_groups(conf, curves);
+
+    if (cacert != NULL)
+    {
+        mbedtls_ssl_conf_ca_chain(conf, cacert, NULL);
+        mbedtls_ssl_conf_authmode(conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    }
+    else
+    {
+        mbedtls_ssl_conf_authmode(conf, MBEDTLS_SSL_VERIFY_NONE);
+    }
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    mbedtls_ssl_conf_session_tickets(conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+    mbedtls_ssl_conf_tls13_enable_signal_new_session_tickets(conf, MBEDTLS_SSL_TLS1_3_SIGNAL_NEW_SESSION_TICKETS_ENABLED);
+    mbedtls_ssl_conf_tls13_key_exchange_modes(conf, MBEDTLS_SSL_TLS1_3_KEY_EXCHANGE_MODE_ALL);
+#endif
+    return 0;
+}
+
+static void print_header(void)
+{
+    printf("%-32s %-10s %-8s %10s %10s  %-23s %-23s %s\n", "cipher", "group", "mode", "hs/s", "req/s",
+           "handshake p50/p99/p999", "request p50/p99/p999", "errors");
+}
+
+/**
+ * Run one cipher/group/mode combination for opt->duration seconds and print
+ * a result line. Latencies are in milliseconds. Returns 0, 1 when not a
+ * single handshake (or request) completed, or a negative error from setup.
+ */
+static int run_benchmark(const bench_options_t *opt, const struct addrinfo *addr, mbedtls_x509_crt *cacert,
+                         int cipher, int group, int resumed)
+{
+    int suites[2] = {ciphers[cipher].id, 0};
+    uint16_t curves[2] = {groups[group].id, 0};
+    mbedtls_ssl_config conf;
+    char request[512];
+    int ret;
+
+    mbedtls_ssl_config_init(&conf);
+    if ((ret = setup_client_config(&conf, cacert, suites, curves)) != 0)
+    {
+        printf("Failed to set up client config: %d\n", ret);
+        mbedtls_ssl_config_free(&conf);
+        return ret;
+    }
+
+    int request_len = snprintf(request, sizeof(request),
+                               "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: bench_client\r\n\r\n",
+                               opt->path, opt->host);
+
+    bench_thread_t *threads = calloc((size_t)opt->threads, sizeof(*threads));
+    slot_t *slots = calloc((size_t)opt->connections, sizeof(*slots));
+    if (threads == NULL || slots == NULL)
+    {
+        free(threads);
+        free(slots);
+        mbedtls_ssl_config_free(&conf);
+        return -1;
+    }
+
+    // Each thread owns a contiguous run of slots
+    for (int i = 0, first = 0; i < opt->threads; i++)
+    {
+        bench_thread_t *t = &threads[i];
+        t->opt = opt;
+        t->conf = &conf;
+        t->addr = addr;
+        t->request = request;
+        t->request_len = (size_t)request_len;
+        t->resumed = resumed;
+        t->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        t->slots = &slots[first];
+        t->slot_count = opt->connections / opt->threads + (i < opt->connections % opt->threads);
+        for (int j = 0; j < t->slot_count; j++)
+            t->slots[j].thread = t;
+        first += t->slot_count;
+        if (t->epoll_fd < 0)
+            ret = -1;
+    }
+
+    for (int i = 0; ret == 0 && i < opt->connections; i++)
+    {
+        slot_t *slot = &slots[i];
+        mbedtls_net_init(&slot->net);
+        mbedtls_ssl_init(&slot->ssl);
+        mbedtls_ssl_session_init(&slot->session);
+        if ((ret = mbedtls_ssl_setup(&slot->ssl, &conf)) != 0 ||
+            (ret = mbedtls_ssl_set_hostname(&slot->ssl, opt->host)) != 0)
+            break;
+        mbedtls_ssl_set_bio(&slot->ssl, &slot->net, mbedtls_net_send, mbedtls_net_recv, NULL);
+    }
+
+    // Resumed runs start with an untimed second of handshakes so every slot holds a ticket
+    uint64_t start_ns = now_ns();
+    if (ret == 0 && resumed)
+    {
+        for (int i = 0; i < opt->threads; i++)
+        {
+            threads[i].deadline_ns = start_ns + 1000000000ull;
+            pthread_create(&threads[i].thread, NULL, bench_thread_main, &threads[i]);
+        }
+        for (int i = 0; i < opt->threads; i++)
+        {
+            bench_thread_t *t = &threads[i];
+            pthread_join(t->thread, NULL);
+            free(t->hs_full.v);
+            free(t->hs_resumed.v);
+            free(t->req.v);
+            memset(&t->hs_full, 0, sizeof(t->hs_full));
+            memset(&t->hs_resumed, 0, sizeof(t->hs_resumed));
+            memset(&t->req, 0, sizeof(t->req));
+            t->handshakes_full = t->handshakes_resumed = t->requests = t->errors = 0;
+        }
+        start_ns = now_ns();
+    }
+
+    for (int i = 0; ret == 0 && i < opt->threads; i++)
+    {
+        threads[i].deadline_ns = start_ns + (uint64_t)opt->duration * 1000000000ull;
+        pthread_create(&threads[i].thread, NULL, bench_thread_main, &threads[i]);
+    }
+
+    bench_thread_t total = {0};
+    for (int i = 0; ret == 0 && i < opt->threads; i++)
+    {
+        bench_thread_t *t = &threads[i];
+        pthread_join(t->thread, NULL);
+        total.handshakes_full += t->handshakes_full;
+        total.handshakes_resumed += t->handshakes_resumed;
+        total.requests += t->requests;
+        total.errors += t->errors;
+        samples_merge(&total.hs_full, &t->hs_full);
+        samples_merge(&total.hs_resumed, &t->hs_resumed);
+        samples_merge(&total.req, &t->req);
+    }
+    double secs = (double)(now_ns() - start_ns) / 1e9;
+
+    if (ret == 0)
+    {
+        // In a resumed run a slot without a ticket shows up as a full handshake and is reported separately
+        samples_t *hs = resumed ? &total.hs_resumed : &total.hs_full;
+        unsigned long handshakes = resumed ? total.handshakes_resumed : total.handshakes_full;
+        qsort(hs->v, hs->n, sizeof(uint32_t), compare_u32);
+        qsort(total.req.v, total.req.n, sizeof(uint32_t), compare_u32);
+
+        printf("%-32s %-10s %-8s %10.0f %10.0f  %7.2f/%7.2f/%7.2f %7.2f/%7.2f/%7.2f %lu\n", ciphers[cipher].name,
+               groups[group].name, resumed ? "resumed" : "full", (double)handshakes / secs,
+               (double)total.requests / secs, percentile_ms(hs, 0.50), percentile_ms(hs, 0.99),
+               percentile_ms(hs, 0.999), percentile_ms(&total.req, 0.50), percentile_ms(&total.req, 0.99),
+               percentile_ms(&total.req, 0.999), total.errors);
+        if (resumed && total.handshakes_full > 0)
+            printf("  (%lu connections had no ticket to offer and did a full handshake)\n", total.handshakes_full);
+        // Nothing at all got through: the server is down or refuses this combination
+        if (handshakes + total.handshakes_full == 0 || (opt->requests > 0 && total.requests == 0))
+        {
+            printf("  (no %s completed)\n", handshakes + total.handshakes_full == 0 ? "handshake" : "request");
+            ret = 1;
+        }
+    }
+    else
+    {
+        printf("Failed to set up connections: %d\n", ret);
+    }
+
+    free(total.hs_full.v);
+    free(total.hs_resumed.v);
+    free(total.req.v);
+    for (int i = 0; i < opt->connections; i++)
+    {
+        mbedtls_ssl_free(&slots[i].ssl);
+        mbedtls_ssl_session_free(&slots[i].session);
+    }
+    for (int i = 0; i < opt->threads; i++)
+    {
+        if (threads[i].epoll_fd > 0)
+            close(threads[i].epoll_fd);
+    }
+    free(slots);
+    free(threads);
+    mbedtls_ssl_config_free(&conf);
+    return ret;
+}
+
+/* --- Main --- */
+
+static int find_entry(const char *name, int cipher_table)
+{
+    if (strcmp(name, "all") == 0)
+        return -1;
+    int count = cipher_table ? NUM_CIPHERS : NUM_GROUPS;
+    for (int i = 0; i < count; i++)
+    {
+        if (strcasecmp(name, cipher_table ? ciphers[i].name : groups[i].name) == 0)
+            return i;
+    }
+    return -2;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [options]\n", prog);
+    printf("  -H, --host HOST       server host (default %s)\n", DEFAULT_HOST);
+    printf("  -p, --port PORT       server port (default %s)\n", DEFAULT_PORT);
+    printf("  -c, --connections N   concurrent connections (default %d)\n", DEFAULT_CONNECTIONS);
+    printf("  -t, --threads N       client threads sharing the connections (default 1)\n");
+    printf("  -d, --duration SECS   length of each run (default %d)\n", DEFAULT_DURATION);
+    printf("  -r, --requests N      requests per connection, 0 = handshakes only (default 1)\n");
+    printf("  -u, --path PATH       request path (default /)\n");
+    printf("  -C, --cipher NAME     one ciphersuite, or all (default all)\n");
+    printf("  -g, --group NAME      one group, or all (default all)\n");
+    printf("  -m, --mode MODE       full, resumed or both (default both)\n");
+    printf("  -a, --cacert FILE     verify the server against FILE (default: no verification)\n");
+    printf("  -h, --help            show this help\n");
+    printf("\nCiphers:");
+    for (int i = 0; i < NUM_CIPHERS; i++)
+        printf(" %s", ciphers[i].name);
+    printf("\nGroups:");
+    for (int i = 0; i < NUM_GROUPS; i++)
+        printf(" %s", groups[i].name);
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    bench_options_t opt = {.host = DEFAULT_HOST, .port = DEFAULT_PORT, .path = "/",
+                           .connections = DEFAULT_CONNECTIONS, .threads = 1, .duration = DEFAULT_DURATION,
+                           .requests = 1, .cipher = -1, .group = -1, .full = 1, .resumed = 1};
+    static const struct option long_options[] = {
+        {"host", required_argument, NULL, 'H'},
+        {"port", required_argument, NULL, 'p'},
+        {"connections", required_argument, NULL, 'c'},
+        {"threads", required_argument, NULL, 't'},
+        {"duration", required_argument, NULL, 'd'},
+        {"requests", required_argument, NULL, 'r'},
+        {"path", required_argument, NULL, 'u'},
+        {"cipher", required_argument, NULL, 'C'},
+        {"group", required_argument, NULL, 'g'},
+        {"mode", required_argument, NULL, 'm'},
+        {"cacert", required_argument, NULL, 'a'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}};
+    int opt_char;
+
+    while ((opt_char = getopt_long(argc, argv, "H:p:c:t:d:r:u:C:g:m:a:h", long_options, NULL)) != -1)
+    {
+        switch (opt_char)
+        {
+        case 'H':
+            opt.host = optarg;
+            break;
+        case 'p':
+            opt.port = optarg;
+            break;
+        case 'c':
+            opt.connections = atoi(optarg);
+            break;
+        case 't':
+            opt.threads = atoi(optarg);
+            break;
+        case 'd':
+            opt.duration = atoi(optarg);
+            break;
+        case 'r':
+            opt.requests = atoi(optarg);
+            break;
+        case 'u':
+            opt.path = optarg;
+            break;
+        case 'C':
+            if ((opt.cipher = find_entry(optarg, 1)) == -2)
+            {
+                printf("Unknown cipher %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'g':
+            if ((opt.group = find_entry(optarg, 0)) == -2)
+            {
+                printf("Unknown group %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'm':
+            opt.full = strcmp(optarg, "full") == 0 || strcmp(optarg, "both") == 0;
+            opt.resumed = strcmp(optarg, "resumed") == 0 || strcmp(optarg, "both") == 0;
+            if (!opt.full && !opt.resumed)
+            {
+                printf("Unknown mode %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'a':
+            opt.cacert = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opt.connections < 1 || opt.threads < 1 || opt.duration < 1 || opt.requests < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if (opt.threads > opt.connections)
+        opt.threads = opt.connections;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (psa_crypto_init() != PSA_SUCCESS)
+    {
+        printf("Failed to initialize PSA crypto\n");
+        return 1;
+    }
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_protocol = IPPROTO_TCP};
+    struct addrinfo *addr;
+    if (getaddrinfo(opt.host, opt.port, &hints, &addr) != 0)
+    {
+        printf("Cannot resolve %s:%s\n", opt.host, opt.port);
+        return 1;
+    }
+
+    mbedtls_x509_crt cacert;
+    mbedtls_x509_crt_init(&cacert);
+    if (opt.cacert && mbedtls_x509_crt_parse_file(&cacert, opt.cacert) != 0)
+    {
+        printf("Failed to load %s\n", opt.cacert);
+        freeaddrinfo(addr);
+        return 1;
+    }
+
+    printf("%s:%s, %d connections on %d thread(s), %d s per run, %d request(s) per connection\n\n", opt.host,
+           opt.port, opt.connections, opt.threads, opt.duration, opt.requests);
+    print_header();
+
+    // Runs where nothing completed do not stop the matrix, but the exit status reports them
+    int ret = 0, empty_runs = 0;
+    for (int c = 0; c < NUM_CIPHERS && ret == 0; c++)
+    {
+        if (opt.cipher >= 0 && c != opt.cipher)
+            continue;
+        for (int g = 0; g < NUM_GROUPS && ret == 0; g++)
+        {
+            if (opt.group >= 0 && g != opt.group)
+                continue;
+            for (int resumed = 0; resumed <= 1 && ret == 0; resumed++)
+            {
+                if (resumed ? !opt.resumed : !opt.full)
+                    continue;
+                ret = run_benchmark(&opt, addr, opt.cacert ? &cacert : NULL, c, g, resumed);
+                if (ret > 0)
+                {
+                    empty_runs++;
+                    ret = 0;
+                }
+            }
+        }
+    }
+
+    mbedtls_x509_crt_free(&cacert);
+    freeaddrinfo(addr);
+    mbedtls_psa_crypto_free();
+    return ret == 0 && empty_runs == 0 ? 0 : 1;
+}
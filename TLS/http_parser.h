@@ -0,0 +1,548 @@
+/**
+ * Incremental, allocation-free HTTP/1.x request parser
+ *
+ * Method, path and header fields come back as slices into the caller's
+ * buffer, so nothing is copied. The buffer may grow between calls (more
+ * bytes appended after a partial read); the parser remembers how far it has
+ * already scanned and never rescans those bytes.
+ *
+ * Delimiters are found 32 bytes at a time with AVX2 or 16 at a time with
+ * SSE2, depending on what the compiler targets (-mavx2 / -march=native).
+ * Define HTTP_PARSER_NO_SIMD to force the scalar path.
+ */
+
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#if !defined(HTTP_PARSER_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define HTTP_PARSER_AVX2 1
+#elif !defined(HTTP_PARSER_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define HTTP_PARSER_SSE2 1
+#endif
+
+#define HTTP_MAX_HEADERS 64
+
+#define HTTP_PARSE_INCOMPLETE 0
+#define HTTP_PARSE_ERROR -1
+#define HTTP_PARSE_TOO_MANY_HEADERS -2
+
+typedef struct
+{
+    const char *name;
+    size_t name_len;
+    const char *value;
+    size_t value_len;
+} http_header_t;
+
+/**
+ * Request head; every pointer refers into the buffer given to the parser
+ */
+typedef struct
+{
+    const char *method;
+    size_t method_len;
+    const char *path;
+    size_t path_len;
+    int minor_version;
+    http_header_t headers[HTTP_MAX_HEADERS];
+    size_t num_headers;
+
+    // Message framing, derived from the headers above
+    long long content_length; // -1 when absent
+    int chunked;
+    int keep_alive;
+} http_request_t;
+
+/**
+ * Resume point for a request head that has not fully arrived yet.
+ * Reset with http_parser_reset() before starting the next request.
+ */
+typedef struct
+{
+    size_t scanned; // bytes known not to contain the end of the head
+} http_parser_t;
+
+typedef enum
+{
+    HTTP_CHUNK_SIZE,
+    HTTP_CHUNK_EXT,
+    HTTP_CHUNK_SIZE_LF, // CR seen at the end of the chunk-size line
+    HTTP_CHUNK_DATA,
+    HTTP_CHUNK_DATA_END,
+    HTTP_CHUNK_DATA_LF,
+    HTTP_CHUNK_TRAILER,
+    HTTP_CHUNK_TRAILER_LF,
+    HTTP_CHUNK_DONE
+} http_chunk_state_t;
+
+/**
+ * Streaming chunked-body decoder. Payload bytes are reported, not copied.
+ */
+typedef struct
+{
+    http_chunk_state_t state;
+    unsigned long long remaining; // bytes left in the current chunk
+    int digits;                   // hex digits read on the current chunk-size line
+    size_t trailer_line_len;
+} http_chunked_t;
+
+/* --- Delimiter scanning --- */
+
+/**
+ * Return a bitmask with bit i set where p[i] == c, for the next block.
+ * Block width is 32 (AVX2), 16 (SSE2) or 1 (scalar).
+ */
+#if defined(HTTP_PARSER_AVX2)
+#define HTTP_SCAN_WIDTH 32
+static inline uint32_t http_scan_block(const char *p, char c)
+{
+    __m256i block = _mm256_loadu_si256((const __m256i *)p);
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8(c)));
+}
+
+static inline uint32_t http_scan_block2(const char *p, char c1, char c2)
+{
+    __m256i block = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8(c1)),
+                                  _mm256_cmpeq_epi8(block, _mm256_set1_epi8(c2)));
+    return (uint32_t)_mm256_movemask_epi8(hit);
+}
+#elif defined(HTTP_PARSER_SSE2)
+#define HTTP_SCAN_WIDTH 16
+static inline uint32_t http_scan_block(const char *p, char c)
+{
+    __m128i block = _mm_loadu_si128((const __m128i *)p);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(c)));
+}
+
+static inline uint32_t http_scan_block2(const char *p, char c1, char c2)
+{
+    __m128i block = _mm_loadu_si128((const __m128i *)p);
+    __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(c1)),
+                               _mm_cmpeq_epi8(block, _mm_set1_epi8(c2)));
+    return (uint32_t)_mm_movemask_epi8(hit);
+}
+#endif
+
+/**
+ * First occurrence of c in [p, end), or NULL
+ */
+static inline const char *http_find_char(const char *p, const char *end, char c)
+{
+#if defined(HTTP_SCAN_WIDTH)
+    for (; end - p >= HTTP_SCAN_WIDTH; p += HTTP_SCAN_WIDTH)
+    {
+        uint32_t mask = http_scan_block(p, c);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+#endif
+    for (; p < end; p++)
+    {
+        if (*p == c)
+            return p;
+    }
+    return NULL;
+}
+
+/**
+ * First occurrence of c1 or c2 in [p, end), or NULL
+ */
+static inline const char *http_find_char2(const char *p, const char *end, char c1, char c2)
+{
+#if defined(HTTP_SCAN_WIDTH)
+    for (; end - p >= HTTP_SCAN_WIDTH; p += HTTP_SCAN_WIDTH)
+    {
+        uint32_t mask = http_scan_block2(p, c1, c2);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+#endif
+    for (; p < end; p++)
+    {
+        if (*p == c1 || *p == c2)
+            return p;
+    }
+    return NULL;
+}
+
+/**
+ * Locate the blank line ending the head: only '\n' bytes are candidates,
+ * so a whole block without one is skipped in a single compare.
+ * Returns the offset just past "\r\n\r\n", or 0 if it is not in [from, len).
+ */
+static inline size_t http_find_head_end(const char *buf, size_t from, size_t len)
+{
+    const char *p = buf + (from > 3 ? from : 3);
+    const char *end = buf + len;
+
+#if defined(HTTP_SCAN_WIDTH)
+    for (; end - p >= HTTP_SCAN_WIDTH; p += HTTP_SCAN_WIDTH)
+    {
+        uint32_t mask = http_scan_block(p, '\n');
+        while (mask)
+        {
+            const char *lf = p + __builtin_ctz(mask);
+            if (lf[-1] == '\r' && lf[-2] == '\n' && lf[-3] == '\r')
+                return (size_t)(lf + 1 - buf);
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; p < end; p++)
+    {
+        if (*p == '\n' && p[-1] == '\r' && p[-2] == '\n' && p[-3] == '\r')
+            return (size_t)(p + 1 - buf);
+    }
+    return 0;
+}
+
+/**
+ * Bitmask of the control bytes (0x00-0x1f and 0x7f) in the next block,
+ * leaving out HTAB when `allow_tab` is set
+ */
+#if defined(HTTP_PARSER_AVX2)
+static inline uint32_t http_scan_ctl_block(const char *p, int allow_tab)
+{
+    __m256i block = _mm256_loadu_si256((const __m256i *)p);
+    __m256i printable = _mm256_cmpeq_epi8(_mm256_max_epu8(block, _mm256_set1_epi8(0x20)), block);
+    if (allow_tab)
+        printable = _mm256_or_si256(printable, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\t')));
+    __m256i del = _mm256_cmpeq_epi8(block, _mm256_set1_epi8(0x7f));
+    return ~(uint32_t)_mm256_movemask_epi8(printable) | (uint32_t)_mm256_movemask_epi8(del);
+}
+#elif defined(HTTP_PARSER_SSE2)
+static inline uint32_t http_scan_ctl_block(const char *p, int allow_tab)
+{
+    __m128i block = _mm_loadu_si128((const __m128i *)p);
+    __m128i printable = _mm_cmpeq_epi8(_mm_max_epu8(block, _mm_set1_epi8(0x20)), block);
+    if (allow_tab)
+        printable = _mm_or_si128(printable, _mm_cmpeq_epi8(block, _mm_set1_epi8('\t')));
+    __m128i del = _mm_cmpeq_epi8(block, _mm_set1_epi8(0x7f));
+    return (~(uint32_t)_mm_movemask_epi8(printable) & 0xffff) | (uint32_t)_mm_movemask_epi8(del);
+}
+#endif
+
+/**
+ * Whether [p, end) holds a control byte (HTAB excepted when `allow_tab`).
+ * A bare LF is one, so this also keeps it from passing as a line end.
+ */
+static inline int http_has_ctl(const char *p, const char *end, int allow_tab)
+{
+#if defined(HTTP_SCAN_WIDTH)
+    for (; end - p >= HTTP_SCAN_WIDTH; p += HTTP_SCAN_WIDTH)
+    {
+        if (http_scan_ctl_block(p, allow_tab))
+            return 1;
+    }
+#endif
+    for (; p < end; p++)
+    {
+        unsigned char c = (unsigned char)*p;
+        if ((c < 0x20 && !(allow_tab && c == '\t')) || c == 0x7f)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Whether [p, end) is a non-empty token (RFC 9110 section 5.6.2): methods
+ * and header names. Both are short, so a bit lookup per byte is enough.
+ */
+static inline int http_is_token(const char *p, const char *end)
+{
+    // tchar = "!" / "#" / "$" / "%" / "&" / "'" / "*" / "+" / "-" / "." / "^" / "_" / "`" / "|" / "~" / DIGIT / ALPHA
+    static const uint64_t tchar[2] = {0x03ff6cfa00000000ull, 0x57ffffffc7fffffeull};
+
+    if (p == end)
+        return 0;
+    for (; p < end; p++)
+    {
+        unsigned char c = (unsigned char)*p;
+        if (c >= 128 || !(tchar[c >> 6] >> (c & 63) & 1))
+            return 0;
+    }
+    return 1;
+}
+
+/* --- Request head --- */
+
+static inline int http_token_eq(const char *s, size_t len, const char *token)
+{
+    return strlen(token) == len && strncasecmp(s, token, len) == 0;
+}
+
+static inline void http_parser_reset(http_parser_t *parser)
+{
+    parser->scanned = 0;
+}
+
+/**
+ * Whether the last comma-separated coding in a Transfer-Encoding value is
+ * exactly "chunked": "gzip, chunked" is, "xchunked" and "chunked, gzip" are not
+ */
+static inline int http_te_ends_chunked(const char *value, size_t len)
+{
+    size_t start = len;
+    while (start > 0 && value[start - 1] != ',')
+        start--;
+    while (start < len && (value[start] == ' ' || value[start] == '\t'))
+        start++;
+    return http_token_eq(value + start, len - start, "chunked");
+}
+
+static inline int http_parse_framing(http_request_t *req, const http_header_t *h)
+{
+    if (http_token_eq(h->name, h->name_len, "Content-Length"))
+    {
+        long long n = 0;
+        if (h->value_len == 0 || h->value_len > 18 || req->content_length >= 0)
+            return HTTP_PARSE_ERROR;
+        for (size_t i = 0; i < h->value_len; i++)
+        {
+            if (h->value[i] < '0' || h->value[i] > '9')
+                return HTTP_PARSE_ERROR;
+            n = n * 10 + (h->value[i] - '0');
+        }
+        req->content_length = n;
+    }
+    else if (http_token_eq(h->name, h->name_len, "Transfer-Encoding"))
+    {
+        // Only "chunked" as the final coding is supported; anything else cannot be framed
+        if (req->chunked || !http_te_ends_chunked(h->value, h->value_len))
+            return HTTP_PARSE_ERROR;
+        req->chunked = 1;
+    }
+    else if (http_token_eq(h->name, h->name_len, "Connection"))
+    {
+        if (http_token_eq(h->value, h->value_len, "close"))
+            req->keep_alive = 0;
+        else if (http_token_eq(h->value, h->value_len, "keep-alive"))
+            req->keep_alive = 1;
+    }
+    return 0;
+}
+
+/**
+ * Parse the request head at the start of buf[0, len).
+ * Call again with the same buffer (and more bytes) after HTTP_PARSE_INCOMPLETE.
+ * Returns the head length including the blank line, HTTP_PARSE_INCOMPLETE,
+ * HTTP_PARSE_ERROR or HTTP_PARSE_TOO_MANY_HEADERS.
+ */
+static inline int http_parse_request(http_parser_t *parser, const unsigned char *buf, size_t len,
+                                     http_request_t *req)
+{
+    const char *start = (const char *)buf;
+    size_t head_len = http_find_head_end(start, parser->scanned, len);
+    if (head_len == 0)
+    {
+        // Each '\n' is checked against the bytes before it, so a terminator
+        // split across reads is still found when scanning resumes here
+        parser->scanned = len;
+        return HTTP_PARSE_INCOMPLETE;
+    }
+
+    const char *end = start + head_len - 2; // at the final CRLF
+
+    // Request line: METHOD SP PATH SP HTTP/1.x CRLF
+    const char *line_end = http_find_char(start, end + 1, '\r');
+    const char *sp1 = http_find_char(start, line_end, ' ');
+    if (sp1 == NULL || !http_is_token(start, sp1))
+        return HTTP_PARSE_ERROR;
+    const char *sp2 = http_find_char(sp1 + 1, line_end, ' ');
+    if (sp2 == NULL || sp2 == sp1 + 1 || line_end - sp2 != 9 || memcmp(sp2 + 1, "HTTP/1.", 7) != 0)
+        return HTTP_PARSE_ERROR;
+    if ((sp2[8] != '0' && sp2[8] != '1') || line_end[1] != '\n')
+        return HTTP_PARSE_ERROR;
+    // No control bytes in the target; a bare LF there is not a line end either: accepting it
+    // here while a proxy in front does not is a desync
+    if (http_has_ctl(sp1 + 1, sp2, 0))
+        return HTTP_PARSE_ERROR;
+
+    req->method = start;
+    req->method_len = (size_t)(sp1 - start);
+    req->path = sp1 + 1;
+    req->path_len = (size_t)(sp2 - sp1 - 1);
+    req->minor_version = sp2[8] - '0';
+    req->num_headers = 0;
+    req->content_length = -1;
+    req->chunked = 0;
+    req->keep_alive = req->minor_version == 1;
+
+    // Header fields: one SIMD scan finds the colon (or a premature CR), another the CR
+    for (const char *line = line_end + 2; line < end;)
+    {
+        // The name must be a token, which also rules out whitespace before the colon and an
+        // obs-fold continuation line (leading SP or HTAB) posing as a header of its own
+        const char *colon = http_find_char2(line, end, ':', '\r');
+        if (colon == NULL || *colon != ':' || !http_is_token(line, colon))
+            return HTTP_PARSE_ERROR;
+        const char *eol = http_find_char(colon, end + 1, '\r');
+        if (eol == NULL || eol[1] != '\n' || http_has_ctl(colon + 1, eol, 1))
+            return HTTP_PARSE_ERROR;
+        if (req->num_headers == HTTP_MAX_HEADERS)
+            return HTTP_PARSE_TOO_MANY_HEADERS;
+
+        const char *value = colon + 1;
+        while (value < eol && (*value == ' ' || *value == '\t'))
+            value++;
+        const char *value_end = eol;
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+            value_end--;
+
+        http_header_t *h = &req->headers[req->num_headers++];
+        h->name = line;
+        h->name_len = (size_t)(colon - line);
+        h->value = value;
+        h->value_len = (size_t)(value_end - value);
+        if (http_parse_framing(req, h) != 0)
+            return HTTP_PARSE_ERROR;
+
+        line = eol + 2;
+    }
+
+    // Both framings at once is a request-smuggling vector
+    if (req->chunked && req->content_length >= 0)
+        return HTTP_PARSE_ERROR;
+
+    parser->scanned = 0;
+    return (int)head_len;
+}
+
+/**
+ * Find a header by name (case-insensitive). Returns NULL when absent.
+ */
+static inline const http_header_t *http_find_header(const http_request_t *req, const char *name)
+{
+    for (size_t i = 0; i < req->num_headers; i++)
+    {
+        if (http_token_eq(req->headers[i].name, req->headers[i].name_len, name))
+            return &req->headers[i];
+    }
+    return NULL;
+}
+
+/* --- Chunked bodies --- */
+
+static inline void http_chunked_init(http_chunked_t *dec)
+{
+    dec->state = HTTP_CHUNK_SIZE;
+    dec->remaining = 0;
+    dec->digits = 0;
+    dec->trailer_line_len = 0;
+}
+
+static inline int http_chunked_done(const http_chunked_t *dec)
+{
+    return dec->state == HTTP_CHUNK_DONE;
+}
+
+/**
+ * Consume chunked framing from p[0, len). Stops at the end of the body.
+ * Every line must end in exactly CRLF, and a chunk size needs at least one
+ * hex digit: anything looser lets a request be framed differently here than
+ * by a proxy in front (request smuggling).
+ * Returns the number of bytes consumed, or -1 on malformed framing.
+ */
+static inline long http_chunked_consume(http_chunked_t *dec, const unsigned char *p, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len && dec->state != HTTP_CHUNK_DONE)
+    {
+        unsigned char c = p[i];
+
+        switch (dec->state)
+        {
+        case HTTP_CHUNK_SIZE:
+            i++;
+            if (dec->digits < 15 && ((c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')))
+            {
+                dec->remaining = dec->remaining * 16 + (unsigned)(c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+                dec->digits++;
+            }
+            else if (dec->digits == 0)
+                return -1;
+            else if (c == ';')
+                dec->state = HTTP_CHUNK_EXT;
+            else if (c == '\r')
+                dec->state = HTTP_CHUNK_SIZE_LF;
+            else
+                return -1;
+            break;
+
+        case HTTP_CHUNK_EXT:
+            // Extensions are skipped; they end at the CR, and may not hold a bare LF
+            i++;
+            if (c == '\r')
+                dec->state = HTTP_CHUNK_SIZE_LF;
+            else if (c == '\n')
+                return -1;
+            break;
+
+        case HTTP_CHUNK_SIZE_LF:
+            i++;
+            if (c != '\n')
+                return -1;
+            dec->state = dec->remaining ? HTTP_CHUNK_DATA : HTTP_CHUNK_TRAILER;
+            dec->digits = 0;
+            dec->trailer_line_len = 0;
+            break;
+
+        case HTTP_CHUNK_DATA:
+        {
+            size_t n = len - i < dec->remaining ? len - i : (size_t)dec->remaining;
+            i += n;
+            dec->remaining -= n;
+            if (dec->remaining == 0)
+                dec->state = HTTP_CHUNK_DATA_END;
+            break;
+        }
+
+        case HTTP_CHUNK_DATA_END:
+            i++;
+            if (c != '\r')
+                return -1;
+            dec->state = HTTP_CHUNK_DATA_LF;
+            break;
+
+        case HTTP_CHUNK_DATA_LF:
+            i++;
+            if (c != '\n')
+                return -1;
+            dec->state = HTTP_CHUNK_SIZE;
+            break;
+
+        case HTTP_CHUNK_TRAILER:
+            i++;
+            if (c == '\r')
+                dec->state = HTTP_CHUNK_TRAILER_LF;
+            else if (c == '\n')
+                return -1;
+            else
+                dec->trailer_line_len++;
+            break;
+
+        case HTTP_CHUNK_TRAILER_LF:
+            i++;
+            if (c != '\n')
+                return -1;
+            dec->state = dec->trailer_line_len == 0 ? HTTP_CHUNK_DONE : HTTP_CHUNK_TRAILER;
+            dec->trailer_line_len = 0;
+            break;
+
+        case HTTP_CHUNK_DONE:
+            break;
+        }
+    }
+    return (long)i;
+}
+
+#endif /* HTTP_PARSER_H */
@@ -0,0 +1,267 @@
+/**
+ * Kernel TLS (kTLS) for a TLS 1.3 server connection made with Mbed TLS
+ *
+ * Once the handshake is over, the application traffic keys are derived from
+ * the secrets Mbed TLS exports and installed on the socket with
+ * TCP_ULP "tls", after which data moves with plain send()/recv().
+ *
+ * The record sequence numbers come from fields Mbed TLS keeps private
+ * (MBEDTLS_PRIVATE(in_ctr), MBEDTLS_PRIVATE(cur_out_ctr)), which may change
+ * between releases. The server therefore only compiles this in with
+ * SERVER_KTLS, which the Makefile sets once tests/ktls_test has completed a
+ * round trip through a kernel TLS socket against the same Mbed TLS.
+ */
+
+#ifndef KTLS_H
+#define KTLS_H
+
+#include <errno.h>
+#include <string.h>
+#include <linux/tls.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/platform_util.h>
+#include <mbedtls/ssl.h>
+#include <psa/crypto.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+/**
+ * Application traffic secrets captured during the handshake
+ */
+typedef struct
+{
+    unsigned char client_secret[48];
+    unsigned char server_secret[48];
+    size_t secret_len;
+    mbedtls_tls_prf_types secret_hash;
+} ktls_secrets_t;
+
+/**
+ * Key export callback (mbedtls_ssl_set_export_keys_cb, with a ktls_secrets_t):
+ * keep the TLS 1.3 application traffic secrets; the kernel needs keys
+ * derived from them once the handshake is over
+ */
+static void ktls_capture_secrets(void *p_expkey, mbedtls_ssl_key_export_type type, const unsigned char *secret,
+                                 size_t secret_len, const unsigned char client_random[32],
+                                 const unsigned char server_random[32], mbedtls_tls_prf_types tls_prf_type)
+{
+    ktls_secrets_t *secrets = p_expkey;
+    (void)client_random;
+    (void)server_random;
+
+    if (secret_len > sizeof(secrets->client_secret))
+        return;
+    if (type == MBEDTLS_SSL_KEY_EXPORT_TLS1_3_CLIENT_APPLICATION_TRAFFIC_SECRET)
+        memcpy(secrets->client_secret, secret, secret_len);
+    else if (type == MBEDTLS_SSL_KEY_EXPORT_TLS1_3_SERVER_APPLICATION_TRAFFIC_SECRET)
+        memcpy(secrets->server_secret, secret, secret_len);
+    else
+        return;
+    secrets->secret_len = secret_len;
+    secrets->secret_hash = tls_prf_type;
+}
+
+/**
+ * HKDF-Expand-Label(secret, label, "", out_len) from RFC 8446 section 7.1
+ */
+static int tls13_expand_label(mbedtls_tls_prf_types hash, const unsigned char *secret, size_t secret_len,
+                              const char *label, unsigned char *out, size_t out_len)
+{
+    psa_algorithm_t alg = hash == MBEDTLS_SSL_TLS_PRF_SHA384 ? PSA_ALG_SHA_384 : PSA_ALG_SHA_256;
+    psa_key_derivation_operation_t op = PSA_KEY_DERIVATION_OPERATION_INIT;
+    unsigned char info[2 + 1 + 6 + 8 + 1];
+    size_t label_len = strlen(label);
+
+    // struct { uint16 length; opaque label<7..255> = "tls13 " + label; opaque context<0..255> = ""; }
+    info[0] = (unsigned char)(out_len >> 8);
+    info[1] = (unsigned char)out_len;
+    info[2] = (unsigned char)(6 + label_len);
+    memcpy(info + 3, "tls13 ", 6);
+    memcpy(info + 9, label, label_len);
+    info[9 + label_len] = 0;
+
+    psa_status_t status = psa_key_derivation_setup(&op, PSA_ALG_HKDF_EXPAND(alg));
+    if (status == PSA_SUCCESS)
+        status = psa_key_derivation_input_bytes(&op, PSA_KEY_DERIVATION_INPUT_SECRET, secret, secret_len);
+    if (status == PSA_SUCCESS)
+        status = psa_key_derivation_input_bytes(&op, PSA_KEY_DERIVATION_INPUT_INFO, info, 10 + label_len);
+    if (status == PSA_SUCCESS)
+        status = psa_key_derivation_output_bytes(&op, out, out_len);
+    psa_key_derivation_abort(&op);
+    return status == PSA_SUCCESS ? 0 : -1;
+}
+
+typedef union
+{
+    struct tls_crypto_info info;
+    struct tls12_crypto_info_aes_gcm_128 aes128;
+    struct tls12_crypto_info_aes_gcm_256 aes256;
+#if defined(TLS_CIPHER_CHACHA20_POLY1305)
+    struct tls12_crypto_info_chacha20_poly1305 chacha;
+#endif
+} ktls_crypto_info_t;
+
+/**
+ * Fill the kernel's crypto_info for one direction: key and IV come from the
+ * traffic secret, the record sequence number from Mbed TLS.
+ * Returns the structure size, or 0 for a ciphersuite the kernel cannot take.
+ */
+static size_t ktls_crypto_info(ktls_crypto_info_t *ci, int ciphersuite, mbedtls_tls_prf_types hash,
+                               const unsigned char *secret, size_t secret_len, const unsigned char seq[8])
+{
+    unsigned char key[32], iv[12];
+    size_t key_len, size;
+
+    switch (ciphersuite)
+    {
+    case MBEDTLS_TLS1_3_AES_128_GCM_SHA256:
+        key_len = 16;
+        break;
+    case MBEDTLS_TLS1_3_AES_256_GCM_SHA384:
+        key_len = 32;
+        break;
+#if defined(TLS_CIPHER_CHACHA20_POLY1305)
+    case MBEDTLS_TLS1_3_CHACHA20_POLY1305_SHA256:
+        key_len = 32;
+        break;
+#endif
+    default:
+        return 0;
+    }
+
+    if (tls13_expand_label(hash, secret, secret_len, "key", key, key_len) != 0 ||
+        tls13_expand_label(hash, secret, secret_len, "iv", iv, sizeof(iv)) != 0)
+        return 0;
+
+    memset(ci, 0, sizeof(*ci));
+    ci->info.version = TLS_1_3_VERSION;
+    if (ciphersuite == MBEDTLS_TLS1_3_AES_128_GCM_SHA256)
+    {
+        // The kernel splits the 12-byte IV into a 4-byte salt and an 8-byte explicit part
+        ci->info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        memcpy(ci->aes128.key, key, key_len);
+        memcpy(ci->aes128.salt, iv, 4);
+        memcpy(ci->aes128.iv, iv + 4, 8);
+        memcpy(ci->aes128.rec_seq, seq, 8);
+        size = sizeof(ci->aes128);
+    }
+    else if (ciphersuite == MBEDTLS_TLS1_3_AES_256_GCM_SHA384)
+    {
+        ci->info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        memcpy(ci->aes256.key, key, key_len);
+        memcpy(ci->aes256.salt, iv, 4);
+        memcpy(ci->aes256.iv, iv + 4, 8);
+        memcpy(ci->aes256.rec_seq, seq, 8);
+        size = sizeof(ci->aes256);
+    }
+#if defined(TLS_CIPHER_CHACHA20_POLY1305)
+    else
+    {
+        ci->info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+        memcpy(ci->chacha.key, key, key_len);
+        memcpy(ci->chacha.iv, iv, sizeof(iv));
+        memcpy(ci->chacha.rec_seq, seq, 8);
+        size = sizeof(ci->chacha);
+    }
+#endif
+
+    mbedtls_platform_zeroize(key, sizeof(key));
+    mbedtls_platform_zeroize(iv, sizeof(iv));
+    return size;
+}
+
+/**
+ * Hand the record layer of a server connection to the kernel once its
+ * handshake is over. Each direction is installed separately and falls back
+ * to Mbed TLS on its own, so a kernel without TLS_RX (or without ChaCha20)
+ * still offloads what it can; *rx and *tx are set for the directions that
+ * now belong to the kernel. The secrets are wiped either way.
+ * Returns a short description for the handshake log.
+ */
+static const char *ktls_install(int fd, mbedtls_ssl_context *ssl, ktls_secrets_t *secrets, int *rx, int *tx)
+{
+    const char *result = "off (unsupported ciphersuite)";
+    ktls_crypto_info_t ci;
+    size_t size;
+
+    *rx = *tx = 0;
+    // Bytes Mbed TLS has already pulled off the socket would never reach the kernel
+    if (mbedtls_ssl_check_pending(ssl) || secrets->secret_len == 0)
+    {
+        result = "off (records already buffered)";
+        goto cleanup;
+    }
+    if (setsockopt(fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) != 0)
+    {
+        result = errno == ENOENT ? "off (tls module not loaded)" : "off (TCP_ULP failed)";
+        goto cleanup;
+    }
+
+    int ciphersuite = mbedtls_ssl_get_ciphersuite_id_from_ssl(ssl);
+    size = ktls_crypto_info(&ci, ciphersuite, secrets->secret_hash, secrets->client_secret, secrets->secret_len,
+                            ssl->MBEDTLS_PRIVATE(in_ctr));
+    if (size && setsockopt(fd, SOL_TLS, TLS_RX, &ci, (socklen_t)size) == 0)
+        *rx = 1;
+
+    size = ktls_crypto_info(&ci, ciphersuite, secrets->secret_hash, secrets->server_secret, secrets->secret_len,
+                            ssl->MBEDTLS_PRIVATE(cur_out_ctr));
+    if (size && setsockopt(fd, SOL_TLS, TLS_TX, &ci, (socklen_t)size) == 0)
+        *tx = 1;
+    mbedtls_platform_zeroize(&ci, sizeof(ci));
+
+    if (*rx || *tx)
+        result = *rx && *tx ? "tx+rx" : *tx ? "tx only" : "rx only";
+
+cleanup:
+    mbedtls_platform_zeroize(secrets, sizeof(*secrets));
+    return result;
+}
+
+/**
+ * recv() on an offloaded socket. Anything but application data (an alert,
+ * or a KeyUpdate the kernel cannot act on) ends the connection.
+ */
+static int ktls_recv(int fd, unsigned char *buf, size_t len)
+{
+    char control[CMSG_SPACE(sizeof(unsigned char))];
+    struct iovec iov = {.iov_base = buf, .iov_len = len};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                         .msg_controllen = sizeof(control)};
+
+    ssize_t n = recvmsg(fd, &msg, 0);
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_RECV_FAILED;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_TLS && cmsg->cmsg_type == TLS_GET_RECORD_TYPE &&
+        *CMSG_DATA(cmsg) != MBEDTLS_SSL_MSG_APPLICATION_DATA)
+        return 0;
+    return (int)n;
+}
+
+/**
+ * Send a close_notify alert through the kernel's record layer
+ */
+static void ktls_close_notify(int fd)
+{
+    unsigned char alert[2] = {MBEDTLS_SSL_ALERT_LEVEL_WARNING, MBEDTLS_SSL_ALERT_MSG_CLOSE_NOTIFY};
+    char control[CMSG_SPACE(sizeof(unsigned char))] = {0};
+    struct iovec iov = {.iov_base = alert, .iov_len = sizeof(alert)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                         .msg_controllen = sizeof(control)};
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_TLS;
+    cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+    *CMSG_DATA(cmsg) = MBEDTLS_SSL_MSG_ALERT;
+    sendmsg(fd, &msg, MSG_DONTWAIT);
+}
+
+#endif /* KTLS_H */
@@ -0,0 +1,642 @@
+/**
+ * Asynchronous structured logger for the server's I/O threads
+ *
+ * log_write() never formats and never touches a file descriptor: it copies
+ * the format pointer, a timestamp and the raw arguments into a fixed-size
+ * record in the calling thread's own ring. A single flusher thread drains
+ * every ring, formats the records and writes them out in batches. Each ring
+ * has one producer and one consumer, so no locks are taken on the hot path;
+ * when a ring is full the record is dropped and counted instead of waiting.
+ *
+ * Format strings must be string literals (they are kept by pointer) and may
+ * use the usual printf conversions. Strings are copied and truncated to fit
+ * the record.
+ *
+ * Keeps its state in static variables: include from one translation unit.
+ */
+
+#ifndef LOG_RING_H
+#define LOG_RING_H
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_RING_RECORDS 1024     // per thread; a power of two
+#define LOG_RECORD_SIZE 256       // header included
+#define LOG_BATCH_SIZE 65536      // formatted bytes handed to one write
+#define LOG_FLUSH_INTERVAL_MS 10  // flusher sleep when every ring is empty
+#define LOG_THREAD_NAME_SIZE 16
+
+typedef enum
+{
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG
+} log_level_t;
+
+static const char *const log_level_names[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+
+/**
+ * One log call; the payload holds the arguments in the order the format
+ * string consumes them: integers and doubles as 8 bytes, strings as a
+ * 16-bit length followed by the bytes
+ */
+typedef struct
+{
+    const char *fmt;
+    uint64_t timestamp_ns;
+    uint16_t len;
+    uint8_t level;
+    unsigned char payload[LOG_RECORD_SIZE - sizeof(const char *) - sizeof(uint64_t) - 4];
+} log_record_t;
+
+typedef struct log_ring
+{
+    _Alignas(64) atomic_size_t head; // next record to format, advanced by the flusher
+    _Alignas(64) atomic_size_t tail; // next free slot, advanced by the owning thread
+    atomic_ulong dropped;
+    char name[LOG_THREAD_NAME_SIZE];
+    struct log_ring *next;
+    log_record_t records[LOG_RING_RECORDS];
+} log_ring_t;
+
+static struct
+{
+    atomic_int level;
+    FILE *out;
+    pthread_t thread;
+    atomic_int running;
+    int started;
+    pthread_mutex_t rings_lock; // guards the list below, never taken by log_write()
+    log_ring_t *_Atomic rings;
+    unsigned long reported_drops;
+    char batch[LOG_BATCH_SIZE];
+    size_t batch_len;
+} log_state = {.level = LOG_INFO, .rings_lock = PTHREAD_MUTEX_INITIALIZER};
+
+static _Thread_local log_ring_t *log_ring_self;
+
+static inline int log_enabled(log_level_t level)
+{
+    return (int)level <= atomic_load_explicit(&log_state.level, memory_order_relaxed);
+}
+
+static inline void log_set_level(log_level_t level)
+{
+    atomic_store_explicit(&log_state.level, (int)level, memory_order_relaxed);
+}
+
+/**
+ * Parses a level name as given on the command line; returns -1 if unknown
+ */
+static inline int log_parse_level(const char *name)
+{
+    for (size_t i = 0; i < sizeof(log_level_names) / sizeof(log_level_names[0]); i++)
+        if (strcasecmp(name, log_level_names[i]) == 0)
+            return (int)i;
+    return -1;
+}
+
+/**
+ * Gives the calling thread's ring a name for the log lines; creates the ring
+ * if the thread has not logged yet. Call once when a thread starts.
+ */
+static log_ring_t *log_thread_name(const char *name)
+{
+    log_ring_t *ring = log_ring_self;
+
+    if (ring == NULL)
+    {
+        ring = calloc(1, sizeof(*ring));
+        if (ring == NULL)
+            return NULL;
+        pthread_mutex_lock(&log_state.rings_lock);
+        ring->next = atomic_load_explicit(&log_state.rings, memory_order_relaxed);
+        atomic_store_explicit(&log_state.rings, ring, memory_order_release);
+        pthread_mutex_unlock(&log_state.rings_lock);
+        log_ring_self = ring;
+    }
+    if (name != NULL)
+        snprintf(ring->name, sizeof(ring->name), "%s", name);
+    return ring;
+}
+
+// --- Producer side ---
+
+typedef struct
+{
+    unsigned char *p;
+    unsigned char *end;
+} log_cursor_t;
+
+static inline void log_put(log_cursor_t *c, const void *v, size_t n)
+{
+    if ((size_t)(c->end - c->p) >= n)
+    {
+        memcpy(c->p, v, n);
+        c->p += n;
+    }
+    else
+        c->p = c->end + 1; // mark the record as truncated
+}
+
+static inline void log_put_string(log_cursor_t *c, const char *s, size_t max)
+{
+    if (s == NULL)
+        s = "(null)";
+    size_t room = c->p < c->end ? (size_t)(c->end - c->p) : 0;
+    size_t n = strnlen(s, max < room ? max : room);
+    uint16_t len;
+
+    if (room < sizeof(len))
+    {
+        c->p = c->end + 1;
+        return;
+    }
+    if (n > room - sizeof(len))
+        n = room - sizeof(len);
+    len = (uint16_t)n;
+    memcpy(c->p, &len, sizeof(len));
+    memcpy(c->p + sizeof(len), s, n);
+    c->p += sizeof(len) + n;
+}
+
+/**
+ * Conversion parsed out of a format string, shared by the producer (to pull
+ * the arguments) and the flusher (to print them)
+ */
+typedef struct
+{
+    const char *start; // the '%'
+    const char *end;   // one past the conversion character
+    int width_star;
+    int prec_star;
+    int width;   // literal width, 0 if none
+    int prec;    // literal precision, -1 if none
+    char length; // 'H' hh, 'h', 'l', 'L' ll, 'z', 'j', 't', 'D' long double, 0 none
+    char conv;
+} log_spec_t;
+
+/**
+ * Finds the next conversion at or after fmt; returns 0 at the end of the string
+ */
+static inline int log_next_spec(const char *fmt, log_spec_t *spec)
+{
+    const char *p = strchr(fmt, '%');
+
+    while (p != NULL && p[1] == '%')
+        p = strchr(p + 2, '%');
+    if (p == NULL)
+        return 0;
+
+    memset(spec, 0, sizeof(*spec));
+    spec->prec = -1;
+    spec->start = p++;
+    while (*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0')
+        p++;
+    if (*p == '*')
+    {
+        spec->width_star = 1;
+        p++;
+    }
+    else
+        while (*p >= '0' && *p <= '9')
+            spec->width = spec->width * 10 + (*p++ - '0');
+    if (*p == '.')
+    {
+        spec->prec = 0;
+        p++;
+        if (*p == '*')
+        {
+            spec->prec_star = 1;
+            p++;
+        }
+        else
+            while (*p >= '0' && *p <= '9')
+                spec->prec = spec->prec * 10 + (*p++ - '0');
+    }
+    switch (*p)
+    {
+    case 'h':
+        spec->length = p[1] == 'h' ? 'H' : 'h';
+        p += p[1] == 'h' ? 2 : 1;
+        break;
+    case 'l':
+        spec->length = p[1] == 'l' ? 'L' : 'l';
+        p += p[1] == 'l' ? 2 : 1;
+        break;
+    case 'z':
+    case 'j':
+    case 't':
+        spec->length = *p++;
+        break;
+    case 'L':
+        spec->length = 'D';
+        p++;
+        break;
+    }
+    spec->conv = *p;
+    spec->end = *p ? p + 1 : p;
+    return 1;
+}
+
+static void log_vwrite(log_level_t level, const char *fmt, va_list ap)
+{
+    log_ring_t *ring = log_ring_self;
+    struct timespec ts;
+    log_spec_t spec;
+
+    if (ring == NULL && (ring = log_thread_name(NULL)) == NULL)
+        return;
+
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) >= LOG_RING_RECORDS)
+    {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    log_record_t *rec = &ring->records[tail & (LOG_RING_RECORDS - 1)];
+    log_cursor_t c = {rec->payload, rec->payload + sizeof(rec->payload)};
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->timestamp_ns = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+    rec->fmt = fmt;
+    rec->level = (uint8_t)level;
+
+    for (const char *p = fmt; log_next_spec(p, &spec); p = spec.end)
+    {
+        int64_t i = 0;
+        int prec = spec.prec;
+
+        if (spec.width_star)
+        {
+            i = va_arg(ap, int);
+            log_put(&c, &i, sizeof(i));
+        }
+        if (spec.prec_star)
+        {
+            prec = va_arg(ap, int);
+            i = prec;
+            log_put(&c, &i, sizeof(i));
+        }
+        switch (spec.conv)
+        {
+        case 's':
+            log_put_string(&c, va_arg(ap, const char *), prec >= 0 ? (size_t)prec : SIZE_MAX);
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        {
+            double d = spec.length == 'D' ? (double)va_arg(ap, long double) : va_arg(ap, double);
+            log_put(&c, &d, sizeof(d));
+            break;
+        }
+        case 'p':
+            i = (int64_t)(intptr_t)va_arg(ap, void *);
+            log_put(&c, &i, sizeof(i));
+            break;
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+        case 'c':
+            switch (spec.length)
+            {
+            case 'l':
+                i = va_arg(ap, long);
+                break;
+            case 'L':
+                i = va_arg(ap, long long);
+                break;
+            case 'z':
+                i = (int64_t)va_arg(ap, size_t);
+                break;
+            case 'j':
+                i = va_arg(ap, intmax_t);
+                break;
+            case 't':
+                i = va_arg(ap, ptrdiff_t);
+                break;
+            default:
+                i = va_arg(ap, int);
+                break;
+            }
+            log_put(&c, &i, sizeof(i));
+            break;
+        default:
+            break; // unsupported conversion: printed literally
+        }
+    }
+
+    rec->len = (uint16_t)(c.p - rec->payload); // > sizeof(payload) when truncated
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+__attribute__((format(printf, 2, 3))) static void log_write(log_level_t level, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    log_vwrite(level, fmt, ap);
+    va_end(ap);
+}
+
+// Arguments are not evaluated when the level is filtered out
+#define LOG(level, ...)              \
+    do                               \
+    {                                \
+        if (log_enabled(level))      \
+            log_write(level, __VA_ARGS__); \
+    } while (0)
+
+#define LOG_ERROR(...) LOG(LOG_ERROR, __VA_ARGS__)
+#define LOG_WARN(...) LOG(LOG_WARN, __VA_ARGS__)
+#define LOG_INFO(...) LOG(LOG_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG(LOG_DEBUG, __VA_ARGS__)
+
+// --- Flusher side ---
+
+static void log_flush_batch(void)
+{
+    size_t off = 0;
+
+    while (off < log_state.batch_len)
+    {
+        ssize_t n = write(fileno(log_state.out), log_state.batch + off, log_state.batch_len - off);
+        if (n <= 0)
+            break; // nothing useful to do about a failing log file
+        off += (size_t)n;
+    }
+    log_state.batch_len = 0;
+}
+
+static void log_append(const char *fmt, ...)
+{
+    va_list ap;
+    size_t room = sizeof(log_state.batch) - log_state.batch_len;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(log_state.batch + log_state.batch_len, room, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        log_state.batch_len += (size_t)n < room ? (size_t)n : room - 1;
+}
+
+static inline int64_t log_get(const unsigned char **p, const unsigned char *end)
+{
+    int64_t v = 0;
+
+    if (end - *p >= (ptrdiff_t)sizeof(v))
+    {
+        memcpy(&v, *p, sizeof(v));
+        *p += sizeof(v);
+    }
+    return v;
+}
+
+static void log_format_record(const log_ring_t *ring, const log_record_t *rec)
+{
+    static time_t cached_sec = -1;
+    static char cached_stamp[32];
+    const unsigned char *p = rec->payload;
+    const unsigned char *end = p + (rec->len < sizeof(rec->payload) ? rec->len : sizeof(rec->payload));
+    time_t sec = (time_t)(rec->timestamp_ns / 1000000000ull);
+    log_spec_t spec;
+    char conv[16];
+
+    // One line is at most a record's worth of payload plus its decoration
+    if (sizeof(log_state.batch) - log_state.batch_len < 2 * LOG_RECORD_SIZE + 256)
+        log_flush_batch();
+
+    if (sec != cached_sec)
+    {
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        strftime(cached_stamp, sizeof(cached_stamp), "%Y-%m-%d %H:%M:%S", &tm);
+        cached_sec = sec;
+    }
+    log_append("%s.%06u %-5s [%s] ", cached_stamp, (unsigned)(rec->timestamp_ns % 1000000000ull / 1000),
+               log_level_names[rec->level], ring->name[0] ? ring->name : "-");
+
+    const char *lit = rec->fmt;
+    while (log_next_spec(lit, &spec))
+    {
+        // Literal text up to the conversion, with "%%" collapsed
+        for (const char *q = lit; q < spec.start; q++)
+        {
+            if (q[0] == '%' && q[1] == '%')
+                q++;
+            log_append("%c", *q);
+        }
+        lit = spec.end;
+
+        int width = spec.width_star ? (int)log_get(&p, end) : spec.width;
+        int prec = spec.prec_star ? (int)log_get(&p, end) : spec.prec; // negative means none
+
+        // Rebuild the conversion as flags + "*.*" + normalised length + type
+        size_t n = 0;
+        conv[n++] = '%';
+        for (const char *s = spec.start + 1; strchr("-+ #0", *s) != NULL && *s; s++)
+            conv[n++] = *s;
+        conv[n++] = '*';
+        conv[n++] = '.';
+        conv[n++] = '*';
+
+        switch (spec.conv)
+        {
+        case 's':
+        {
+            uint16_t len = 0;
+            if (end - p >= (ptrdiff_t)sizeof(len))
+            {
+                memcpy(&len, p, sizeof(len));
+                p += sizeof(len);
+                if (len > end - p)
+                    len = (uint16_t)(end - p);
+            }
+            conv[n++] = 's';
+            conv[n] = '\0';
+            log_append(conv, width, (int)len, (const char *)p);
+            p += len;
+            break;
+        }
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        {
+            double d = 0;
+            if (end - p >= (ptrdiff_t)sizeof(d))
+            {
+                memcpy(&d, p, sizeof(d));
+                p += sizeof(d);
+            }
+            conv[n++] = spec.conv;
+            conv[n] = '\0';
+            log_append(conv, width, prec, d);
+            break;
+        }
+        case 'p':
+            log_append("%p", (void *)(intptr_t)log_get(&p, end));
+            break;
+        case 'c':
+            log_append("%c", (int)log_get(&p, end));
+            break;
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+        {
+            int64_t v = log_get(&p, end);
+            int is_signed = spec.conv == 'd' || spec.conv == 'i';
+            // Narrow the value back to the argument's own type
+            if (spec.length == 'H')
+                v = is_signed ? (int64_t)(signed char)v : (int64_t)(unsigned char)v;
+            else if (spec.length == 'h')
+                v = is_signed ? (int64_t)(short)v : (int64_t)(unsigned short)v;
+            else if (spec.length == 0)
+                v = is_signed ? (int64_t)(int)v : (int64_t)(unsigned)v;
+            conv[n++] = 'l';
+            conv[n++] = 'l';
+            conv[n++] = spec.conv;
+            conv[n] = '\0';
+            log_append(conv, width, prec, (long long)v);
+            break;
+        }
+        default:
+            log_append("%.*s", (int)(spec.end - spec.start), spec.start);
+            break;
+        }
+    }
+    for (const char *q = lit; *q; q++)
+    {
+        if (q[0] == '%' && q[1] == '%')
+            q++;
+        log_append("%c", *q);
+    }
+    if (rec->len > sizeof(rec->payload))
+        log_append(" [truncated]");
+    log_append("\n");
+}
+
+/**
+ * Formats everything currently queued; returns the number of records written
+ */
+static size_t log_drain(void)
+{
+    size_t count = 0;
+    unsigned long dropped = 0;
+
+    for (log_ring_t *ring = atomic_load_explicit(&log_state.rings, memory_order_acquire); ring != NULL;
+         ring = ring->next)
+    {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+        for (; head != tail; head++, count++)
+        {
+            log_format_record(ring, &ring->records[head & (LOG_RING_RECORDS - 1)]);
+            // Hand the slot back as soon as it is formatted
+            atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+        }
+        dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    }
+
+    if (dropped != log_state.reported_drops)
+    {
+        log_append("log: %lu record(s) dropped, rings full\n", dropped - log_state.reported_drops);
+        log_state.reported_drops = dropped;
+    }
+    if (log_state.batch_len > 0)
+        log_flush_batch();
+    return count;
+}
+
+static void *log_flusher(void *arg)
+{
+    (void)arg;
+    while (atomic_load(&log_state.running))
+    {
+        if (log_drain() == 0)
+        {
+            struct timespec ts = {0, LOG_FLUSH_INTERVAL_MS * 1000000L};
+            nanosleep(&ts, NULL);
+        }
+    }
+    log_drain();
+    return NULL;
+}
+
+/**
+ * Records dropped so far because a thread's ring was full
+ */
+static inline unsigned long log_dropped(void)
+{
+    unsigned long dropped = 0;
+
+    for (log_ring_t *ring = atomic_load_explicit(&log_state.rings, memory_order_acquire); ring != NULL;
+         ring = ring->next)
+        dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    return dropped;
+}
+
+/**
+ * Starts the flusher thread writing to out; returns 0 on success
+ */
+static int log_start(FILE *out)
+{
+    log_state.out = out;
+    atomic_store(&log_state.running, 1);
+    if (pthread_create(&log_state.thread, NULL, log_flusher, NULL) != 0)
+    {
+        atomic_store(&log_state.running, 0);
+        return -1;
+    }
+    log_state.started = 1;
+    return 0;
+}
+
+/**
+ * Writes out whatever is still queued, then stops the flusher. Call after
+ * every logging thread has been joined.
+ */
+static void log_stop(void)
+{
+    if (!log_state.started)
+        return;
+    atomic_store(&log_state.running, 0);
+    pthread_join(log_state.thread, NULL);
+    log_state.started = 0;
+
+    log_ring_t *ring = atomic_exchange(&log_state.rings, NULL);
+    while (ring != NULL)
+    {
+        log_ring_t *next = ring->next;
+        free(ring);
+        ring = next;
+    }
+    log_ring_self = NULL;
+}
+
+#endif // LOG_RING_H
@@ -0,0 +1,333 @@
+/**
+ * Sharded in-memory cache of pre-serialized HTTP responses
+ *
+ * An entry holds everything needed to answer a request for one
+ * representation without building anything: the head of its 200 response,
+ * the head of the matching 304, its strong entity tag and the body. Both
+ * heads stop short of the Connection header, which depends on the request.
+ *
+ * Keys are hashed onto CACHE_SHARDS shards. Each shard has its own lock,
+ * hash table, LRU list and an equal share of the memory budget, so threads
+ * looking up different keys seldom wait on each other, and eviction only
+ * ever scans one shard. Entries are reference-counted: a lookup hands out a
+ * reference that stays valid after the entry is evicted or replaced, and the
+ * last release frees it.
+ */
+
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_SHARDS 16    // a power of two
+#define CACHE_BUCKETS 1024 // hash chains per shard; a power of two
+
+typedef struct cache_entry
+{
+    struct cache_entry *chain;    // next in the hash bucket, or in a list of evicted entries
+    struct cache_entry *lru_prev; // towards the most recently used
+    struct cache_entry *lru_next;
+    atomic_int refs; // one held by the cache while linked, plus one per lookup
+    int linked;      // guarded by the shard lock
+    uint64_t hash;
+    size_t charge; // bytes counted against the budget
+
+    // Left to the owner: a description of the source the response was built from,
+    // when that was last found unchanged, and anything else worth remembering
+    uint64_t validator[4];
+    atomic_ullong checked_ms;
+    int flags;
+
+    const unsigned char *key;
+    size_t key_len;
+    const char *etag; // quoted, as sent
+    size_t etag_len;
+    const char *head; // "HTTP/1.1 200 OK\r\n" and every header but Connection
+    size_t head_len;
+    const char *not_modified; // the same for the 304
+    size_t not_modified_len;
+    unsigned char *body;
+    size_t body_len;
+    unsigned char data[];
+} cache_entry_t;
+
+typedef struct
+{
+    _Alignas(64) pthread_mutex_t lock; // own cache line, so shards do not contend through it
+    cache_entry_t *lru_head;
+    cache_entry_t *lru_tail;
+    size_t bytes;
+    cache_entry_t *buckets[CACHE_BUCKETS];
+} cache_shard_t;
+
+typedef struct
+{
+    cache_shard_t *shards;
+    size_t shard_budget;
+    atomic_size_t bytes;
+    atomic_size_t entries;
+    atomic_ulong evictions;
+} response_cache_t;
+
+/**
+ * 64-bit FNV-1a
+ */
+static uint64_t cache_hash(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t h = 0xcbf29ce484222325ull;
+
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ p[i]) * 0x100000001b3ull;
+    return h;
+}
+
+/**
+ * A cache holding up to `budget` bytes of entries, headers and bodies included.
+ * Returns NULL when out of memory.
+ */
+static response_cache_t *response_cache_create(size_t budget)
+{
+    response_cache_t *cache = calloc(1, sizeof(*cache));
+    if (cache == NULL)
+        return NULL;
+    cache->shards = aligned_alloc(_Alignof(cache_shard_t), CACHE_SHARDS * sizeof(cache_shard_t));
+    if (cache->shards == NULL)
+    {
+        free(cache);
+        return NULL;
+    }
+    memset(cache->shards, 0, CACHE_SHARDS * sizeof(cache_shard_t));
+    for (int i = 0; i < CACHE_SHARDS; i++)
+        pthread_mutex_init(&cache->shards[i].lock, NULL);
+    cache->shard_budget = budget / CACHE_SHARDS;
+    return cache;
+}
+
+/**
+ * An unlinked entry with room for a body of `body_len` bytes, which the
+ * caller fills in before inserting it. The caller holds the only reference.
+ */
+static cache_entry_t *cache_entry_create(const void *key, size_t key_len, const char *etag, const char *head,
+                                         const char *not_modified, size_t body_len)
+{
+    size_t etag_len = strlen(etag), head_len = strlen(head), not_modified_len = strlen(not_modified);
+    size_t size = sizeof(cache_entry_t) + key_len + etag_len + head_len + not_modified_len + body_len;
+    cache_entry_t *e = malloc(size);
+    if (e == NULL)
+        return NULL;
+
+    memset(e, 0, sizeof(*e));
+    atomic_init(&e->refs, 1);
+    e->hash = cache_hash(key, key_len);
+    e->charge = size;
+
+    unsigned char *p = e->data;
+    e->key = memcpy(p, key, key_len);
+    e->key_len = key_len;
+    p += key_len;
+    e->etag = memcpy(p, etag, etag_len);
+    e->etag_len = etag_len;
+    p += etag_len;
+    e->head = memcpy(p, head, head_len);
+    e->head_len = head_len;
+    p += head_len;
+    e->not_modified = memcpy(p, not_modified, not_modified_len);
+    e->not_modified_len = not_modified_len;
+    p += not_modified_len;
+    e->body = p;
+    e->body_len = body_len;
+    return e;
+}
+
+static void cache_entry_release(cache_entry_t *e)
+{
+    if (e != NULL && atomic_fetch_sub_explicit(&e->refs, 1, memory_order_acq_rel) == 1)
+        free(e);
+}
+
+static cache_shard_t *cache_shard(response_cache_t *cache, uint64_t hash)
+{
+    return &cache->shards[(hash >> 32) & (CACHE_SHARDS - 1)];
+}
+
+/**
+ * Take an entry out of its shard's table and LRU list; called with the shard
+ * locked. The cache's reference is handed over to the caller.
+ */
+static void cache_unlink(response_cache_t *cache, cache_shard_t *shard, cache_entry_t *e)
+{
+    cache_entry_t **pp = &shard->buckets[e->hash & (CACHE_BUCKETS - 1)];
+    while (*pp != e)
+        pp = &(*pp)->chain;
+    *pp = e->chain;
+    e->chain = NULL;
+
+    if (e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        shard->lru_head = e->lru_next;
+    if (e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        shard->lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+
+    e->linked = 0;
+    shard->bytes -= e->charge;
+    atomic_fetch_sub_explicit(&cache->bytes, e->charge, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&cache->entries, 1, memory_order_relaxed);
+}
+
+static void cache_lru_push(cache_shard_t *shard, cache_entry_t *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = shard->lru_head;
+    if (shard->lru_head)
+        shard->lru_head->lru_prev = e;
+    else
+        shard->lru_tail = e;
+    shard->lru_head = e;
+}
+
+/**
+ * The entry stored under `key`, marked most recently used, or NULL.
+ * The caller releases the reference it gets.
+ */
+static cache_entry_t *response_cache_lookup(response_cache_t *cache, const void *key, size_t key_len)
+{
+    uint64_t hash = cache_hash(key, key_len);
+    cache_shard_t *shard = cache_shard(cache, hash);
+    cache_entry_t *e;
+
+    pthread_mutex_lock(&shard->lock);
+    for (e = shard->buckets[hash & (CACHE_BUCKETS - 1)]; e; e = e->chain)
+    {
+        if (e->hash == hash && e->key_len == key_len && memcmp(e->key, key, key_len) == 0)
+            break;
+    }
+    if (e)
+    {
+        if (e != shard->lru_head)
+        {
+            // Unlinked and pushed back without touching the table
+            e->lru_prev->lru_next = e->lru_next;
+            if (e->lru_next)
+                e->lru_next->lru_prev = e->lru_prev;
+            else
+                shard->lru_tail = e->lru_prev;
+            cache_lru_push(shard, e);
+        }
+        atomic_fetch_add_explicit(&e->refs, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return e;
+}
+
+/**
+ * Store an entry, replacing any under the same key, and evict from the cold
+ * end of its shard until the shard is within budget again. The caller keeps
+ * its own reference. Returns -1, storing nothing, if the entry alone is
+ * larger than a shard's budget.
+ */
+static int response_cache_insert(response_cache_t *cache, cache_entry_t *e)
+{
+    cache_shard_t *shard = cache_shard(cache, e->hash);
+    cache_entry_t **bucket = &shard->buckets[e->hash & (CACHE_BUCKETS - 1)];
+    cache_entry_t *victims = NULL;
+    unsigned long evicted = 0;
+
+    if (e->charge > cache->shard_budget)
+        return -1;
+
+    pthread_mutex_lock(&shard->lock);
+    for (cache_entry_t *old = *bucket; old; old = old->chain)
+    {
+        if (old->hash == e->hash && old->key_len == e->key_len && memcmp(old->key, e->key, e->key_len) == 0)
+        {
+            cache_unlink(cache, shard, old);
+            old->chain = victims;
+            victims = old;
+            break;
+        }
+    }
+
+    atomic_fetch_add_explicit(&e->refs, 1, memory_order_relaxed);
+    e->chain = *bucket;
+    *bucket = e;
+    cache_lru_push(shard, e);
+    e->linked = 1;
+    shard->bytes += e->charge;
+    atomic_fetch_add_explicit(&cache->bytes, e->charge, memory_order_relaxed);
+    atomic_fetch_add_explicit(&cache->entries, 1, memory_order_relaxed);
+
+    // The new entry is at the hot end and fits on its own, so this stops before reaching it
+    while (shard->bytes > cache->shard_budget)
+    {
+        cache_entry_t *cold = shard->lru_tail;
+        cache_unlink(cache, shard, cold);
+        cold->chain = victims;
+        victims = cold;
+        evicted++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    // Freed outside the lock
+    while (victims)
+    {
+        cache_entry_t *next = victims->chain;
+        cache_entry_release(victims);
+        victims = next;
+    }
+    if (evicted)
+        atomic_fetch_add_explicit(&cache->evictions, evicted, memory_order_relaxed);
+    return 0;
+}
+
+/**
+ * Drop an entry found to be stale, unless it has already been replaced or evicted
+ */
+static void response_cache_remove(response_cache_t *cache, cache_entry_t *e)
+{
+    cache_shard_t *shard = cache_shard(cache, e->hash);
+    int unlinked = 0;
+
+    pthread_mutex_lock(&shard->lock);
+    if (e->linked)
+    {
+        cache_unlink(cache, shard, e);
+        unlinked = 1;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if (unlinked)
+        cache_entry_release(e);
+}
+
+/**
+ * Free the cache and every entry nobody holds a reference to anymore
+ */
+static void response_cache_destroy(response_cache_t *cache)
+{
+    if (cache == NULL)
+        return;
+    for (int i = 0; i < CACHE_SHARDS; i++)
+    {
+        cache_shard_t *shard = &cache->shards[i];
+        while (shard->lru_head)
+        {
+            cache_entry_t *e = shard->lru_head;
+            cache_unlink(cache, shard, e);
+            cache_entry_release(e);
+        }
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(cache->shards);
+    free(cache);
+}
+
+#endif /* RESPONSE_CACHE_H */
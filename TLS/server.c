@@ -3,6 +3,8 @@
  * TLS 1.3 with ChaCha20-Poly1305
  */
 
+#define _GNU_SOURCE // CPU affinity and SO_REUSEPORT helpers
+
 #include <mbedtls/build_info.h>
 #include <mbedtls/net_sockets.h>
 #include <mbedtls/ssl.h>
@@ -15,6 +17,13 @@
 #include <mbedtls/version.h>
 #include <mbedtls/pem.h>
 #include <mbedtls/oid.h>
+
+// The PSA-only key handling and TLS 1.3 calls here are the Mbed TLS 4 API; say so
+// instead of failing on the first 3.x signature
+#if !defined(MBEDTLS_VERSION_MAJOR) || MBEDTLS_VERSION_MAJOR < 4
+#error "Mbed TLS 4 is required (see Mbed_TLS_4_install.md)"
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,30 +32,535 @@
 #include <unistd.h>
 #include <mbedtls/pk.h>       // For mbedtls_pk functions
 #include <mbedtls/psa_util.h> // For mbedtls_psa_get_random
+#include <mbedtls/ssl_ticket.h>
+#include <mbedtls/platform.h>
+#include <stdatomic.h>
+#include <strings.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+// kTLS depends on Mbed TLS internals; the Makefile defines SERVER_KTLS once tests/ktls_test passes (make KTLS=1)
+#if defined(SERVER_KTLS) && defined(__linux__) && __has_include(<linux/tls.h>)
+#define HAVE_KTLS
+#endif
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_RECV_MULTISHOT) // multishot recv and provided buffer rings: Linux 6.0 headers
+#define HAVE_IO_URING
+#include "uring.h"
+#endif
+#endif
+
+// USDT probes for perf / bpftrace (see trace/): each one is a nop until a tracer attaches
+#if __has_include(<sys/sdt.h>) && !defined(NO_USDT)
+#include <sys/sdt.h>
+#define PROBE(name, ...) STAP_PROBEV(tls_server, name, ##__VA_ARGS__)
+#else
+#define PROBE(name, ...) ((void)0)
+#endif
+
+#include "http_parser.h"
+#if defined(HAVE_KTLS)
+#include "ktls.h"
+#endif
+#include "log_ring.h"
+#include "response_cache.h"
+#include "static_path.h"
+#include "timer_wheel.h"
 
 #define SERVER_PORT "8443"
 #define SERVER_ADDR "0.0.0.0"
-#define HTTP_RESPONSE "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nConnection: close\r\n\r\n"         \
-                      "<html><body><h1>🔒 TLS 1.3 Mbed TLS 4.0 Server</h1>"                             \
-                      "<p>This connection is secured with TLS 1.3 using a self-signed certificate.</p>" \
-                      "<p>To trust this certificate, save it as 'server_cert.pem' and use:</p>"         \
-                      "<pre>curl --cacert server_cert.pem https://localhost:8443</pre>"                 \
-                      "</body></html>"
+#define DEFAULT_CERT_FILE "server_cert.pem"
+#define DEFAULT_KEY_FILE "server_key.pem"
+#define MAX_EVENTS 256
+#define TICKET_LIFETIME 86400 // seconds; the ticket key rotates on the same period
+#define EARLY_DATA_MAX 1024   // largest 0-RTT request we accept
+#define REQUEST_BUF_SIZE 8192 // request line + headers must fit; bodies are streamed through
+#define RESPONSE_BUF_SIZE 16384
+#define RECORD_OVERHEAD 22       // TLS 1.3 record header, inner content type and AEAD tag
+#define RECORD_RAMP_BYTES 65536  // one-segment records until this much has been written
+#define RECORD_IDLE_MS 1000      // after this long without writes, start over with small records
+#define HANDSHAKE_TIMEOUT_MS 10000 // from accept until the handshake is done
+#define HEADER_TIMEOUT_MS 10000    // from a request's first byte until its head is complete
+#define IDLE_TIMEOUT_MS 15000      // keep-alive connections with no traffic for this long are closed
+#define WRITE_TIMEOUT_MS 15000     // a peer that takes none of a response for this long is dropped
+#define TIMER_TICK_MS 16           // deadline resolution
+#define ADMIT_BURST_MS 100         // the handshake budget saves up at most this much wall time
+#define ADMIT_COST_NS 2000000      // assumed CPU time of a handshake until some have been measured
+#define ADMIT_PEEK_SIZE 2048       // ClientHello bytes inspected; a longer one counts as a full handshake
+#define ADMIT_BACKLOG_CHECK_MS 10  // how often a worker over budget looks at its accept queue
+#define CACHE_DEFAULT_MB 64        // response cache for small files under the document root
+#define CACHE_REVALIDATE_MS 1000   // a cached file is compared against the disk at most this often
+#define CACHE_GZIP_SIBLING 1       // cache entry flag: the file had a pre-compressed variant when last checked
+#define CONNECTION_POOL_SIZE 256 // recycled connections kept per worker
+#define ARENA_SIZE 16384         // per-connection Mbed TLS allocations; larger ones fall back to the heap
+#define HANDSHAKE_QUEUE_SIZE 1024 // handshake steps waiting for a pool thread; beyond this they run inline
+#define URING_ENTRIES 1024          // io_uring submission queue per worker
+#define URING_BUF_COUNT 1024        // provided receive buffers per worker; a power of two
+#define URING_BUF_SIZE 4096
+#define URING_RX_SLOTS 16           // received buffers one connection may hold
+#define URING_RX_HEADROOM 4         // receives still in flight after a pause is requested
+#define URING_TX_SIZE (2 * 16896)   // two full TLS records
+#define URING_CLOSE_TIMEOUT_MS 5000 // unsent bytes of a closed connection are dropped after this
+#define MAX_CIPHERS 8             // entries in ciphers[], counted per suite for /metrics
+#define HIST_SUB_BITS 3           // latency histograms: 8 linear sub-buckets per power of two, within 12.5%
+#define HIST_MAX_EXP 37           // nanoseconds up to 2^37 (~137 s); longer lands in the last bucket
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+#if defined(MBEDTLS_PLATFORM_MEMORY) && !defined(MBEDTLS_PLATFORM_CALLOC_MACRO)
+#define HAVE_ARENA
+#endif
+#define HTTP_BODY "<html><body><h1>🔒 TLS 1.3 Mbed TLS 4.0 Server</h1>"                             \
+                  "<p>This connection is secured with TLS 1.3 using a self-signed certificate.</p>" \
+                  "<p>To trust this certificate, save it as 'server_cert.pem' and use:</p>"         \
+                  "<pre>curl --cacert server_cert.pem https://localhost:8443</pre>"                 \
+                  "</body></html>"
+
+typedef enum
+{
+    CONN_HANDSHAKE,
+    CONN_READ_REQUEST,
+    CONN_WRITE_RESPONSE,
+    CONN_CLOSE_NOTIFY
+} conn_state_t;
+
+// What a connection's deadline is for; counted per kind in /metrics
+typedef enum
+{
+    TIMEOUT_HANDSHAKE,
+    TIMEOUT_HEADER,
+    TIMEOUT_IDLE,
+    TIMEOUT_WRITE,
+    TIMEOUT_KINDS
+} timeout_kind_t;
+
+static const char *const timeout_names[TIMEOUT_KINDS] = {"handshake", "header", "idle", "write"};
+
+typedef enum
+{
+    BODY_NONE,
+    BODY_LENGTH, // Content-Length bytes still to skip
+    BODY_CHUNKED
+} body_mode_t;
+
 
+/**
+ * Bump allocator behind one connection's Mbed TLS allocations. Blocks are
+ * never freed one by one; the arena is rewound once none of them is alive.
+ */
+typedef struct arena
+{
+    atomic_size_t live; // outstanding blocks, plus one held by the owning connection
+    size_t used;        // bump offset, only touched by the owning worker
+    _Alignas(16) unsigned char data[ARENA_SIZE];
+} arena_t;
+
+/**
+ * Log-linear latency histogram in the style of HdrHistogram: constant
+ * relative precision from a nanosecond up, and recording is an index
+ * computation plus a store. Each one has a single writer (its worker).
+ */
 typedef struct
 {
-    mbedtls_net_context listen_fd;
+    atomic_ulong buckets[HIST_BUCKETS];
+    atomic_ulong count;
+    atomic_ulong sum_ns;
+} histogram_t;
+
+#if defined(HAVE_IO_URING)
+/**
+ * A connection's side of the io_uring backend. Received data stays in the
+ * worker's provided buffers until Mbed TLS reads it through the BIO; records
+ * Mbed TLS writes are staged in `tx` and go out in one SEND per flush.
+ */
+typedef struct uring_io
+{
+    struct
+    {
+        uint16_t bid;
+        uint16_t off;
+        uint16_t len;
+    } rx[URING_RX_SLOTS];
+    // Single producer (the worker, on recv completions), single consumer (whichever
+    // thread runs the connection's step, a handshake pool thread included)
+    atomic_uint rx_head;
+    atomic_uint rx_tail;
+    atomic_int rx_end;     // published after the last buffer: 1 for EOF, or -errno
+    unsigned rx_reclaimed; // slots before this one are back in the buffer ring
+    int recv_armed;        // multishot recv in flight
+    int recv_paused;       // cancelled because rx is nearly full; re-armed once it drains
+    int starved;           // the buffer ring ran dry; re-armed when buffers come back
+    int send_inflight;     // bytes at the front of tx being sent
+    int send_failed;
+    int send_deferred;     // a send completed while a pool thread owned the connection
+    int send_deferred_res;
+    int ops;               // recv and send operations in flight
+    int closing;
+    int cancelled;
+    size_t tx_len;
+    unsigned char tx[URING_TX_SIZE];
+} uring_io_t;
+#endif
+
+/**
+ * Per-connection state: each client owns its SSL context and resumes
+ * from wherever the last WANT_READ/WANT_WRITE left it
+ */
+typedef struct connection
+{
+    mbedtls_net_context net;
+    mbedtls_ssl_context ssl;
+    conn_state_t state;
+    struct worker *worker;
+    struct tls_credentials *creds; // keeps the SSL config alive across a reload
+    int resumed;
+    int close_after; // stop reading requests once the queued responses are written
+    int ktls_rx;     // the kernel decrypts incoming records; read with recv()
+    int ktls_tx;     // the kernel encrypts outgoing records; write with send()/sendfile()
+
+    // Dynamic record sizing: records that each fit one TCP segment while the congestion
+    // window is small, full-size records once RECORD_RAMP_BYTES have gone out
+    size_t record_small;    // payload of a one-segment record
+    size_t ramp_sent;       // written since the connection started or last went idle
+    uint64_t last_write_ns; // last response fully written
+    size_t write_retry;     // length of a write that wanted I/O; it must be repeated as is
+
+    // Whatever the connection waits on must happen by deadline_ms. The timer may be
+    // armed earlier than that (deadlines only slide later) and is moved up when it fires.
+    uint64_t deadline_ms;
+    timeout_kind_t deadline_kind;
+    uint64_t head_deadline_ms; // set when a request head starts arriving, 0 between requests
+    wheel_timer_t timer;
+    int timed_out; // expired while offloaded; closed once the pool hands it back
+
+    // Admission control
+    int admitted;            // ClientHello inspected and let through
+    int admit_resumption;    // it offered a session ticket that checked out
+    int64_t admit_charge_ns; // taken from the worker's budget, settled when the handshake ends
+
+    // Latency bookkeeping for /metrics
+    uint64_t accepted_ns;
+    uint64_t handshake_ns;     // time spent inside mbedtls_ssl_handshake() so far
+    uint64_t request_start_ns; // first request whose response is still queued
+    int requests_pending;      // requests answered in `out` but not yet written
+
+    // Pipelined requests are parsed in place out of this buffer
+    unsigned char in[REQUEST_BUF_SIZE];
+    size_t in_start;        // first byte not yet consumed
+    size_t in_len;          // end of the buffered bytes
+    size_t early_remaining; // unconsumed bytes that arrived as 0-RTT early data
+    http_parser_t parser;   // resume point for a request head split across reads
+
+    // Request body being skipped
+    body_mode_t body_mode;
+    unsigned long long body_remaining;
+    http_chunked_t chunked;
+
+    // Responses for every request parsed so far, flushed together
+    unsigned char out[RESPONSE_BUF_SIZE];
+    size_t out_len;
+    size_t out_sent;
+
+    // Static file body following the last queued head
+    int file_fd;
+    off_t file_off;
+    size_t file_remaining;
+
+#if defined(HAVE_KTLS)
+    ktls_secrets_t ktls; // application traffic secrets captured during the handshake
+#endif
+
+    // The worker's live connections, or its closing ones under io_uring
+    struct connection *prev;
+    struct connection *next;
+
+    // Two arenas: the SSL state for the next connection is set up in one while the last one's is released
+    arena_t *arena[2];
+    int arena_cur;
+
+    // Handshake step running on the handshake pool; the I/O thread leaves the connection alone meanwhile
+    int offloaded;
+    int io_ready;      // socket became ready while offloaded; run another step on completion
+    int handshake_ret; // result of the offloaded step
+    struct connection *done_next;
+
+#if defined(HAVE_IO_URING)
+    struct uring_io *io; // NULL on the epoll path
+#endif
+} connection_t;
+
+typedef struct worker worker_t;
+
+typedef struct
+{
+    void (*function)(void *);
+    void *arg;
+} task_t;
+
+/**
+ * Fixed set of threads draining a bounded task queue, after
+ * pool/c/thread _pool.c. Used to take handshake crypto off the I/O threads.
+ */
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t notify;
+    pthread_t *threads;
+    int thread_count;
+    task_t task_queue[HANDSHAKE_QUEUE_SIZE];
+    int head;
+    int tail;
+    int count;
+    int shutdown;
+} handshake_pool_t;
+
+/**
+ * A credential file, either read into memory or mapped
+ */
+typedef struct
+{
+    unsigned char *data;
+    size_t len;     // file size; data[len] is always a NUL so PEM can be parsed in place
+    size_t map_len; // nonzero when data is an mmap() of the file
+} mapped_file_t;
+
+/**
+ * A certificate/key pair and the SSL config serving it. The set is read-only
+ * once published; connections hold a reference, so a SIGHUP reload can swap
+ * in a new set while handshakes on the old one finish undisturbed.
+ */
+typedef struct tls_credentials
+{
     mbedtls_ssl_config conf;
     mbedtls_x509_crt srvcert;
     mbedtls_pk_context pkey;
-    mbedtls_svc_key_id_t key_id; // Store this for PSA cleanup
+    mbedtls_svc_key_id_t key_id; // Store this for PSA cleanup (generated keys only)
+    mapped_file_t cert_file;     // backs srvcert when a DER file is parsed without copying
+    atomic_int refs;
+} tls_credentials_t;
+
+/**
+ * Process-wide state. Workers share the current credentials and the ticket
+ * keys; everything else is read-only once they start.
+ */
+typedef struct
+{
+    tls_credentials_t *creds; // current set; swap under creds_lock
+    pthread_mutex_t creds_lock;
+    atomic_uint creds_generation; // bumped on every reload so workers pick up the new set
+    const char *cert_path;
+    const char *key_path;
+    int use_mmap;
+    mbedtls_ssl_ticket_context ticket_ctx; // shared by every credential set, so tickets survive reloads
+    int early_data;
+    int ktls;       // hand the record layer to the kernel after the handshake
+    handshake_pool_t *handshake_pool; // NULL runs handshakes on the I/O threads
+    unsigned handshake_budget; // percent of wall time a worker may spend on handshakes; 0 admits everything
+    int io_uring;   // workers run io_uring loops instead of epoll
+    int docroot_fd; // serve files from here instead of the built-in page, or -1
+    response_cache_t *cache; // small files from the document root, ready to send; NULL when off
+    char page_etag[24];      // of the built-in page
     int running;
-    char cert_pem[4096];
-    size_t cert_pem_len;
+    int shutdown_fd; // eventfd watched by every worker, written once on shutdown
+    worker_t *workers;
+    int worker_count;
 } server_context_t;
 
+/**
+ * One event loop pinned to one core, with its own SO_REUSEPORT listener.
+ * The kernel spreads incoming connections across the workers' listeners.
+ */
+struct worker
+{
+    int id;
+    int cpu;
+    pthread_t thread;
+    server_context_t *server;
+    mbedtls_net_context listen_fd;
+    int epoll_fd;
+    connection_t *connections; // newest first
+    timer_wheel_t timers;      // every live connection's deadline
+    tls_credentials_t *creds;  // this worker's reference to the current credentials
+    unsigned creds_generation;
+    // Closed connections with their SSL context already reset, as in pool/c/object_pool2.c
+    connection_t *pool[CONNECTION_POOL_SIZE];
+    int pool_index; // top of the stack, -1 when empty
+    // Handshake steps finished by the pool, handed back through done_fd
+    int done_fd;
+    pthread_mutex_t done_lock;
+    connection_t *done_head;
+    int offloaded; // connections currently on the pool
+#if defined(HAVE_IO_URING)
+    uring_t ring;
+    uring_bufs_t bufs;
+    unsigned bufs_free;   // provided buffers the kernel can still fill
+    int starved;          // connections whose recv stopped because bufs_free hit 0
+    connection_t *closing; // closed, waiting for their last operations to complete
+    int closing_count;
+#endif
+    // Admission control: handshake CPU time left, refilled at handshake_budget percent of
+    // wall time, and what a full and a resumed handshake have cost lately
+    int64_t admit_tokens_ns;
+    uint64_t admit_refill_ns;
+    int64_t admit_cost_ns[2];
+    uint64_t backlog_checked_ns;
+    int backlog_deep;
+    // Written only by this worker, summed on SIGUSR1 / shutdown and by /metrics on any worker
+    atomic_ulong connections_accepted;
+    atomic_ulong connections_open;
+    atomic_ulong handshakes_full;
+    atomic_ulong handshakes_resumed;
+    atomic_ulong handshakes_failed;
+    atomic_ulong handshakes_by_cipher[MAX_CIPHERS]; // indexed like ciphers[]
+    atomic_ulong early_data_requests;
+    atomic_ulong ktls_connections;
+    atomic_ulong handshakes_offloaded;
+    atomic_ulong handshakes_inline; // pool queue was full
+    atomic_ulong requests;
+    atomic_ulong bad_requests;
+    atomic_ulong timeouts[TIMEOUT_KINDS];
+    atomic_ulong admitted_full;
+    atomic_ulong admitted_resumed;
+    atomic_ulong shed_handshakes; // full handshakes refused, budget spent
+    atomic_ulong shed_accepts;    // reset at accept, budget spent and accept queue filling up
+    atomic_ulong psk_fallbacks;   // offered a session ticket, ran (or was shed) as a full handshake
+    atomic_ulong cache_hits;
+    atomic_ulong cache_misses;
+    atomic_ulong not_modified; // 304s sent
+    histogram_t accept_to_ready; // accept until the handshake is done, waits included
+    histogram_t handshake_time;  // inside mbedtls_ssl_handshake() only
+    histogram_t request_time;    // request parsed until its response is written
+};
+
+/**
+ * Single writer, so a plain load and store: no locked instruction on the hot path
+ */
+static void counter_add(atomic_ulong *counter, unsigned long n)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static void counter_inc(atomic_ulong *counter)
+{
+    counter_add(counter, 1);
+}
+
+static unsigned histogram_index(uint64_t ns)
+{
+    if (ns < (1u << HIST_SUB_BITS))
+        return (unsigned)ns;
+    unsigned exp = 63 - (unsigned)__builtin_clzll(ns);
+    if (exp >= HIST_MAX_EXP)
+        return HIST_BUCKETS - 1;
+    return ((exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+           (unsigned)(ns >> (exp - HIST_SUB_BITS)) - (1u << HIST_SUB_BITS);
+}
+
+/**
+ * Exclusive upper bound of a bucket, in nanoseconds
+ */
+static uint64_t histogram_bucket_limit(unsigned index)
+{
+    unsigned major = index >> HIST_SUB_BITS;
+    uint64_t sub = index & ((1u << HIST_SUB_BITS) - 1);
+    if (major == 0)
+        return sub + 1;
+    return ((1ull << HIST_SUB_BITS) + sub + 1) << (major - 1);
+}
+
+static void histogram_record(histogram_t *h, uint64_t ns)
+{
+    counter_inc(&h->buckets[histogram_index(ns)]);
+    counter_inc(&h->count);
+    counter_add(&h->sum_ns, ns);
+}
+
+/**
+ * One histogram summed over every worker, for reporting
+ */
+typedef struct
+{
+    unsigned long buckets[HIST_BUCKETS];
+    unsigned long count;
+    unsigned long sum_ns;
+} histogram_snapshot_t;
+
+/**
+ * Sum a worker_t counter (given by its offset) over every worker
+ */
+static unsigned long workers_sum(server_context_t *server, size_t offset)
+{
+    unsigned long sum = 0;
+    for (int i = 0; i < server->worker_count; i++)
+        sum += atomic_load_explicit((atomic_ulong *)((char *)&server->workers[i] + offset), memory_order_relaxed);
+    return sum;
+}
+
+static void histogram_snapshot(server_context_t *server, size_t offset, histogram_snapshot_t *snap)
+{
+    memset(snap, 0, sizeof(*snap));
+    for (int i = 0; i < server->worker_count; i++)
+    {
+        histogram_t *h = (histogram_t *)((char *)&server->workers[i] + offset);
+        for (unsigned b = 0; b < HIST_BUCKETS; b++)
+            snap->buckets[b] += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+        snap->count += atomic_load_explicit(&h->count, memory_order_relaxed);
+        snap->sum_ns += atomic_load_explicit(&h->sum_ns, memory_order_relaxed);
+    }
+}
+
+/**
+ * Upper bound of the bucket holding quantile q, in milliseconds
+ */
+static double histogram_quantile_ms(const histogram_snapshot_t *snap, double q)
+{
+    unsigned long rank = (unsigned long)(q * (double)snap->count + 0.5), seen = 0;
+    for (unsigned b = 0; b < HIST_BUCKETS; b++)
+    {
+        seen += snap->buckets[b];
+        if (seen >= rank && seen > 0)
+            return (double)histogram_bucket_limit(b) / 1e6;
+    }
+    return 0.0;
+}
+
 /* --- Utility Functions --- */
 
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int is_want_io(int ret)
+{
+    return ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE;
+}
+
 static void print_certificate_info(mbedtls_x509_crt *cert)
 {
     char buf[4096];
@@ -54,39 +568,219 @@ static void print_certificate_info(mbedtls_x509_crt *cert)
     printf("%s\n", buf);
 }
 
+/**
+ * Replace `filename` with `data` in one step: write a new file next to it,
+ * created exclusively with `mode` whatever the old one had, sync it and
+ * rename it over the old name. A crash leaves either the old file or the new
+ * one, never a truncated one.
+ */
+static int write_file_atomic(const char *filename, const void *data, size_t len, mode_t mode)
+{
+    char tmp[PATH_MAX];
+    const unsigned char *p = data;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", filename) >= (int)sizeof(tmp))
+        return -1;
+    int fd = mkostemp(tmp, O_CLOEXEC); // O_EXCL, mode 0600 until fchmod
+    if (fd < 0)
+        return -1;
+    if (fchmod(fd, mode) != 0)
+        goto fail;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            goto fail;
+        p += n;
+        len -= (size_t)n;
+    }
+    if (fsync(fd) != 0 || close(fd) != 0)
+    {
+        fd = -1;
+        goto fail;
+    }
+    if (rename(tmp, filename) != 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+
+fail:
+    if (fd >= 0)
+        close(fd);
+    unlink(tmp);
+    return -1;
+}
+
 /**
  * Save certificate to PEM file
  */
 static void save_certificate_pem(const char *filename, const char *pem_data, size_t pem_len)
 {
-    FILE *fp = fopen(filename, "w");
-    if (fp)
-    {
-        fwrite(pem_data, 1, pem_len, fp);
-        fclose(fp);
+    if (write_file_atomic(filename, pem_data, pem_len, 0644) == 0)
         printf("Certificate saved to %s\n", filename);
+    else
+        printf("Failed to save certificate to %s\n", filename);
+}
+
+/**
+ * Save the private key next to the certificate, readable by the owner only,
+ * even when an older key file was left readable by others
+ */
+static void save_private_key_pem(const char *filename, const mbedtls_pk_context *pkey)
+{
+    unsigned char pem[2048];
+    int ret = mbedtls_pk_write_key_pem(pkey, pem, sizeof(pem));
+    if (ret != 0)
+    {
+        printf("Failed to export private key: %d\n", ret);
+        return;
     }
+
+    if (write_file_atomic(filename, pem, strlen((char *)pem), 0600) == 0)
+        printf("Private key saved to %s\n", filename);
     else
+        printf("Failed to save private key to %s\n", filename);
+    mbedtls_platform_zeroize(pem, sizeof(pem));
+}
+
+/**
+ * Read a credential file, or map it when use_mmap is set. Either way
+ * data[len] is a NUL, which mbedtls needs to parse PEM in place.
+ */
+static int load_file(const char *path, int use_mmap, mapped_file_t *file)
+{
+    struct stat st;
+    long page = sysconf(_SC_PAGESIZE);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    memset(file, 0, sizeof(*file));
+    if (fd < 0)
+        return MBEDTLS_ERR_X509_FILE_IO_ERROR;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0)
     {
-        printf("Failed to save certificate to %s\n", filename);
+        close(fd);
+        return MBEDTLS_ERR_X509_FILE_IO_ERROR;
+    }
+    file->len = (size_t)st.st_size;
+
+    // The kernel zero-fills a mapping past EOF up to the page end; that byte is the NUL
+    if (use_mmap && file->len % (size_t)page != 0)
+    {
+        void *map = mmap(NULL, file->len + 1, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            close(fd);
+            file->data = map;
+            file->map_len = file->len + 1;
+            return 0;
+        }
+    }
+
+    file->data = malloc(file->len + 1);
+    if (file->data == NULL || read(fd, file->data, file->len) != (ssize_t)file->len)
+    {
+        free(file->data);
+        file->data = NULL;
+        close(fd);
+        return MBEDTLS_ERR_X509_FILE_IO_ERROR;
+    }
+    file->data[file->len] = '\0';
+    close(fd);
+    return 0;
+}
+
+static void unload_file(mapped_file_t *file)
+{
+    if (file->data == NULL)
+        return;
+    if (file->map_len)
+    {
+        munmap(file->data, file->map_len);
+    }
+    else
+    {
+        mbedtls_platform_zeroize(file->data, file->len);
+        free(file->data);
+    }
+    file->data = NULL;
+}
+
+/**
+ * DER starts with an ASN.1 SEQUENCE tag; PEM starts with text
+ */
+static int is_der(const mapped_file_t *file)
+{
+    return file->len > 0 && file->data[0] == 0x30;
+}
+
+/**
+ * Load an existing certificate and private key (PEM or DER)
+ */
+static int load_credentials(server_context_t *server, tls_credentials_t *creds)
+{
+    mapped_file_t key_file;
+    int ret;
+
+    if ((ret = load_file(server->cert_path, server->use_mmap, &creds->cert_file)) != 0)
+    {
+        printf("Failed to read %s\n", server->cert_path);
+        return ret;
+    }
+    if (is_der(&creds->cert_file) && creds->cert_file.map_len)
+    {
+        // Parse straight out of the mapping; it stays mapped for the life of the credentials
+        ret = mbedtls_x509_crt_parse_der_nocopy(&creds->srvcert, creds->cert_file.data, creds->cert_file.len);
     }
+    else
+    {
+        size_t len = creds->cert_file.len + (is_der(&creds->cert_file) ? 0 : 1);
+        ret = mbedtls_x509_crt_parse(&creds->srvcert, creds->cert_file.data, len);
+        unload_file(&creds->cert_file);
+    }
+    if (ret != 0)
+    {
+        printf("Failed to parse certificate %s: %d\n", server->cert_path, ret);
+        return ret;
+    }
+
+    if ((ret = load_file(server->key_path, server->use_mmap, &key_file)) != 0)
+    {
+        printf("Failed to read %s\n", server->key_path);
+        return ret;
+    }
+    ret = mbedtls_pk_parse_key(&creds->pkey, key_file.data, key_file.len + (is_der(&key_file) ? 0 : 1), NULL, 0);
+    unload_file(&key_file);
+    if (ret != 0)
+    {
+        printf("Failed to parse private key %s: %d\n", server->key_path, ret);
+        return ret;
+    }
+
+    printf("Loaded certificate %s and key %s%s\n", server->cert_path, server->key_path,
+           server->use_mmap ? " (mmap)" : "");
+    return 0;
 }
 
+
 /**
  * Generate self-signed certificate using PSA-backed PK
  */
-static int generate_self_signed_certificate(server_context_t *server)
+static int generate_self_signed_certificate(server_context_t *server, tls_credentials_t *creds)
 {
     mbedtls_x509write_cert write_cert;
     unsigned char cert_der[4096];
+    char cert_pem[4096];
+    size_t cert_pem_len;
     int ret;
     psa_status_t status;
 
     printf("Generating self-signed certificate...\n");
 
     mbedtls_x509write_crt_init(&write_cert);
-    mbedtls_pk_init(&server->pkey);
-
     // 1. Generate EC Key using PSA API
     psa_key_attributes_t attributes = PSA_KEY_ATTRIBUTES_INIT;
 
@@ -95,7 +789,7 @@ static int generate_self_signed_certificate(server_context_t *server)
     psa_set_key_type(&attributes, PSA_KEY_TYPE_ECC_KEY_PAIR(PSA_ECC_FAMILY_SECP_R1));
     psa_set_key_bits(&attributes, 256);
 
-    status = psa_generate_key(&attributes, &server->key_id);
+    status = psa_generate_key(&attributes, &creds->key_id);
     if (status != PSA_SUCCESS)
     {
         printf("Failed to generate PSA key: %d\n", (int)status);
@@ -103,7 +797,7 @@ static int generate_self_signed_certificate(server_context_t *server)
     }
 
     // 2. Wrap the PSA key into the PK context
-    ret = mbedtls_pk_wrap_psa(&server->pkey, server->key_id);
+    ret = mbedtls_pk_wrap_psa(&creds->pkey, creds->key_id);
     if (ret != 0)
     {
         printf("Failed to wrap PSA key: %d\n", ret);
@@ -111,8 +805,8 @@ static int generate_self_signed_certificate(server_context_t *server)
     }
 
     // 3. Configure the Certificate
-    mbedtls_x509write_crt_set_subject_key(&write_cert, &server->pkey);
-    mbedtls_x509write_crt_set_issuer_key(&write_cert, &server->pkey);
+    mbedtls_x509write_crt_set_subject_key(&write_cert, &creds->pkey);
+    mbedtls_x509write_crt_set_issuer_key(&write_cert, &creds->pkey);
 
     ret = mbedtls_x509write_crt_set_subject_name(&write_cert, "CN=localhost,O=MbedTLS4,C=US");
     if (ret != 0)
@@ -147,7 +841,7 @@ static int generate_self_signed_certificate(server_context_t *server)
     unsigned char *cert_start = cert_der + sizeof(cert_der) - cert_len;
 
     // 7. Parse into the server context srvcert
-    ret = mbedtls_x509_crt_parse_der(&server->srvcert, cert_start, cert_len);
+    ret = mbedtls_x509_crt_parse_der(&creds->srvcert, cert_start, cert_len);
     if (ret != 0)
     {
         printf("Failed to parse DER certificate: %d\n", ret);
@@ -158,7 +852,7 @@ static int generate_self_signed_certificate(server_context_t *server)
     printf("  Exporting to PEM format...\n");
     ret = mbedtls_pem_write_buffer("-----BEGIN CERTIFICATE-----\n", "-----END CERTIFICATE-----\n",
                                    cert_start, cert_len,
-                                   (unsigned char *)server->cert_pem, sizeof(server->cert_pem), &server->cert_pem_len);
+                                   (unsigned char *)cert_pem, sizeof(cert_pem), &cert_pem_len);
     if (ret != 0)
     {
         printf("Failed to write PEM buffer: %d\n", ret);
@@ -167,83 +861,167 @@ static int generate_self_signed_certificate(server_context_t *server)
 
     // 9. Print certificate information
     printf("\n=== Generated Self-Signed Certificate ===\n");
-    print_certificate_info(&server->srvcert);
+    print_certificate_info(&creds->srvcert);
     printf("=========================================\n\n");
 
-    // 10. Save certificate to file
-    save_certificate_pem("server_cert.pem", server->cert_pem, server->cert_pem_len);
+    // 10. Save certificate and key so the next start loads them instead
+    save_certificate_pem(server->cert_path, cert_pem, cert_pem_len);
+    save_private_key_pem(server->key_path, &creds->pkey);
 
     printf("To connect with curl, use:\n");
-    printf("  curl --cacert server_cert.pem https://localhost:8443\n\n");
+    printf("  curl --cacert %s https://localhost:8443\n\n", server->cert_path);
 
     mbedtls_x509write_crt_free(&write_cert);
     return 0;
 }
 
-static void handle_client(server_context_t *server, mbedtls_net_context *client_fd)
-{
-    mbedtls_ssl_context ssl;
-    unsigned char buf[1024];
-    int ret;
+/* --- Session Resumption --- */
 
-    mbedtls_ssl_init(&ssl);
-    mbedtls_ssl_setup(&ssl, &server->conf);
-    mbedtls_ssl_set_bio(&ssl, client_fd, mbedtls_net_send, mbedtls_net_recv, NULL);
+/*
+ * mbedtls has no public "was this handshake resumed" query. The ticket parse
+ * callback runs on the thread driving the handshake, so it flags the
+ * accepted ticket here and connection_advance() collects it right after.
+ */
+static __thread int ticket_accepted;
 
-    printf("New client connection...\n");
+static int ticket_parse_counted(void *p_ticket, mbedtls_ssl_session *session, unsigned char *buf, size_t len)
+{
+    int ret = mbedtls_ssl_ticket_parse(p_ticket, session, buf, len);
+    if (ret == 0)
+        ticket_accepted = 1;
+    return ret;
+}
 
-    while ((ret = mbedtls_ssl_handshake(&ssl)) != 0)
+static int setup_session_tickets(server_context_t *server)
+{
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_TICKET_C)
+    // Stateless tickets: the ticket context keeps two AES-256-GCM keys and rotates them every TICKET_LIFETIME
+    mbedtls_ssl_ticket_init(&server->ticket_ctx);
+    int ret = mbedtls_ssl_ticket_setup(&server->ticket_ctx, PSA_ALG_GCM, PSA_KEY_TYPE_AES, 256, TICKET_LIFETIME);
+    if (ret != 0)
     {
-        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
-        {
-            char error_buf[256];
-            mbedtls_strerror(ret, error_buf, sizeof(error_buf));
-            printf("SSL handshake failed: %s (%d)\n", error_buf, ret);
-            goto cleanup;
-        }
+        printf("Failed to set up session tickets: %d\n", ret);
+        return ret;
     }
+#else
+    (void)server;
+    printf("Session tickets not compiled into Mbed TLS; every handshake will be a full one\n");
+#endif
+    return 0;
+}
 
-    printf("TLS handshake successful!\n");
-    printf("  Cipher: %s\n", mbedtls_ssl_get_ciphersuite(&ssl));
-    printf("  Version: %s\n", mbedtls_ssl_get_version(&ssl));
+static void conf_session_resumption(server_context_t *server, mbedtls_ssl_config *conf)
+{
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_TICKET_C)
+    mbedtls_ssl_conf_session_tickets_cb(conf, mbedtls_ssl_ticket_write, ticket_parse_counted, &server->ticket_ctx);
+    mbedtls_ssl_conf_new_session_tickets(conf, 1);
 
-    ret = mbedtls_ssl_read(&ssl, buf, sizeof(buf) - 1);
-    if (ret > 0)
+    // Offer psk_dhe_ke and psk_ke so resumed clients skip the certificate signature (and ECDHE with psk_ke)
+    mbedtls_ssl_conf_tls13_key_exchange_modes(conf, MBEDTLS_SSL_TLS1_3_KEY_EXCHANGE_MODE_ALL);
+
+#if defined(MBEDTLS_SSL_EARLY_DATA)
+    if (server->early_data)
     {
-        buf[ret] = '\0';
-        printf("Received request:\n%s\n", buf);
-        mbedtls_ssl_write(&ssl, (unsigned char *)HTTP_RESPONSE, strlen(HTTP_RESPONSE));
+        mbedtls_ssl_conf_early_data(conf, MBEDTLS_SSL_EARLY_DATA_ENABLED);
+        mbedtls_ssl_conf_max_early_data_size(conf, EARLY_DATA_MAX);
     }
-
-    mbedtls_ssl_close_notify(&ssl);
-    printf("Connection closed.\n\n");
-
-cleanup:
-    mbedtls_ssl_free(&ssl);
-    mbedtls_net_free(client_fd);
+#endif
+#else
+    (void)server;
+    (void)conf;
+#endif
 }
 
-static int setup_server(server_context_t *server)
+static void print_handshake_stats(server_context_t *server)
 {
-    int ret;
+    unsigned long full = 0, resumed = 0, early = 0, ktls = 0, offloaded = 0, inline_steps = 0;
 
-    mbedtls_net_init(&server->listen_fd);
-    mbedtls_ssl_config_init(&server->conf);
-    mbedtls_x509_crt_init(&server->srvcert);
-    mbedtls_pk_init(&server->pkey);
+    for (int i = 0; i < server->worker_count; i++)
+    {
+        full += atomic_load_explicit(&server->workers[i].handshakes_full, memory_order_relaxed);
+        resumed += atomic_load_explicit(&server->workers[i].handshakes_resumed, memory_order_relaxed);
+        early += atomic_load_explicit(&server->workers[i].early_data_requests, memory_order_relaxed);
+        ktls += atomic_load_explicit(&server->workers[i].ktls_connections, memory_order_relaxed);
+        offloaded += atomic_load_explicit(&server->workers[i].handshakes_offloaded, memory_order_relaxed);
+        inline_steps += atomic_load_explicit(&server->workers[i].handshakes_inline, memory_order_relaxed);
+    }
 
-    // Generate certificate
-    if ((ret = generate_self_signed_certificate(server)) != 0)
+    // Through the log, so the numbers land after the lines already queued
+    unsigned long total = full + resumed;
+    LOG_INFO("Handshakes: %lu total, %lu resumed (%.1f%%), %lu answered from 0-RTT",
+             total, resumed, total ? 100.0 * (double)resumed / (double)total : 0.0, early);
+    if (server->ktls)
+        LOG_INFO("kTLS: %lu connections offloaded to the kernel", ktls);
+    if (server->handshake_pool)
+        LOG_INFO("Handshake pool: %lu steps on %d threads, %lu inline because the queue was full", offloaded,
+                 server->handshake_pool->thread_count, inline_steps);
+    LOG_INFO("Timeouts: %lu handshake, %lu header, %lu idle, %lu write",
+             workers_sum(server, offsetof(worker_t, timeouts[TIMEOUT_HANDSHAKE])),
+             workers_sum(server, offsetof(worker_t, timeouts[TIMEOUT_HEADER])),
+             workers_sum(server, offsetof(worker_t, timeouts[TIMEOUT_IDLE])),
+             workers_sum(server, offsetof(worker_t, timeouts[TIMEOUT_WRITE])));
+    if (server->handshake_budget)
     {
-        printf("Failed to generate certificate: %d\n", ret);
-        return ret;
+        LOG_INFO("Admission: %lu full and %lu resumed handshakes admitted, %lu shed at ClientHello, %lu reset at accept",
+                 workers_sum(server, offsetof(worker_t, admitted_full)),
+                 workers_sum(server, offsetof(worker_t, admitted_resumed)),
+                 workers_sum(server, offsetof(worker_t, shed_handshakes)),
+                 workers_sum(server, offsetof(worker_t, shed_accepts)));
+        LOG_INFO("Admission: %lu offered a session ticket that did not resume",
+                 workers_sum(server, offsetof(worker_t, psk_fallbacks)));
+    }
+    if (server->cache)
+        LOG_INFO("Response cache: %lu hits, %lu misses, %lu evicted, %zu entries in %.1f MB",
+                 workers_sum(server, offsetof(worker_t, cache_hits)),
+                 workers_sum(server, offsetof(worker_t, cache_misses)),
+                 atomic_load_explicit(&server->cache->evictions, memory_order_relaxed),
+                 atomic_load_explicit(&server->cache->entries, memory_order_relaxed),
+                 (double)atomic_load_explicit(&server->cache->bytes, memory_order_relaxed) / (1024.0 * 1024.0));
+    LOG_INFO("Not modified: %lu conditional requests answered with a 304",
+             workers_sum(server, offsetof(worker_t, not_modified)));
+
+    static const struct
+    {
+        const char *name;
+        size_t offset;
+    } latencies[] = {
+        {"accept to ready", offsetof(worker_t, accept_to_ready)},
+        {"handshake", offsetof(worker_t, handshake_time)},
+        {"request", offsetof(worker_t, request_time)},
+    };
+    for (size_t i = 0; i < sizeof(latencies) / sizeof(latencies[0]); i++)
+    {
+        histogram_snapshot_t snap;
+        histogram_snapshot(server, latencies[i].offset, &snap);
+        if (snap.count > 0)
+            LOG_INFO("Latency, %s: p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms", latencies[i].name,
+                     histogram_quantile_ms(&snap, 0.5), histogram_quantile_ms(&snap, 0.99),
+                     histogram_quantile_ms(&snap, 0.999));
     }
+    LOG_INFO("Log: %lu records dropped", log_dropped());
+}
+
+/* --- Credentials --- */
+
+// Supported groups for TLS 1.3
+static const uint16_t groups[] = {
+    MBEDTLS_SSL_IANA_TLS_GROUP_SECP256R1,
+    MBEDTLS_SSL_IANA_TLS_GROUP_SECP384R1,
+    0};
+
+// Ciphersuites for TLS 1.3
+static const int ciphers[] = {
+    MBEDTLS_TLS1_3_CHACHA20_POLY1305_SHA256,
+    MBEDTLS_TLS1_3_AES_256_GCM_SHA384,
+    MBEDTLS_TLS1_3_AES_128_GCM_SHA256,
+    0};
 
-    // Configure SSL
-    ret = mbedtls_ssl_config_defaults(&server->conf,
-                                      MBEDTLS_SSL_IS_SERVER,
-                                      MBEDTLS_SSL_TRANSPORT_STREAM,
-                                      MBEDTLS_SSL_PRESET_DEFAULT);
+static int build_ssl_config(server_context_t *server, tls_credentials_t *creds)
+{
+    int ret = mbedtls_ssl_config_defaults(&creds->conf,
+                                          MBEDTLS_SSL_IS_SERVER,
+                                          MBEDTLS_SSL_TRANSPORT_STREAM,
+                                          MBEDTLS_SSL_PRESET_DEFAULT);
     if (ret != 0)
     {
         printf("Failed to set SSL defaults: %d\n", ret);
@@ -251,46 +1029,3095 @@ static int setup_server(server_context_t *server)
     }
 
     // Force TLS 1.3 only
-    mbedtls_ssl_conf_min_tls_version(&server->conf, MBEDTLS_SSL_VERSION_TLS1_3);
-    mbedtls_ssl_conf_max_tls_version(&server->conf, MBEDTLS_SSL_VERSION_TLS1_3);
-
-    // Supported groups for TLS 1.3
-    static const uint16_t groups[] = {
-        MBEDTLS_SSL_IANA_TLS_GROUP_SECP256R1,
-        MBEDTLS_SSL_IANA_TLS_GROUP_SECP384R1,
-        0};
-    mbedtls_ssl_conf_groups(&server->conf, groups);
-
-    // Ciphersuites for TLS 1.3
-    static const int ciphers[] = {
-        MBEDTLS_TLS1_3_CHACHA20_POLY1305_SHA256,
-        MBEDTLS_TLS1_3_AES_256_GCM_SHA384,
-        MBEDTLS_TLS1_3_AES_128_GCM_SHA256,
-        0};
-    mbedtls_ssl_conf_ciphersuites(&server->conf, ciphers);
+    mbedtls_ssl_conf_min_tls_version(&creds->conf, MBEDTLS_SSL_VERSION_TLS1_3);
+    mbedtls_ssl_conf_max_tls_version(&creds->conf, MBEDTLS_SSL_VERSION_TLS1_3);
+
+    mbedtls_ssl_conf_groups(&creds->conf, groups);
+    mbedtls_ssl_conf_ciphersuites(&creds->conf, ciphers);
 
     // Set our certificate and private key
-    mbedtls_ssl_conf_own_cert(&server->conf, &server->srvcert, &server->pkey);
+    mbedtls_ssl_conf_own_cert(&creds->conf, &creds->srvcert, &creds->pkey);
 
-    // Bind to address
-    printf("Binding to %s:%s...\n", SERVER_ADDR, SERVER_PORT);
-    return mbedtls_net_bind(&server->listen_fd, SERVER_ADDR, SERVER_PORT, MBEDTLS_NET_PROTO_TCP);
+    // Session tickets, PSK resumption and optional 0-RTT
+    conf_session_resumption(server, &creds->conf);
+    return 0;
 }
 
-int main()
+static void credentials_release(tls_credentials_t *creds)
 {
-    server_context_t server = {.running = 1};
-    int ret;
+    if (creds == NULL || atomic_fetch_sub_explicit(&creds->refs, 1, memory_order_acq_rel) != 1)
+        return;
 
-    printf("Initializing PSA crypto...\n");
-    if (psa_crypto_init() != PSA_SUCCESS)
-    {
-        printf("Failed to initialize PSA crypto\n");
-        return 1;
-    }
+    mbedtls_ssl_config_free(&creds->conf);
+    mbedtls_x509_crt_free(&creds->srvcert);
+    mbedtls_pk_free(&creds->pkey);
 
-    printf("Setting up server...\n");
-    if ((ret = setup_server(&server)) != 0)
+    // Destroy PSA key
+    if (creds->key_id != 0)
+        psa_destroy_key(creds->key_id);
+
+    unload_file(&creds->cert_file);
+    free(creds);
+}
+
+/**
+ * Load the configured certificate and key, generating a self-signed pair
+ * only when allowed and neither file exists yet
+ */
+static tls_credentials_t *credentials_create(server_context_t *server, int allow_generate, int *ret)
+{
+    tls_credentials_t *creds = calloc(1, sizeof(*creds));
+    if (creds == NULL)
+    {
+        *ret = MBEDTLS_ERR_SSL_ALLOC_FAILED;
+        return NULL;
+    }
+    mbedtls_ssl_config_init(&creds->conf);
+    mbedtls_x509_crt_init(&creds->srvcert);
+    mbedtls_pk_init(&creds->pkey);
+    atomic_init(&creds->refs, 1);
+
+    int have_files = access(server->cert_path, F_OK) == 0 && access(server->key_path, F_OK) == 0;
+    if (have_files || !allow_generate)
+        *ret = load_credentials(server, creds);
+    else
+        *ret = generate_self_signed_certificate(server, creds);
+
+    if (*ret == 0)
+        *ret = build_ssl_config(server, creds);
+    if (*ret != 0)
+    {
+        credentials_release(creds);
+        return NULL;
+    }
+    return creds;
+}
+
+static tls_credentials_t *credentials_acquire(server_context_t *server)
+{
+    pthread_mutex_lock(&server->creds_lock);
+    tls_credentials_t *creds = server->creds;
+    atomic_fetch_add_explicit(&creds->refs, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&server->creds_lock);
+    return creds;
+}
+
+/**
+ * SIGHUP: re-read the certificate and key and publish them. Live
+ * connections keep the set they started with until they close.
+ */
+static void reload_credentials(server_context_t *server)
+{
+    int ret;
+    tls_credentials_t *creds = credentials_create(server, 0, &ret);
+    if (creds == NULL)
+    {
+        LOG_ERROR("Certificate reload failed (%d); keeping the current one", ret);
+        return;
+    }
+
+    pthread_mutex_lock(&server->creds_lock);
+    tls_credentials_t *old = server->creds;
+    server->creds = creds;
+    pthread_mutex_unlock(&server->creds_lock);
+    atomic_fetch_add_explicit(&server->creds_generation, 1, memory_order_release);
+
+    credentials_release(old);
+    LOG_INFO("Certificate reloaded");
+}
+
+/**
+ * Called from the worker's loop: swap to the newest credentials after a
+ * reload. The generation check keeps the lock off the accept path.
+ */
+static void worker_refresh_credentials(worker_t *worker)
+{
+    unsigned generation = atomic_load_explicit(&worker->server->creds_generation, memory_order_acquire);
+    if (worker->creds != NULL && generation == worker->creds_generation)
+        return;
+
+    tls_credentials_t *creds = credentials_acquire(worker->server);
+    credentials_release(worker->creds);
+    worker->creds = creds;
+    worker->creds_generation = generation;
+}
+
+/* --- Handshake Pool --- */
+
+static void *handshake_pool_thread(void *arg)
+{
+    handshake_pool_t *pool = arg;
+
+    log_thread_name("hs");
+    for (;;)
+    {
+        pthread_mutex_lock(&pool->lock);
+
+        // Wait for a task or the shutdown signal
+        while (pool->count == 0 && !pool->shutdown)
+            pthread_cond_wait(&pool->notify, &pool->lock);
+
+        if (pool->shutdown)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+
+        task_t task = pool->task_queue[pool->head];
+        pool->head = (pool->head + 1) % HANDSHAKE_QUEUE_SIZE;
+        pool->count--;
+
+        pthread_mutex_unlock(&pool->lock);
+
+        // Run the task outside the lock
+        task.function(task.arg);
+    }
+    return NULL;
+}
+
+static void handshake_pool_destroy(handshake_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->notify);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->thread_count; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->notify);
+    free(pool->threads);
+    free(pool);
+}
+
+static handshake_pool_t *handshake_pool_create(int thread_count)
+{
+    handshake_pool_t *pool = calloc(1, sizeof(*pool));
+    if (pool == NULL)
+        return NULL;
+    pool->threads = calloc((size_t)thread_count, sizeof(pthread_t));
+    if (pool->threads == NULL)
+    {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->notify, NULL);
+
+    for (int i = 0; i < thread_count; i++)
+    {
+        if (pthread_create(&pool->threads[i], NULL, handshake_pool_thread, pool) != 0)
+        {
+            handshake_pool_destroy(pool);
+            return NULL;
+        }
+        pool->thread_count++;
+    }
+    return pool;
+}
+
+/**
+ * Queue a task. Returns -1 when the queue is full, so the caller can run it
+ * itself instead of dropping it.
+ */
+static int handshake_pool_submit(handshake_pool_t *pool, void (*function)(void *), void *arg)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count < HANDSHAKE_QUEUE_SIZE)
+    {
+        pool->task_queue[pool->tail] = (task_t){.function = function, .arg = arg};
+        pool->tail = (pool->tail + 1) % HANDSHAKE_QUEUE_SIZE;
+        pool->count++;
+        pthread_cond_signal(&pool->notify);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return ret;
+}
+
+/* --- Connection Arenas --- */
+
+#if defined(HAVE_ARENA)
+
+// Arena of the connection this thread is currently driving; NULL means plain heap
+static __thread arena_t *current_arena;
+
+/**
+ * Every block carries the arena it came from (NULL for the heap), so a
+ * block can be freed from any thread, after its connection has moved on
+ */
+typedef union
+{
+    arena_t *arena;
+    max_align_t align;
+} alloc_header_t;
+
+static arena_t *arena_create(void)
+{
+    arena_t *arena = malloc(sizeof(*arena));
+    if (arena == NULL)
+        return NULL;
+    atomic_init(&arena->live, 1);
+    arena->used = 0;
+    return arena;
+}
+
+static void arena_unref(arena_t *arena)
+{
+    if (arena != NULL && atomic_fetch_sub_explicit(&arena->live, 1, memory_order_acq_rel) == 1)
+        free(arena);
+}
+
+static void *arena_calloc(size_t n, size_t size)
+{
+    if (size != 0 && n > (SIZE_MAX - sizeof(alloc_header_t) - 15) / size)
+        return NULL;
+    size_t need = (sizeof(alloc_header_t) + n * size + 15) & ~(size_t)15;
+    arena_t *arena = current_arena;
+    alloc_header_t *h;
+
+    if (arena != NULL && need <= ARENA_SIZE - arena->used)
+    {
+        h = (alloc_header_t *)(arena->data + arena->used);
+        arena->used += need;
+        atomic_fetch_add_explicit(&arena->live, 1, memory_order_relaxed);
+        memset(h + 1, 0, need - sizeof(*h));
+    }
+    else
+    {
+        h = calloc(1, need);
+        if (h == NULL)
+            return NULL;
+        arena = NULL;
+    }
+    h->arena = arena;
+    return h + 1;
+}
+
+static void arena_free(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+    alloc_header_t *h = (alloc_header_t *)ptr - 1;
+    if (h->arena != NULL)
+        arena_unref(h->arena);
+    else
+        free(h);
+}
+
+/**
+ * Rewind an arena for reuse. Something allocated during the last connection
+ * may still be alive elsewhere (a ticket key rotated mid-handshake, say); then
+ * the old arena is left to its remaining blocks and a fresh one takes its place.
+ */
+static void arena_recycle(arena_t **slot)
+{
+    arena_t *arena = *slot;
+    if (arena != NULL && atomic_load_explicit(&arena->live, memory_order_acquire) == 1)
+    {
+        arena->used = 0;
+        return;
+    }
+    arena_unref(arena);
+    *slot = arena_create();
+}
+
+static void arena_enter(connection_t *conn)
+{
+    current_arena = conn->arena[conn->arena_cur];
+}
+
+static void arena_leave(void)
+{
+    current_arena = NULL;
+}
+
+#else
+
+static void arena_enter(connection_t *conn)
+{
+    (void)conn;
+}
+
+static void arena_leave(void)
+{
+}
+
+#endif /* HAVE_ARENA */
+
+/* --- Kernel TLS --- */
+
+#if defined(HAVE_KTLS)
+
+/**
+ * Hand the record layer to the kernel once the handshake is over.
+ * Returns a short description for the handshake log.
+ */
+static const char *ktls_enable(connection_t *conn)
+{
+    const char *result = ktls_install(conn->net.fd, &conn->ssl, &conn->ktls, &conn->ktls_rx, &conn->ktls_tx);
+    if (conn->ktls_rx || conn->ktls_tx)
+        counter_inc(&conn->worker->ktls_connections);
+    return result;
+}
+
+#endif /* HAVE_KTLS */
+
+/**
+ * Read application data through whichever record layer owns the socket.
+ * Returns bytes read, 0 at end of stream, or an MBEDTLS_ERR_* code.
+ */
+static int connection_recv(connection_t *conn, unsigned char *buf, size_t len)
+{
+#if defined(HAVE_KTLS)
+    if (conn->ktls_rx)
+        return ktls_recv(conn->net.fd, buf, len);
+#endif
+    return mbedtls_ssl_read(&conn->ssl, buf, len);
+}
+
+/**
+ * Size the record layer for a connection whose handshake just completed
+ */
+static void record_sizing_init(connection_t *conn)
+{
+    int mss = 0;
+    socklen_t optlen = sizeof(mss);
+
+    // Fallback: a 1500-byte MTU with IPv4 and TCP timestamps
+    if (getsockopt(conn->net.fd, IPPROTO_TCP, TCP_MAXSEG, &mss, &optlen) != 0 || mss <= RECORD_OVERHEAD)
+        mss = 1448;
+    conn->record_small = (size_t)mss - RECORD_OVERHEAD;
+    conn->ramp_sent = 0;
+    conn->last_write_ns = now_ns();
+    conn->write_retry = 0;
+}
+
+/**
+ * Write application data. `more` tells the kernel a file body follows, so
+ * the head and the first part of the body can share a record.
+ */
+static int connection_send(connection_t *conn, const unsigned char *buf, size_t len, int more)
+{
+#if defined(HAVE_KTLS)
+    if (conn->ktls_tx)
+    {
+        ssize_t n = send(conn->net.fd, buf, len, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? MBEDTLS_ERR_SSL_WANT_WRITE : MBEDTLS_ERR_NET_SEND_FAILED;
+        return (int)n;
+    }
+#endif
+    (void)more;
+    if (conn->write_retry > 0)
+    {
+        // Mbed TLS finishes the pending record and reports `len` as written, so `out`
+        // having been topped up since must not change it
+        len = conn->write_retry;
+    }
+    else if (conn->ramp_sent < RECORD_RAMP_BYTES && len > conn->record_small)
+    {
+        // Early on, a record the client can decrypt as soon as its one segment lands
+        // beats a 16 KB one that waits for a dozen segments, some past the congestion window
+        len = conn->record_small;
+    }
+    int ret = mbedtls_ssl_write(&conn->ssl, buf, len);
+    conn->write_retry = is_want_io(ret) ? len : 0;
+    if (ret > 0)
+        conn->ramp_sent += (size_t)ret;
+    return ret;
+}
+
+static int connection_close_notify(connection_t *conn)
+{
+#if defined(HAVE_KTLS)
+    if (conn->ktls_tx)
+    {
+        ktls_close_notify(conn->net.fd);
+        return 0;
+    }
+#endif
+    return mbedtls_ssl_close_notify(&conn->ssl);
+}
+
+/* --- Metrics --- */
+
+static void metrics_append(char *buf, size_t size, size_t *len, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static void metrics_append(char *buf, size_t size, size_t *len, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (*len >= size)
+        return;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf + *len, size - *len, fmt, ap);
+    va_end(ap);
+    *len += n > 0 ? (size_t)n : 0; // past size on truncation, which the caller checks
+}
+
+static void metrics_counter(char *buf, size_t size, size_t *len, const char *name, const char *help,
+                            unsigned long value)
+{
+    metrics_append(buf, size, len, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", name, help, name, name, value);
+}
+
+/**
+ * Prometheus histogram with a bucket per power of two from ~1 us to ~69 s;
+ * the finer sub-buckets only feed the SIGUSR1 percentiles
+ */
+static void metrics_histogram(char *buf, size_t size, size_t *len, server_context_t *server, const char *name,
+                              const char *help, size_t offset)
+{
+    histogram_snapshot_t snap;
+    unsigned long cumulative = 0;
+    unsigned b = 0;
+
+    histogram_snapshot(server, offset, &snap);
+    metrics_append(buf, size, len, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (unsigned exp = 10; exp <= HIST_MAX_EXP - 1; exp++)
+    {
+        for (; b < HIST_BUCKETS && histogram_bucket_limit(b) <= (1ull << exp); b++)
+            cumulative += snap.buckets[b];
+        metrics_append(buf, size, len, "%s_bucket{le=\"%.12g\"} %lu\n", name, (double)(1ull << exp) / 1e9, cumulative);
+    }
+    metrics_append(buf, size, len, "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %.9f\n%s_count %lu\n", name, snap.count,
+                   name, (double)snap.sum_ns / 1e9, name, snap.count);
+}
+
+/**
+ * Render every worker's counters and histograms in the Prometheus text format.
+ * Returns the length, or -1 if buf is too small.
+ */
+static int render_metrics(server_context_t *server, char *buf, size_t size)
+{
+    size_t len = 0;
+
+    metrics_counter(buf, size, &len, "tls_connections_accepted_total", "Connections accepted.",
+                    workers_sum(server, offsetof(worker_t, connections_accepted)));
+    metrics_append(buf, size, &len,
+                   "# HELP tls_connections_open Connections currently open.\n# TYPE tls_connections_open gauge\n"
+                   "tls_connections_open %lu\n",
+                   workers_sum(server, offsetof(worker_t, connections_open)));
+
+    metrics_append(buf, size, &len, "# HELP tls_handshakes_total Handshakes by outcome.\n"
+                                    "# TYPE tls_handshakes_total counter\n");
+    metrics_append(buf, size, &len, "tls_handshakes_total{result=\"full\"} %lu\n",
+                   workers_sum(server, offsetof(worker_t, handshakes_full)));
+    metrics_append(buf, size, &len, "tls_handshakes_total{result=\"resumed\"} %lu\n",
+                   workers_sum(server, offsetof(worker_t, handshakes_resumed)));
+    metrics_append(buf, size, &len, "tls_handshakes_total{result=\"failed\"} %lu\n",
+                   workers_sum(server, offsetof(worker_t, handshakes_failed)));
+
+    metrics_append(buf, size, &len, "# HELP tls_handshakes_by_ciphersuite_total Completed handshakes by ciphersuite.\n"
+                                    "# TYPE tls_handshakes_by_ciphersuite_total counter\n");
+    for (int i = 0; ciphers[i] != 0 && i < MAX_CIPHERS; i++)
+        metrics_append(buf, size, &len, "tls_handshakes_by_ciphersuite_total{ciphersuite=\"%s\"} %lu\n",
+                       mbedtls_ssl_get_ciphersuite_name(ciphers[i]),
+                       workers_sum(server, offsetof(worker_t, handshakes_by_cipher) + (size_t)i * sizeof(atomic_ulong)));
+
+    metrics_counter(buf, size, &len, "tls_early_data_requests_total", "Requests answered from 0-RTT early data.",
+                    workers_sum(server, offsetof(worker_t, early_data_requests)));
+    metrics_counter(buf, size, &len, "tls_ktls_connections_total", "Connections handed to kernel TLS.",
+                    workers_sum(server, offsetof(worker_t, ktls_connections)));
+    metrics_counter(buf, size, &len, "tls_handshake_steps_offloaded_total", "Handshake steps run on the pool.",
+                    workers_sum(server, offsetof(worker_t, handshakes_offloaded)));
+    metrics_counter(buf, size, &len, "tls_handshake_steps_inline_total",
+                    "Handshake steps run on the I/O thread because the pool queue was full.",
+                    workers_sum(server, offsetof(worker_t, handshakes_inline)));
+    metrics_counter(buf, size, &len, "http_requests_total", "Requests answered.",
+                    workers_sum(server, offsetof(worker_t, requests)));
+    metrics_counter(buf, size, &len, "http_bad_requests_total", "Malformed or oversized requests.",
+                    workers_sum(server, offsetof(worker_t, bad_requests)));
+    metrics_append(buf, size, &len, "# HELP tls_connection_timeouts_total Connections closed at a deadline.\n"
+                                    "# TYPE tls_connection_timeouts_total counter\n");
+    for (int i = 0; i < TIMEOUT_KINDS; i++)
+        metrics_append(buf, size, &len, "tls_connection_timeouts_total{phase=\"%s\"} %lu\n", timeout_names[i],
+                       workers_sum(server, offsetof(worker_t, timeouts) + (size_t)i * sizeof(atomic_ulong)));
+    metrics_append(buf, size, &len, "# HELP tls_admission_total New connections by admission decision.\n"
+                                    "# TYPE tls_admission_total counter\n");
+    metrics_append(buf, size, &len, "tls_admission_total{decision=\"full\"} %lu\n",
+                   workers_sum(server, offsetof(worker_t, admitted_full)));
+    metrics_append(buf, size, &len, "tls_admission_total{decision=\"resumed\"} %lu\n",
+                   workers_sum(server, offsetof(worker_t, admitted_resumed)));
+    metrics_append(buf, size, &len, "tls_admission_total{decision=\"shed_handshake\"} %lu\n",
+                   workers_sum(server, offsetof(worker_t, shed_handshakes)));
+    metrics_append(buf, size, &len, "tls_admission_total{decision=\"shed_accept\"} %lu\n",
+                   workers_sum(server, offsetof(worker_t, shed_accepts)));
+    metrics_append(buf, size, &len,
+                   "# HELP tls_psk_fallbacks_total Handshakes that offered a session ticket but were not resumed.\n"
+                   "# TYPE tls_psk_fallbacks_total counter\n");
+    metrics_append(buf, size, &len, "tls_psk_fallbacks_total %lu\n",
+                   workers_sum(server, offsetof(worker_t, psk_fallbacks)));
+    metrics_append(buf, size, &len, "# HELP http_response_cache_total Document root requests by cache outcome.\n"
+                                    "# TYPE http_response_cache_total counter\n");
+    metrics_append(buf, size, &len, "http_response_cache_total{result=\"hit\"} %lu\n",
+                   workers_sum(server, offsetof(worker_t, cache_hits)));
+    metrics_append(buf, size, &len, "http_response_cache_total{result=\"miss\"} %lu\n",
+                   workers_sum(server, offsetof(worker_t, cache_misses)));
+    metrics_counter(buf, size, &len, "http_response_cache_evictions_total", "Responses evicted to stay within budget.",
+                    server->cache ? atomic_load_explicit(&server->cache->evictions, memory_order_relaxed) : 0);
+    metrics_append(buf, size, &len,
+                   "# HELP http_response_cache_bytes Memory held by cached responses.\n"
+                   "# TYPE http_response_cache_bytes gauge\nhttp_response_cache_bytes %zu\n",
+                   server->cache ? atomic_load_explicit(&server->cache->bytes, memory_order_relaxed) : 0);
+    metrics_counter(buf, size, &len, "http_not_modified_total", "Conditional requests answered with a 304.",
+                    workers_sum(server, offsetof(worker_t, not_modified)));
+    metrics_counter(buf, size, &len, "log_records_dropped_total", "Log records dropped because a ring was full.",
+                    log_dropped());
+
+    metrics_histogram(buf, size, &len, server, "tls_accept_to_ready_seconds",
+                      "From accept until the handshake is done, waits included.", offsetof(worker_t, accept_to_ready));
+    metrics_histogram(buf, size, &len, server, "tls_handshake_seconds", "Time spent computing the handshake.",
+                      offsetof(worker_t, handshake_time));
+    metrics_histogram(buf, size, &len, server, "http_request_duration_seconds",
+                      "From parsing a request until its response is written.", offsetof(worker_t, request_time));
+
+    return len < size ? (int)len : -1;
+}
+
+/* --- HTTP/1.1 --- */
+
+static int method_is(const http_request_t *req, const char *method)
+{
+    return req->method_len == strlen(method) && memcmp(req->method, method, req->method_len) == 0;
+}
+
+/**
+ * 0-RTT data can be replayed by an attacker, so only idempotent requests may
+ * be answered from it
+ */
+static int is_idempotent_request(const http_request_t *req)
+{
+    return method_is(req, "GET") || method_is(req, "HEAD");
+}
+
+/**
+ * Skip the body of the current request.
+ * Returns the number of bytes consumed, or -1 on a malformed chunked body.
+ */
+static long consume_body(connection_t *conn, const unsigned char *p, size_t len)
+{
+    if (conn->body_mode == BODY_LENGTH)
+    {
+        size_t n = len < conn->body_remaining ? len : (size_t)conn->body_remaining;
+        conn->body_remaining -= n;
+        if (conn->body_remaining == 0)
+            conn->body_mode = BODY_NONE;
+        return (long)n;
+    }
+
+    long n = http_chunked_consume(&conn->chunked, p, len);
+    if (n >= 0 && http_chunked_done(&conn->chunked))
+        conn->body_mode = BODY_NONE;
+    return n;
+}
+
+/**
+ * Format a response head into `out` without committing it. `extra` holds any
+ * further header lines, each ending in CRLF.
+ * Returns its length, or -1 if it does not fit together with `reserve` body bytes.
+ */
+static int format_head(connection_t *conn, const char *status, const char *content_type, size_t content_length,
+                       const char *extra, int keep_alive, size_t reserve)
+{
+    size_t room = sizeof(conn->out) - conn->out_len;
+    int n = snprintf((char *)conn->out + conn->out_len, room,
+                     "HTTP/1.1 %s\r\n"
+                     "Content-Type: %s\r\n"
+                     "Content-Length: %zu\r\n"
+                     "%s"
+                     "Connection: %s\r\n"
+                     "\r\n",
+                     status, content_type, content_length, extra, keep_alive ? "keep-alive" : "close");
+    if (n < 0 || (size_t)n >= room || (size_t)n + reserve > room)
+        return -1;
+    return n;
+}
+
+/**
+ * Queue a complete response behind any pipelined ones already in `out`.
+ * Returns -1 if it does not fit yet; the caller flushes and retries.
+ */
+static int queue_response(connection_t *conn, const char *status, const char *content_type, const char *body,
+                          size_t body_len, int send_body, int keep_alive)
+{
+    int n = format_head(conn, status, content_type, body_len, "", keep_alive, send_body ? body_len : 0);
+    if (n < 0)
+        return -1;
+
+    if (send_body)
+        memcpy(conn->out + conn->out_len + n, body, body_len);
+    conn->out_len += (size_t)n + (send_body ? body_len : 0);
+    if (!keep_alive)
+        conn->close_after = 1;
+    return 0;
+}
+
+/**
+ * Whether a conditional GET or HEAD already holds `etag`: some If-None-Match
+ * names it, or is "*". Tags compare weakly, as RFC 9110 asks for this header,
+ * so a W/ prefix is ignored.
+ */
+static int etag_matches(const http_request_t *req, const char *etag, size_t etag_len)
+{
+    if (!is_idempotent_request(req))
+        return 0;
+    for (size_t i = 0; i < req->num_headers; i++)
+    {
+        const http_header_t *h = &req->headers[i];
+        if (!http_token_eq(h->name, h->name_len, "If-None-Match"))
+            continue;
+
+        const char *p = h->value, *end = h->value + h->value_len;
+        while (p < end)
+        {
+            if (*p == ' ' || *p == '\t' || *p == ',')
+            {
+                p++;
+                continue;
+            }
+            if (*p == '*')
+                return 1;
+            if (end - p > 2 && p[0] == 'W' && p[1] == '/')
+                p += 2;
+            const char *tag = p;
+            const char *close = p < end && *p == '"' ? memchr(p + 1, '"', (size_t)(end - p - 1)) : NULL;
+            if (close == NULL)
+                break; // not a quoted tag; nothing after it can be trusted
+            p = close + 1;
+            if ((size_t)(p - tag) == etag_len && memcmp(tag, etag, etag_len) == 0)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Whether the client takes gzip: some Accept-Encoding lists it without q=0
+ */
+static int accepts_gzip(const http_request_t *req)
+{
+    for (size_t i = 0; i < req->num_headers; i++)
+    {
+        const http_header_t *h = &req->headers[i];
+        if (!http_token_eq(h->name, h->name_len, "Accept-Encoding"))
+            continue;
+
+        const char *p = h->value, *end = h->value + h->value_len;
+        while (p < end)
+        {
+            const char *item_end = memchr(p, ',', (size_t)(end - p));
+            if (item_end == NULL)
+                item_end = end;
+            while (p < item_end && (*p == ' ' || *p == '\t'))
+                p++;
+            const char *token = p;
+            while (p < item_end && *p != ';' && *p != ' ' && *p != '\t')
+                p++;
+            if (http_token_eq(token, (size_t)(p - token), "gzip"))
+            {
+                // Any parameter other than a zero weight leaves it acceptable
+                const char *q = p;
+                while (q + 1 < item_end && !((q[0] == 'q' || q[0] == 'Q') && q[1] == '='))
+                    q++;
+                if (q + 1 >= item_end)
+                    return 1;
+                for (q += 2; q < item_end && (*q == '0' || *q == '.'); q++)
+                    ;
+                if (q < item_end && *q >= '1' && *q <= '9')
+                    return 1;
+            }
+            p = item_end < end ? item_end + 1 : end;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Queue a header-only 304 for a representation the client already holds
+ */
+static int queue_not_modified(connection_t *conn, const char *etag, int vary, int keep_alive)
+{
+    size_t room = sizeof(conn->out) - conn->out_len;
+    int n = snprintf((char *)conn->out + conn->out_len, room,
+                     "HTTP/1.1 304 Not Modified\r\n"
+                     "ETag: %s\r\n"
+                     "%s"
+                     "Connection: %s\r\n"
+                     "\r\n",
+                     etag, vary ? "Vary: Accept-Encoding\r\n" : "", keep_alive ? "keep-alive" : "close");
+    if (n < 0 || (size_t)n >= room)
+        return -1;
+    conn->out_len += (size_t)n;
+    if (!keep_alive)
+        conn->close_after = 1;
+    counter_inc(&conn->worker->not_modified);
+    return 0;
+}
+
+/**
+ * The built-in page, with a strong ETag so repeat visitors get a 304
+ */
+static int queue_page(connection_t *conn, const http_request_t *req, int head_only)
+{
+    const char *etag = conn->worker->server->page_etag;
+    char extra[64];
+
+    if (etag_matches(req, etag, strlen(etag)))
+        return queue_not_modified(conn, etag, 0, req->keep_alive);
+
+    snprintf(extra, sizeof(extra), "ETag: %s\r\n", etag);
+    size_t body_len = strlen(HTTP_BODY);
+    int n = format_head(conn, "200 OK", "text/html", body_len, extra, req->keep_alive, head_only ? 0 : body_len);
+    if (n < 0)
+        return -1;
+    if (!head_only)
+        memcpy(conn->out + conn->out_len + n, HTTP_BODY, body_len);
+    conn->out_len += (size_t)n + (head_only ? 0 : body_len);
+    if (!req->keep_alive)
+        conn->close_after = 1;
+    return 0;
+}
+
+static const char *content_type_for(const char *path)
+{
+    static const struct
+    {
+        const char *ext;
+        const char *type;
+    } types[] = {
+        {".html", "text/html"},        {".css", "text/css"},       {".js", "text/javascript"},
+        {".json", "application/json"}, {".txt", "text/plain"},     {".svg", "image/svg+xml"},
+        {".png", "image/png"},         {".jpg", "image/jpeg"},     {".ico", "image/x-icon"},
+        {".wasm", "application/wasm"}, {".pdf", "application/pdf"}};
+    const char *dot = strrchr(path, '.');
+
+    for (size_t i = 0; dot && i < sizeof(types) / sizeof(types[0]); i++)
+    {
+        if (strcasecmp(dot, types[i].ext) == 0)
+            return types[i].type;
+    }
+    return "application/octet-stream";
+}
+
+/**
+ * Map a request path onto a file name under the document root. `rel` is left
+ * with room for a ".gz" suffix. Returns -1 when the path cannot name a file there.
+ */
+static int static_file_path(const http_request_t *req, char *rel, size_t rel_size)
+{
+    return static_path_resolve(req->path, req->path_len, rel, rel_size);
+}
+
+/**
+ * Open a regular file under the document root, or return -1. Symbolic links
+ * are not followed, so nothing outside the root can be served.
+ */
+static int open_static_file(int docroot_fd, const char *rel, struct stat *st)
+{
+    int fd = open_beneath(docroot_fd, rel, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, st) != 0 || !S_ISREG(st->st_mode))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Open what to send for `rel`: its pre-compressed sibling `rel`.gz when the
+ * client takes gzip and there is one, else the file itself. Sets *gzipped to match.
+ */
+static int open_representation(int docroot_fd, char *rel, int gzip, struct stat *st, int *gzipped)
+{
+    size_t len = strlen(rel);
+
+    *gzipped = 0;
+    if (gzip)
+    {
+        memcpy(rel + len, ".gz", 4);
+        int fd = open_static_file(docroot_fd, rel, st);
+        rel[len] = '\0';
+        if (fd >= 0)
+        {
+            *gzipped = 1;
+            return fd;
+        }
+    }
+    return open_static_file(docroot_fd, rel, st);
+}
+
+static int has_gzip_sibling(int docroot_fd, char *rel)
+{
+    size_t len = strlen(rel);
+    struct stat st;
+
+    memcpy(rel + len, ".gz", 4);
+    int found = stat_beneath(docroot_fd, rel, &st) == 0 && S_ISREG(st.st_mode);
+    rel[len] = '\0';
+    return found;
+}
+
+/**
+ * What a file looked like: a cached response stays valid while it still does
+ */
+static void file_validator(const struct stat *st, uint64_t validator[4])
+{
+    validator[0] = (uint64_t)st->st_dev;
+    validator[1] = (uint64_t)st->st_ino;
+    validator[2] = (uint64_t)st->st_size;
+    validator[3] = (uint64_t)st->st_mtim.tv_sec * 1000000000ull + (uint64_t)st->st_mtim.tv_nsec;
+}
+
+/**
+ * Cache key: the encoding, then the file name under the document root
+ */
+static size_t cache_key(char *key, size_t size, const char *rel, int gzipped)
+{
+    int n = snprintf(key, size, "%c%s", gzipped ? 'g' : 'i', rel);
+    return n > 0 && (size_t)n < size ? (size_t)n : 0;
+}
+
+/**
+ * Check a cached file response against the disk, at most every
+ * CACHE_REVALIDATE_MS. Drops the entry and returns 0 once the file changed.
+ */
+static int cache_entry_fresh(worker_t *worker, cache_entry_t *e, char *rel, int gzipped)
+{
+    uint64_t now = now_ms();
+    if (now - atomic_load_explicit(&e->checked_ms, memory_order_relaxed) < CACHE_REVALIDATE_MS)
+        return 1;
+
+    size_t len = strlen(rel);
+    struct stat st;
+    uint64_t validator[4];
+    int fresh;
+
+    if (gzipped)
+        memcpy(rel + len, ".gz", 4);
+    fresh = stat_beneath(worker->server->docroot_fd, rel, &st) == 0 && S_ISREG(st.st_mode);
+    rel[len] = '\0';
+    if (fresh)
+    {
+        file_validator(&st, validator);
+        fresh = memcmp(validator, e->validator, sizeof(validator)) == 0;
+    }
+    // A variant that appeared or went away changes which entry an identity lookup may answer with
+    if (fresh && !gzipped)
+        fresh = !!(e->flags & CACHE_GZIP_SIBLING) == has_gzip_sibling(worker->server->docroot_fd, rel);
+    if (!fresh)
+    {
+        response_cache_remove(worker->server->cache, e);
+        return 0;
+    }
+    atomic_store_explicit(&e->checked_ms, now, memory_order_relaxed);
+    return 1;
+}
+
+/**
+ * The cached response for `rel` in the encoding the client would get, or NULL
+ */
+static cache_entry_t *cache_find(worker_t *worker, char *rel, int gzip)
+{
+    response_cache_t *cache = worker->server->cache;
+    char key[1 + 1024 + 4];
+    size_t key_len;
+    cache_entry_t *e;
+
+    if (gzip && (key_len = cache_key(key, sizeof(key), rel, 1)) > 0 &&
+        (e = response_cache_lookup(cache, key, key_len)) != NULL)
+    {
+        if (cache_entry_fresh(worker, e, rel, 1))
+            return e;
+        cache_entry_release(e);
+    }
+    if ((key_len = cache_key(key, sizeof(key), rel, 0)) > 0 &&
+        (e = response_cache_lookup(cache, key, key_len)) != NULL)
+    {
+        // Without a gzip entry, the identity one only answers if there is no gzip variant to send instead
+        if ((!gzip || !(e->flags & CACHE_GZIP_SIBLING)) && cache_entry_fresh(worker, e, rel, 0))
+            return e;
+        cache_entry_release(e);
+    }
+    return NULL;
+}
+
+/**
+ * Build the response for an open file small enough that it always fits in an
+ * empty `out`, and store it. Returns a reference, or NULL to stream the file.
+ */
+static cache_entry_t *cache_fill(worker_t *worker, char *rel, int fd, const struct stat *st, int gzipped)
+{
+    unsigned char body[RESPONSE_BUF_SIZE];
+    char key[1 + 1024 + 4], etag[24], head[512], not_modified[256];
+    size_t key_len = cache_key(key, sizeof(key), rel, gzipped);
+
+    if (key_len == 0 || (size_t)st->st_size > sizeof(body))
+        return NULL;
+    ssize_t n = pread(fd, body, (size_t)st->st_size, 0);
+    if (n != st->st_size)
+        return NULL; // changing under us; not worth caching
+
+    // With a gzip variant around, the identity response depends on Accept-Encoding as well
+    int sibling = !gzipped && has_gzip_sibling(worker->server->docroot_fd, rel);
+    const char *vary = gzipped || sibling ? "Vary: Accept-Encoding\r\n" : "";
+
+    // Strong, and the same on every worker and every restart: a hash of the bytes sent
+    snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long)cache_hash(body, (size_t)n));
+    int head_len = snprintf(head, sizeof(head),
+                            "HTTP/1.1 200 OK\r\n"
+                            "Content-Type: %s\r\n"
+                            "Content-Length: %zu\r\n"
+                            "ETag: %s\r\n"
+                            "%s%s",
+                            content_type_for(rel), (size_t)n, etag, gzipped ? "Content-Encoding: gzip\r\n" : "", vary);
+    snprintf(not_modified, sizeof(not_modified), "HTTP/1.1 304 Not Modified\r\nETag: %s\r\n%s", etag, vary);
+    // Leaves room for the Connection header
+    if (head_len < 0 || (size_t)head_len >= sizeof(head) || (size_t)head_len + (size_t)n + 64 > RESPONSE_BUF_SIZE)
+        return NULL;
+
+    cache_entry_t *e = cache_entry_create(key, key_len, etag, head, not_modified, (size_t)n);
+    if (e == NULL)
+        return NULL;
+    memcpy(e->body, body, (size_t)n);
+    file_validator(st, e->validator);
+    atomic_init(&e->checked_ms, now_ms());
+    if (sibling)
+        e->flags |= CACHE_GZIP_SIBLING;
+    response_cache_insert(worker->server->cache, e); // too large for a shard: served once, then freed
+    return e;
+}
+
+/**
+ * Copy a cached response into `out`: the whole of it, the head alone for
+ * HEAD, or just the 304 head when the client already holds the entity.
+ */
+static int queue_cached_response(connection_t *conn, const http_request_t *req, const cache_entry_t *e,
+                                 int head_only)
+{
+    const char *connection = req->keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    size_t connection_len = strlen(connection);
+    int not_modified = etag_matches(req, e->etag, e->etag_len);
+    const char *head = not_modified ? e->not_modified : e->head;
+    size_t head_len = not_modified ? e->not_modified_len : e->head_len;
+    size_t body_len = not_modified || head_only ? 0 : e->body_len;
+
+    if (head_len + connection_len + body_len > sizeof(conn->out) - conn->out_len)
+        return -1;
+    memcpy(conn->out + conn->out_len, head, head_len);
+    memcpy(conn->out + conn->out_len + head_len, connection, connection_len);
+    memcpy(conn->out + conn->out_len + head_len + connection_len, e->body, body_len);
+    conn->out_len += head_len + connection_len + body_len;
+    if (!req->keep_alive)
+        conn->close_after = 1;
+    if (not_modified)
+        counter_inc(&conn->worker->not_modified);
+    return 0;
+}
+
+/**
+ * Queue the response for a file under the document root. Small files are
+ * answered from the response cache; larger ones get their head queued here
+ * and their body streamed after `out` is flushed, straight from the page
+ * cache when kTLS owns the socket. Either way a matching If-None-Match gets
+ * a 304 without the body being read.
+ * Returns -1 if the response does not fit yet.
+ */
+static int queue_file_response(connection_t *conn, const http_request_t *req, int head_only)
+{
+    worker_t *worker = conn->worker;
+    char rel[1024 + 4];
+    struct stat st;
+    int gzip, gzipped, ret;
+
+    if (static_file_path(req, rel, sizeof(rel)) != 0)
+        return queue_response(conn, "404 Not Found", "text/html", "", 0, 0, req->keep_alive);
+    gzip = accepts_gzip(req);
+
+    cache_entry_t *e = worker->server->cache ? cache_find(worker, rel, gzip) : NULL;
+    if (e != NULL)
+    {
+        ret = queue_cached_response(conn, req, e, head_only);
+        if (ret == 0)
+            counter_inc(&worker->cache_hits);
+        cache_entry_release(e);
+        return ret;
+    }
+
+    int fd = open_representation(worker->server->docroot_fd, rel, gzip, &st, &gzipped);
+    if (fd < 0)
+        return queue_response(conn, "404 Not Found", "text/html", "", 0, 0, req->keep_alive);
+
+    if (worker->server->cache && (e = cache_fill(worker, rel, fd, &st, gzipped)) != NULL)
+    {
+        close(fd);
+        ret = queue_cached_response(conn, req, e, head_only);
+        if (ret == 0)
+            counter_inc(&worker->cache_misses); // otherwise it is retried, and then found
+        cache_entry_release(e);
+        return ret;
+    }
+
+    // Too large to cache: the tag comes from the file's identity and modification time instead
+    char etag[64], extra[160];
+    int vary = gzipped || has_gzip_sibling(worker->server->docroot_fd, rel);
+    snprintf(etag, sizeof(etag), "\"%llx-%llx-%llx\"", (unsigned long long)st.st_ino,
+             (unsigned long long)st.st_size,
+             (unsigned long long)st.st_mtim.tv_sec * 1000000000ull + (unsigned long long)st.st_mtim.tv_nsec);
+    if (etag_matches(req, etag, strlen(etag)))
+    {
+        close(fd);
+        return queue_not_modified(conn, etag, vary, req->keep_alive);
+    }
+    snprintf(extra, sizeof(extra), "ETag: %s\r\n%s%s", etag, gzipped ? "Content-Encoding: gzip\r\n" : "",
+             vary ? "Vary: Accept-Encoding\r\n" : "");
+
+    int n = format_head(conn, "200 OK", content_type_for(rel), (size_t)st.st_size, extra, req->keep_alive, 0);
+    if (n < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    conn->out_len += (size_t)n;
+    if (!req->keep_alive)
+        conn->close_after = 1;
+
+    if (head_only || st.st_size == 0)
+    {
+        close(fd);
+        return 0;
+    }
+    conn->file_fd = fd;
+    conn->file_off = 0;
+    conn->file_remaining = (size_t)st.st_size;
+    return 0;
+}
+
+/**
+ * Move the next part of the file body. With kTLS the kernel encrypts pages
+ * straight out of the page cache; otherwise the free space in `out` is filled,
+ * right behind the head for the first part, for the user-space record layer.
+ * Returns 0 on progress or an MBEDTLS_ERR_* code.
+ */
+static int send_file_body(connection_t *conn)
+{
+#if defined(HAVE_KTLS)
+    if (conn->ktls_tx)
+    {
+        while (conn->file_remaining > 0)
+        {
+            ssize_t n = sendfile(conn->net.fd, conn->file_fd, &conn->file_off, conn->file_remaining);
+            if (n < 0)
+                return errno == EAGAIN ? MBEDTLS_ERR_SSL_WANT_WRITE : MBEDTLS_ERR_NET_SEND_FAILED;
+            if (n == 0)
+                return MBEDTLS_ERR_NET_SEND_FAILED; // file truncated under us
+            PROBE(write, conn, conn->net.fd, (int)n);
+            conn->file_remaining -= (size_t)n;
+        }
+        return 0;
+    }
+#endif
+    size_t room = sizeof(conn->out) - conn->out_len;
+    size_t want = conn->file_remaining < room ? conn->file_remaining : room;
+    ssize_t n = pread(conn->file_fd, conn->out + conn->out_len, want, conn->file_off);
+    if (n <= 0)
+        return MBEDTLS_ERR_NET_SEND_FAILED;
+    conn->file_off += n;
+    conn->file_remaining -= (size_t)n;
+    conn->out_len += (size_t)n;
+    return 0;
+}
+
+/**
+ * GET /metrics. Rendered fresh on each request, from whichever worker takes it.
+ */
+static int queue_metrics(connection_t *conn, int head_only, int keep_alive)
+{
+    // Leaves room for the head, so an empty `out` always takes it
+    char body[RESPONSE_BUF_SIZE - 256];
+    int len = render_metrics(conn->worker->server, body, sizeof(body));
+    if (len < 0)
+        return queue_response(conn, "500 Internal Server Error", "text/html", "", 0, 0, keep_alive);
+    return queue_response(conn, "200 OK", "text/plain; version=0.0.4", body, (size_t)len, !head_only, keep_alive);
+}
+
+static int queue_error(connection_t *conn, const char *status)
+{
+    // An error response always fits once the pending responses are flushed; this head is parsed
+    // again then, so it is only counted once its response is actually queued
+    if (queue_response(conn, status, "text/html", "", 0, 0, 0) != 0)
+        return conn->out_len == 0 ? -1 : 0;
+    counter_inc(&conn->worker->bad_requests);
+    return 0;
+}
+
+static void consume_input(connection_t *conn, size_t n)
+{
+    conn->in_start += n;
+    if (conn->in_start == conn->in_len)
+        conn->in_start = conn->in_len = 0;
+    conn->early_remaining = conn->early_remaining > n ? conn->early_remaining - n : 0;
+}
+
+/**
+ * Make room at the end of `in` by sliding the unconsumed bytes to the front.
+ * Only needed when the buffer is full, so pipelined requests are not copied.
+ */
+static void compact_input(connection_t *conn)
+{
+    memmove(conn->in, conn->in + conn->in_start, conn->in_len - conn->in_start);
+    conn->in_len -= conn->in_start;
+    conn->in_start = 0;
+}
+
+/**
+ * Answer every complete request already buffered in `in`, as long as the
+ * responses fit in `out`. Returns -1 if the connection must be dropped.
+ */
+static int process_requests(connection_t *conn)
+{
+    // A file body must go out before the next response head
+    while (conn->in_start < conn->in_len && !conn->close_after && conn->file_fd < 0)
+    {
+        const unsigned char *data = conn->in + conn->in_start;
+        size_t avail = conn->in_len - conn->in_start;
+
+        if (conn->body_mode != BODY_NONE)
+        {
+            long n = consume_body(conn, data, avail);
+            if (n < 0)
+                return -1;
+            consume_input(conn, (size_t)n);
+            continue;
+        }
+
+        http_request_t req;
+        int head_len = http_parse_request(&conn->parser, data, avail, &req);
+        if (head_len == HTTP_PARSE_INCOMPLETE)
+        {
+            if (avail < sizeof(conn->in))
+                return 0;
+            return queue_error(conn, "431 Request Header Fields Too Large");
+        }
+        if (head_len == HTTP_PARSE_TOO_MANY_HEADERS)
+            return queue_error(conn, "431 Request Header Fields Too Large");
+        if (head_len < 0)
+            return queue_error(conn, "400 Bad Request");
+
+        int from_early_data = conn->early_remaining > 0;
+        int head_only = method_is(&req, "HEAD");
+        int ret;
+
+        if (from_early_data && !is_idempotent_request(&req))
+            ret = queue_response(conn, "425 Too Early", "text/html", "", 0, 0, 0);
+        else if (req.path_len == 8 && memcmp(req.path, "/metrics", 8) == 0)
+            ret = queue_metrics(conn, head_only, req.keep_alive);
+        else if (conn->worker->server->docroot_fd >= 0)
+            ret = queue_file_response(conn, &req, head_only);
+        else
+            ret = queue_page(conn, &req, head_only);
+        if (ret != 0)
+            return 0; // `out` is full: flush, then come back for this request
+
+        if (conn->requests_pending++ == 0)
+            conn->request_start_ns = now_ns();
+        counter_inc(&conn->worker->requests);
+        if (from_early_data && is_idempotent_request(&req))
+            counter_inc(&conn->worker->early_data_requests);
+        LOG_DEBUG("Request: %.*s %.*s", (int)req.method_len, req.method, (int)req.path_len, req.path);
+
+        if (req.chunked)
+        {
+            conn->body_mode = BODY_CHUNKED;
+            http_chunked_init(&conn->chunked);
+        }
+        else if (req.content_length > 0)
+        {
+            conn->body_mode = BODY_LENGTH;
+            conn->body_remaining = (unsigned long long)req.content_length;
+        }
+        consume_input(conn, (size_t)head_len);
+        conn->head_deadline_ms = 0;
+    }
+    return 0;
+}
+
+/* --- io_uring Backend --- */
+
+#if defined(HAVE_IO_URING)
+// Completion tags, kept in the low bits of user_data next to the worker or connection pointer
+enum
+{
+    URING_ACCEPT = 1,
+    URING_RECV,
+    URING_SEND,
+    URING_DONE,
+    URING_STOP,
+    URING_CANCEL
+};
+#define URING_UD(ptr, tag) ((uint64_t)(uintptr_t)(ptr) | (uint64_t)(tag))
+#define URING_TAG(ud) ((int)((ud) & 7))
+#define URING_PTR(ud) ((void *)(uintptr_t)((ud) & ~(uint64_t)7))
+
+/**
+ * BIO receive: copy out of the buffers the kernel already filled. Never
+ * makes a system call.
+ */
+static int uring_bio_recv(void *ctx, unsigned char *buf, size_t len)
+{
+    connection_t *conn = ctx;
+    uring_io_t *io = conn->io;
+    const uring_bufs_t *bufs = &conn->worker->bufs;
+    unsigned head = atomic_load_explicit(&io->rx_head, memory_order_relaxed);
+    size_t copied = 0;
+
+    for (;;)
+    {
+        unsigned tail = atomic_load_explicit(&io->rx_tail, memory_order_acquire);
+        while (copied < len && head != tail)
+        {
+            __typeof__(io->rx[0]) *slot = &io->rx[head % URING_RX_SLOTS];
+            size_t n = (size_t)(slot->len - slot->off);
+            if (n > len - copied)
+                n = len - copied;
+            memcpy(buf + copied, uring_buf(bufs, slot->bid) + slot->off, n);
+            slot->off += (uint16_t)n;
+            copied += n;
+            if (slot->off == slot->len)
+                head++;
+        }
+        atomic_store_explicit(&io->rx_head, head, memory_order_release);
+        if (copied > 0)
+            return (int)copied;
+
+        int end = atomic_load_explicit(&io->rx_end, memory_order_acquire);
+        if (end == 0)
+            return MBEDTLS_ERR_SSL_WANT_READ;
+        // The end is published after the last buffer: look once more before reporting it
+        if (head == atomic_load_explicit(&io->rx_tail, memory_order_acquire))
+            return end > 0 ? 0 : end == -ECONNRESET || end == -EPIPE ? MBEDTLS_ERR_NET_CONN_RESET
+                                                                      : MBEDTLS_ERR_NET_RECV_FAILED;
+    }
+}
+
+/**
+ * Copy what has been received without consuming it, for the admission check.
+ * Returns the count, 0 once the stream has ended, or MBEDTLS_ERR_SSL_WANT_READ.
+ */
+static int uring_peek(connection_t *conn, unsigned char *buf, size_t len)
+{
+    uring_io_t *io = conn->io;
+    const uring_bufs_t *bufs = &conn->worker->bufs;
+    unsigned tail = atomic_load_explicit(&io->rx_tail, memory_order_acquire);
+    size_t copied = 0;
+
+    for (unsigned i = atomic_load_explicit(&io->rx_head, memory_order_relaxed); i != tail && copied < len; i++)
+    {
+        const __typeof__(io->rx[0]) *slot = &io->rx[i % URING_RX_SLOTS];
+        size_t n = (size_t)(slot->len - slot->off);
+        if (n > len - copied)
+            n = len - copied;
+        memcpy(buf + copied, uring_buf(bufs, slot->bid) + slot->off, n);
+        copied += n;
+    }
+    if (copied > 0)
+        return (int)copied;
+    return atomic_load_explicit(&io->rx_end, memory_order_acquire) == 0 ? MBEDTLS_ERR_SSL_WANT_READ : 0;
+}
+
+/**
+ * BIO send: stage the record; uring_flush() sends everything staged at once
+ */
+static int uring_bio_send(void *ctx, const unsigned char *buf, size_t len)
+{
+    uring_io_t *io = ((connection_t *)ctx)->io;
+    size_t room = sizeof(io->tx) - io->tx_len;
+
+    if (io->send_failed)
+        return MBEDTLS_ERR_NET_SEND_FAILED;
+    if (room == 0)
+        return MBEDTLS_ERR_SSL_WANT_WRITE;
+    if (len > room)
+        len = room;
+    memcpy(io->tx + io->tx_len, buf, len);
+    io->tx_len += len;
+    return (int)len;
+}
+
+static void uring_arm_recv(worker_t *worker, connection_t *conn)
+{
+    if (uring_prep_recv_multishot(&worker->ring, conn->net.fd, &worker->bufs, URING_UD(conn, URING_RECV)) != 0)
+        return;
+    conn->io->recv_armed = 1;
+    conn->io->recv_paused = 0;
+    conn->io->ops++;
+}
+
+/**
+ * Return the buffers in slots [rx_reclaimed, upto) to the kernel
+ */
+static void uring_reclaim(worker_t *worker, uring_io_t *io, unsigned upto)
+{
+    if (io->rx_reclaimed == upto)
+        return;
+    for (; io->rx_reclaimed != upto; io->rx_reclaimed++)
+    {
+        uring_buf_add(&worker->bufs, io->rx[io->rx_reclaimed % URING_RX_SLOTS].bid);
+        worker->bufs_free++;
+    }
+    uring_buf_publish(&worker->bufs);
+}
+
+/**
+ * After a step on the worker: hand back consumed buffers, send what was
+ * staged, and receive again if the last recv ended. Only queues SQEs; the
+ * loop submits them all with its next wait.
+ */
+static void uring_flush(worker_t *worker, connection_t *conn)
+{
+    uring_io_t *io = conn->io;
+
+    uring_reclaim(worker, io, atomic_load_explicit(&io->rx_head, memory_order_acquire));
+
+    if (!io->send_inflight && io->tx_len > 0 && !io->send_failed &&
+        uring_prep_send(&worker->ring, conn->net.fd, io->tx, io->tx_len, URING_UD(conn, URING_SEND)) == 0)
+    {
+        io->send_inflight = (int)io->tx_len;
+        io->ops++;
+    }
+
+    if (!io->recv_armed && !io->closing && !io->starved &&
+        atomic_load_explicit(&io->rx_end, memory_order_relaxed) == 0 &&
+        atomic_load_explicit(&io->rx_tail, memory_order_relaxed) - io->rx_reclaimed <= URING_RX_SLOTS / 2)
+        uring_arm_recv(worker, conn);
+}
+
+/**
+ * Account for a finished SEND. Returns -1 if the socket failed.
+ */
+static int uring_send_complete(connection_t *conn, int res)
+{
+    uring_io_t *io = conn->io;
+
+    io->ops--;
+    io->send_inflight = 0;
+    if (res < 0)
+    {
+        io->send_failed = 1;
+        io->tx_len = 0;
+        return -1;
+    }
+    // Anything after a short send goes out with the next flush
+    memmove(io->tx, io->tx + res, io->tx_len - (size_t)res);
+    io->tx_len -= (size_t)res;
+    return 0;
+}
+
+/**
+ * Back from the handshake pool: apply a send that completed meanwhile
+ */
+static void uring_resume(connection_t *conn)
+{
+    if (conn->io != NULL && conn->io->send_deferred)
+    {
+        conn->io->send_deferred = 0;
+        uring_send_complete(conn, conn->io->send_deferred_res);
+    }
+}
+
+/**
+ * Switch a new connection to the io_uring BIO and start receiving
+ */
+static int uring_attach(worker_t *worker, connection_t *conn)
+{
+    if (conn->io == NULL && (conn->io = malloc(sizeof(*conn->io))) == NULL)
+        return -1;
+    memset(conn->io, 0, offsetof(uring_io_t, tx));
+    mbedtls_ssl_set_bio(&conn->ssl, conn, uring_bio_send, uring_bio_recv, NULL);
+    uring_arm_recv(worker, conn);
+    return conn->io->recv_armed ? 0 : -1;
+}
+
+/**
+ * Start closing: stop receiving, send what is still staged (a close_notify
+ * at least), and keep the connection until its operations have completed.
+ * Returns 1 if the close finishes later, 0 if it can finish now.
+ */
+static int uring_close_begin(worker_t *worker, connection_t *conn)
+{
+    uring_io_t *io = conn->io;
+
+    io->closing = 1;
+    if (io->starved)
+    {
+        io->starved = 0;
+        worker->starved--;
+    }
+    if (io->recv_armed)
+        uring_prep_cancel(&worker->ring, URING_UD(conn, URING_RECV), -1, URING_CANCEL);
+    // Unread data is dropped; rx_head moves too, so the flush below does not reclaim backwards
+    unsigned tail = atomic_load_explicit(&io->rx_tail, memory_order_relaxed);
+    atomic_store_explicit(&io->rx_head, tail, memory_order_relaxed);
+    uring_reclaim(worker, io, tail);
+    uring_flush(worker, conn);
+    if (io->ops == 0)
+        return 0;
+
+    // connection_expired() gives up on the peer at this deadline
+    conn->deadline_ms = now_ms() + URING_CLOSE_TIMEOUT_MS;
+    wheel_arm(&worker->timers, &conn->timer, conn->deadline_ms);
+    conn->prev = NULL;
+    conn->next = worker->closing;
+    if (conn->next)
+        conn->next->prev = conn;
+    worker->closing = conn;
+    worker->closing_count++;
+    return 1;
+}
+#endif
+
+/* --- Admission Control --- */
+
+/**
+ * Whether a ClientHello offers a session ticket: TLS 1.3 resumption sends a
+ * pre_shared_key extension. Returns 1 or 0, or MBEDTLS_ERR_SSL_WANT_READ
+ * while the record is incomplete; with 1, the first identity offered is at
+ * p + *id_off, *id_len bytes long (0 when it is cut off or malformed).
+ * Anything that does not parse counts as a full handshake and is left to
+ * Mbed TLS to reject.
+ */
+static int client_hello_psk_identity(const unsigned char *p, size_t len, size_t *id_off, size_t *id_len)
+{
+#define U16(off) ((size_t)p[off] << 8 | p[(off) + 1])
+    if (len < 5)
+        return MBEDTLS_ERR_SSL_WANT_READ;
+    if (p[0] != MBEDTLS_SSL_MSG_HANDSHAKE)
+        return 0;
+    size_t end = 5 + U16(3);
+    if (len < end)
+        return MBEDTLS_ERR_SSL_WANT_READ;
+
+    // Handshake header, legacy_version and random
+    size_t off = 5;
+    if (end - off < 4 + 2 + 32 || p[off] != MBEDTLS_SSL_HS_CLIENT_HELLO)
+        return 0;
+    off += 4 + 2 + 32;
+    // legacy_session_id, cipher_suites, legacy_compression_methods
+    if (off + 1 > end)
+        return 0;
+    off += 1 + p[off];
+    if (off + 2 > end)
+        return 0;
+    off += 2 + U16(off);
+    if (off + 1 > end)
+        return 0;
+    off += 1 + p[off];
+    if (off + 2 > end)
+        return 0;
+    size_t ext_end = off + 2 + U16(off);
+    if (ext_end > end)
+        ext_end = end; // continued in another record: look at what is here
+    for (off += 2; off + 4 <= ext_end; off += 4 + U16(off + 2))
+    {
+        if (U16(off) != MBEDTLS_TLS_EXT_PRE_SHARED_KEY)
+            continue;
+        // OfferedPsks: identities<7..2^16-1>, each an opaque identity<1..2^16-1> and a 32-bit age
+        size_t data_end = off + 4 + U16(off + 2) < ext_end ? off + 4 + U16(off + 2) : ext_end;
+        *id_len = 0;
+        if (off + 8 <= data_end && off + 8 + U16(off + 6) <= data_end)
+        {
+            *id_off = off + 8;
+            *id_len = U16(off + 6);
+        }
+        return 1;
+    }
+    return 0;
+#undef U16
+}
+
+/**
+ * Look at received bytes without consuming them.
+ * Returns the count, 0 at end of stream, or an MBEDTLS_ERR_* code.
+ */
+static int connection_peek(connection_t *conn, unsigned char *buf, size_t len)
+{
+#if defined(HAVE_IO_URING)
+    if (conn->io != NULL)
+        return uring_peek(conn, buf, len);
+#endif
+    ssize_t n = recv(conn->net.fd, buf, len, MSG_PEEK);
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? MBEDTLS_ERR_SSL_WANT_READ
+                                                                          : MBEDTLS_ERR_NET_RECV_FAILED;
+    return (int)n;
+}
+
+/**
+ * Make the coming close() send a RST: a shed client is owed nothing, and the
+ * socket skips TIME_WAIT
+ */
+static void socket_abort_on_close(int fd)
+{
+    struct linger lg = {.l_onoff = 1, .l_linger = 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+}
+
+static void admission_init(worker_t *worker)
+{
+    worker->admit_refill_ns = now_ns();
+    worker->admit_tokens_ns = (int64_t)ADMIT_BURST_MS * 1000000 * worker->server->handshake_budget / 100;
+    worker->admit_cost_ns[0] = worker->admit_cost_ns[1] = ADMIT_COST_NS;
+}
+
+/**
+ * Credit the budget for the wall time since the last look
+ */
+static void admission_refill(worker_t *worker, uint64_t now)
+{
+    int64_t share = worker->server->handshake_budget;
+    int64_t burst = (int64_t)ADMIT_BURST_MS * 1000000 * share / 100;
+
+    worker->admit_tokens_ns += (int64_t)(now - worker->admit_refill_ns) * share / 100;
+    if (worker->admit_tokens_ns > burst)
+        worker->admit_tokens_ns = burst;
+    worker->admit_refill_ns = now;
+}
+
+/**
+ * At accept: with the budget spent and the listener's accept queue filling
+ * up, the worker cannot keep up, so a new connection is reset before it costs
+ * a read. Returns 0 to shed it.
+ */
+static int admission_accept(worker_t *worker)
+{
+    if (worker->server->handshake_budget == 0)
+        return 1;
+
+    uint64_t now = now_ns();
+    admission_refill(worker, now);
+    if (worker->admit_tokens_ns > 0)
+        return 1;
+
+    if (now - worker->backlog_checked_ns >= ADMIT_BACKLOG_CHECK_MS * 1000000ull)
+    {
+        // On a listener, TCP_INFO reports the accept queue length and its limit
+        struct tcp_info ti;
+        socklen_t len = sizeof(ti);
+        worker->backlog_deep = getsockopt(worker->listen_fd.fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0 &&
+                               ti.tcpi_unacked * 4 > ti.tcpi_sacked;
+        worker->backlog_checked_ns = now;
+    }
+    if (!worker->backlog_deep)
+        return 1;
+    counter_inc(&worker->shed_accepts);
+    return 0;
+}
+
+/**
+ * Whether the ticket a ClientHello offers would resume: the same check Mbed
+ * TLS makes (key, integrity, lifetime), on a copy of the identity, before any
+ * handshake crypto runs. A junk, expired or rotated-out ticket is only a
+ * full handshake in disguise.
+ */
+static int ticket_would_resume(server_context_t *server, unsigned char *identity, size_t len)
+{
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_TICKET_C)
+    mbedtls_ssl_session session;
+
+    if (len == 0)
+        return 0;
+    mbedtls_ssl_session_init(&session);
+    int ok = mbedtls_ssl_ticket_parse(&server->ticket_ctx, &session, identity, len) == 0;
+    mbedtls_ssl_session_free(&session);
+    return ok;
+#else
+    (void)server;
+    (void)identity;
+    (void)len;
+    return 0;
+#endif
+}
+
+/**
+ * Decide on a new connection from its ClientHello. A resumption with a ticket
+ * that checks out always passes; anything else, a failed ticket included,
+ * is a full handshake and needs budget left. Either is charged what
+ * handshakes of its kind have cost lately, settled against its measured time
+ * at the end.
+ * Returns 0 to go ahead, MBEDTLS_ERR_SSL_WANT_READ to wait for the rest of the
+ * ClientHello, or -1 to close the connection.
+ */
+static int admission_check(connection_t *conn)
+{
+    worker_t *worker = conn->worker;
+    unsigned char hello[ADMIT_PEEK_SIZE];
+
+    int n = connection_peek(conn, hello, sizeof(hello));
+    if (n == MBEDTLS_ERR_SSL_WANT_READ)
+        return n;
+    if (n <= 0)
+        return -1;
+    size_t id_off = 0, id_len = 0;
+    int offered = client_hello_psk_identity(hello, (size_t)n, &id_off, &id_len);
+    if (offered == MBEDTLS_ERR_SSL_WANT_READ)
+    {
+        if (n < (int)sizeof(hello))
+            return offered;
+        offered = 0; // too long to see the end of; assume the worst
+    }
+    // The peeked copy is ours, so the ticket can be decrypted in place
+    int psk = offered && ticket_would_resume(worker->server, hello + id_off, id_len);
+    if (offered && !psk)
+        counter_inc(&worker->psk_fallbacks);
+
+    admission_refill(worker, now_ns());
+    if (!psk && worker->admit_tokens_ns <= 0)
+    {
+        counter_inc(&worker->shed_handshakes);
+        socket_abort_on_close(conn->net.fd);
+        return -1;
+    }
+    conn->admitted = 1;
+    conn->admit_resumption = psk;
+    conn->admit_charge_ns = worker->admit_cost_ns[psk];
+    worker->admit_tokens_ns -= conn->admit_charge_ns;
+    counter_inc(psk ? &worker->admitted_resumed : &worker->admitted_full);
+    return 0;
+}
+
+/**
+ * The handshake is over: charge its measured time instead of the estimate,
+ * and fold it into the estimate for the kind it turned out to be. A ticket
+ * that passed admission can still end in a full handshake (a bad binder, a
+ * ciphersuite the session cannot use); only a genuine ticket gets that far,
+ * so it is counted rather than shed.
+ */
+static void admission_settle(connection_t *conn, int ret)
+{
+    worker_t *worker = conn->worker;
+    int64_t spent = (int64_t)conn->handshake_ns;
+    int resumed = conn->resumed != 0;
+
+    if (worker->server->handshake_budget == 0)
+        return;
+    if (ret == 0 && conn->admit_resumption && !resumed)
+        counter_inc(&worker->psk_fallbacks);
+    worker->admit_tokens_ns += conn->admit_charge_ns - spent;
+    worker->admit_cost_ns[resumed] += (spent - worker->admit_cost_ns[resumed]) / 8;
+    conn->admit_charge_ns = 0;
+}
+
+/* --- Connection Engine --- */
+
+static void connection_unlink(worker_t *worker, connection_t *conn)
+{
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        worker->connections = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    conn->prev = conn->next = NULL;
+}
+
+static void connection_link(worker_t *worker, connection_t *conn)
+{
+    conn->prev = NULL;
+    conn->next = worker->connections;
+    if (conn->next)
+        conn->next->prev = conn;
+    worker->connections = conn;
+}
+
+static void connection_destroy(connection_t *conn)
+{
+#if defined(HAVE_IO_URING)
+    free(conn->io);
+#endif
+    mbedtls_ssl_free(&conn->ssl);
+    credentials_release(conn->creds);
+#if defined(HAVE_ARENA)
+    arena_unref(conn->arena[0]);
+    arena_unref(conn->arena[1]);
+#endif
+    free(conn);
+}
+
+/**
+ * Take a connection from the worker's pool, or build a new one. The SSL
+ * context is rebuilt only when the credentials were reloaded since it was set up.
+ */
+static connection_t *connection_acquire(worker_t *worker)
+{
+    connection_t *conn;
+
+    if (worker->pool_index >= 0)
+    {
+        conn = worker->pool[worker->pool_index--];
+    }
+    else
+    {
+        conn = calloc(1, sizeof(*conn));
+        if (conn == NULL)
+            return NULL;
+        mbedtls_ssl_init(&conn->ssl);
+        wheel_timer_init(&conn->timer);
+#if defined(HAVE_ARENA)
+        conn->arena[0] = arena_create();
+        conn->arena[1] = arena_create();
+#endif
+    }
+
+    if (conn->creds != worker->creds)
+    {
+        // Record buffers live as long as the context, so they come from the heap, not an arena
+        if (conn->creds != NULL)
+        {
+            mbedtls_ssl_free(&conn->ssl);
+            mbedtls_ssl_init(&conn->ssl);
+            credentials_release(conn->creds);
+        }
+        conn->creds = worker->creds;
+        atomic_fetch_add_explicit(&conn->creds->refs, 1, memory_order_relaxed);
+        if (mbedtls_ssl_setup(&conn->ssl, &conn->creds->conf) != 0)
+        {
+            connection_destroy(conn);
+            return NULL;
+        }
+        mbedtls_ssl_set_bio(&conn->ssl, &conn->net, mbedtls_net_send, mbedtls_net_recv, NULL);
+    }
+    return conn;
+}
+
+/**
+ * Return a closed connection to the pool with its SSL context reset for the
+ * next client, or free it when the pool is full
+ */
+static void connection_release(worker_t *worker, connection_t *conn)
+{
+    int ret;
+
+#if defined(HAVE_ARENA)
+    // The reset frees this connection's state and allocates the next one's in the other arena
+    arena_recycle(&conn->arena[conn->arena_cur ^ 1]);
+    conn->arena_cur ^= 1;
+#endif
+    arena_enter(conn);
+    ret = mbedtls_ssl_session_reset(&conn->ssl);
+    arena_leave();
+
+    if (ret != 0 || worker->pool_index >= CONNECTION_POOL_SIZE - 1)
+        connection_destroy(conn);
+    else
+        worker->pool[++worker->pool_index] = conn;
+}
+
+static connection_t *connection_open(worker_t *worker, mbedtls_net_context *client_fd)
+{
+    connection_t *conn = connection_acquire(worker);
+    if (conn == NULL)
+        return NULL;
+
+    // Everything up to the buffers is per-connection; the buffers need no clearing
+    conn->net = *client_fd;
+    conn->state = CONN_HANDSHAKE;
+    conn->worker = worker;
+    conn->resumed = conn->close_after = 0;
+    conn->ktls_rx = conn->ktls_tx = 0;
+    conn->accepted_ns = now_ns();
+    conn->handshake_ns = 0;
+    conn->requests_pending = 0;
+    conn->in_start = conn->in_len = conn->early_remaining = 0;
+    http_parser_reset(&conn->parser);
+    conn->body_mode = BODY_NONE;
+    conn->out_len = conn->out_sent = 0;
+    conn->file_fd = -1;
+    conn->file_remaining = 0;
+#if defined(HAVE_KTLS)
+    conn->ktls.secret_len = 0;
+#endif
+    conn->head_deadline_ms = 0;
+    conn->timed_out = 0;
+    conn->admitted = worker->server->handshake_budget == 0;
+    conn->admit_resumption = 0;
+    conn->admit_charge_ns = 0;
+    conn->prev = conn->next = NULL;
+    mbedtls_net_set_nonblock(&conn->net);
+    // Records are written whole, so Nagle could only hold back the last one of a response
+    int one = 1;
+    setsockopt(conn->net.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+#if defined(HAVE_KTLS)
+    if (worker->server->ktls)
+        mbedtls_ssl_set_export_keys_cb(&conn->ssl, ktls_capture_secrets, &conn->ktls);
+#endif
+
+#if defined(HAVE_IO_URING)
+    if (worker->server->io_uring)
+    {
+        if (uring_attach(worker, conn) != 0)
+        {
+            conn->net.fd = -1;
+            connection_release(worker, conn);
+            return NULL;
+        }
+    }
+    else
+#endif
+    {
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn};
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, conn->net.fd, &ev) != 0)
+        {
+            conn->net.fd = -1; // the caller still owns the socket
+            connection_release(worker, conn);
+            return NULL;
+        }
+    }
+
+    // Link into the live connection list so shutdown can reach every socket
+    connection_link(worker, conn);
+
+    // The whole handshake must fit in this, however its steps are spread out
+    conn->deadline_ms = now_ms() + HANDSHAKE_TIMEOUT_MS;
+    conn->deadline_kind = TIMEOUT_HANDSHAKE;
+    wheel_arm(&worker->timers, &conn->timer, conn->deadline_ms);
+
+    counter_inc(&worker->connections_accepted);
+    counter_inc(&worker->connections_open);
+    PROBE(accept, conn, conn->net.fd, worker->id);
+    LOG_DEBUG("New client connection (fd %d)", conn->net.fd);
+    return conn;
+}
+
+static void connection_close(worker_t *worker, connection_t *conn)
+{
+    PROBE(close, conn, conn->net.fd, (int)conn->state, (int)conn->timed_out);
+    connection_unlink(worker, conn);
+    wheel_cancel(&worker->timers, &conn->timer);
+    counter_add(&worker->connections_open, (unsigned long)-1);
+
+    if (conn->file_fd >= 0)
+    {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+    }
+#if defined(HAVE_IO_URING)
+    // Staged bytes still go out; the socket is closed once the ring is done with it
+    if (conn->io != NULL && uring_close_begin(worker, conn))
+        return;
+#endif
+    // Closing the descriptor also removes it from the epoll set
+    mbedtls_net_free(&conn->net);
+    connection_release(worker, conn);
+}
+
+/**
+ * Run the handshake as far as the socket allows, on whichever thread owns
+ * the connection right now
+ */
+static int handshake_step(connection_t *conn)
+{
+    uint64_t start = now_ns();
+    int ret;
+
+    if (conn->handshake_ns == 0)
+        PROBE(handshake_start, conn, conn->net.fd);
+    do
+    {
+        ticket_accepted = 0;
+        ret = mbedtls_ssl_handshake(&conn->ssl);
+        conn->resumed |= ticket_accepted;
+#if defined(MBEDTLS_SSL_EARLY_DATA)
+        if (ret == MBEDTLS_ERR_SSL_RECEIVED_EARLY_DATA)
+        {
+            // Collect the 0-RTT request, then let the handshake finish
+            int n = mbedtls_ssl_read_early_data(&conn->ssl, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len);
+            if (n > 0)
+            {
+                conn->in_len += (size_t)n;
+                conn->early_remaining = conn->in_len;
+            }
+        }
+#endif
+    } while (ret == MBEDTLS_ERR_SSL_RECEIVED_EARLY_DATA);
+    conn->handshake_ns += now_ns() - start;
+    return ret;
+}
+
+/**
+ * Act on a handshake step's result, back on the I/O thread.
+ * Returns 1 when the handshake is done, 0 to wait for I/O, -1 to close.
+ */
+static int handshake_result(connection_t *conn, int ret)
+{
+    if (is_want_io(ret))
+        return 0;
+    PROBE(handshake_end, conn, conn->net.fd, ret, conn->resumed, conn->handshake_ns);
+    admission_settle(conn, ret);
+    if (ret != 0)
+    {
+        // The code only: mbedtls_strerror() is too slow for the I/O thread
+        LOG_WARN("TLS handshake failed: -0x%04x", (unsigned)-ret);
+        counter_inc(&conn->worker->handshakes_failed);
+        return -1;
+    }
+
+    const char *ktls = "off";
+#if defined(HAVE_KTLS)
+    if (conn->worker->server->ktls)
+        ktls = ktls_enable(conn);
+#endif
+    LOG_DEBUG("TLS handshake successful: cipher %s, version %s, resumed %s, kTLS %s",
+              mbedtls_ssl_get_ciphersuite(&conn->ssl), mbedtls_ssl_get_version(&conn->ssl),
+              conn->resumed ? "yes" : "no", ktls);
+    worker_t *worker = conn->worker;
+    counter_inc(conn->resumed ? &worker->handshakes_resumed : &worker->handshakes_full);
+    histogram_record(&worker->handshake_time, conn->handshake_ns);
+    histogram_record(&worker->accept_to_ready, now_ns() - conn->accepted_ns);
+    int id = mbedtls_ssl_get_ciphersuite_id_from_ssl(&conn->ssl);
+    for (int i = 0; ciphers[i] != 0 && i < MAX_CIPHERS; i++)
+        if (ciphers[i] == id)
+            counter_inc(&worker->handshakes_by_cipher[i]);
+    record_sizing_init(conn);
+    conn->state = CONN_READ_REQUEST;
+    return 1;
+}
+
+/**
+ * Pool thread: one handshake step, then hand the connection back to its worker
+ */
+static void handshake_task(void *arg)
+{
+    connection_t *conn = arg;
+    worker_t *worker = conn->worker;
+
+    arena_enter(conn);
+    conn->handshake_ret = handshake_step(conn);
+    arena_leave();
+
+    pthread_mutex_lock(&worker->done_lock);
+    int was_empty = worker->done_head == NULL;
+    conn->done_next = worker->done_head;
+    worker->done_head = conn;
+    pthread_mutex_unlock(&worker->done_lock);
+
+    if (was_empty)
+    {
+        uint64_t one = 1;
+        if (write(worker->done_fd, &one, sizeof(one)) < 0)
+            LOG_ERROR("Failed to signal handshake completion: %s", strerror(errno));
+    }
+}
+
+/**
+ * Hand the next handshake step to the pool, so ECDHE and signing do not
+ * hold up I/O on established connections. Returns -1 to run it inline.
+ */
+static int handshake_offload(connection_t *conn)
+{
+    worker_t *worker = conn->worker;
+    handshake_pool_t *pool = worker->server->handshake_pool;
+
+    if (pool == NULL)
+        return -1;
+
+    conn->offloaded = 1;
+    conn->io_ready = 0;
+    worker->offloaded++;
+    if (handshake_pool_submit(pool, handshake_task, conn) != 0)
+    {
+        conn->offloaded = 0;
+        worker->offloaded--;
+        counter_inc(&worker->handshakes_inline);
+        return -1;
+    }
+    counter_inc(&worker->handshakes_offloaded);
+    return 0;
+}
+
+/**
+ * Drive one connection's state machine as far as the socket allows.
+ * Returns 0 while the connection is waiting for I/O, -1 when it must be closed.
+ */
+static int connection_step(connection_t *conn)
+{
+    int ret;
+
+    for (;;)
+    {
+        switch (conn->state)
+        {
+        case CONN_HANDSHAKE:
+            if (!conn->admitted)
+            {
+                ret = admission_check(conn);
+                if (ret != 0)
+                    return is_want_io(ret) ? 0 : -1;
+            }
+            if (handshake_offload(conn) == 0)
+                return 0; // handshake_completions() takes over when the pool is done
+            ret = handshake_result(conn, handshake_step(conn));
+            if (ret <= 0)
+                return ret;
+            break;
+
+        case CONN_READ_REQUEST:
+            // Serve what is already buffered before reading more (pipelining)
+            if (process_requests(conn) != 0)
+                return -1;
+            if (conn->out_len > 0)
+            {
+                // The kernel restarts slow start on a connection idle for an RTO or so; so do the records
+                if (now_ns() - conn->last_write_ns > RECORD_IDLE_MS * 1000000ull)
+                    conn->ramp_sent = 0;
+                conn->state = CONN_WRITE_RESPONSE;
+                break;
+            }
+            if (conn->close_after)
+            {
+                conn->state = CONN_CLOSE_NOTIFY;
+                break;
+            }
+
+            if (conn->in_len == sizeof(conn->in))
+                compact_input(conn);
+            ret = connection_recv(conn, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len);
+            if (is_want_io(ret))
+                return 0;
+            if (ret <= 0)
+                return -1; // close_notify, EOF or error
+            PROBE(read, conn, conn->net.fd, ret);
+            conn->in_len += (size_t)ret;
+            break;
+
+        case CONN_WRITE_RESPONSE:
+            // Without kTLS, fill `out` from the file first so head and body share records and writes
+            if (conn->file_remaining > 0 && !conn->ktls_tx && conn->out_len < sizeof(conn->out) &&
+                send_file_body(conn) != 0)
+                return -1;
+            while (conn->out_sent < conn->out_len)
+            {
+                ret = connection_send(conn, conn->out + conn->out_sent, conn->out_len - conn->out_sent,
+                                      conn->file_remaining > 0);
+                if (is_want_io(ret))
+                    return 0;
+                if (ret < 0)
+                    return -1;
+                PROBE(write, conn, conn->net.fd, ret);
+                conn->out_sent += (size_t)ret;
+            }
+            conn->out_len = conn->out_sent = 0;
+
+            if (conn->file_remaining > 0)
+            {
+                if (conn->ktls_tx)
+                {
+                    ret = send_file_body(conn);
+                    if (is_want_io(ret))
+                        return 0;
+                    if (ret != 0)
+                        return -1;
+                }
+                break; // with user-space records the next part is read at the top
+            }
+            if (conn->file_fd >= 0)
+            {
+                close(conn->file_fd);
+                conn->file_fd = -1;
+            }
+            conn->last_write_ns = now_ns();
+            if (conn->requests_pending > 0)
+            {
+                // Pipelined requests flushed together are all timed from the first one
+                uint64_t elapsed = conn->last_write_ns - conn->request_start_ns;
+                for (; conn->requests_pending > 0; conn->requests_pending--)
+                    histogram_record(&conn->worker->request_time, elapsed);
+            }
+            conn->state = CONN_READ_REQUEST;
+            break;
+
+        case CONN_CLOSE_NOTIFY:
+            ret = connection_close_notify(conn);
+            if (is_want_io(ret))
+                return 0;
+            LOG_DEBUG("Connection closed (fd %d)", conn->net.fd);
+            return -1;
+        }
+    }
+}
+
+/**
+ * Set the deadline for whatever the connection now waits on. The timer only
+ * moves when the deadline comes closer; one that slid later is caught up
+ * when the timer fires, so a busy keep-alive connection costs no list updates.
+ */
+static void connection_schedule(worker_t *worker, connection_t *conn)
+{
+    uint64_t now = now_ms();
+
+    switch (conn->state)
+    {
+    case CONN_HANDSHAKE:
+        return; // fixed at accept
+    case CONN_READ_REQUEST:
+        if (conn->in_start < conn->in_len && conn->body_mode == BODY_NONE)
+        {
+            // Part of a head is in: the rest must follow in time, however slowly it trickles (slowloris)
+            if (conn->head_deadline_ms == 0)
+                conn->head_deadline_ms = now + HEADER_TIMEOUT_MS;
+            conn->deadline_ms = conn->head_deadline_ms;
+            conn->deadline_kind = TIMEOUT_HEADER;
+        }
+        else
+        {
+            conn->deadline_ms = now + IDLE_TIMEOUT_MS;
+            conn->deadline_kind = TIMEOUT_IDLE;
+        }
+        break;
+    default:
+        // The peer has to take response bytes (or the close_notify)
+        conn->deadline_ms = now + WRITE_TIMEOUT_MS;
+        conn->deadline_kind = TIMEOUT_WRITE;
+        break;
+    }
+    if (!wheel_armed(&conn->timer) || wheel_expires_ms(&worker->timers, &conn->timer) > conn->deadline_ms)
+        wheel_arm(&worker->timers, &conn->timer, conn->deadline_ms);
+}
+
+/**
+ * Run the state machine with Mbed TLS allocating from the connection's arena
+ */
+static int connection_advance(connection_t *conn)
+{
+    arena_enter(conn);
+    int ret = connection_step(conn);
+    arena_leave();
+    if (ret == 0 && !conn->offloaded)
+    {
+        connection_schedule(conn->worker, conn);
+#if defined(HAVE_IO_URING)
+        if (conn->io != NULL)
+            uring_flush(conn->worker, conn);
+#endif
+    }
+    return ret;
+}
+
+/**
+ * Timer wheel callback: close a connection that missed its deadline, or
+ * re-arm for the later deadline it has slid to since
+ */
+static void connection_expired(wheel_timer_t *timer, void *arg)
+{
+    worker_t *worker = arg;
+    connection_t *conn = (connection_t *)((char *)timer - offsetof(connection_t, timer));
+
+#if defined(HAVE_IO_URING)
+    if (conn->io != NULL && conn->io->closing)
+    {
+        // Already closed, but the peer stopped reading the rest: cancel, and finish once the ring reports back
+        conn->io->cancelled = 1;
+        uring_prep_cancel(&worker->ring, 0, conn->net.fd, URING_CANCEL);
+        return;
+    }
+#endif
+    if (now_ms() < conn->deadline_ms)
+    {
+        wheel_arm(&worker->timers, timer, conn->deadline_ms);
+        return;
+    }
+
+    counter_inc(&worker->timeouts[conn->deadline_kind]);
+    if (conn->offloaded)
+    {
+        conn->timed_out = 1; // owned by a pool thread until its step completes
+        return;
+    }
+    LOG_DEBUG("Connection timed out (%s, fd %d)", timeout_names[conn->deadline_kind], conn->net.fd);
+    if (conn->deadline_kind == TIMEOUT_IDLE || conn->deadline_kind == TIMEOUT_HEADER)
+    {
+        // Best effort; a peer that is not reading gets no more of our time
+        arena_enter(conn);
+        connection_close_notify(conn);
+        arena_leave();
+    }
+    connection_close(worker, conn);
+}
+
+static void accept_connections(worker_t *worker)
+{
+    // Edge-triggered: drain the accept queue until it would block
+    for (;;)
+    {
+        mbedtls_net_context client_fd;
+        mbedtls_net_init(&client_fd);
+
+        int ret = mbedtls_net_accept(&worker->listen_fd, &client_fd, NULL, 0, NULL);
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ)
+            return;
+        if (ret != 0)
+        {
+            LOG_ERROR("Accept failed: %d", ret);
+            return;
+        }
+        if (!admission_accept(worker))
+        {
+            socket_abort_on_close(client_fd.fd);
+            mbedtls_net_free(&client_fd);
+            continue;
+        }
+
+        connection_t *conn = connection_open(worker, &client_fd);
+        if (conn == NULL)
+        {
+            mbedtls_net_free(&client_fd);
+            continue;
+        }
+        if (connection_advance(conn) != 0)
+            connection_close(worker, conn);
+    }
+}
+
+/**
+ * Pick up handshake steps the pool has finished and carry on with each
+ * connection. While shutting down they are only closed.
+ */
+static void handshake_completions(worker_t *worker, int stopping)
+{
+    uint64_t value;
+    if (read(worker->done_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        LOG_ERROR("Failed to read handshake completions: %s", strerror(errno));
+
+    pthread_mutex_lock(&worker->done_lock);
+    connection_t *conn = worker->done_head;
+    worker->done_head = NULL;
+    pthread_mutex_unlock(&worker->done_lock);
+
+    while (conn)
+    {
+        connection_t *next = conn->done_next;
+        conn->offloaded = 0;
+        worker->offloaded--;
+#if defined(HAVE_IO_URING)
+        uring_resume(conn);
+#endif
+
+        int ret = -1;
+        if (!stopping && !conn->timed_out)
+        {
+            arena_enter(conn);
+            ret = handshake_result(conn, conn->handshake_ret);
+            arena_leave();
+            // The socket became ready while the step ran: the edge was already consumed, so step again now
+            if (ret == 0 && conn->io_ready)
+                ret = 1;
+            if (ret > 0)
+                ret = connection_advance(conn);
+#if defined(HAVE_IO_URING)
+            else if (ret == 0 && conn->io != NULL)
+                uring_flush(worker, conn); // the step's records are only staged so far
+#endif
+        }
+        if (ret != 0)
+            connection_close(worker, conn);
+        conn = next;
+    }
+}
+
+/**
+ * Loop exit: free the pooled connections and drop the credentials
+ */
+static void worker_release(worker_t *worker)
+{
+    while (worker->pool_index >= 0)
+        connection_destroy(worker->pool[worker->pool_index--]);
+    credentials_release(worker->creds);
+    worker->creds = NULL;
+}
+
+static void run_event_loop(worker_t *worker)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int stop = 0;
+
+    while (!stop)
+    {
+        int accept_ready = 0, completions_ready = 0;
+        int n = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, wheel_timeout(&worker->timers, now_ms(), 1000));
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            LOG_ERROR("epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        worker_refresh_credentials(worker);
+
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == &worker->listen_fd)
+            {
+                accept_ready = 1;
+                continue;
+            }
+            if (events[i].data.ptr == &worker->server->shutdown_fd)
+            {
+                stop = 1;
+                continue;
+            }
+            if (events[i].data.ptr == &worker->done_fd)
+            {
+                completions_ready = 1;
+                continue;
+            }
+
+            connection_t *conn = events[i].data.ptr;
+            if (conn->offloaded)
+            {
+                conn->io_ready = 1;
+                continue;
+            }
+            if ((events[i].events & (EPOLLERR | EPOLLHUP)) || connection_advance(conn) != 0)
+                connection_close(worker, conn);
+        }
+
+        // Only once the batch is done: completions may close, and accepts reuse, connections whose
+        // events are still further down in it
+        if (completions_ready)
+            handshake_completions(worker, 0);
+        if (accept_ready)
+            accept_connections(worker);
+
+        wheel_advance(&worker->timers, now_ms(), connection_expired, worker);
+    }
+
+    // Pool threads still hold pointers to offloaded connections; wait for them first
+    while (worker->offloaded > 0)
+    {
+        struct pollfd pfd = {.fd = worker->done_fd, .events = POLLIN};
+        if (poll(&pfd, 1, -1) > 0)
+            handshake_completions(worker, 1);
+    }
+    while (worker->connections)
+        connection_close(worker, worker->connections);
+    worker_release(worker);
+}
+
+#if defined(HAVE_IO_URING)
+/**
+ * The ring has finished with a closed connection: now the socket can go
+ */
+static void uring_close_finish(worker_t *worker, connection_t *conn)
+{
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        worker->closing = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    conn->prev = conn->next = NULL;
+    worker->closing_count--;
+    wheel_cancel(&worker->timers, &conn->timer);
+
+    mbedtls_net_free(&conn->net);
+    connection_release(worker, conn);
+}
+
+static void uring_on_recv(worker_t *worker, connection_t *conn, const struct io_uring_cqe *cqe, int stopping)
+{
+    uring_io_t *io = conn->io;
+    int res = cqe->res;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        io->recv_armed = 0;
+        io->ops--;
+    }
+
+    if (res > 0)
+    {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        unsigned tail = atomic_load_explicit(&io->rx_tail, memory_order_relaxed);
+
+        worker->bufs_free--;
+        if (io->closing || tail - io->rx_reclaimed >= URING_RX_SLOTS)
+        {
+            // Closing, or data kept arriving after the pause: nowhere to put it
+            uring_buf_add(&worker->bufs, bid);
+            uring_buf_publish(&worker->bufs);
+            worker->bufs_free++;
+            if (!io->closing)
+                atomic_store_explicit(&io->rx_end, -ENOBUFS, memory_order_release);
+        }
+        else
+        {
+            io->rx[tail % URING_RX_SLOTS].bid = (uint16_t)bid;
+            io->rx[tail % URING_RX_SLOTS].off = 0;
+            io->rx[tail % URING_RX_SLOTS].len = (uint16_t)res;
+            atomic_store_explicit(&io->rx_tail, tail + 1, memory_order_release);
+
+            // Backpressure: the requests are not being consumed, so stop reading the socket
+            if (tail + 1 - io->rx_reclaimed >= URING_RX_SLOTS - URING_RX_HEADROOM && io->recv_armed &&
+                !io->recv_paused)
+            {
+                uring_prep_cancel(&worker->ring, URING_UD(conn, URING_RECV), -1, URING_CANCEL);
+                io->recv_paused = 1;
+            }
+        }
+    }
+    else if (res == -ENOBUFS)
+    {
+        // The buffer ring ran dry; uring_rearm_starved() resumes once buffers come back
+        if (!io->closing)
+        {
+            io->starved = 1;
+            worker->starved++;
+        }
+    }
+    else if (res != -ECANCELED)
+        atomic_store_explicit(&io->rx_end, res == 0 ? 1 : res, memory_order_release);
+
+    if (io->closing)
+    {
+        if (io->ops == 0)
+            uring_close_finish(worker, conn);
+        return;
+    }
+    if (conn->offloaded)
+    {
+        conn->io_ready = 1;
+        return;
+    }
+    if (stopping)
+        return;
+    if (res == -ECANCELED || res == -ENOBUFS)
+    {
+        // Nothing new to read; a paused recv is re-armed here if rx already drained
+        uring_flush(worker, conn);
+        return;
+    }
+    if (connection_advance(conn) != 0)
+        connection_close(worker, conn);
+}
+
+static void uring_on_send(worker_t *worker, connection_t *conn, int res, int stopping)
+{
+    uring_io_t *io = conn->io;
+
+    if (conn->offloaded)
+    {
+        // The pool thread may be appending to tx: apply this once it hands the connection back
+        io->send_deferred = 1;
+        io->send_deferred_res = res;
+        conn->io_ready = 1;
+        return;
+    }
+
+    int ret = uring_send_complete(conn, res);
+    if (io->closing)
+    {
+        uring_flush(worker, conn);
+        if (io->ops == 0)
+            uring_close_finish(worker, conn);
+        return;
+    }
+    if (stopping)
+        return;
+    if (ret != 0 || connection_advance(conn) != 0)
+        connection_close(worker, conn);
+}
+
+static void uring_on_accept(worker_t *worker, int res, int stopping)
+{
+    if (res < 0)
+    {
+        if (res != -ECANCELED)
+            LOG_ERROR("Accept failed: %s", strerror(-res));
+        return;
+    }
+    if (stopping)
+    {
+        close(res);
+        return;
+    }
+    if (!admission_accept(worker))
+    {
+        socket_abort_on_close(res);
+        close(res);
+        return;
+    }
+
+    mbedtls_net_context client_fd;
+    mbedtls_net_init(&client_fd);
+    client_fd.fd = res;
+    connection_t *conn = connection_open(worker, &client_fd);
+    if (conn == NULL)
+    {
+        mbedtls_net_free(&client_fd);
+        return;
+    }
+    if (connection_advance(conn) != 0)
+        connection_close(worker, conn);
+}
+
+/**
+ * Buffers came back after the ring ran dry: resume the receives it stopped
+ */
+static void uring_rearm_starved(worker_t *worker)
+{
+    for (connection_t *conn = worker->connections; conn && worker->starved > 0; conn = conn->next)
+    {
+        if (worker->bufs_free < URING_BUF_COUNT / 4)
+            return;
+        if (!conn->io->starved || conn->offloaded)
+            continue;
+        conn->io->starved = 0;
+        worker->starved--;
+        uring_flush(worker, conn);
+    }
+}
+
+/**
+ * Shutdown: stop waiting for the peers of closed connections to read the rest
+ */
+static void uring_cancel_closing(worker_t *worker)
+{
+    for (connection_t *conn = worker->closing; conn; conn = conn->next)
+    {
+        wheel_cancel(&worker->timers, &conn->timer);
+        if (conn->io->cancelled)
+            continue;
+        conn->io->cancelled = 1;
+        uring_prep_cancel(&worker->ring, 0, conn->net.fd, URING_CANCEL);
+    }
+}
+
+/**
+ * Handle every completion that has arrived. Returns 1 once shutdown was signalled.
+ */
+static int uring_reap(worker_t *worker, int stopping)
+{
+    struct io_uring_cqe *cqe;
+    int stop = 0, completions_ready = 0;
+
+    while ((cqe = uring_peek_cqe(&worker->ring)) != NULL)
+    {
+        // Copy out first: the handlers may queue SQEs, and the slot is reused once seen
+        struct io_uring_cqe c = *cqe;
+        uring_cqe_seen(&worker->ring);
+
+        switch (URING_TAG(c.user_data))
+        {
+        case URING_ACCEPT:
+            uring_on_accept(worker, c.res, stopping);
+            if (!(c.flags & IORING_CQE_F_MORE) && !stopping)
+                uring_prep_accept_multishot(&worker->ring, worker->listen_fd.fd, URING_UD(worker, URING_ACCEPT));
+            break;
+        case URING_RECV:
+            uring_on_recv(worker, URING_PTR(c.user_data), &c, stopping);
+            break;
+        case URING_SEND:
+            uring_on_send(worker, URING_PTR(c.user_data), c.res, stopping);
+            break;
+        case URING_DONE:
+            completions_ready = 1;
+            if (!(c.flags & IORING_CQE_F_MORE))
+                uring_prep_poll_multishot(&worker->ring, worker->done_fd, URING_UD(worker, URING_DONE));
+            break;
+        case URING_STOP:
+            stop = 1;
+            break;
+        default:
+            break; // cancellations
+        }
+    }
+
+    // After the batch, as on the epoll path, so no completion in it is handled for a connection closed under it.
+    // Accepts need no such care: a connection is only pooled once none of its operations is outstanding.
+    if (completions_ready)
+        handshake_completions(worker, stopping);
+    return stop;
+}
+
+/**
+ * The worker loop on io_uring: accepts, receives and sends are completions,
+ * and every operation queued while handling one batch is submitted together
+ * with the wait for the next, in a single system call.
+ */
+static void run_uring_loop(worker_t *worker)
+{
+    uring_t *ring = &worker->ring;
+    int ret;
+
+    // Created on this thread: with SINGLE_ISSUER only the creator may submit
+    if ((ret = uring_init(ring, URING_ENTRIES)) != 0 ||
+        (ret = uring_bufs_init(ring, &worker->bufs, 0, URING_BUF_COUNT, URING_BUF_SIZE)) != 0)
+    {
+        LOG_ERROR("io_uring setup failed: %s", strerror(-ret));
+        uring_free(ring);
+        worker_release(worker);
+        return;
+    }
+    worker->bufs_free = URING_BUF_COUNT;
+
+    uring_prep_accept_multishot(ring, worker->listen_fd.fd, URING_UD(worker, URING_ACCEPT));
+    uring_prep_poll_multishot(ring, worker->server->shutdown_fd, URING_UD(worker, URING_STOP));
+    uring_prep_poll_multishot(ring, worker->done_fd, URING_UD(worker, URING_DONE));
+
+    for (;;)
+    {
+        ret = uring_submit_and_wait(ring, 1, wheel_timeout(&worker->timers, now_ms(), 1000));
+        if (ret < 0 && ret != -ETIME && ret != -EINTR && ret != -EBUSY)
+        {
+            LOG_ERROR("io_uring_enter failed: %s", strerror(-ret));
+            break;
+        }
+
+        worker_refresh_credentials(worker);
+        if (uring_reap(worker, 0))
+            break;
+        if (worker->starved > 0)
+            uring_rearm_starved(worker);
+        wheel_advance(&worker->timers, now_ms(), connection_expired, worker);
+    }
+
+    // Stop accepting, let the pool hand back what it holds, then close everything
+    uring_prep_cancel(ring, URING_UD(worker, URING_ACCEPT), -1, URING_CANCEL);
+    while (worker->offloaded > 0)
+    {
+        uring_submit_and_wait(ring, 1, 1000);
+        uring_reap(worker, 1);
+    }
+    while (worker->connections)
+        connection_close(worker, worker->connections);
+    uring_cancel_closing(worker);
+    while (worker->closing_count > 0)
+    {
+        uring_submit_and_wait(ring, 1, 1000);
+        uring_reap(worker, 1);
+        uring_cancel_closing(worker);
+    }
+
+    uring_bufs_free(&worker->bufs);
+    uring_free(ring);
+    worker_release(worker);
+}
+
+/**
+ * Check once, before any worker starts, that this kernel can run the backend
+ */
+static int uring_probe(void)
+{
+    uring_t ring;
+    uring_bufs_t bufs;
+    int ret = uring_init(&ring, 8);
+
+    if (ret != 0)
+        return ret;
+    ret = uring_bufs_init(&ring, &bufs, 0, 8, 64);
+    if (ret == 0)
+        uring_bufs_free(&bufs);
+    uring_free(&ring);
+    return ret;
+}
+#endif
+
+static void *worker_main(void *arg)
+{
+    worker_t *worker = arg;
+    char name[LOG_THREAD_NAME_SIZE];
+
+    snprintf(name, sizeof(name), "w%d", worker->id);
+    log_thread_name(name);
+    wheel_init(&worker->timers, now_ms(), TIMER_TICK_MS);
+    admission_init(worker);
+#if defined(HAVE_IO_URING)
+    if (worker->server->io_uring)
+    {
+        run_uring_loop(worker);
+        return NULL;
+    }
+#endif
+    run_event_loop(worker);
+    return NULL;
+}
+
+/* --- Workers --- */
+
+/**
+ * Bind a non-blocking listener with SO_REUSEPORT so every worker can own one
+ * on the same address. mbedtls_net_bind() cannot set the option itself.
+ */
+static int create_reuseport_listener(mbedtls_net_context *listen_fd, const char *addr, const char *port)
+{
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM,
+                             .ai_protocol = IPPROTO_TCP, .ai_flags = AI_PASSIVE};
+    struct addrinfo *res;
+    int fd = -1;
+    int one = 1;
+
+    if (getaddrinfo(addr, port, &hints, &res) != 0)
+        return MBEDTLS_ERR_NET_UNKNOWN_HOST;
+
+    for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0)
+            break;
+
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0)
+        return MBEDTLS_ERR_NET_BIND_FAILED;
+
+    listen_fd->fd = fd;
+    return 0;
+}
+
+/**
+ * List the CPUs this process may run on, so pinning respects taskset/cgroups
+ */
+static int allowed_cpus(int *cpus, int max)
+{
+    cpu_set_t set;
+    int n = 0;
+
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        return 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++)
+    {
+        if (CPU_ISSET(cpu, &set))
+            cpus[n++] = cpu;
+    }
+    return n;
+}
+
+static int worker_start(server_context_t *server, worker_t *worker)
+{
+    int ret;
+
+    mbedtls_net_init(&worker->listen_fd);
+    worker->server = server;
+    worker->connections = NULL;
+    worker->pool_index = -1;
+    worker->done_head = NULL;
+    pthread_mutex_init(&worker->done_lock, NULL);
+    worker_refresh_credentials(worker);
+
+    if ((ret = create_reuseport_listener(&worker->listen_fd, SERVER_ADDR, SERVER_PORT)) != 0)
+        return ret;
+
+    worker->epoll_fd = -1;
+    worker->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker->done_fd < 0)
+        return MBEDTLS_ERR_NET_SOCKET_FAILED;
+
+    // The io_uring loop sets up its ring on the worker thread itself
+    if (!server->io_uring)
+    {
+        worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (worker->epoll_fd < 0)
+            return MBEDTLS_ERR_NET_SOCKET_FAILED;
+
+        struct epoll_event listen_ev = {.events = EPOLLIN | EPOLLET, .data.ptr = &worker->listen_fd};
+        struct epoll_event stop_ev = {.events = EPOLLIN, .data.ptr = &server->shutdown_fd};
+        struct epoll_event done_ev = {.events = EPOLLIN, .data.ptr = &worker->done_fd};
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->listen_fd.fd, &listen_ev) != 0 ||
+            epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, server->shutdown_fd, &stop_ev) != 0 ||
+            epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->done_fd, &done_ev) != 0)
+            return MBEDTLS_ERR_NET_SOCKET_FAILED;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (worker->cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker->cpu, &set);
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+    ret = pthread_create(&worker->thread, &attr, worker_main, worker);
+    pthread_attr_destroy(&attr);
+
+    return ret == 0 ? 0 : MBEDTLS_ERR_SSL_ALLOC_FAILED;
+}
+
+static int start_workers(server_context_t *server, int count)
+{
+    int cpus[CPU_SETSIZE];
+    int ncpus = allowed_cpus(cpus, CPU_SETSIZE);
+    int ret;
+
+    if (count <= 0)
+        count = ncpus > 0 ? ncpus : 1;
+
+    server->workers = calloc((size_t)count, sizeof(worker_t));
+    if (server->workers == NULL)
+        return MBEDTLS_ERR_SSL_ALLOC_FAILED;
+
+    LOG_INFO("Binding to %s:%s with %d %s worker(s)...", SERVER_ADDR, SERVER_PORT, count,
+             server->io_uring ? "io_uring" : "epoll");
+    for (int i = 0; i < count; i++)
+    {
+        worker_t *worker = &server->workers[i];
+        worker->id = i;
+        // A single worker is left unpinned, as before; otherwise one worker per core
+        worker->cpu = (count > 1 && ncpus > 0) ? cpus[i % ncpus] : -1;
+
+        if ((ret = worker_start(server, worker)) != 0)
+            return ret;
+        server->worker_count++;
+    }
+    return 0;
+}
+
+static void stop_workers(server_context_t *server)
+{
+    uint64_t one = 1;
+
+    server->running = 0;
+    if (write(server->shutdown_fd, &one, sizeof(one)) < 0)
+        LOG_ERROR("Failed to signal workers: %s", strerror(errno));
+
+    for (int i = 0; i < server->worker_count; i++)
+    {
+        worker_t *worker = &server->workers[i];
+        pthread_join(worker->thread, NULL);
+        if (worker->epoll_fd >= 0)
+            close(worker->epoll_fd);
+        close(worker->done_fd);
+        pthread_mutex_destroy(&worker->done_lock);
+        mbedtls_net_free(&worker->listen_fd);
+    }
+    free(server->workers);
+    server->workers = NULL;
+    server->worker_count = 0;
+}
+
+/**
+ * Let the process hold one descriptor per in-flight connection
+ */
+static void raise_fd_limit(void)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [options]\n", prog);
+    printf("  -w, --workers N   run N event-loop workers pinned one per core (0 = all cores, default 1)\n");
+    printf("  -e, --early-data  accept TLS 1.3 0-RTT early data for idempotent requests\n");
+    printf("  -c, --cert FILE   certificate, PEM or DER (default %s)\n", DEFAULT_CERT_FILE);
+    printf("  -k, --key FILE    private key, PEM or DER (default %s)\n", DEFAULT_KEY_FILE);
+    printf("  -m, --mmap        map the credential files instead of reading them\n");
+    printf("  -t, --ktls        offload record encryption to the kernel after the handshake\n");
+    printf("  -d, --docroot DIR serve static files from DIR instead of the built-in page\n");
+    printf("  -C, --cache-mb MB keep small files from DIR in a response cache of MB megabytes (default %d, 0 = off)\n",
+           CACHE_DEFAULT_MB);
+    printf("  -T, --handshake-threads N\n");
+    printf("                    run handshake crypto on a pool of N threads, off the I/O threads (default 0)\n");
+    printf("  -b, --handshake-budget PCT\n");
+    printf("                    under load, admit full handshakes only within PCT%% of each worker's time (default 0, off)\n");
+    printf("  -u, --io-uring    run accept, recv and send through io_uring instead of epoll\n");
+    printf("  -l, --log-level L error, warn, info or debug (default info)\n");
+    printf("  -h, --help        show this help\n");
+}
+
+static int setup_server(server_context_t *server)
+{
+    int ret;
+
+    pthread_mutex_init(&server->creds_lock, NULL);
+
+    if ((ret = setup_session_tickets(server)) != 0)
+        return ret;
+
+    // Load the certificate, generating one only on first start
+    server->creds = credentials_create(server, 1, &ret);
+    if (server->creds == NULL)
+    {
+        printf("Failed to set up certificate: %d\n", ret);
+        return ret;
+    }
+
+    server->shutdown_fd = eventfd(0, EFD_CLOEXEC);
+    if (server->shutdown_fd < 0)
+        return MBEDTLS_ERR_NET_SOCKET_FAILED;
+
+    snprintf(server->page_etag, sizeof(server->page_etag), "\"%016llx\"",
+             (unsigned long long)cache_hash(HTTP_BODY, strlen(HTTP_BODY)));
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    server_context_t server = {.running = 1, .shutdown_fd = -1, .docroot_fd = -1,
+                               .cert_path = DEFAULT_CERT_FILE, .key_path = DEFAULT_KEY_FILE};
+    int worker_count = 1;
+    int handshake_threads = 0;
+    int cache_mb = CACHE_DEFAULT_MB;
+    int ret;
+
+    static const struct option long_options[] = {
+        {"workers", required_argument, NULL, 'w'},
+        {"early-data", no_argument, NULL, 'e'},
+        {"cert", required_argument, NULL, 'c'},
+        {"key", required_argument, NULL, 'k'},
+        {"mmap", no_argument, NULL, 'm'},
+        {"ktls", no_argument, NULL, 't'},
+        {"docroot", required_argument, NULL, 'd'},
+        {"cache-mb", required_argument, NULL, 'C'},
+        {"handshake-threads", required_argument, NULL, 'T'},
+        {"handshake-budget", required_argument, NULL, 'b'},
+        {"io-uring", no_argument, NULL, 'u'},
+        {"log-level", required_argument, NULL, 'l'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}};
+    int opt;
+    while ((opt = getopt_long(argc, argv, "w:ec:k:mtd:C:T:b:ul:h", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'w':
+            worker_count = atoi(optarg);
+            break;
+        case 'e':
+            server.early_data = 1;
+            break;
+        case 'c':
+            server.cert_path = optarg;
+            break;
+        case 'k':
+            server.key_path = optarg;
+            break;
+        case 'm':
+            server.use_mmap = 1;
+            break;
+        case 't':
+#if defined(HAVE_KTLS)
+            server.ktls = 1;
+#else
+            printf("kTLS is not compiled in (build with make KTLS=1); using user-space records\n");
+#endif
+            break;
+        case 'T':
+            handshake_threads = atoi(optarg);
+            break;
+        case 'b':
+            ret = atoi(optarg);
+            if (ret < 0 || ret > 1000)
+            {
+                printf("Handshake budget must be 0-1000 (percent of a core per worker)\n");
+                return 1;
+            }
+            server.handshake_budget = (unsigned)ret;
+            break;
+        case 'd':
+            server.docroot_fd = open(optarg, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (server.docroot_fd < 0)
+            {
+                printf("Cannot open document root %s: %s\n", optarg, strerror(errno));
+                return 1;
+            }
+            break;
+        case 'C':
+            cache_mb = atoi(optarg);
+            if (cache_mb < 0)
+            {
+                printf("Cache size must be 0 or more megabytes\n");
+                return 1;
+            }
+            break;
+        case 'u':
+#if defined(HAVE_IO_URING)
+            server.io_uring = 1;
+#else
+            printf("io_uring is not available in this build; using epoll\n");
+#endif
+            break;
+        case 'l':
+            if ((ret = log_parse_level(optarg)) < 0)
+            {
+                printf("Unknown log level %s\n", optarg);
+                return 1;
+            }
+            log_set_level((log_level_t)ret);
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+#if defined(HAVE_IO_URING)
+    if (server.io_uring)
+    {
+        if ((ret = uring_probe()) != 0)
+        {
+            printf("io_uring is not usable here (%s); using epoll\n", strerror(-ret));
+            server.io_uring = 0;
+        }
+        else if (server.ktls)
+        {
+            // kTLS reads and writes the socket directly, which the staged io_uring BIO cannot follow
+            printf("kTLS is not supported with io_uring; using user-space records\n");
+            server.ktls = 0;
+        }
+    }
+#endif
+
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+
+    // Workers inherit this mask, so only the main thread sees shutdown signals
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+#if defined(HAVE_ARENA)
+    // Before anything allocates: every block must carry the header arena_free() expects
+    mbedtls_platform_set_calloc_free(arena_calloc, arena_free);
+#endif
+
+    printf("Initializing PSA crypto...\n");
+    if (psa_crypto_init() != PSA_SUCCESS)
+    {
+        printf("Failed to initialize PSA crypto\n");
+        return 1;
+    }
+
+    printf("Setting up server...\n");
+    if ((ret = setup_server(&server)) != 0)
     {
         char error_buf[256];
         mbedtls_strerror(ret, error_buf, sizeof(error_buf));
@@ -298,41 +4125,76 @@ int main()
         return 1;
     }
 
-    printf("\n========================================\n");
-    printf("✅ Server listening on https://localhost:8443\n");
-    printf("========================================\n\n");
-
-    while (server.running)
+    if (handshake_threads > 0)
     {
-        mbedtls_net_context client_fd;
-        mbedtls_net_init(&client_fd);
-
-        ret = mbedtls_net_accept(&server.listen_fd, &client_fd, NULL, 0, NULL);
-        if (ret == 0)
+        server.handshake_pool = handshake_pool_create(handshake_threads);
+        if (server.handshake_pool == NULL)
         {
-            handle_client(&server, &client_fd);
+            printf("Failed to start the handshake pool\n");
+            return 1;
         }
-        else if (ret != MBEDTLS_ERR_SSL_WANT_READ)
+        printf("Handshakes run on a pool of %d thread(s)\n", handshake_threads);
+    }
+
+    if (server.docroot_fd >= 0 && cache_mb > 0)
+    {
+        server.cache = response_cache_create((size_t)cache_mb << 20);
+        if (server.cache == NULL)
         {
-            printf("Accept failed: %d\n", ret);
-            break;
+            printf("Failed to allocate the response cache\n");
+            return 1;
         }
     }
 
-    // Cleanup
-    printf("Shutting down server...\n");
+    // The flusher runs before the first worker, so no worker line waits in its ring for it.
+    // From here on the main thread logs too, so its lines stay in order with the workers'.
+    fflush(stdout);
+    log_thread_name("main");
+    if (log_start(stdout) != 0)
+    {
+        printf("Failed to start the log flusher\n");
+        return 1;
+    }
+
+    if ((ret = start_workers(&server, worker_count)) != 0)
+    {
+        LOG_ERROR("Failed to start workers: %d", ret);
+        stop_workers(&server);
+        log_stop();
+        return 1;
+    }
 
-    mbedtls_net_free(&server.listen_fd);
-    mbedtls_x509_crt_free(&server.srvcert);
+    // Through the ring like every other line now that the flusher owns stdout
+    LOG_INFO("✅ Server listening on https://localhost:%s", SERVER_PORT);
 
-    // Destroy PSA key
-    if (server.key_id != 0)
+    // SIGUSR1 prints the handshake counters, SIGHUP reloads the certificate; SIGINT/SIGTERM shut down
+    int sig;
+    while (sigwait(&signals, &sig) == 0 && (sig == SIGUSR1 || sig == SIGHUP))
     {
-        psa_destroy_key(server.key_id);
+        if (sig == SIGHUP)
+            reload_credentials(&server);
+        else
+            print_handshake_stats(&server);
     }
 
-    mbedtls_pk_free(&server.pkey);
-    mbedtls_ssl_config_free(&server.conf);
+    // Cleanup
+    LOG_INFO("Shutting down server...");
+
+    print_handshake_stats(&server);
+    stop_workers(&server);
+    if (server.handshake_pool)
+        handshake_pool_destroy(server.handshake_pool);
+    log_stop();
+    if (server.shutdown_fd >= 0)
+        close(server.shutdown_fd);
+    credentials_release(server.creds);
+    pthread_mutex_destroy(&server.creds_lock);
+    response_cache_destroy(server.cache);
+    if (server.docroot_fd >= 0)
+        close(server.docroot_fd);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_TICKET_C)
+    mbedtls_ssl_ticket_free(&server.ticket_ctx);
+#endif
     mbedtls_psa_crypto_free();
 
     printf("Server shutdown complete.\n");
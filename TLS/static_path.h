@@ -0,0 +1,162 @@
+/**
+ * File names under a document root, and opening them without escaping it
+ *
+ * A request path is only turned into a name relative to the root when every
+ * segment is a plain name: no empty segment (so no leading "//" that would
+ * make it absolute), no "." and no "..". Opening then refuses to leave the
+ * root by any route, symbolic links included: openat2() with RESOLVE_BENEATH
+ * and RESOLVE_NO_SYMLINKS where the kernel has it (Linux 5.6), otherwise a
+ * walk that opens one component at a time with O_NOFOLLOW.
+ *
+ * Needs _GNU_SOURCE for O_PATH.
+ */
+
+#ifndef STATIC_PATH_H
+#define STATIC_PATH_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(__linux__) && __has_include(<linux/openat2.h>)
+#include <linux/openat2.h>
+#include <sys/syscall.h>
+#if defined(SYS_openat2)
+#define HAVE_OPENAT2
+#endif
+#endif
+
+#define STATIC_INDEX "index.html"
+
+/**
+ * Whether the segment [s, s + len) may appear in a name under the root
+ */
+static inline int static_segment_ok(const char *s, size_t len)
+{
+    return len > 0 && !(len == 1 && s[0] == '.') && !(len == 2 && s[0] == '.' && s[1] == '.');
+}
+
+/**
+ * Map a request path ("/dir/file?query") onto a name relative to the
+ * document root in `rel`, with "index.html" appended to a directory, and
+ * room left for a ".gz" suffix. No percent-decoding is done. Returns -1 when
+ * the path cannot name a file under the root.
+ */
+static int static_path_resolve(const char *path, size_t len, char *rel, size_t rel_size)
+{
+    const char *query = memchr(path, '?', len);
+    if (query)
+        len = (size_t)(query - path);
+
+    if (len == 0 || path[0] != '/' || len + sizeof(STATIC_INDEX) + 3 > rel_size || memchr(path, '\0', len) != NULL)
+        return -1;
+    memcpy(rel, path + 1, len - 1);
+    rel[len - 1] = '\0';
+
+    // Every segment but a trailing empty one (a directory) must be a plain name
+    for (const char *seg = rel;;)
+    {
+        const char *slash = strchr(seg, '/');
+        size_t seg_len = slash ? (size_t)(slash - seg) : strlen(seg);
+        if (slash == NULL && seg_len == 0)
+            break;
+        if (!static_segment_ok(seg, seg_len))
+            return -1;
+        if (slash == NULL)
+            break;
+        seg = slash + 1;
+    }
+
+    if (rel[0] == '\0' || rel[len - 2] == '/')
+        strcat(rel, STATIC_INDEX);
+    return 0;
+}
+
+/**
+ * open_beneath() for kernels without openat2(): open each directory on the
+ * way with O_NOFOLLOW and re-check each name, so neither a symbolic link nor
+ * a ".." leads out of `dirfd`
+ */
+static int open_beneath_walk(int dirfd, const char *rel, int flags)
+{
+    char name[NAME_MAX + 1];
+    int dir = dirfd;
+
+    if (rel[0] == '/')
+    {
+        errno = EXDEV;
+        return -1;
+    }
+    for (;;)
+    {
+        const char *slash = strchr(rel, '/');
+        size_t len = slash ? (size_t)(slash - rel) : strlen(rel);
+        int fd;
+
+        if (!static_segment_ok(rel, len) || len > NAME_MAX)
+        {
+            if (dir != dirfd)
+                close(dir);
+            errno = EXDEV;
+            return -1;
+        }
+        memcpy(name, rel, len);
+        name[len] = '\0';
+        if (slash)
+            fd = openat(dir, name, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        else
+            fd = openat(dir, name, flags | O_NOFOLLOW | O_CLOEXEC);
+        if (dir != dirfd)
+        {
+            int saved = errno;
+            close(dir);
+            errno = saved;
+        }
+        if (fd < 0 || slash == NULL)
+            return fd;
+        dir = fd;
+        rel = slash + 1;
+    }
+}
+
+/**
+ * openat(dirfd, rel, flags), except that nothing outside `dirfd` can be
+ * reached: absolute names, "..", and symbolic links anywhere on the way fail
+ */
+static int open_beneath(int dirfd, const char *rel, int flags)
+{
+#if defined(HAVE_OPENAT2)
+    static atomic_int unsupported;
+
+    if (!atomic_load_explicit(&unsupported, memory_order_relaxed))
+    {
+        struct open_how how = {.flags = (unsigned long long)(flags | O_NOFOLLOW | O_CLOEXEC),
+                               .resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS | RESOLVE_NO_MAGICLINKS};
+        int fd = (int)syscall(SYS_openat2, dirfd, rel, &how, sizeof(how));
+        if (fd >= 0 || errno != ENOSYS)
+            return fd;
+        atomic_store_explicit(&unsupported, 1, memory_order_relaxed);
+    }
+#endif
+    return open_beneath_walk(dirfd, rel, flags);
+}
+
+/**
+ * fstatat() under the same rules as open_beneath(). A symbolic link at the
+ * end is not followed but reported as itself, as with AT_SYMLINK_NOFOLLOW.
+ */
+static int stat_beneath(int dirfd, const char *rel, struct stat *st)
+{
+    int fd = open_beneath(dirfd, rel, O_PATH);
+    if (fd < 0)
+        return -1;
+    int ret = fstat(fd, st);
+    close(fd);
+    return ret;
+}
+
+#endif /* STATIC_PATH_H */
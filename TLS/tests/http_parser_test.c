@@ -0,0 +1,181 @@
+/**
+ * Tests for http_parser.h: request heads, framing headers and chunked bodies,
+ * with the malformed inputs that would let a request be framed differently
+ * here than by a proxy in front of the server
+ *
+ *   make -C TLS test
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../http_parser.h"
+
+static int failures;
+
+#define CHECK(cond)                                                                                               \
+    do                                                                                                            \
+    {                                                                                                             \
+        if (!(cond))                                                                                              \
+        {                                                                                                         \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);                                       \
+            failures++;                                                                                           \
+        }                                                                                                         \
+    } while (0)
+
+static int parse(const char *text, http_request_t *req)
+{
+    http_parser_t parser;
+    http_parser_reset(&parser);
+    return http_parse_request(&parser, (const unsigned char *)text, strlen(text), req);
+}
+
+/**
+ * Feed a chunked body one byte at a time, so every state is also crossed at a
+ * read boundary. Returns the bytes consumed up to the end of the body, or -1.
+ */
+static long chunked_bytewise(const char *body)
+{
+    http_chunked_t dec;
+    size_t len = strlen(body), i = 0;
+
+    http_chunked_init(&dec);
+    while (i < len && !http_chunked_done(&dec))
+    {
+        long n = http_chunked_consume(&dec, (const unsigned char *)body + i, 1);
+        if (n < 0)
+            return -1;
+        i += (size_t)n;
+    }
+    return http_chunked_done(&dec) ? (long)i : -1;
+}
+
+/**
+ * The same body in one call; both ways must agree
+ */
+static long chunked_whole(const char *body)
+{
+    http_chunked_t dec;
+
+    http_chunked_init(&dec);
+    long n = http_chunked_consume(&dec, (const unsigned char *)body, strlen(body));
+    return n >= 0 && http_chunked_done(&dec) ? n : -1;
+}
+
+static long chunked(const char *body)
+{
+    long a = chunked_bytewise(body), b = chunked_whole(body);
+    CHECK(a == b);
+    return a;
+}
+
+static void test_request_head(void)
+{
+    http_request_t req;
+    const char *get = "GET /index.html HTTP/1.1\r\nHost: x\r\nAccept: */*\r\n\r\n";
+
+    CHECK(parse(get, &req) == (int)strlen(get));
+    CHECK(req.num_headers == 2 && req.keep_alive && req.content_length == -1 && !req.chunked);
+    CHECK(req.path_len == 11 && memcmp(req.path, "/index.html", 11) == 0);
+
+    CHECK(parse("GET / HTTP/1.1\r\nHost: x\r\n", &req) == HTTP_PARSE_INCOMPLETE);
+    CHECK(parse("GET / HTTP/2.0\r\n\r\n", &req) == HTTP_PARSE_ERROR);
+
+    // A bare LF is never a line end, in the request line or inside a header
+    CHECK(parse("GET /a\nb HTTP/1.1\r\nHost: x\r\n\r\n", &req) == HTTP_PARSE_ERROR);
+    CHECK(parse("GET / HTTP/1.1\r\nHost: x\nContent-Length: 5\r\n\r\n", &req) == HTTP_PARSE_ERROR);
+    CHECK(parse("GET / HTTP/1.1\r\nX-A: 1\nTransfer-Encoding: chunked\r\n\r\n", &req) == HTTP_PARSE_ERROR);
+    CHECK(parse("GET / HTTP/1.1\r\nHo\nst: x\r\n\r\n", &req) == HTTP_PARSE_ERROR);
+
+    // Header names are tokens: an obs-fold line is not a header named " Content-Length"
+    CHECK(parse("POST / HTTP/1.1\r\nX-A: 1\r\n Content-Length: 5\r\n\r\n", &req) == HTTP_PARSE_ERROR);
+    CHECK(parse("POST / HTTP/1.1\r\nX-A: 1\r\n\tContent-Length: 5\r\n\r\n", &req) == HTTP_PARSE_ERROR);
+    CHECK(parse("GET / HTTP/1.1\r\nHost : x\r\n\r\n", &req) == HTTP_PARSE_ERROR);
+    CHECK(parse("GET / HTTP/1.1\r\nHo(st: x\r\n\r\n", &req) == HTTP_PARSE_ERROR);
+    CHECK(parse("GET / HTTP/1.1\r\n: x\r\n\r\n", &req) == HTTP_PARSE_ERROR);
+    CHECK(parse("GET / HTTP/1.1\r\nX-Tok!#$%&'*+.^_`|~09: x\r\n\r\n", &req) > 0 && req.num_headers == 1);
+
+    // Control bytes: none in the request line, only HTAB in a header value
+    CHECK(parse("G\x01T / HTTP/1.1\r\n\r\n", &req) == HTTP_PARSE_ERROR);
+    CHECK(parse("GET /a\x7f HTTP/1.1\r\n\r\n", &req) == HTTP_PARSE_ERROR);
+    CHECK(parse("GET /a\tb HTTP/1.1\r\n\r\n", &req) == HTTP_PARSE_ERROR);
+    CHECK(parse("GET /0123456789abcdef0123456789abcdef\x1b HTTP/1.1\r\n\r\n", &req) == HTTP_PARSE_ERROR);
+    CHECK(parse("GET / HTTP/1.1\r\nX-A: a\x01z\r\n\r\n", &req) == HTTP_PARSE_ERROR);
+    CHECK(parse("GET / HTTP/1.1\r\nX-A: a\tz \xe9\r\n\r\n", &req) > 0 && req.headers[0].value_len == 5);
+}
+
+static void test_framing(void)
+{
+    http_request_t req;
+
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length: 12\r\n\r\n", &req) > 0 && req.content_length == 12);
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 1\r\n\r\n", &req) == HTTP_PARSE_ERROR);
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n", &req) == HTTP_PARSE_ERROR);
+
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n", &req) > 0 && req.chunked);
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: CHUNKED\r\n\r\n", &req) > 0 && req.chunked);
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: gzip, chunked\r\n\r\n", &req) > 0 && req.chunked);
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: gzip,chunked\r\n\r\n", &req) > 0 && req.chunked);
+
+    // "chunked" must be the whole final coding, not a suffix of it
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: xchunked\r\n\r\n", &req) == HTTP_PARSE_ERROR);
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: gzip, xchunked\r\n\r\n", &req) == HTTP_PARSE_ERROR);
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: gzipchunked\r\n\r\n", &req) == HTTP_PARSE_ERROR);
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked, gzip\r\n\r\n", &req) == HTTP_PARSE_ERROR);
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n", &req) == HTTP_PARSE_ERROR);
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nTransfer-Encoding: chunked\r\n\r\n", &req) ==
+          HTTP_PARSE_ERROR);
+
+    // Both framings at once
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length: 3\r\nTransfer-Encoding: chunked\r\n\r\n", &req) ==
+          HTTP_PARSE_ERROR);
+}
+
+static void test_chunked(void)
+{
+    const char *body = "5\r\nhello\r\n1a;name=value\r\nabcdefghijklmnopqrstuvwxyz\r\n0\r\n\r\n";
+    CHECK(chunked(body) == (long)strlen(body));
+
+    const char *trailers = "3\r\nabc\r\n0\r\nX-Checksum: 1\r\nX-Other: 2\r\n\r\n";
+    CHECK(chunked(trailers) == (long)strlen(trailers));
+
+    // Consumption stops at the end of the body; a pipelined request after it is left alone
+    CHECK(chunked("0\r\n\r\nGET / HTTP/1.1\r\n\r\n") == 5);
+
+    // A chunk-size line with no digits is not a last chunk
+    CHECK(chunked("\r\n\r\n") == -1);
+    CHECK(chunked(";ext\r\n\r\n") == -1);
+    CHECK(chunked("5\r\nhello\r\n\r\n\r\n") == -1);
+    CHECK(chunked(" 5\r\nhello\r\n0\r\n\r\n") == -1);
+    CHECK(chunked("g\r\n") == -1);
+
+    // Exactly CRLF after the size, the data and every trailer line
+    CHECK(chunked("5\r\r\nhello\r\n0\r\n\r\n") == -1);
+    CHECK(chunked("5\nhello\r\n0\r\n\r\n") == -1);
+    CHECK(chunked("5;ext\r\r\nhello\r\n0\r\n\r\n") == -1);
+    CHECK(chunked("5;e\nxt\r\nhello\r\n0\r\n\r\n") == -1);
+    CHECK(chunked("5\r\nhello\r\r\n0\r\n\r\n") == -1);
+    CHECK(chunked("5\r\nhello\n0\r\n\r\n") == -1);
+    CHECK(chunked("5\r\nhelloX\r\n0\r\n\r\n") == -1);
+    CHECK(chunked("0\r\n\r\r\n") == -1);
+    CHECK(chunked("0\r\n\n") == -1);
+    CHECK(chunked("0\r\nX-A: 1\n\r\n") == -1);
+
+    // Sizes that would overflow
+    CHECK(chunked("10000000000000000\r\n") == -1);
+    CHECK(chunked("fffffffffffffff\r\n") == -1); // valid size, but the body never arrives
+}
+
+int main(void)
+{
+    test_request_head();
+    test_framing();
+    test_chunked();
+    if (failures)
+    {
+        printf("http_parser_test: %d failed\n", failures);
+        return 1;
+    }
+    printf("http_parser_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,381 @@
+/**
+ * Round trip through a kernel TLS socket, against the Mbed TLS being built
+ * against: a server and a client connection over loopback, both Mbed TLS,
+ * finish a TLS 1.3 handshake, and the server's record layer goes to the
+ * kernel with ktls_install() as soon as mbedtls_ssl_handshake() returns, the
+ * way the server does it. Session tickets are configured as in the server,
+ * so the NewSessionTicket Mbed TLS has already sent is part of the record
+ * sequence handed to the kernel. Data must then flow both ways, a
+ * close_notify must arrive, and the ticket the client received must resume
+ * a second connection, which goes through the kernel the same way. It checks
+ * the keys derived from the exported secrets, and the record sequence
+ * numbers read from Mbed TLS internals.
+ *
+ * The Makefile runs it before compiling kTLS into the server:
+ *
+ *   make -C TLS KTLS=1 server
+ *
+ * It needs the kernel's tls module (modprobe tls).
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/ssl_ticket.h>
+#include <psa/crypto.h>
+
+#include "../ktls.h"
+
+#define MAX_SPINS 100000 // non-blocking retries before a step counts as stuck
+
+static const char psk_identity[] = "ktls_test";
+static unsigned char psk[32];
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_TICKET_C)
+#define HAVE_TICKETS
+static mbedtls_ssl_ticket_context ticket_ctx;
+static int ticket_accepted;  // the server took the ticket the client offered
+static int tickets_received; // NewSessionTicket messages the client has read
+
+static int ticket_parse_counted(void *p_ticket, mbedtls_ssl_session *session, unsigned char *buf, size_t len)
+{
+    int ret = mbedtls_ssl_ticket_parse(p_ticket, session, buf, len);
+    if (ret == 0)
+        ticket_accepted = 1;
+    return ret;
+}
+#endif
+
+typedef struct
+{
+    mbedtls_ssl_config conf;
+    mbedtls_ssl_context ssl;
+    mbedtls_net_context net;
+} peer_t;
+
+static void pause_briefly(void)
+{
+    struct timespec ts = {0, 100000};
+    nanosleep(&ts, NULL);
+}
+
+static void peer_init(peer_t *peer, int fd)
+{
+    mbedtls_ssl_config_init(&peer->conf);
+    mbedtls_ssl_init(&peer->ssl);
+    mbedtls_net_init(&peer->net);
+    peer->net.fd = fd;
+}
+
+/**
+ * One end of the connection: TLS 1.3 only, PSK with ECDHE so no certificate
+ * is needed, and the one ciphersuite under test. The server issues a ticket
+ * after each handshake as server.c does, and the client keeps it.
+ */
+static int peer_setup(peer_t *peer, int endpoint, const int *suites)
+{
+    int ret = mbedtls_ssl_config_defaults(&peer->conf, endpoint, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                          MBEDTLS_SSL_PRESET_DEFAULT);
+    if (ret != 0)
+        return ret;
+    mbedtls_ssl_conf_min_tls_version(&peer->conf, MBEDTLS_SSL_VERSION_TLS1_3);
+    mbedtls_ssl_conf_max_tls_version(&peer->conf, MBEDTLS_SSL_VERSION_TLS1_3);
+    mbedtls_ssl_conf_ciphersuites(&peer->conf, suites);
+    mbedtls_ssl_conf_tls13_key_exchange_modes(&peer->conf, MBEDTLS_SSL_TLS1_3_KEY_EXCHANGE_MODE_PSK_EPHEMERAL);
+    if ((ret = mbedtls_ssl_conf_psk(&peer->conf, psk, sizeof(psk), (const unsigned char *)psk_identity,
+                                    sizeof(psk_identity) - 1)) != 0)
+        return ret;
+#if defined(HAVE_TICKETS)
+    if (endpoint == MBEDTLS_SSL_IS_SERVER)
+    {
+        mbedtls_ssl_conf_session_tickets_cb(&peer->conf, mbedtls_ssl_ticket_write, ticket_parse_counted, &ticket_ctx);
+        mbedtls_ssl_conf_new_session_tickets(&peer->conf, 1);
+    }
+    else
+    {
+        mbedtls_ssl_conf_session_tickets(&peer->conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+        mbedtls_ssl_conf_tls13_enable_signal_new_session_tickets(&peer->conf,
+                                                                 MBEDTLS_SSL_TLS1_3_SIGNAL_NEW_SESSION_TICKETS_ENABLED);
+    }
+#endif
+    if ((ret = mbedtls_ssl_setup(&peer->ssl, &peer->conf)) != 0)
+        return ret;
+    mbedtls_ssl_set_bio(&peer->ssl, &peer->net, mbedtls_net_send, mbedtls_net_recv, NULL);
+    return mbedtls_net_set_nonblock(&peer->net);
+}
+
+static void peer_free(peer_t *peer)
+{
+    mbedtls_ssl_free(&peer->ssl);
+    mbedtls_ssl_config_free(&peer->conf);
+    mbedtls_net_free(&peer->net);
+}
+
+/**
+ * A connected pair of loopback TCP sockets; kTLS needs TCP, not a socketpair
+ */
+static int tcp_pair(int *server_fd, int *client_fd)
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t addr_len = sizeof(addr);
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    *server_fd = *client_fd = -1;
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 1) != 0 ||
+        getsockname(listener, (struct sockaddr *)&addr, &addr_len) != 0)
+        goto out;
+    *client_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (*client_fd < 0 || connect(*client_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        goto out;
+    *server_fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+
+out:
+    if (listener >= 0)
+        close(listener);
+    return *server_fd >= 0 && *client_fd >= 0 ? 0 : -1;
+}
+
+static int handshake(peer_t *server, peer_t *client)
+{
+    int server_done = 0, client_done = 0;
+
+    for (int i = 0; i < MAX_SPINS && !(server_done && client_done); i++)
+    {
+        int ret;
+        if (!client_done && (ret = mbedtls_ssl_handshake(&client->ssl)) == 0)
+            client_done = 1;
+        else if (!client_done && ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
+            return ret;
+        if (!server_done && (ret = mbedtls_ssl_handshake(&server->ssl)) == 0)
+            server_done = 1;
+        else if (!server_done && ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
+            return ret;
+    }
+    return server_done && client_done ? 0 : -1;
+}
+
+/**
+ * Read exactly `len` bytes of application data through Mbed TLS, or through
+ * the kernel when `fd` is given
+ */
+static int read_all(mbedtls_ssl_context *ssl, int fd, unsigned char *buf, size_t len)
+{
+    size_t got = 0;
+
+    for (int i = 0; got < len && i < MAX_SPINS; i++)
+    {
+        int n = fd >= 0 ? ktls_recv(fd, buf + got, len - got) : mbedtls_ssl_read(ssl, buf + got, len - got);
+        if (n > 0)
+            got += (size_t)n;
+        else if (n == MBEDTLS_ERR_SSL_WANT_READ)
+            pause_briefly();
+        else if (n == MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET)
+        {
+#if defined(HAVE_TICKETS)
+            tickets_received++;
+#endif
+        }
+        else
+            return n == 0 ? -1 : n;
+    }
+    return got == len ? 0 : -1;
+}
+
+static int write_all(mbedtls_ssl_context *ssl, const char *text)
+{
+    size_t len = strlen(text), sent = 0;
+
+    for (int i = 0; sent < len && i < MAX_SPINS; i++)
+    {
+        int n = mbedtls_ssl_write(ssl, (const unsigned char *)text + sent, len - sent);
+        if (n > 0)
+            sent += (size_t)n;
+        else if (n != MBEDTLS_ERR_SSL_WANT_WRITE && n != MBEDTLS_ERR_SSL_WANT_READ)
+            return n;
+    }
+    return sent == len ? 0 : -1;
+}
+
+static int expect(const char *what, const unsigned char *got, const char *want)
+{
+    if (memcmp(got, want, strlen(want)) == 0)
+        return 0;
+    printf("  %s: got '%.*s', want '%s'\n", what, (int)strlen(want), (const char *)got, want);
+    return -1;
+}
+
+/**
+ * One connection with one ciphersuite. With `session` holding a ticket the
+ * client offers it and the server must accept it; either way the ticket the
+ * client is issued is left in `session` for the next connection.
+ * Returns 0 on a full round trip, 1 when this kernel does not offload the
+ * ciphersuite, -1 on failure.
+ */
+static int round_trip(const char *name, int suite, int required, mbedtls_ssl_session *session, int resume)
+{
+    int suites[2] = {suite, 0};
+    peer_t server, client;
+    ktls_secrets_t secrets = {0};
+    unsigned char buf[64];
+    int server_fd, client_fd, rx, tx, ret = -1;
+
+    if (tcp_pair(&server_fd, &client_fd) != 0)
+        perror("loopback connection");
+    // Both own their descriptor from here, even a failed one
+    peer_init(&server, server_fd);
+    peer_init(&client, client_fd);
+    if (server_fd < 0 || client_fd < 0 || peer_setup(&server, MBEDTLS_SSL_IS_SERVER, suites) != 0 ||
+        peer_setup(&client, MBEDTLS_SSL_IS_CLIENT, suites) != 0 ||
+        (resume && mbedtls_ssl_set_session(&client.ssl, session) != 0))
+    {
+        printf("%s: setup failed\n", name);
+        goto out;
+    }
+    mbedtls_ssl_set_export_keys_cb(&server.ssl, ktls_capture_secrets, &secrets);
+
+#if defined(HAVE_TICKETS)
+    ticket_accepted = 0;
+    tickets_received = 0;
+#endif
+    if ((ret = handshake(&server, &client)) != 0)
+    {
+        printf("%s: %s handshake failed (-0x%04x)\n", name, resume ? "resumed" : "full", (unsigned)-ret);
+        ret = -1;
+        goto out;
+    }
+    ret = -1;
+#if defined(HAVE_TICKETS)
+    if (resume && !ticket_accepted)
+    {
+        printf("%s: the ticket from the first connection did not resume the second\n", name);
+        goto out;
+    }
+#endif
+
+    // Straight to the kernel, as the server does: the NewSessionTicket is already out, nothing else is
+    const char *result = ktls_install(server_fd, &server.ssl, &secrets, &rx, &tx);
+    if (!(rx && tx))
+    {
+        printf("%s: kTLS %s\n", name, result);
+        ret = required || strstr(result, "module") != NULL ? -1 : 1;
+        goto out;
+    }
+
+    // Twice each way, so the kernel's sequence numbers have to keep step with Mbed TLS's
+    for (int i = 0; i < 2; i++)
+    {
+        static const char *const from_kernel[] = {"kernel to mbedtls 1", "kernel to mbedtls 2"};
+        static const char *const to_kernel[] = {"mbedtls to kernel 1", "mbedtls to kernel 2"};
+        size_t len = strlen(from_kernel[i]);
+
+        if (send(server_fd, from_kernel[i], len, 0) != (ssize_t)len ||
+            read_all(&client.ssl, -1, buf, len) != 0 || expect("server to client, kTLS", buf, from_kernel[i]) != 0)
+        {
+            printf("%s: kTLS transmit failed\n", name);
+            goto out;
+        }
+        if (write_all(&client.ssl, to_kernel[i]) != 0 || read_all(NULL, server_fd, buf, strlen(to_kernel[i])) != 0 ||
+            expect("client to server, kTLS", buf, to_kernel[i]) != 0)
+        {
+            printf("%s: kTLS receive failed\n", name);
+            goto out;
+        }
+    }
+
+    ktls_close_notify(server_fd);
+    int n = MBEDTLS_ERR_SSL_WANT_READ;
+    for (int i = 0; i < MAX_SPINS && n == MBEDTLS_ERR_SSL_WANT_READ; i++)
+    {
+        n = mbedtls_ssl_read(&client.ssl, buf, sizeof(buf));
+        if (n == MBEDTLS_ERR_SSL_WANT_READ)
+            pause_briefly();
+    }
+    if (n != MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY)
+    {
+        printf("%s: close_notify through kTLS not received (%d)\n", name, n);
+        goto out;
+    }
+
+#if defined(HAVE_TICKETS)
+    // The ticket went out through Mbed TLS before the kernel took over; the client must have it
+    mbedtls_ssl_session_free(session);
+    mbedtls_ssl_session_init(session);
+    if (tickets_received == 0 || mbedtls_ssl_get_session(&client.ssl, session) != 0)
+    {
+        printf("%s: the client got no usable session ticket\n", name);
+        goto out;
+    }
+#endif
+
+    printf("%s: %s handshake, kTLS tx+rx round trip ok\n", name, resume ? "resumed" : "full");
+    ret = 0;
+
+out:
+    peer_free(&server);
+    peer_free(&client);
+    return ret;
+}
+
+/**
+ * A full handshake, then one resumed with the ticket it issued
+ */
+static int suite_test(const char *name, int suite, int required)
+{
+    mbedtls_ssl_session session;
+
+    mbedtls_ssl_session_init(&session);
+    int ret = round_trip(name, suite, required, &session, 0);
+#if defined(HAVE_TICKETS)
+    if (ret == 0)
+        ret = round_trip(name, suite, required, &session, 1);
+#endif
+    mbedtls_ssl_session_free(&session);
+    return ret;
+}
+
+int main(void)
+{
+    int failures = 0;
+
+    for (size_t i = 0; i < sizeof(psk); i++)
+        psk[i] = (unsigned char)(i * 7 + 1);
+    if (psa_crypto_init() != PSA_SUCCESS)
+    {
+        printf("ktls_test: PSA crypto init failed\n");
+        return 1;
+    }
+#if defined(HAVE_TICKETS)
+    mbedtls_ssl_ticket_init(&ticket_ctx);
+    if (mbedtls_ssl_ticket_setup(&ticket_ctx, PSA_ALG_GCM, PSA_KEY_TYPE_AES, 256, 3600) != 0)
+    {
+        printf("ktls_test: session ticket setup failed\n");
+        return 1;
+    }
+#else
+    printf("ktls_test: session tickets not compiled into Mbed TLS; no resumption checked\n");
+#endif
+
+    // AES-128-GCM in both directions has been in every kernel with TLS_RX (4.17); the others may be missing
+    failures += suite_test("TLS1-3-AES-128-GCM-SHA256", MBEDTLS_TLS1_3_AES_128_GCM_SHA256, 1) < 0;
+    failures += suite_test("TLS1-3-AES-256-GCM-SHA384", MBEDTLS_TLS1_3_AES_256_GCM_SHA384, 0) < 0;
+    failures += suite_test("TLS1-3-CHACHA20-POLY1305-SHA256", MBEDTLS_TLS1_3_CHACHA20_POLY1305_SHA256, 0) < 0;
+
+#if defined(HAVE_TICKETS)
+    mbedtls_ssl_ticket_free(&ticket_ctx);
+#endif
+    mbedtls_psa_crypto_free();
+    if (failures)
+    {
+        printf("ktls_test: %d failed; kTLS stays out of the server\n", failures);
+        return 1;
+    }
+    printf("ktls_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,220 @@
+/**
+ * Tests for response_cache.h: LRU eviction within one shard's budget,
+ * replacing an entry under the same key, removing an entry that was already
+ * replaced or evicted, and references that outlive the cache's own
+ *
+ *   make -C TLS test
+ *
+ * Built with AddressSanitizer, so an entry freed too early or never freed
+ * fails the run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../response_cache.h"
+
+static int failures;
+
+#define CHECK(cond)                                                                                               \
+    do                                                                                                            \
+    {                                                                                                             \
+        if (!(cond))                                                                                              \
+        {                                                                                                         \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);                                       \
+            failures++;                                                                                           \
+        }                                                                                                         \
+    } while (0)
+
+#define BODY_LEN 1000
+
+static char keys[8][16]; // keys[0..5] share a shard, keys[6..7] land on others
+
+/**
+ * Pick keys by where they hash to, since the shard is what eviction works on
+ */
+static void pick_keys(void)
+{
+    int same = 0, other = 6;
+    cache_shard_t *first = NULL;
+    response_cache_t *probe = response_cache_create(0);
+
+    for (int i = 0; same < 6 || other < 8; i++)
+    {
+        char key[16];
+        snprintf(key, sizeof(key), "/f%04d", i); // one length, so one charge
+        cache_shard_t *shard = cache_shard(probe, cache_hash(key, strlen(key)));
+        if (first == NULL)
+            first = shard;
+        if (shard == first && same < 6)
+            memcpy(keys[same++], key, sizeof(key));
+        else if (shard != first && other < 8)
+            memcpy(keys[other++], key, sizeof(key));
+    }
+    response_cache_destroy(probe);
+}
+
+/**
+ * An entry whose body is `BODY_LEN` copies of `fill`
+ */
+static cache_entry_t *entry(const char *key, int fill)
+{
+    cache_entry_t *e = cache_entry_create(key, strlen(key), "\"tag\"", "HTTP/1.1 200 OK\r\n",
+                                          "HTTP/1.1 304 Not Modified\r\n", BODY_LEN);
+    if (e == NULL)
+    {
+        printf("response_cache_test: out of memory\n");
+        exit(1);
+    }
+    memset(e->body, fill, BODY_LEN);
+    return e;
+}
+
+static int body_is(const cache_entry_t *e, int fill)
+{
+    for (size_t i = 0; i < e->body_len; i++)
+        if (e->body[i] != (unsigned char)fill)
+            return 0;
+    return e->body_len == BODY_LEN;
+}
+
+/**
+ * Whether `key` is cached, with a body of `fill`; -1 fill only checks presence
+ */
+static int cached(response_cache_t *cache, const char *key, int fill)
+{
+    cache_entry_t *e = response_cache_lookup(cache, key, strlen(key));
+    int ok = e != NULL && (fill < 0 || body_is(e, fill));
+    cache_entry_release(e);
+    return ok;
+}
+
+/**
+ * Insert and drop the caller's reference, as a filler that is done with it would
+ */
+static int insert(response_cache_t *cache, const char *key, int fill)
+{
+    cache_entry_t *e = entry(key, fill);
+    int ret = response_cache_insert(cache, e);
+    cache_entry_release(e);
+    return ret;
+}
+
+static size_t charge(void)
+{
+    cache_entry_t *e = entry(keys[0], 0);
+    size_t size = e->charge;
+    cache_entry_release(e);
+    return size;
+}
+
+static void test_eviction(void)
+{
+    // Room for three entries per shard
+    response_cache_t *cache = response_cache_create(CACHE_SHARDS * (3 * charge() + charge() / 2));
+
+    CHECK(insert(cache, keys[0], 'a') == 0);
+    CHECK(insert(cache, keys[1], 'b') == 0);
+    CHECK(insert(cache, keys[2], 'c') == 0);
+    CHECK(insert(cache, keys[6], 'x') == 0);
+    CHECK(atomic_load(&cache->entries) == 4 && atomic_load(&cache->evictions) == 0);
+
+    // keys[0] is used again, so keys[1] is now the coldest in that shard
+    CHECK(cached(cache, keys[0], 'a'));
+    CHECK(insert(cache, keys[3], 'd') == 0);
+    CHECK(atomic_load(&cache->evictions) == 1);
+    CHECK(!cached(cache, keys[1], -1));
+    CHECK(cached(cache, keys[0], 'a') && cached(cache, keys[2], 'c') && cached(cache, keys[3], 'd'));
+
+    // Another shard's entry is never evicted for this one's sake
+    CHECK(insert(cache, keys[4], 'e') == 0);
+    CHECK(insert(cache, keys[5], 'f') == 0);
+    CHECK(atomic_load(&cache->evictions) == 3);
+    CHECK(cached(cache, keys[6], 'x'));
+    CHECK(!cached(cache, keys[2], -1) && !cached(cache, keys[0], -1));
+    CHECK(atomic_load(&cache->entries) == 4);
+    CHECK(atomic_load(&cache->bytes) == 4 * charge());
+
+    // Larger than a shard's budget: not stored, and nothing is evicted for it
+    cache_entry_t *big = cache_entry_create(keys[7], strlen(keys[7]), "\"big\"", "", "", 4 * charge());
+    CHECK(big != NULL && response_cache_insert(cache, big) == -1);
+    cache_entry_release(big);
+    CHECK(!cached(cache, keys[7], -1) && atomic_load(&cache->entries) == 4);
+
+    response_cache_destroy(cache);
+}
+
+static void test_replace_and_remove(void)
+{
+    response_cache_t *cache = response_cache_create(CACHE_SHARDS * 8 * charge());
+
+    // The filler keeps its reference to the first entry across its replacement
+    cache_entry_t *first = entry(keys[0], '1');
+    CHECK(response_cache_insert(cache, first) == 0 && first->linked);
+    cache_entry_t *second = entry(keys[0], '2');
+    CHECK(response_cache_insert(cache, second) == 0);
+    CHECK(!first->linked && second->linked);
+    CHECK(cached(cache, keys[0], '2'));
+    CHECK(atomic_load(&cache->entries) == 1 && atomic_load(&cache->bytes) == second->charge);
+    CHECK(body_is(first, '1'));
+
+    // Removing the replaced entry, as a stale lookup would, leaves its replacement alone
+    response_cache_remove(cache, first);
+    CHECK(cached(cache, keys[0], '2') && atomic_load(&cache->entries) == 1);
+    cache_entry_release(first);
+
+    // Removing the live one drops it, and a second remove is harmless
+    response_cache_remove(cache, second);
+    CHECK(!cached(cache, keys[0], -1) && atomic_load(&cache->entries) == 0 && atomic_load(&cache->bytes) == 0);
+    response_cache_remove(cache, second);
+    CHECK(body_is(second, '2'));
+    cache_entry_release(second);
+
+    // Replacing one key never touches another in the same bucket chain or shard
+    CHECK(insert(cache, keys[1], 'b') == 0 && insert(cache, keys[2], 'c') == 0 && insert(cache, keys[1], 'B') == 0);
+    CHECK(cached(cache, keys[1], 'B') && cached(cache, keys[2], 'c') && atomic_load(&cache->entries) == 2);
+
+    response_cache_destroy(cache);
+}
+
+static void test_references(void)
+{
+    response_cache_t *cache = response_cache_create(CACHE_SHARDS * (2 * charge() + charge() / 2));
+
+    // A lookup's reference outlives the entry's eviction
+    CHECK(insert(cache, keys[0], 'a') == 0);
+    cache_entry_t *held = response_cache_lookup(cache, keys[0], strlen(keys[0]));
+    CHECK(held != NULL);
+    CHECK(insert(cache, keys[1], 'b') == 0 && insert(cache, keys[2], 'c') == 0);
+    CHECK(!cached(cache, keys[0], -1) && held != NULL && !held->linked);
+    CHECK(held != NULL && body_is(held, 'a') && atomic_load(&held->refs) == 1);
+
+    // Removing an already evicted entry is a no-op, not a second release
+    if (held != NULL)
+        response_cache_remove(cache, held);
+    CHECK(held != NULL && atomic_load(&held->refs) == 1);
+
+    // ... and the cache itself: entries still referenced survive destroy
+    cache_entry_t *live = response_cache_lookup(cache, keys[2], strlen(keys[2]));
+    CHECK(live != NULL);
+    response_cache_destroy(cache);
+    CHECK(live != NULL && body_is(live, 'c'));
+    cache_entry_release(live);
+    cache_entry_release(held);
+}
+
+int main(void)
+{
+    pick_keys();
+    test_eviction();
+    test_replace_and_remove();
+    test_references();
+    if (failures)
+    {
+        printf("response_cache_test: %d failed\n", failures);
+        return 1;
+    }
+    printf("response_cache_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,68 @@
+#!/bin/sh
+# Smoke test against a real build: start the server in a scratch directory
+# (it generates its certificate there), then check with bench_client that
+# full and resumed handshakes and requests complete, and with curl, when
+# installed, that a page is served and nothing outside the docroot is.
+#
+#   make -C TLS smoke
+#   tests/smoke.sh SERVER BENCH_CLIENT
+
+set -eu
+
+server=$(realpath "$1")
+bench_client=$(realpath "$2")
+dir=$(mktemp -d)
+pid=
+
+cleanup()
+{
+    if [ -n "$pid" ]; then
+        kill "$pid" 2>/dev/null || true
+    fi
+    rm -rf "$dir"
+}
+trap cleanup EXIT
+
+fail()
+{
+    echo "smoke: $*"
+    echo "--- server output:"
+    cat "$dir/server.log"
+    exit 1
+}
+
+cd "$dir"
+mkdir -p docroot/a
+echo smoke >docroot/index.html
+"$server" --docroot docroot --log-level debug >server.log 2>&1 &
+pid=$!
+
+# The banner comes once the listener is up
+i=0
+until grep -q "Server listening" server.log; do
+    kill -0 "$pid" 2>/dev/null || fail "server exited during startup"
+    i=$((i + 1))
+    [ "$i" -le 100 ] || fail "server did not start within 10 s"
+    sleep 0.1
+done
+
+"$bench_client" --cacert server_cert.pem -c 4 -d 1 -r 2 -C TLS1-3-AES-128-GCM-SHA256 -g secp256r1 -m both ||
+    fail "bench_client completed no handshakes or requests"
+"$bench_client" --cacert server_cert.pem -c 2 -d 1 -r 0 -C TLS1-3-CHACHA20-POLY1305-SHA256 -g secp256r1 -m full ||
+    fail "bench_client completed no ChaCha20-Poly1305 handshakes"
+
+if command -v curl >/dev/null; then
+    body=$(curl -sf --cacert server_cert.pem https://localhost:8443/) || fail "curl could not fetch /"
+    [ "$body" = smoke ] || fail "/ returned '$body'"
+    for path in //etc/passwd /a/../../etc/passwd; do
+        code=$(curl -s -o /dev/null -w '%{http_code}' --path-as-is --cacert server_cert.pem "https://localhost:8443$path")
+        [ "$code" != 200 ] || fail "$path was served"
+    done
+fi
+
+kill -TERM "$pid"
+status=0
+wait "$pid" || status=$?
+pid=
+[ "$status" -eq 0 ] || fail "server exited with status $status"
+echo "smoke: ok"
@@ -0,0 +1,136 @@
+/**
+ * Tests for static_path.h: request paths that would name a file outside the
+ * document root, and symbolic links that would lead out of it, with and
+ * without openat2()
+ *
+ *   make -C TLS test
+ */
+
+#define _GNU_SOURCE // O_PATH
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../static_path.h"
+
+static int failures;
+
+#define CHECK(cond)                                                                                               \
+    do                                                                                                            \
+    {                                                                                                             \
+        if (!(cond))                                                                                              \
+        {                                                                                                         \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);                                       \
+            failures++;                                                                                           \
+        }                                                                                                         \
+    } while (0)
+
+static char rel[256];
+
+static int resolve(const char *path)
+{
+    return static_path_resolve(path, strlen(path), rel, sizeof(rel));
+}
+
+static void test_resolve(void)
+{
+    // Absolute after the leading '/', or climbing out with a ".." segment
+    CHECK(resolve("//etc/passwd") == -1);
+    CHECK(resolve("/a/../../x") == -1);
+    CHECK(resolve("/..") == -1);
+    CHECK(resolve("/../x") == -1);
+    CHECK(resolve("/a/..") == -1);
+    CHECK(resolve("/a//b") == -1);
+    CHECK(resolve("/./x") == -1);
+    CHECK(resolve("/a/./") == -1);
+    CHECK(resolve("etc/passwd") == -1);
+    CHECK(resolve("") == -1);
+    CHECK(static_path_resolve("/a\0b", 4, rel, sizeof(rel)) == -1);
+
+    // ".." is only special as a whole segment
+    CHECK(resolve("/a/..b") == 0 && strcmp(rel, "a/..b") == 0);
+    CHECK(resolve("/x..") == 0 && strcmp(rel, "x..") == 0);
+    CHECK(resolve("/.well-known/x") == 0 && strcmp(rel, ".well-known/x") == 0);
+
+    // Directories get index.html; the query is dropped before any check
+    CHECK(resolve("/") == 0 && strcmp(rel, "index.html") == 0);
+    CHECK(resolve("/a/") == 0 && strcmp(rel, "a/index.html") == 0);
+    CHECK(resolve("/a/b.txt?x=/../..") == 0 && strcmp(rel, "a/b.txt") == 0);
+    CHECK(resolve("/?q") == 0 && strcmp(rel, "index.html") == 0);
+}
+
+/**
+ * Both ways of opening beneath the root must agree: openat2() when the
+ * kernel has it, and the component walk
+ */
+static int opens(int (*open_fn)(int, const char *, int), int root, const char *name)
+{
+    int fd = open_fn(root, name, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    close(fd);
+    return 1;
+}
+
+static void test_open(int root, int (*open_fn)(int, const char *, int))
+{
+    CHECK(opens(open_fn, root, "ok.txt"));
+    CHECK(opens(open_fn, root, "a/b.txt"));
+
+    CHECK(!opens(open_fn, root, "/etc/passwd"));
+    CHECK(!opens(open_fn, root, "../ok.txt"));
+    CHECK(!opens(open_fn, root, "a/../../ok.txt"));
+    CHECK(!opens(open_fn, root, "passwd"));        // symlink to /etc/passwd
+    CHECK(!opens(open_fn, root, "up/root/ok.txt")); // symlink to .. on the way
+    CHECK(!opens(open_fn, root, "inner"));         // even a link that stays inside
+    CHECK(!opens(open_fn, root, "a/missing"));
+}
+
+int main(void)
+{
+    char dir[] = "/tmp/static_path_test.XXXXXX";
+    char path[sizeof(dir) + 32];
+    struct stat st;
+
+    if (mkdtemp(dir) == NULL)
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    // dir/root is the document root; dir/root/up points at dir
+    snprintf(path, sizeof(path), "%s/root", dir);
+    mkdir(path, 0755);
+    int root = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    mkdirat(root, "a", 0755);
+    close(openat(root, "ok.txt", O_WRONLY | O_CREAT, 0644));
+    close(openat(root, "a/b.txt", O_WRONLY | O_CREAT, 0644));
+    symlinkat("/etc/passwd", root, "passwd");
+    symlinkat("..", root, "up");
+    symlinkat("ok.txt", root, "inner");
+
+    test_resolve();
+    test_open(root, open_beneath);
+    test_open(root, open_beneath_walk);
+    CHECK(stat_beneath(root, "a/b.txt", &st) == 0 && S_ISREG(st.st_mode));
+    CHECK(stat_beneath(root, "passwd", &st) == 0 && S_ISLNK(st.st_mode));
+    CHECK(stat_beneath(root, "up/root/ok.txt", &st) == -1);
+
+    unlinkat(root, "inner", 0);
+    unlinkat(root, "up", 0);
+    unlinkat(root, "passwd", 0);
+    unlinkat(root, "a/b.txt", 0);
+    unlinkat(root, "ok.txt", 0);
+    unlinkat(root, "a", AT_REMOVEDIR);
+    close(root);
+    rmdir(path);
+    rmdir(dir);
+
+    if (failures)
+    {
+        printf("static_path_test: %d failed\n", failures);
+        return 1;
+    }
+    printf("static_path_test: ok\n");
+    return 0;
+}
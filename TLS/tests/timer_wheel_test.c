@@ -0,0 +1,273 @@
+/**
+ * Tests for timer_wheel.h: deadlines on either side of each cascade
+ * boundary, overdue and out-of-range deadlines, callbacks that re-arm or
+ * cancel, and how long wheel_timeout() lets the owner sleep
+ *
+ *   make -C TLS test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../timer_wheel.h"
+
+static int failures;
+
+#define CHECK(cond)                                                                                               \
+    do                                                                                                            \
+    {                                                                                                             \
+        if (!(cond))                                                                                              \
+        {                                                                                                         \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);                                       \
+            failures++;                                                                                           \
+        }                                                                                                         \
+    } while (0)
+
+#define WHEEL_RANGE (1ull << (WHEEL_BITS * WHEEL_LEVELS)) // ticks the wheel can look ahead
+
+typedef struct test_timer
+{
+    wheel_timer_t timer; // first, so the callback can cast back
+    int fired;
+    uint64_t fired_tick;
+    int rearms;                 // re-arm from the callback this many more times
+    uint64_t rearm_after_ms;    // ... this far past the tick that fired
+    struct test_timer *cancels; // cancel this one from the callback
+} test_timer_t;
+
+static void on_expired(wheel_timer_t *timer, void *arg)
+{
+    timer_wheel_t *tw = arg;
+    test_timer_t *t = (test_timer_t *)timer;
+
+    t->fired++;
+    t->fired_tick = tw->now - 1; // now already points past the tick being run
+    if (t->cancels)
+        wheel_cancel(tw, &t->cancels->timer);
+    if (t->rearms > 0)
+    {
+        t->rearms--;
+        wheel_arm(tw, timer, wheel_expires_ms(tw, timer) + t->rearm_after_ms);
+    }
+}
+
+static void test_timer_init(test_timer_t *t)
+{
+    *t = (test_timer_t){0};
+    wheel_timer_init(&t->timer);
+}
+
+/**
+ * Arm one timer `ticks` ahead of a wheel whose clock starts at `start`, and
+ * check it fires on exactly that tick and not one before
+ */
+static void check_fires_at(uint64_t start, uint64_t ticks)
+{
+    timer_wheel_t tw;
+    test_timer_t t;
+
+    wheel_init(&tw, 0, 1);
+    wheel_advance(&tw, start, on_expired, &tw); // empty, so it just moves the clock
+    test_timer_init(&t);
+    wheel_arm(&tw, &t.timer, start + 1 + ticks);
+
+    wheel_advance(&tw, start + ticks, on_expired, &tw);
+    if (t.fired != 0)
+        printf("  start %llu, %llu ticks ahead: fired early at %llu\n", (unsigned long long)start,
+               (unsigned long long)ticks, (unsigned long long)t.fired_tick);
+    CHECK(t.fired == 0 && wheel_armed(&t.timer));
+    wheel_advance(&tw, start + 1 + ticks, on_expired, &tw);
+    if (t.fired != 1 || t.fired_tick != start + 1 + ticks)
+        printf("  start %llu, %llu ticks ahead: fired %d times, at %llu\n", (unsigned long long)start,
+               (unsigned long long)ticks, t.fired, (unsigned long long)t.fired_tick);
+    CHECK(t.fired == 1 && t.fired_tick == start + 1 + ticks);
+    CHECK(!wheel_armed(&t.timer) && tw.count == 0);
+}
+
+static void test_cascade_boundaries(void)
+{
+    // Deadlines just inside, on and past the span of each level (64, 64^2, 64^3 ticks)
+    static const uint64_t spans[] = {64, 64 * 64, 64 * 64 * 64};
+
+    check_fires_at(0, 0);
+    check_fires_at(0, 1);
+    for (size_t i = 0; i < sizeof(spans) / sizeof(spans[0]); i++)
+    {
+        check_fires_at(0, spans[i] - 2);
+        check_fires_at(0, spans[i] - 1);
+        check_fires_at(0, spans[i]);
+        check_fires_at(0, spans[i] + 1);
+    }
+    check_fires_at(0, WHEEL_RANGE - 2);
+
+    // From a clock that is not at a slot boundary, so the higher levels are part way through a round
+    check_fires_at(4000, 95);
+    check_fires_at(4000, 96);
+    check_fires_at(4095, 1);
+    check_fires_at(262100, 64 * 64 + 50);
+    check_fires_at(1000003, 64 * 64 * 64 + 7);
+
+    // Many timers, one per tick across two level 1 rounds, all fire in order
+    timer_wheel_t tw;
+    static test_timer_t timers[64 * 64 * 2];
+    int in_order = 1;
+
+    wheel_init(&tw, 0, 1);
+    for (size_t i = 0; i < sizeof(timers) / sizeof(timers[0]); i++)
+    {
+        test_timer_init(&timers[i]);
+        wheel_arm(&tw, &timers[i].timer, i);
+    }
+    CHECK(tw.count == sizeof(timers) / sizeof(timers[0]));
+    wheel_advance(&tw, sizeof(timers) / sizeof(timers[0]), on_expired, &tw);
+    for (size_t i = 0; i < sizeof(timers) / sizeof(timers[0]); i++)
+        in_order &= timers[i].fired == 1 && timers[i].fired_tick == i;
+    CHECK(in_order && tw.count == 0);
+}
+
+static void test_deadlines(void)
+{
+    timer_wheel_t tw;
+    test_timer_t t;
+
+    // A deadline between ticks rounds up to the next one
+    wheel_init(&tw, 1000, 10);
+    test_timer_init(&t);
+    wheel_arm(&tw, &t.timer, 1025);
+    CHECK(wheel_expires_ms(&tw, &t.timer) == 1030);
+    wheel_advance(&tw, 1029, on_expired, &tw);
+    CHECK(t.fired == 0);
+    wheel_advance(&tw, 1030, on_expired, &tw);
+    CHECK(t.fired == 1 && t.fired_tick == 3);
+
+    // Overdue, including before the wheel's origin: runs on the next tick
+    wheel_advance(&tw, 2000, on_expired, &tw);
+    test_timer_init(&t);
+    wheel_arm(&tw, &t.timer, 1500);
+    CHECK(t.timer.expires == tw.now);
+    wheel_arm(&tw, &t.timer, 0);
+    CHECK(t.timer.expires == tw.now && tw.count == 1);
+    wheel_advance(&tw, 2010, on_expired, &tw);
+    CHECK(t.fired == 1 && t.fired_tick == 101);
+
+    // Clamped to the end of the range, then fires there and not before
+    wheel_init(&tw, 0, 1);
+    test_timer_init(&t);
+    wheel_arm(&tw, &t.timer, WHEEL_RANGE * 10);
+    CHECK(wheel_expires_ms(&tw, &t.timer) == WHEEL_RANGE - 1);
+    wheel_advance(&tw, WHEEL_RANGE - 2, on_expired, &tw);
+    CHECK(t.fired == 0 && wheel_armed(&t.timer));
+    wheel_advance(&tw, WHEEL_RANGE - 1, on_expired, &tw);
+    CHECK(t.fired == 1 && t.fired_tick == WHEEL_RANGE - 1);
+
+    // Moving an armed timer, and cancelling it twice
+    wheel_init(&tw, 0, 1);
+    test_timer_init(&t);
+    wheel_arm(&tw, &t.timer, 5000);
+    wheel_arm(&tw, &t.timer, 20);
+    CHECK(tw.count == 1);
+    wheel_advance(&tw, 20, on_expired, &tw);
+    CHECK(t.fired == 1 && t.fired_tick == 20);
+    wheel_arm(&tw, &t.timer, 30);
+    wheel_cancel(&tw, &t.timer);
+    wheel_cancel(&tw, &t.timer);
+    CHECK(tw.count == 0);
+    wheel_advance(&tw, 5000, on_expired, &tw);
+    CHECK(t.fired == 1);
+}
+
+static void test_callbacks(void)
+{
+    timer_wheel_t tw;
+    test_timer_t t, a, b;
+
+    // Re-armed from its own callback, several times within one advance
+    wheel_init(&tw, 0, 1);
+    test_timer_init(&t);
+    t.rearms = 3;
+    t.rearm_after_ms = 70; // crosses into level 1 each time
+    wheel_arm(&tw, &t.timer, 5);
+    wheel_advance(&tw, 1000, on_expired, &tw);
+    CHECK(t.fired == 4 && t.fired_tick == 5 + 3 * 70 && tw.count == 0);
+
+    // Re-armed for the tick that is running: lands on the next one instead of looping
+    wheel_init(&tw, 0, 1);
+    test_timer_init(&t);
+    t.rearms = 2;
+    wheel_arm(&tw, &t.timer, 5);
+    wheel_advance(&tw, 5, on_expired, &tw);
+    CHECK(t.fired == 1 && wheel_armed(&t.timer));
+    wheel_advance(&tw, 10, on_expired, &tw);
+    CHECK(t.fired == 3 && t.fired_tick == 7 && tw.count == 0);
+
+    // Two timers on one tick: whichever runs first cancels the other
+    wheel_init(&tw, 0, 1);
+    test_timer_init(&a);
+    test_timer_init(&b);
+    a.cancels = &b;
+    b.cancels = &a;
+    wheel_arm(&tw, &a.timer, 9);
+    wheel_arm(&tw, &b.timer, 9);
+    wheel_advance(&tw, 9, on_expired, &tw);
+    CHECK(a.fired + b.fired == 1 && tw.count == 0);
+    CHECK(!wheel_armed(&a.timer) && !wheel_armed(&b.timer));
+}
+
+static void test_timeout(void)
+{
+    timer_wheel_t tw;
+    test_timer_t t;
+
+    wheel_init(&tw, 1000, 10);
+    CHECK(wheel_timeout(&tw, 1000, 500) == 500);
+
+    test_timer_init(&t);
+    wheel_arm(&tw, &t.timer, 1035);
+    CHECK(wheel_timeout(&tw, 1000, 500) == 40);
+    CHECK(wheel_timeout(&tw, 1000, 25) == 25);
+    CHECK(wheel_timeout(&tw, 1040, 500) == 0);
+    CHECK(wheel_timeout(&tw, 1100, 500) == 0);
+
+    // Past the current level 0 round: wake at its end, where the next cascade is due, even when
+    // the clock already stands on that tick and the cascade has yet to run
+    wheel_init(&tw, 0, 1);
+    test_timer_init(&t);
+    wheel_arm(&tw, &t.timer, 100);
+    CHECK(wheel_timeout(&tw, 0, 1000) == 64);
+    wheel_advance(&tw, 59, on_expired, &tw);
+    CHECK(wheel_timeout(&tw, 59, 1000) == 5);
+    wheel_advance(&tw, 63, on_expired, &tw);
+    CHECK(wheel_timeout(&tw, 63, 1000) == 1);
+    wheel_advance(&tw, 64, on_expired, &tw);
+    CHECK(wheel_timeout(&tw, 64, 1000) == 36);
+
+    // Sleeping for as long as it says, round after round, still fires on time
+    wheel_init(&tw, 0, 1);
+    test_timer_init(&t);
+    wheel_arm(&tw, &t.timer, 64 * 64 + 300);
+    uint64_t now_ms = 0;
+    int wakeups = 0;
+    while (t.fired == 0 && wakeups < 1000)
+    {
+        now_ms += (uint64_t)wheel_timeout(&tw, now_ms, 100000);
+        wheel_advance(&tw, now_ms, on_expired, &tw);
+        wakeups++;
+    }
+    CHECK(t.fired == 1 && t.fired_tick == 64 * 64 + 300 && now_ms == 64 * 64 + 300);
+    CHECK(wakeups <= (64 * 64 + 300) / 64 + 4);
+}
+
+int main(void)
+{
+    test_cascade_boundaries();
+    test_deadlines();
+    test_callbacks();
+    test_timeout();
+    if (failures)
+    {
+        printf("timer_wheel_test: %d failed\n", failures);
+        return 1;
+    }
+    printf("timer_wheel_test: ok\n");
+    return 0;
+}
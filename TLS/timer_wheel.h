@@ -0,0 +1,209 @@
+/**
+ * Hierarchical timer wheel
+ *
+ * Timers are intrusive list nodes, so arming and cancelling one is O(1).
+ * Level 0 has a slot per tick; each level above covers 64 times the span of
+ * the one below, and its slots are redistributed downwards (cascaded) as time
+ * reaches them. Four levels of 64 slots cover 2^24 ticks; later deadlines are
+ * clamped to the end of that range.
+ *
+ * Not thread-safe: each event loop owns its wheel.
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1u << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+
+typedef struct wheel_timer
+{
+    struct wheel_timer *next;
+    struct wheel_timer **pprev; // NULL while not armed
+    uint64_t expires;           // tick
+} wheel_timer_t;
+
+typedef struct
+{
+    uint64_t origin_ms;
+    unsigned tick_ms;
+    uint64_t now; // next tick to run; every earlier one has been
+    size_t count; // armed timers
+    wheel_timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} timer_wheel_t;
+
+typedef void (*wheel_expired_fn)(wheel_timer_t *timer, void *arg);
+
+static void wheel_init(timer_wheel_t *tw, uint64_t now_ms, unsigned tick_ms)
+{
+    *tw = (timer_wheel_t){.origin_ms = now_ms, .tick_ms = tick_ms};
+}
+
+static void wheel_timer_init(wheel_timer_t *t)
+{
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+static int wheel_armed(const wheel_timer_t *t)
+{
+    return t->pprev != NULL;
+}
+
+/**
+ * When an armed timer will fire, rounded up to its tick
+ */
+static uint64_t wheel_expires_ms(const timer_wheel_t *tw, const wheel_timer_t *t)
+{
+    return tw->origin_ms + t->expires * tw->tick_ms;
+}
+
+static void wheel_link(wheel_timer_t **head, wheel_timer_t *t)
+{
+    t->next = *head;
+    if (t->next)
+        t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+}
+
+/**
+ * File a timer by how far away it is: level n holds those due within
+ * 64^(n+1) ticks, in the slot its expiry maps to at that level
+ */
+static void wheel_place(timer_wheel_t *tw, wheel_timer_t *t)
+{
+    uint64_t delta = t->expires - tw->now;
+    int level = 0;
+
+    if (t->expires < tw->now)
+    {
+        t->expires = tw->now; // overdue: runs on the next tick
+        delta = 0;
+    }
+    if (delta >= (1ull << (WHEEL_BITS * WHEEL_LEVELS)))
+    {
+        t->expires = tw->now + (1ull << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+        delta = t->expires - tw->now;
+    }
+    while (delta >= (1ull << (WHEEL_BITS * (level + 1))))
+        level++;
+    wheel_link(&tw->slots[level][(t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK], t);
+}
+
+static void wheel_cancel(timer_wheel_t *tw, wheel_timer_t *t)
+{
+    if (t->pprev == NULL)
+        return;
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+    tw->count--;
+}
+
+/**
+ * Arm (or move) a timer to fire at the first tick at or after `deadline_ms`
+ */
+static void wheel_arm(timer_wheel_t *tw, wheel_timer_t *t, uint64_t deadline_ms)
+{
+    wheel_cancel(tw, t);
+    t->expires = deadline_ms > tw->origin_ms ? (deadline_ms - tw->origin_ms + tw->tick_ms - 1) / tw->tick_ms : 0;
+    wheel_place(tw, t);
+    tw->count++;
+}
+
+/**
+ * Re-file every timer of one higher-level slot; they all land below it
+ */
+static void wheel_cascade(timer_wheel_t *tw, int level)
+{
+    wheel_timer_t **slot = &tw->slots[level][(tw->now >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    wheel_timer_t *t = *slot;
+
+    *slot = NULL;
+    while (t)
+    {
+        wheel_timer_t *next = t->next;
+        wheel_place(tw, t);
+        t = next;
+    }
+}
+
+/**
+ * Run every tick up to `now_ms`, calling `expired` once per timer that came
+ * due. The timer is disarmed first, so the callback may re-arm it or cancel
+ * any other timer.
+ */
+static void wheel_advance(timer_wheel_t *tw, uint64_t now_ms, wheel_expired_fn expired, void *arg)
+{
+    if (now_ms < tw->origin_ms)
+        return;
+    uint64_t target = (now_ms - tw->origin_ms) / tw->tick_ms;
+
+    if (tw->count == 0)
+    {
+        if (tw->now <= target)
+            tw->now = target + 1; // nothing to cascade, so skip the idle ticks outright
+        return;
+    }
+
+    while (tw->now <= target)
+    {
+        for (int level = 1; level < WHEEL_LEVELS && ((tw->now >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK) == 0;
+             level++)
+            wheel_cascade(tw, level);
+
+        // Detach the slot and move on first, so timers re-armed from a callback land on a later tick
+        wheel_timer_t *due = tw->slots[0][tw->now & WHEEL_MASK];
+        tw->slots[0][tw->now & WHEEL_MASK] = NULL;
+        tw->now++;
+        if (due)
+            due->pprev = &due;
+        while (due)
+        {
+            wheel_timer_t *t = due;
+            wheel_cancel(tw, t);
+            expired(t, arg);
+        }
+    }
+}
+
+/**
+ * Milliseconds the owner can sleep before the wheel needs to advance, at
+ * most `max_ms`. Looks no further than the end of the current level 0 round,
+ * where the next cascade is due; when that cascade is the next tick and has
+ * timers to bring down, level 0 does not hold them yet, so that tick is it.
+ */
+static int wheel_timeout(const timer_wheel_t *tw, uint64_t now_ms, int max_ms)
+{
+    if (tw->count == 0)
+        return max_ms;
+
+    uint64_t tick = tw->now;
+    int cascading = 0;
+    for (int level = 1; level < WHEEL_LEVELS && ((tick >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK) == 0; level++)
+        cascading |= tw->slots[level][(tick >> (WHEEL_BITS * level)) & WHEEL_MASK] != NULL;
+    if (!cascading)
+    {
+        do
+        {
+            if (tw->slots[0][tick & WHEEL_MASK])
+                break;
+            tick++;
+        } while (tick & WHEEL_MASK);
+    }
+
+    uint64_t at = tw->origin_ms + tick * tw->tick_ms;
+    if (at <= now_ms)
+        return 0;
+    return at - now_ms < (uint64_t)max_ms ? (int)(at - now_ms) : max_ms;
+}
+
+#endif /* TIMER_WHEEL_H */
@@ -0,0 +1,384 @@
+/**
+ * Minimal io_uring wrapper over the raw system calls
+ *
+ * Just what the server's io_uring backend needs: one ring per worker thread,
+ * submissions batched until the next wait, and a provided-buffer ring that
+ * multishot receives pick their buffers from. No liburing dependency; needs
+ * Linux 6.0 or later for multishot recv.
+ *
+ * Rings are created with IORING_SETUP_SINGLE_ISSUER | DEFER_TASKRUN when the
+ * kernel has them, so only the owning thread may submit or reap.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct
+{
+    int fd;
+    // Submission queue
+    atomic_uint *sq_head;
+    atomic_uint *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_pending_tail; // SQEs prepared since the last submit end here
+    struct io_uring_sqe *sqes;
+    // Completion queue
+    atomic_uint *cq_head;
+    atomic_uint *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    // Mappings, for teardown
+    void *sq_map;
+    size_t sq_map_len;
+    void *cq_map;
+    size_t cq_map_len;
+    size_t sqes_len;
+} uring_t;
+
+/**
+ * Buffers the kernel fills for IOSQE_BUFFER_SELECT receives; the CQE names
+ * the one it used, and it belongs to the application until re-added
+ */
+typedef struct
+{
+    struct io_uring_buf_ring *ring;
+    size_t ring_len;
+    unsigned entries; // a power of two
+    unsigned char *data;
+    size_t buf_size;
+    uint16_t bgid;
+    uint16_t tail; // local copy; published with uring_buf_publish()
+} uring_bufs_t;
+
+static inline int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg,
+                              size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+/**
+ * Set up a ring with `entries` submission slots and four times as many
+ * completion slots. Returns 0, or -errno.
+ */
+static int uring_init(uring_t *r, unsigned entries)
+{
+    struct io_uring_params p;
+    unsigned char *sq, *cq;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = entries * 4;
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0 && errno == EINVAL)
+    {
+        // Older kernel: no single-issuer / deferred task work
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = entries * 4;
+        r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    }
+    if (r->fd < 0)
+        return -errno;
+
+    r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (r->cq_map_len > r->sq_map_len)
+            r->sq_map_len = r->cq_map_len;
+        r->cq_map_len = 0;
+    }
+    r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                     IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED)
+        goto fail;
+    r->cq_map = r->sq_map;
+    if (r->cq_map_len)
+    {
+        r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                         IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED)
+            goto fail;
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto fail;
+
+    sq = r->sq_map;
+    cq = r->cq_map;
+    r->sq_head = (atomic_uint *)(sq + p.sq_off.head);
+    r->sq_tail = (atomic_uint *)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_pending_tail = atomic_load_explicit(r->sq_tail, memory_order_relaxed);
+    r->cq_head = (atomic_uint *)(cq + p.cq_off.head);
+    r->cq_tail = (atomic_uint *)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // SQE i always sits in slot i, so the indirection array is filled once
+    unsigned *array = (unsigned *)(sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        array[i] = i;
+    return 0;
+
+fail:
+    {
+        int err = -errno;
+        if (r->sqes != NULL && r->sqes != MAP_FAILED)
+            munmap(r->sqes, r->sqes_len);
+        if (r->cq_map_len && r->cq_map != NULL && r->cq_map != MAP_FAILED)
+            munmap(r->cq_map, r->cq_map_len);
+        if (r->sq_map != NULL && r->sq_map != MAP_FAILED)
+            munmap(r->sq_map, r->sq_map_len);
+        close(r->fd);
+        r->fd = -1;
+        return err;
+    }
+}
+
+static void uring_free(uring_t *r)
+{
+    if (r->fd < 0)
+        return;
+    munmap(r->sqes, r->sqes_len);
+    if (r->cq_map_len)
+        munmap(r->cq_map, r->cq_map_len);
+    munmap(r->sq_map, r->sq_map_len);
+    close(r->fd);
+    r->fd = -1;
+}
+
+/**
+ * Hand the prepared SQEs to the kernel and wait for at least `wait_nr`
+ * completions, or `timeout_ms` (negative: no limit). One system call.
+ * Returns the number submitted, or -errno (-ETIME on timeout).
+ */
+static int uring_submit_and_wait(uring_t *r, unsigned wait_nr, int timeout_ms)
+{
+    // Everything the kernel has not consumed, including entries a partial submit left behind
+    unsigned submit = r->sq_pending_tail - atomic_load_explicit(r->sq_head, memory_order_acquire);
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts = {timeout_ms / 1000, (long long)(timeout_ms % 1000) * 1000000};
+    struct io_uring_getevents_arg arg = {.ts = (uint64_t)(uintptr_t)&ts};
+    int ret;
+
+    atomic_store_explicit(r->sq_tail, r->sq_pending_tail, memory_order_release);
+    if (wait_nr && timeout_ms >= 0)
+        ret = uring_enter(r->fd, submit, wait_nr, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    else
+        ret = uring_enter(r->fd, submit, wait_nr, flags, NULL, 0);
+    return ret < 0 ? -errno : ret;
+}
+
+/**
+ * Next free SQE, cleared, with its user_data set. Submits early if the queue is full.
+ */
+static struct io_uring_sqe *uring_get_sqe(uring_t *r, uint64_t user_data)
+{
+    while (r->sq_pending_tail - atomic_load_explicit(r->sq_head, memory_order_acquire) >= r->sq_entries)
+    {
+        if (uring_submit_and_wait(r, 0, -1) < 0)
+            return NULL;
+    }
+    struct io_uring_sqe *sqe = &r->sqes[r->sq_pending_tail++ & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    return sqe;
+}
+
+/**
+ * Oldest unreaped completion, or NULL. Release it with uring_cqe_seen().
+ */
+static inline struct io_uring_cqe *uring_peek_cqe(uring_t *r)
+{
+    unsigned head = atomic_load_explicit(r->cq_head, memory_order_relaxed);
+    if (head == atomic_load_explicit(r->cq_tail, memory_order_acquire))
+        return NULL;
+    return &r->cqes[head & r->cq_mask];
+}
+
+static inline void uring_cqe_seen(uring_t *r)
+{
+    atomic_store_explicit(r->cq_head, atomic_load_explicit(r->cq_head, memory_order_relaxed) + 1,
+                          memory_order_release);
+}
+
+// --- Operations ---
+
+static inline int uring_prep_accept_multishot(uring_t *r, int fd, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r, user_data);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    return 0;
+}
+
+/**
+ * Receive into buffers picked from `bufs` until cancelled, an error, EOF,
+ * or the buffer ring runs dry (-ENOBUFS)
+ */
+static inline int uring_prep_recv_multishot(uring_t *r, int fd, const uring_bufs_t *bufs, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r, user_data);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bufs->bgid;
+    return 0;
+}
+
+static inline int uring_prep_send(uring_t *r, int fd, const void *buf, size_t len, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r, user_data);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    return 0;
+}
+
+static inline int uring_prep_poll_multishot(uring_t *r, int fd, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r, user_data);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    return 0;
+}
+
+/**
+ * Cancel the operation submitted with `target`, or with fd >= 0 every
+ * operation on that descriptor
+ */
+static inline int uring_prep_cancel(uring_t *r, uint64_t target, int fd, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r, user_data);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    if (fd >= 0)
+    {
+        sqe->fd = fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    }
+    else
+    {
+        sqe->fd = -1;
+        sqe->addr = target;
+    }
+    return 0;
+}
+
+// --- Provided buffers ---
+
+static inline unsigned char *uring_buf(const uring_bufs_t *b, unsigned bid)
+{
+    return b->data + (size_t)bid * b->buf_size;
+}
+
+/**
+ * Queue buffer `bid` for the kernel; visible after uring_buf_publish()
+ */
+static inline void uring_buf_add(uring_bufs_t *b, unsigned bid)
+{
+    struct io_uring_buf *buf = &b->ring->bufs[b->tail & (b->entries - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buf(b, bid);
+    buf->len = (uint32_t)b->buf_size;
+    buf->bid = (uint16_t)bid;
+    b->tail++;
+}
+
+static inline void uring_buf_publish(uring_bufs_t *b)
+{
+    atomic_store_explicit((_Atomic uint16_t *)&b->ring->tail, b->tail, memory_order_release);
+}
+
+/**
+ * Register `entries` buffers of `buf_size` bytes as group `bgid`, all handed
+ * to the kernel. Returns 0, or -errno.
+ */
+static int uring_bufs_init(uring_t *r, uring_bufs_t *b, uint16_t bgid, unsigned entries, size_t buf_size)
+{
+    struct io_uring_buf_reg reg;
+
+    memset(b, 0, sizeof(*b));
+    b->entries = entries;
+    b->buf_size = buf_size;
+    b->bgid = bgid;
+    b->ring_len = entries * sizeof(struct io_uring_buf);
+    b->ring = mmap(NULL, b->ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b->ring == MAP_FAILED)
+    {
+        b->ring = NULL;
+        return -ENOMEM;
+    }
+    b->data = malloc((size_t)entries * buf_size);
+    if (b->data == NULL)
+    {
+        munmap(b->ring, b->ring_len);
+        b->ring = NULL;
+        return -ENOMEM;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)b->ring;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        int err = -errno;
+        free(b->data);
+        munmap(b->ring, b->ring_len);
+        b->ring = NULL;
+        return err;
+    }
+
+    for (unsigned i = 0; i < entries; i++)
+        uring_buf_add(b, i);
+    uring_buf_publish(b);
+    return 0;
+}
+
+/**
+ * Only once no receive can pick a buffer any more
+ */
+static void uring_bufs_free(uring_bufs_t *b)
+{
+    if (b->ring == NULL)
+        return;
+    free(b->data);
+    munmap(b->ring, b->ring_len);
+    b->ring = NULL;
+}
+
+#endif // URING_H
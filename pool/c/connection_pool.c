@@ -1,102 +1,1048 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
+#include <time.h>
 #include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 
-#define POOL_SIZE 3 // Número de conexões no pool
+// Pontos de instrumentação USDT para perf / bpftrace (ver trace/): um nop enquanto nenhum tracer estiver ligado
+#if __has_include(<sys/sdt.h>) && !defined(NO_USDT)
+#include <sys/sdt.h>
+#define PROBE(name, ...) STAP_PROBEV(connection_pool, name, ##__VA_ARGS__)
+#else
+#define PROBE(name, ...) ((void)0)
+#endif
 
+#define CACHE_LINE 64
+#define SPIN_ROUNDS 64        // tentativas antes de entrar na fila, enquanto ninguém estiver nela
+#define READ_BUFFER_SIZE 4096 // respostas lidas e ainda não consumidas, por conexão
+#define PIPELINE_IOV 64       // requisições por sendmsg
+#define BACKOFF_MIN_MS 50     // primeira espera depois de um connect que falhou; dobra a cada falha
+#define BACKOFF_MAX_MS 5000
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() ((void)0)
+#endif
+
+// Motivos de fechamento, no probe close
+#define CLOSE_IDLE 0     // ociosa além de min_size por mais que idle_timeout_ms
+#define CLOSE_DEAD 1     // o backend fechou ou deu erro enquanto ela estava ociosa
+#define CLOSE_BROKEN 2   // erro de E/S durante o uso
+#define CLOSE_SHUTDOWN 3
+
+/*
+ * Configuração do pool. Campos em zero ficam com o padrão indicado.
+ */
 typedef struct {
-    int id;            // ID da conexão (para exemplo)
-    int in_use;        // Flag para indicar se a conexão está em uso
+    const char* address;     // "unix:/caminho" ou "host:porta"
+    int min_size;            // mantidas abertas e pré-aquecidas na criação (0)
+    int max_size;            // limite de conexões abertas (8)
+    long idle_timeout_ms;    // ociosas além de min_size fecham depois disso (30000)
+    long health_interval_ms; // intervalo da manutenção em segundo plano (1000)
+    long validate_after_ms;  // ociosa há mais que isso é verificada antes de sair do pool (500)
+    long connect_timeout_ms; // (1000)
+    long io_timeout_ms;      // para cada leitura ou escrita numa conexão em uso (5000)
+} PoolConfig;
+
+// Cada conexão numa linha de cache própria: quem segura uma não atrapalha quem segura a vizinha
+typedef struct {
+    _Alignas(CACHE_LINE) int id; // ID da conexão; também o índice da vaga no pool
+    int in_use;                  // Flag para indicar se a conexão está em uso; só quem a segura escreve
+    atomic_uint next;            // próxima na pilha em que estiver, como índice + 1 (0 termina)
+    int fd;                      // -1 numa vaga sem conexão
+    int broken;                  // erro de E/S: release_connection fecha em vez de devolver
+    long last_used_ms;           // quando voltou ao pool
+    size_t rlen;                 // bytes em rbuf
+    char rbuf[READ_BUFFER_SIZE];
 } Connection;
 
+// Uma thread esperando na fila, na pilha dela mesma
+typedef struct Waiter {
+    struct Waiter* prev;
+    struct Waiter* next;
+    pthread_cond_t wake;
+    Connection* granted; // entregue por release_connection
+} Waiter;
+
+/*
+ * As max_size vagas de conexão ficam em duas pilhas de Treiber sem locks:
+ * as abertas e ociosas, e as vagas sem conexão. O topo de cada uma guarda o
+ * índice + 1 da primeira nos 32 bits baixos e um contador nos 32 altos, que
+ * muda a cada operação: um CAS com um topo que saiu e voltou (ABA) falha.
+ * Pegar e devolver uma conexão custa um CAS; o mutex só protege a fila de
+ * quem espera, quando não há nenhuma livre e o pool já está no máximo.
+ *
+ * A pilha de ociosas é LIFO: as usadas há pouco ficam em cima, e as do fundo
+ * ficam frias de verdade e vencem o idle_timeout_ms, que a manutenção fecha.
+ */
 typedef struct {
-    Connection* connections[POOL_SIZE];
+    Connection* connections;
+    PoolConfig config;
+    struct sockaddr_storage addr; // resolvido uma vez, na criação
+    socklen_t addr_len;
+
+    _Alignas(CACHE_LINE) atomic_uint_least64_t idle_top;
+    _Alignas(CACHE_LINE) atomic_uint_least64_t empty_top;
+
+    _Alignas(CACHE_LINE) atomic_int open; // conexões abertas, ou sendo abertas
+    atomic_long retry_at_ms;              // backoff: antes disso ninguém tenta conectar
+    atomic_long backoff_ms;
+
+    _Alignas(CACHE_LINE) atomic_int waiters; // threads na fila ou entrando nela
     pthread_mutex_t lock;
-    pthread_cond_t available;
+    Waiter* head; // a mais antiga, a próxima a receber
+    Waiter* tail;
+
+    // Manutenção em segundo plano: nunca segura maint_lock ao pegar lock
+    _Alignas(CACHE_LINE) pthread_mutex_t maint_lock;
+    pthread_cond_t maint_wake;
+    int stopping;
+    int nudged;
+    pthread_t maintainer;
+    Connection** scratch; // max_size posições, só da manutenção
+
+    atomic_ulong connects;
+    atomic_ulong connect_failures;
+    atomic_ulong evicted;
+    atomic_ulong dead;
+    atomic_ulong broken;
 } ConnectionPool;
 
-// Função para criar o pool de conexões
-ConnectionPool* create_connection_pool() {
-    ConnectionPool* pool = (ConnectionPool*)malloc(sizeof(ConnectionPool));
+static long now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* --- Pilhas de vagas --- */
+
+static Connection* stack_pop(ConnectionPool* pool, atomic_uint_least64_t* stack) {
+    uint_least64_t top = atomic_load(stack);
+    uint_least64_t next;
+    Connection* conn;
+
+    do {
+        uint32_t index = (uint32_t)top;
+        if (index == 0)
+            return NULL;
+        conn = &pool->connections[index - 1];
+        // Pode estar desatualizado se conn já saiu da pilha; aí o contador muda e o CAS falha
+        next = ((top >> 32) + 1) << 32 | atomic_load(&conn->next);
+    } while (!atomic_compare_exchange_weak(stack, &top, next));
+    return conn;
+}
+
+static void stack_push(atomic_uint_least64_t* stack, Connection* conn) {
+    uint_least64_t top = atomic_load(stack);
+    uint_least64_t next;
+
+    do {
+        atomic_store(&conn->next, (uint32_t)top);
+        next = ((top >> 32) + 1) << 32 | (uint32_t)(conn->id + 1);
+    } while (!atomic_compare_exchange_weak(stack, &top, next));
+}
+
+/* --- Fila de espera --- */
+
+// Entrega conn à thread mais antiga da fila; chamado com o lock, e a fila não vazia
+static void grant(ConnectionPool* pool, Connection* conn) {
+    Waiter* w = pool->head;
+
+    pool->head = w->next;
+    if (pool->head != NULL)
+        pool->head->prev = NULL;
+    else
+        pool->tail = NULL;
+    atomic_fetch_sub(&pool->waiters, 1);
+    w->granted = conn;
+    pthread_cond_signal(&(w->wake));
+}
+
+static void unlink_waiter(ConnectionPool* pool, Waiter* w) {
+    if (w->prev != NULL)
+        w->prev->next = w->next;
+    else
+        pool->head = w->next;
+    if (w->next != NULL)
+        w->next->prev = w->prev;
+    else
+        pool->tail = w->prev;
+}
+
+static void nudge_maintainer(ConnectionPool* pool) {
+    pthread_mutex_lock(&(pool->maint_lock));
+    pool->nudged = 1;
+    pthread_cond_signal(&(pool->maint_wake));
+    pthread_mutex_unlock(&(pool->maint_lock));
+}
+
+/*
+ * Põe uma conexão aberta de volta à disposição. Com alguém na fila, ela vai
+ * direto para o primeiro: quem chega depois não fura a fila.
+ */
+static void give_back(ConnectionPool* pool, Connection* connection) {
+    if (atomic_load(&pool->waiters) > 0) {
+        pthread_mutex_lock(&(pool->lock));
+        if (pool->head != NULL) {
+            grant(pool, connection);
+            pthread_mutex_unlock(&(pool->lock));
+            return;
+        }
+        pthread_mutex_unlock(&(pool->lock));
+    }
+    stack_push(&pool->idle_top, connection);
+
+    // Alguém pode ter entrado na fila entre o teste e o push: ou ele viu a conexão na pilha, ou é visto aqui
+    if (atomic_load(&pool->waiters) > 0) {
+        pthread_mutex_lock(&(pool->lock));
+        Connection* conn;
+        if (pool->head != NULL && (conn = stack_pop(pool, &pool->idle_top)) != NULL)
+            grant(pool, conn);
+        pthread_mutex_unlock(&(pool->lock));
+    }
+}
+
+/* --- Sockets --- */
+
+// "unix:/caminho" ou "host:porta"; host resolvido agora, uma vez
+static int resolve_address(ConnectionPool* pool, const char* address) {
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un* sun = (struct sockaddr_un*)&pool->addr;
+        if (strlen(address + 5) >= sizeof(sun->sun_path))
+            return -1;
+        sun->sun_family = AF_UNIX;
+        strcpy(sun->sun_path, address + 5);
+        pool->addr_len = sizeof(*sun);
+        return 0;
+    }
+
+    const char* colon = strrchr(address, ':');
+    char host[256];
+    if (colon == NULL || (size_t)(colon - address) >= sizeof(host))
+        return -1;
+    memcpy(host, address, (size_t)(colon - address));
+    host[colon - address] = '\0';
+
+    struct addrinfo hints = {0}, *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0)
+        return -1;
+    memcpy(&pool->addr, res->ai_addr, res->ai_addrlen);
+    pool->addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+// Connect com prazo; depois o socket volta a bloquear, com io_timeout_ms em cada leitura e escrita
+static int connect_backend(ConnectionPool* pool, Connection* conn, long timeout_ms) {
+    int fd = socket(pool->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr*)&pool->addr, pool->addr_len) != 0) {
+        struct pollfd p = {fd, POLLOUT, 0};
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (errno != EINPROGRESS || poll(&p, 1, (int)timeout_ms) != 1 ||
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+    struct timeval tv = {pool->config.io_timeout_ms / 1000, (pool->config.io_timeout_ms % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (pool->addr.ss_family != AF_UNIX) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    conn->fd = fd;
+    conn->broken = 0;
+    conn->rlen = 0;
+    conn->last_used_ms = now_ms();
+    return 0;
+}
+
+/*
+ * Sem bloquear: uma conexão ociosa não tem nada para ler. EOF, erro ou
+ * bytes sobrando (uma resposta que ninguém leu) indicam que ela não serve.
+ */
+static int connection_alive(Connection* conn) {
+    char c;
+    if (conn->rlen > 0)
+        return 0;
+    ssize_t n = recv(conn->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* --- Abrir e fechar --- */
+
+// Backoff exponencial com jitter: metade fixa, metade sorteada, para que vários clientes não reconectem juntos
+static void connect_failed(ConnectionPool* pool) {
+    long backoff = atomic_load(&pool->backoff_ms);
+    backoff = backoff == 0 ? BACKOFF_MIN_MS : backoff * 2 > BACKOFF_MAX_MS ? BACKOFF_MAX_MS : backoff * 2;
+    atomic_store(&pool->backoff_ms, backoff);
+    atomic_store(&pool->retry_at_ms, now_ms() + backoff / 2 + rand() % (backoff / 2 + 1));
+    atomic_fetch_add(&pool->connect_failures, 1);
+}
+
+/*
+ * Abre uma conexão numa vaga livre. NULL se o pool já estiver no máximo, se
+ * o backoff ainda não deixar tentar ou se o connect falhar.
+ */
+static Connection* open_connection(ConnectionPool* pool, long timeout_ms) {
+    if (timeout_ms <= 0 || now_ms() < atomic_load(&pool->retry_at_ms))
+        return NULL;
+    int open = atomic_load(&pool->open);
+    do {
+        if (open >= pool->config.max_size)
+            return NULL;
+    } while (!atomic_compare_exchange_weak(&pool->open, &open, open + 1));
+
+    // Quem fecha devolve a vaga antes de descontar open, então há uma vaga para cada open < max_size
+    Connection* conn = stack_pop(pool, &pool->empty_top);
+    int ret = connect_backend(pool, conn, timeout_ms);
+    PROBE(connect, pool, conn->id, ret);
+    if (ret != 0) {
+        stack_push(&pool->empty_top, conn);
+        atomic_fetch_sub(&pool->open, 1);
+        connect_failed(pool);
+        return NULL;
+    }
+    atomic_store(&pool->backoff_ms, 0);
+    atomic_fetch_add(&pool->connects, 1);
+    return conn;
+}
+
+static void close_connection(ConnectionPool* pool, Connection* conn, int reason) {
+    (void)reason; // só o probe usa
+    PROBE(close, pool, conn->id, reason);
+    close(conn->fd);
+    conn->fd = -1;
+    stack_push(&pool->empty_top, conn);
+    atomic_fetch_sub(&pool->open, 1);
+
+    // A vaga fica livre: com gente esperando, a manutenção abre outra conexão
+    if (atomic_load(&pool->waiters) > 0)
+        nudge_maintainer(pool);
+}
+
+// Uma ociosa, verificada antes se ficou parada tempo bastante para o backend tê-la fechado
+static Connection* take_idle(ConnectionPool* pool) {
+    Connection* conn;
+
+    while ((conn = stack_pop(pool, &pool->idle_top)) != NULL) {
+        if (now_ms() - conn->last_used_ms < pool->config.validate_after_ms || connection_alive(conn))
+            return conn;
+        atomic_fetch_add(&pool->dead, 1);
+        close_connection(pool, conn, CLOSE_DEAD);
+    }
+    return NULL;
+}
+
+/*
+ * Entra no fim da fila e dorme até receber uma conexão ou o prazo passar.
+ * A conexão vai direto de quem libera para a primeira da fila, então as
+ * threads são atendidas na ordem em que chegaram.
+ */
+static Connection* wait_connection(ConnectionPool* pool, const struct timespec* deadline) {
+    Waiter self = {NULL, NULL, PTHREAD_COND_INITIALIZER, NULL};
+    pthread_condattr_t attr;
+    Connection* conn;
+
+    pthread_mutex_lock(&(pool->lock));
+    atomic_fetch_add(&pool->waiters, 1);
+
+    // Quem devolver a partir de agora vê waiters > 0; a que voltou antes disso ainda está na pilha
+    if ((conn = take_idle(pool)) != NULL) {
+        atomic_fetch_sub(&pool->waiters, 1);
+        pthread_mutex_unlock(&(pool->lock));
+        return conn;
+    }
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&(self.wake), &attr);
+    pthread_condattr_destroy(&attr);
+    self.prev = pool->tail;
+    if (pool->tail != NULL)
+        pool->tail->next = &self;
+    else
+        pool->head = &self;
+    pool->tail = &self;
+
+    // Abaixo do máximo só se espera porque o backend está em backoff: a manutenção reconecta e entrega
+    if (atomic_load(&pool->open) < pool->config.max_size)
+        nudge_maintainer(pool);
+
+    PROBE(acquire_block, pool);
+    while (self.granted == NULL) {
+        if (deadline == NULL) {
+            pthread_cond_wait(&(self.wake), &(pool->lock));
+        } else if (pthread_cond_timedwait(&(self.wake), &(pool->lock), deadline) == ETIMEDOUT &&
+                   self.granted == NULL) {
+            unlink_waiter(pool, &self);
+            atomic_fetch_sub(&pool->waiters, 1);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&(pool->lock));
+    pthread_cond_destroy(&(self.wake));
+    return self.granted;
+}
+
+/* --- Manutenção --- */
+
+/*
+ * Passa por todas as ociosas, das mais frias às mais quentes: fecha as que
+ * passaram de idle_timeout_ms (sem descer de min_size) e as que o backend
+ * fechou, e devolve as outras na mesma ordem. Cada uma fica fora da pilha só
+ * o tempo de um recv.
+ */
+static void check_idle(ConnectionPool* pool) {
+    Connection* conn;
+    long now = now_ms();
+    int n = 0;
+
+    while (n < pool->config.max_size && (conn = stack_pop(pool, &pool->idle_top)) != NULL)
+        pool->scratch[n++] = conn;
+    for (int i = n - 1; i >= 0; i--) {
+        conn = pool->scratch[i];
+        if (now - conn->last_used_ms >= pool->config.idle_timeout_ms &&
+            atomic_load(&pool->open) > pool->config.min_size) {
+            atomic_fetch_add(&pool->evicted, 1);
+            close_connection(pool, conn, CLOSE_IDLE);
+        } else if (!connection_alive(conn)) {
+            atomic_fetch_add(&pool->dead, 1);
+            close_connection(pool, conn, CLOSE_DEAD);
+        } else {
+            give_back(pool, conn);
+        }
+    }
+}
+
+// Abre conexões até min_size, ou enquanto houver fila; retorna em quantos ms rodar de novo
+static long refill(ConnectionPool* pool) {
+    for (;;) {
+        int open = atomic_load(&pool->open);
+        if (open >= pool->config.max_size || (open >= pool->config.min_size && atomic_load(&pool->waiters) == 0))
+            return pool->config.health_interval_ms;
+        Connection* conn = open_connection(pool, pool->config.connect_timeout_ms);
+        if (conn == NULL)
+            break;
+        give_back(pool, conn);
+    }
+
+    // Em backoff: volta quando ele acabar, se for antes da próxima verificação
+    long retry = atomic_load(&pool->retry_at_ms) - now_ms();
+    if (retry < 1)
+        retry = 1;
+    return retry < pool->config.health_interval_ms ? retry : pool->config.health_interval_ms;
+}
+
+static void* maintain(void* arg) {
+    ConnectionPool* pool = (ConnectionPool*)arg;
+
+    pthread_mutex_lock(&(pool->maint_lock));
+    while (!pool->stopping) {
+        pthread_mutex_unlock(&(pool->maint_lock));
+        check_idle(pool);
+        long wait_ms = refill(pool);
+        pthread_mutex_lock(&(pool->maint_lock));
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += wait_ms / 1000;
+        deadline.tv_nsec += (wait_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!pool->stopping && !pool->nudged &&
+               pthread_cond_timedwait(&(pool->maint_wake), &(pool->maint_lock), &deadline) != ETIMEDOUT)
+            ;
+        pool->nudged = 0;
+    }
+    pthread_mutex_unlock(&(pool->maint_lock));
+    return NULL;
+}
+
+/* --- Pool --- */
+
+/*
+ * Cria o pool e pré-aquece min_size conexões. Com o backend fora do ar o
+ * pool é criado assim mesmo, e a manutenção continua tentando com backoff.
+ * Retorna NULL se a configuração ou o endereço forem inválidos.
+ */
+ConnectionPool* create_connection_pool(const PoolConfig* config) {
+    ConnectionPool* pool = aligned_alloc(_Alignof(ConnectionPool), sizeof(ConnectionPool));
+    if (pool == NULL)
+        return NULL;
+    memset(pool, 0, sizeof(ConnectionPool));
+    pool->config = *config;
+    PoolConfig* c = &pool->config;
+    if (c->max_size <= 0)
+        c->max_size = 8;
+    if (c->idle_timeout_ms <= 0)
+        c->idle_timeout_ms = 30000;
+    if (c->health_interval_ms <= 0)
+        c->health_interval_ms = 1000;
+    if (c->validate_after_ms <= 0)
+        c->validate_after_ms = 500;
+    if (c->connect_timeout_ms <= 0)
+        c->connect_timeout_ms = 1000;
+    if (c->io_timeout_ms <= 0)
+        c->io_timeout_ms = 5000;
+    if (c->address == NULL || c->min_size < 0 || c->min_size > c->max_size || resolve_address(pool, c->address) != 0) {
+        free(pool);
+        return NULL;
+    }
+    c->address = NULL; // não guarda o ponteiro de quem chamou
+
+    pool->connections = aligned_alloc(_Alignof(Connection), (size_t)c->max_size * sizeof(Connection));
+    pool->scratch = (Connection**)malloc((size_t)c->max_size * sizeof(Connection*));
+    if (pool->connections == NULL || pool->scratch == NULL) {
+        free(pool->connections);
+        free(pool->scratch);
+        free(pool);
+        return NULL;
+    }
     pthread_mutex_init(&(pool->lock), NULL);
-    pthread_cond_init(&(pool->available), NULL);
+    pthread_mutex_init(&(pool->maint_lock), NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&(pool->maint_wake), &attr);
+    pthread_condattr_destroy(&attr);
 
-    // Inicializa as conexões
-    for (int i = 0; i < POOL_SIZE; i++) {
-        pool->connections[i] = (Connection*)malloc(sizeof(Connection));
-        pool->connections[i]->id = i;
-        pool->connections[i]->in_use = 0;
+    // Todas as vagas começam vazias, empilhadas ao contrário para que a 0 saia primeiro
+    for (int i = c->max_size - 1; i >= 0; i--) {
+        pool->connections[i].id = i;
+        pool->connections[i].in_use = 0;
+        pool->connections[i].fd = -1;
+        atomic_init(&pool->connections[i].next, 0);
+        stack_push(&pool->empty_top, &pool->connections[i]);
+    }
+
+    // Pré-aquecimento: a primeira requisição não paga o connect
+    for (int i = 0; i < c->min_size; i++) {
+        Connection* conn = open_connection(pool, c->connect_timeout_ms);
+        if (conn == NULL)
+            break;
+        give_back(pool, conn);
+    }
+    if (pthread_create(&(pool->maintainer), NULL, maintain, pool) != 0) {
+        Connection* conn;
+        while ((conn = stack_pop(pool, &pool->idle_top)) != NULL)
+            close(conn->fd);
+        pthread_mutex_destroy(&(pool->lock));
+        pthread_mutex_destroy(&(pool->maint_lock));
+        pthread_cond_destroy(&(pool->maint_wake));
+        free(pool->connections);
+        free(pool->scratch);
+        free(pool);
+        return NULL;
     }
     return pool;
 }
 
-// Função para adquirir uma conexão do pool
+// Prazo restante em ms, limitado a limit
+static long remaining_ms(const struct timespec* deadline, long limit) {
+    if (deadline == NULL)
+        return limit;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long left = (long)(deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    return left < limit ? left : limit;
+}
+
+/*
+ * Adquire uma conexão, esperando no máximo até deadline (CLOCK_MONOTONIC,
+ * absoluto; NULL espera sem limite). Um prazo absoluto não se estende com
+ * despertares espúrios. Sem ociosa, abre uma nova se o pool estiver abaixo
+ * de max_size; senão entra na fila. Retorna NULL se o prazo passar.
+ */
+Connection* acquire_connection_until(ConnectionPool* pool, const struct timespec* deadline) {
+    PROBE(acquire_start, pool);
+    Connection* conn = take_idle(pool);
+
+    if (conn == NULL)
+        conn = open_connection(pool, remaining_ms(deadline, pool->config.connect_timeout_ms));
+
+    // Uso curto costuma devolver a conexão logo; com fila formada, girar seria furá-la
+    for (int spin = 0; conn == NULL && spin < SPIN_ROUNDS && atomic_load(&pool->waiters) == 0; spin++) {
+        cpu_relax();
+        conn = take_idle(pool);
+    }
+    if (conn == NULL)
+        conn = wait_connection(pool, deadline);
+    if (conn == NULL) {
+        PROBE(acquire_timeout, pool);
+        return NULL;
+    }
+    conn->in_use = 1;
+    PROBE(acquire_done, pool, conn->id);
+    return conn;
+}
+
+// Função para adquirir uma conexão do pool, esperando o quanto for preciso
 Connection* acquire_connection(ConnectionPool* pool) {
-    pthread_mutex_lock(&(pool->lock));
+    return acquire_connection_until(pool, NULL);
+}
 
-    // Espera até que uma conexão esteja disponível
-    while (1) {
-        for (int i = 0; i < POOL_SIZE; i++) {
-            if (!pool->connections[i]->in_use) {
-                pool->connections[i]->in_use = 1;
-                pthread_mutex_unlock(&(pool->lock));
-                printf("Conexão %d adquirida.\n", pool->connections[i]->id);
-                return pool->connections[i];
-            }
-        }
-        // Se todas as conexões estiverem ocupadas, espera
-        pthread_cond_wait(&(pool->available), &(pool->lock));
+// Espera no máximo timeout_ms milissegundos
+Connection* acquire_connection_timed(ConnectionPool* pool, long timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    return acquire_connection_until(pool, &deadline);
+}
+
+// Sem esperar outra thread: uma ociosa, ou uma nova se houver vaga; NULL senão
+Connection* try_acquire_connection(ConnectionPool* pool) {
+    PROBE(acquire_start, pool);
+    Connection* conn = take_idle(pool);
+    if (conn == NULL)
+        conn = open_connection(pool, pool->config.connect_timeout_ms);
+    if (conn == NULL) {
+        PROBE(acquire_timeout, pool);
+        return NULL;
     }
+    conn->in_use = 1;
+    PROBE(acquire_done, pool, conn->id);
+    return conn;
 }
 
-// Função para liberar uma conexão de volta ao pool
+// Função para liberar uma conexão de volta ao pool; uma que deu erro de E/S é fechada
 void release_connection(ConnectionPool* pool, Connection* connection) {
-    pthread_mutex_lock(&(pool->lock));
     connection->in_use = 0;
-    printf("Conexão %d liberada.\n", connection->id);
-
-    // Notifica uma thread que uma conexão está disponível
-    pthread_cond_signal(&(pool->available));
-    pthread_mutex_unlock(&(pool->lock));
+    PROBE(release, pool, connection->id);
+    if (connection->broken) {
+        atomic_fetch_add(&pool->broken, 1);
+        close_connection(pool, connection, CLOSE_BROKEN);
+        return;
+    }
+    connection->last_used_ms = now_ms();
+    give_back(pool, connection);
 }
 
-// Função para destruir o pool de conexões
+// Função para destruir o pool de conexões; nenhuma pode estar em uso
 void destroy_connection_pool(ConnectionPool* pool) {
-    for (int i = 0; i < POOL_SIZE; i++) {
-        free(pool->connections[i]);
-    }
+    pthread_mutex_lock(&(pool->maint_lock));
+    pool->stopping = 1;
+    pthread_cond_signal(&(pool->maint_wake));
+    pthread_mutex_unlock(&(pool->maint_lock));
+    pthread_join(pool->maintainer, NULL);
+
+    Connection* conn;
+    while ((conn = stack_pop(pool, &pool->idle_top)) != NULL)
+        close_connection(pool, conn, CLOSE_SHUTDOWN);
+    free(pool->connections);
+    free(pool->scratch);
     pthread_mutex_destroy(&(pool->lock));
-    pthread_cond_destroy(&(pool->available));
+    pthread_mutex_destroy(&(pool->maint_lock));
+    pthread_cond_destroy(&(pool->maint_wake));
     free(pool);
 }
 
-// Função de exemplo que simula o uso de uma conexão
+/* --- Requisições --- */
+
+// Escreve tudo, continuando de onde um envio parcial parou. sendmsg em vez de writev por causa do
+// MSG_NOSIGNAL: um backend que fechou a conexão vira EPIPE e conexão marcada, não SIGPIPE no processo
+static int write_all(Connection* conn, struct iovec* iov, int count) {
+    while (count > 0) {
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = (size_t)count};
+        ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return 0;
+}
+
+// Uma linha da resposta, sem o '\n', em out (truncada em size - 1 bytes)
+static int read_line(Connection* conn, char* out, size_t size) {
+    for (;;) {
+        char* nl = memchr(conn->rbuf, '\n', conn->rlen);
+        if (nl != NULL) {
+            size_t len = (size_t)(nl - conn->rbuf);
+            size_t copy = len < size - 1 ? len : size - 1;
+            memcpy(out, conn->rbuf, copy);
+            out[copy] = '\0';
+            conn->rlen -= len + 1;
+            memmove(conn->rbuf, nl + 1, conn->rlen);
+            return 0;
+        }
+        if (conn->rlen == sizeof(conn->rbuf))
+            return -1; // linha maior que o buffer
+        ssize_t n = recv(conn->fd, conn->rbuf + conn->rlen, sizeof(conn->rbuf) - conn->rlen, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        conn->rlen += (size_t)n;
+    }
+}
+
+/*
+ * Pipelining: envia n requisições, cada uma uma linha terminada em '\n', em
+ * poucos sendmsg, e só então lê as n respostas, uma linha cada, na ordem. As
+ * n idas e voltas viram uma. O total enviado deve caber nos buffers do
+ * socket, porque as respostas só são lidas depois. responses[i] recebe até
+ * size - 1 bytes. Num erro de E/S retorna -1 e marca a conexão, que
+ * release_connection fecha em vez de devolver ao pool.
+ */
+int connection_pipeline(Connection* conn, const char* const* requests, int n, char** responses, size_t size) {
+    struct iovec iov[PIPELINE_IOV];
+
+    for (int sent = 0; sent < n;) {
+        int count = 0;
+        for (; count < PIPELINE_IOV && sent < n; count++, sent++) {
+            iov[count].iov_base = (void*)requests[sent];
+            iov[count].iov_len = strlen(requests[sent]);
+        }
+        if (write_all(conn, iov, count) != 0) {
+            conn->broken = 1;
+            return -1;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        if (read_line(conn, responses[i], size) != 0) {
+            conn->broken = 1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int connection_request(Connection* conn, const char* request, char* response, size_t size) {
+    return connection_pipeline(conn, &request, 1, &response, size);
+}
+
+/* --- Servidor de eco para o exemplo --- */
+
+#define ECHO_MAX_CLIENTS 64
+
+typedef struct {
+    char address[128]; // no formato de PoolConfig.address
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int listen_fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t gone;
+    int clients[ECHO_MAX_CLIENTS];
+    int num_clients;
+} EchoServer;
+
+typedef struct {
+    EchoServer* server;
+    int fd;
+} EchoClient;
+
+static void* echo_client(void* arg) {
+    EchoClient client = *(EchoClient*)arg;
+    EchoServer* server = client.server;
+    char buf[4096];
+    ssize_t n;
+
+    free(arg);
+    while ((n = read(client.fd, buf, sizeof(buf))) > 0) {
+        if (write(client.fd, buf, (size_t)n) != n)
+            break;
+    }
+    pthread_mutex_lock(&(server->lock));
+    for (int i = 0; i < server->num_clients; i++) {
+        if (server->clients[i] == client.fd) {
+            server->clients[i] = server->clients[--server->num_clients];
+            break;
+        }
+    }
+    close(client.fd);
+    pthread_cond_broadcast(&(server->gone));
+    pthread_mutex_unlock(&(server->lock));
+    return NULL;
+}
+
+static void* echo_accept(void* arg) {
+    EchoServer* server = (EchoServer*)arg;
+
+    for (;;) {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break; // shutdown do socket de escuta
+        }
+        EchoClient* client = (EchoClient*)malloc(sizeof(EchoClient));
+        pthread_t thread;
+        pthread_mutex_lock(&(server->lock));
+        if (client == NULL || server->num_clients == ECHO_MAX_CLIENTS) {
+            pthread_mutex_unlock(&(server->lock));
+            free(client);
+            close(fd);
+            continue;
+        }
+        server->clients[server->num_clients++] = fd;
+        client->server = server;
+        client->fd = fd;
+        if (pthread_create(&thread, NULL, echo_client, client) == 0) {
+            pthread_detach(thread);
+        } else {
+            server->num_clients--;
+            close(fd);
+            free(client);
+        }
+        pthread_mutex_unlock(&(server->lock));
+    }
+    return NULL;
+}
+
+// Na primeira vez escolhe o endereço (um socket Unix em /tmp, ou uma porta TCP livre); depois reusa o mesmo
+static int echo_start(EchoServer* server, int tcp) {
+    if (server->addr_len == 0) {
+        pthread_mutex_init(&(server->lock), NULL);
+        pthread_cond_init(&(server->gone), NULL);
+        if (tcp) {
+            struct sockaddr_in* sin = (struct sockaddr_in*)&server->addr;
+            sin->sin_family = AF_INET;
+            sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            server->addr_len = sizeof(*sin);
+        } else {
+            struct sockaddr_un* sun = (struct sockaddr_un*)&server->addr;
+            sun->sun_family = AF_UNIX;
+            snprintf(sun->sun_path, sizeof(sun->sun_path), "/tmp/connection_pool_echo.%d.sock", (int)getpid());
+            server->addr_len = sizeof(*sun);
+            snprintf(server->address, sizeof(server->address), "unix:%s", sun->sun_path);
+        }
+    }
+
+    int one = 1;
+    server->listen_fd = socket(server->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server->listen_fd < 0)
+        return -1;
+    if (server->addr.ss_family == AF_UNIX)
+        unlink(((struct sockaddr_un*)&server->addr)->sun_path);
+    else
+        setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(server->listen_fd, (struct sockaddr*)&server->addr, server->addr_len) != 0 ||
+        listen(server->listen_fd, 128) != 0) {
+        close(server->listen_fd);
+        return -1;
+    }
+    if (server->addr.ss_family == AF_INET) {
+        getsockname(server->listen_fd, (struct sockaddr*)&server->addr, &server->addr_len);
+        snprintf(server->address, sizeof(server->address), "127.0.0.1:%d",
+                 ntohs(((struct sockaddr_in*)&server->addr)->sin_port));
+    }
+    if (pthread_create(&(server->thread), NULL, echo_accept, server) != 0) {
+        close(server->listen_fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Fecha todas as conexões abertas e espera que fechem, como um backend que encerra as ociosas
+static void echo_drop_clients(EchoServer* server) {
+    pthread_mutex_lock(&(server->lock));
+    for (int i = 0; i < server->num_clients; i++)
+        shutdown(server->clients[i], SHUT_RDWR);
+    while (server->num_clients > 0)
+        pthread_cond_wait(&(server->gone), &(server->lock));
+    pthread_mutex_unlock(&(server->lock));
+}
+
+// Derruba o servidor e todas as conexões abertas, como um backend reiniciando
+static void echo_stop(EchoServer* server) {
+    shutdown(server->listen_fd, SHUT_RDWR);
+    pthread_join(server->thread, NULL);
+    close(server->listen_fd);
+    echo_drop_clients(server);
+}
+
+/* --- Exemplo --- */
+
+// Carga: mais threads que conexões, cada uma com requisições de verdade
+#define LOAD_THREADS 16
+#define LOAD_REQUESTS 2000
+
+static atomic_long load_errors;
+static atomic_int peak_open;
+
 void* use_connection(void* arg) {
     ConnectionPool* pool = (ConnectionPool*)arg;
-    Connection* conn = acquire_connection(pool);
-    
-    // Simula trabalho com a conexão
-    sleep(1);
-    
-    release_connection(pool, conn);
+    char request[64], response[64];
+
+    for (int i = 0; i < LOAD_REQUESTS; i++) {
+        Connection* conn = acquire_connection_timed(pool, 1000);
+        if (conn == NULL) {
+            atomic_fetch_add(&load_errors, 1);
+            continue;
+        }
+        int open = atomic_load(&pool->open), peak = atomic_load(&peak_open);
+        while (open > peak && !atomic_compare_exchange_weak(&peak_open, &peak, open))
+            ;
+        snprintf(request, sizeof(request), "%lu %d\n", (unsigned long)pthread_self(), i);
+        if (connection_request(conn, request, response, sizeof(response)) != 0 ||
+            strncmp(request, response, strlen(response)) != 0)
+            atomic_fetch_add(&load_errors, 1);
+        release_connection(pool, conn);
+    }
     return NULL;
 }
 
-int main() {
-    ConnectionPool* pool = create_connection_pool();
+static double elapsed_s(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void print_stats(ConnectionPool* pool, const char* when) {
+    printf("%s: %d abertas; %lu conexões, %lu falhas de connect, %lu fechadas por ociosidade, %lu mortas, "
+           "%lu com erro\n",
+           when, atomic_load(&pool->open), atomic_load(&pool->connects), atomic_load(&pool->connect_failures),
+           atomic_load(&pool->evicted), atomic_load(&pool->dead), atomic_load(&pool->broken));
+}
 
-    // Cria threads para simular clientes tentando adquirir conexões
-    pthread_t threads[5];
-    for (int i = 0; i < 5; i++) {
-        pthread_create(&threads[i], NULL, use_connection, pool);
+int main(int argc, char** argv) {
+    EchoServer server = {0};
+    int tcp = argc > 1 && strcmp(argv[1], "tcp") == 0;
+    if (echo_start(&server, tcp) != 0) {
+        printf("Falha ao iniciar o servidor de eco\n");
+        return 1;
     }
 
-    // Aguarda as threads terminarem
-    for (int i = 0; i < 5; i++) {
+    PoolConfig config = {0};
+    config.address = server.address;
+    config.min_size = 2;
+    config.max_size = 8;
+    config.idle_timeout_ms = 500;
+    config.health_interval_ms = 100;
+    config.validate_after_ms = 50;
+    ConnectionPool* pool = create_connection_pool(&config);
+    if (pool == NULL) {
+        printf("Falha ao criar o pool\n");
+        return 1;
+    }
+    print_stats(pool, server.address);
+
+    // Cinco requisições numa ida e volta
+    Connection* conn = acquire_connection(pool);
+    const char* requests[] = {"um\n", "dois\n", "três\n", "quatro\n", "cinco\n"};
+    char buffers[5][32];
+    char* responses[5];
+    for (int i = 0; i < 5; i++)
+        responses[i] = buffers[i];
+    if (connection_pipeline(conn, requests, 5, responses, sizeof(buffers[0])) == 0)
+        printf("Pipeline na conexão %d: %s %s %s %s %s\n", conn->id, buffers[0], buffers[1], buffers[2], buffers[3],
+               buffers[4]);
+    release_connection(pool, conn);
+
+    // Sob carga o pool cresce até max_size
+    pthread_t threads[LOAD_THREADS];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < LOAD_THREADS; i++)
+        pthread_create(&threads[i], NULL, use_connection, pool);
+    for (int i = 0; i < LOAD_THREADS; i++)
         pthread_join(threads[i], NULL);
+    double s = elapsed_s(&start);
+    printf("%d requisições em %.3f s (%.0f mil/s), pico de %d conexões, %ld erros\n", LOAD_THREADS * LOAD_REQUESTS,
+           s, LOAD_THREADS * LOAD_REQUESTS / s / 1e3, atomic_load(&peak_open), atomic_load(&load_errors));
+
+    // No máximo, try falha na hora e a espera com prazo desiste
+    Connection* held[8];
+    int num_held = 0;
+    while (num_held < config.max_size && (held[num_held] = try_acquire_connection(pool)) != NULL)
+        num_held++;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Connection* none = try_acquire_connection(pool);
+    Connection* late = acquire_connection_timed(pool, 100);
+    printf("Pool esgotado com %d: try %s, espera de 100 ms %s após %.0f ms\n", num_held, none ? "conseguiu" : "falhou",
+           late ? "conseguiu" : "desistiu", elapsed_s(&start) * 1000);
+    while (num_held > 0)
+        release_connection(pool, held[--num_held]);
+
+    // As ociosas além de min_size vencem
+    usleep(1000 * 1000);
+    print_stats(pool, "Depois de 1 s ocioso");
+
+    // O backend fecha as ociosas logo após o uso: a que volta antes de validate_after_ms não é verificada,
+    // então a escrita encontra o socket fechado; a conexão é marcada e trocada, sem SIGPIPE
+    conn = acquire_connection(pool);
+    char reply[32];
+    connection_request(conn, "antes\n", reply, sizeof(reply));
+    release_connection(pool, conn);
+    echo_drop_clients(&server);
+    int failed = 0, served = 0;
+    for (int i = 0; i < config.max_size + 1 && !served; i++) {
+        conn = acquire_connection_timed(pool, 1000);
+        if (conn == NULL)
+            break;
+        if (connection_request(conn, "depois\n", reply, sizeof(reply)) == 0)
+            served = 1;
+        else
+            failed++;
+        release_connection(pool, conn);
     }
+    printf("Backend fechou as ociosas: %d requisição(ões) falharam na conexão fechada, a seguinte %s\n", failed,
+           served ? "foi atendida" : "também falhou");
+    print_stats(pool, "Depois das ociosas fechadas");
+
+    // O backend cai: a manutenção descobre as conexões mortas e tenta reconectar com backoff
+    echo_stop(&server);
+    usleep(500 * 1000);
+    print_stats(pool, "Backend fora do ar");
+    none = try_acquire_connection(pool);
+    printf("try com o backend fora do ar: %s\n", none ? "conseguiu" : "falhou");
+
+    // Volta: a manutenção reabre min_size conexões sozinha, e quem esperava é atendido
+    echo_start(&server, tcp);
+    conn = acquire_connection_timed(pool, 10000);
+    char response[32];
+    if (conn != NULL && connection_request(conn, "de volta\n", response, sizeof(response)) == 0)
+        printf("Backend de volta: %s\n", response);
+    if (conn != NULL)
+        release_connection(pool, conn);
+    usleep(200 * 1000);
+    print_stats(pool, "Depois da volta");
 
     destroy_connection_pool(pool);
+    echo_stop(&server);
+    if (!tcp)
+        unlink(((struct sockaddr_un*)&server.addr)->sun_path);
     return 0;
 }
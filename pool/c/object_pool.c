@@ -1,50 +1,97 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
-#define POOL_SIZE 5
+#include "slab.h"
 
-typedef struct {
-    int* objects[POOL_SIZE];
-    int index;
-} IntPool;
+#define CHURN_LIVE 4096     // objetos vivos ao mesmo tempo no benchmark
+#define CHURN_ROUNDS 20000000
+
+// Pool de inteiros: um cache slab de um tamanho só
+typedef SlabCache IntPool;
 
 IntPool* create_pool() {
     IntPool* pool = (IntPool*)malloc(sizeof(IntPool));
-    pool->index = -1;
-    for (int i = 0; i < POOL_SIZE; i++) {
-        pool->objects[i] = NULL;
+    if (pool == NULL || slab_cache_init(pool, sizeof(int), sizeof(int), 0, 0, NULL, NULL, NULL) != 0) {
+        free(pool);
+        return NULL;
     }
     return pool;
 }
 
-int* acquire_object(IntPool* pool) {
-    if (pool->index >= 0) {
-        return pool->objects[pool->index--];
-    } else {
-        // Pool está vazio, cria um novo objeto
-        return (int*)malloc(sizeof(int));
+// Da lista de livres, ou recortado da página atual; NULL só se faltar memória para uma página nova
+static inline int* acquire_object(IntPool* pool) {
+    return (int*)slab_acquire(pool);
+}
+
+static inline void release_object(IntPool* pool, int* obj) {
+    slab_release(pool, obj);
+}
+
+void destroy_pool(IntPool* pool) {
+    slab_cache_destroy(pool);
+    free(pool);
+}
+
+/* --- Benchmark --- */
+
+// Tamanhos pseudoaleatórios e reprodutíveis, concentrados nos pequenos como numa carga real
+static inline size_t churn_size(unsigned* seed) {
+    *seed = *seed * 1103515245u + 12345u;
+    unsigned r = *seed >> 16;
+    return (r & 3) != 0 ? 8 + (r >> 2) % 120 : 8 + (r >> 2) % 2040;
+}
+
+static double elapsed_s(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Troca um objeto vivo por outro de tamanho sorteado, CHURN_ROUNDS vezes
+static double churn_slab(SlabAllocator* alloc, void** live) {
+    unsigned seed = 1;
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < CHURN_ROUNDS; i++) {
+        size_t slot = (size_t)i % CHURN_LIVE;
+        slab_free(alloc, live[slot]);
+        live[slot] = slab_alloc(alloc, churn_size(&seed));
+        *(char*)live[slot] = (char)i;
     }
+    return elapsed_s(&start);
 }
 
-void release_object(IntPool* pool, int* obj) {
-    if (pool->index < POOL_SIZE - 1) {
-        pool->objects[++pool->index] = obj;
-    } else {
-        // Pool está cheio, libera o objeto
-        free(obj);
+static double churn_malloc(void** live) {
+    unsigned seed = 1;
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < CHURN_ROUNDS; i++) {
+        size_t slot = (size_t)i % CHURN_LIVE;
+        free(live[slot]);
+        live[slot] = malloc(churn_size(&seed));
+        *(char*)live[slot] = (char)i;
     }
+    return elapsed_s(&start);
 }
 
-void destroy_pool(IntPool* pool) {
-    for (int i = 0; i <= pool->index; i++) {
-        free(pool->objects[i]);
+static size_t mapped_pages(SlabAllocator* alloc, size_t* huge) {
+    size_t pages = 0;
+    *huge = 0;
+    for (int i = 0; i < alloc->num_classes; i++) {
+        pages += alloc->classes[i].num_pages;
+        *huge += alloc->classes[i].huge_pages;
     }
-    free(pool);
+    return pages;
 }
 
 int main() {
     IntPool* pool = create_pool();
-    
+    if (pool == NULL)
+        return 1;
+
     // Adquire objetos do pool
     int* obj1 = acquire_object(pool);
     int* obj2 = acquire_object(pool);
@@ -52,11 +99,52 @@ int main() {
     *obj1 = 10;
     *obj2 = 20;
     printf("Obj1: %d, Obj2: %d\n", *obj1, *obj2);
-    
-    // Libera objetos de volta para o pool
+
+    // Libera objetos de volta para o pool; o próximo acquire reusa o último liberado
     release_object(pool, obj1);
     release_object(pool, obj2);
-    
+    printf("Reuso: %s\n", acquire_object(pool) == obj2 ? "sim" : "não");
     destroy_pool(pool);
+
+    // Classes de tamanho, alinhadas à linha de cache a partir de 64 bytes, em huge pages se houver
+    static const size_t sizes[] = {8, 16, 32, 48, 64, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048};
+    SlabAllocator alloc;
+    if (slab_allocator_init(&alloc, sizes, sizeof(sizes) / sizeof(sizes[0]), CACHE_LINE, 0, SLAB_HUGEPAGES) != 0)
+        return 1;
+    size_t requests[] = {1, 8, 20, 50, 64, 100, 1000, 2048};
+    for (size_t i = 0; i < sizeof(requests) / sizeof(requests[0]); i++) {
+        void* p = slab_alloc(&alloc, requests[i]);
+        SlabCache* cache = slab_cache_of(p, alloc.page_size);
+        printf("%4zu bytes -> classe %4zu, %p, alinhado a %zu\n", requests[i], cache->size, p,
+               (size_t)1 << __builtin_ctzl((unsigned long)(uintptr_t)p));
+        slab_free(&alloc, p);
+    }
+    printf("%d bytes -> %s\n", 4096, slab_alloc(&alloc, 4096) ? "alocado" : "NULL (acima da maior classe)");
+
+    // Benchmark: o mesmo padrão de tamanhos no slab e no malloc
+    void** live = (void**)malloc(CHURN_LIVE * sizeof(void*));
+    unsigned seed = 2;
+    for (int i = 0; i < CHURN_LIVE; i++)
+        live[i] = slab_alloc(&alloc, churn_size(&seed));
+    double warm = churn_slab(&alloc, live);
+    size_t huge, pages = mapped_pages(&alloc, &huge);
+    double slab = churn_slab(&alloc, live);
+    size_t pages_after = mapped_pages(&alloc, &huge);
+    for (int i = 0; i < CHURN_LIVE; i++)
+        slab_free(&alloc, live[i]);
+    printf("slab:   %.1f M pares alloc/free por segundo (%.1f no aquecimento); %zu páginas, %zu delas huge, "
+           "%zu novas depois do aquecimento\n",
+           CHURN_ROUNDS / slab / 1e6, CHURN_ROUNDS / warm / 1e6, pages, huge, pages_after - pages);
+
+    seed = 2;
+    for (int i = 0; i < CHURN_LIVE; i++)
+        live[i] = malloc(churn_size(&seed));
+    double libc = churn_malloc(live);
+    for (int i = 0; i < CHURN_LIVE; i++)
+        free(live[i]);
+    printf("malloc: %.1f M pares alloc/free por segundo\n", CHURN_ROUNDS / libc / 1e6);
+
+    free(live);
+    slab_allocator_destroy(&alloc);
     return 0;
 }
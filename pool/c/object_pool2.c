@@ -1,60 +1,537 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 
-#define POOL_SIZE 5
+#include "slab.h"
+
+#define MAGAZINE_SIZE 32       // objetos por magazine: a cada quantos acquires/releases se vai ao depósito
+#define MAX_MAGAZINES (1 << 18) // arena reservada, tocada só conforme cresce
 
 typedef struct {
     int id;
     char data[50];
 } MyObject;
 
+/*
+ * Um magazine é uma pilha de até MAGAZINE_SIZE objetos livres. Enquanto está
+ * com uma thread, só ela o toca; no depósito, vai inteiro de uma thread para
+ * outra. Cada um na sua linha de cache.
+ */
 typedef struct {
-    MyObject* objects[POOL_SIZE];
-    int index;
+    _Alignas(CACHE_LINE) atomic_uint next; // próximo na pilha do depósito, como índice + 1 (0 termina)
+    int count;
+    void* rounds[MAGAZINE_SIZE];
+} Magazine;
+
+// Os dois magazines de uma thread: com dois, quem alterna acquire e release na borda não vai ao depósito a cada vez
+typedef struct ThreadCache {
+    Magazine* loaded;
+    Magazine* previous;
+    struct ObjectPool* pool;
+    struct ThreadCache* prev; // na lista do pool, para destroy_pool
+    struct ThreadCache* next;
+} ThreadCache;
+
+/*
+ * Pool de objetos compartilhado entre threads, em três camadas:
+ *
+ *  - cada thread tem seus magazines, e acquire/release são um push ou pop
+ *    neles, sem atômicos e sem tocar memória de outra thread;
+ *  - um depósito global sem locks troca magazines inteiros, cheios por
+ *    vazios, em pilhas de Treiber como as do pool de conexões;
+ *  - embaixo, o SlabCache de slab.h, atrás de um mutex, recorta objetos
+ *    novos, MAGAZINE_SIZE por vez, quando o depósito não tem nenhum cheio.
+ *
+ * Todos os objetos são iguais e as páginas são do pool, não das threads: um
+ * objeto liberado por uma thread diferente da que o adquiriu vai para o
+ * magazine de quem liberou e volta a circular pelo depósito. Num produtor e
+ * consumidor, o produtor devolve magazines vazios e pega cheios, e o
+ * consumidor faz o contrário: um atômico a cada MAGAZINE_SIZE objetos.
+ * Quando uma thread termina, os magazines dela voltam ao depósito.
+ */
+typedef struct ObjectPool {
+    SlabCache slab;
+    pthread_mutex_t slab_lock;
+    int next_id; // de init_object, sob slab_lock
+    unsigned long serial; // distingue este pool de outro que venha a ocupar o mesmo endereço
+    Magazine* magazines;
+
+    _Alignas(CACHE_LINE) atomic_uint_least64_t full_top;
+    _Alignas(CACHE_LINE) atomic_uint_least64_t empty_top;
+    _Alignas(CACHE_LINE) atomic_uint num_magazines;
+
+    pthread_key_t key;
+    pthread_mutex_t caches_lock;
+    ThreadCache* caches;
 } ObjectPool;
 
+static atomic_ulong pool_serial;
+
+// O cache da thread para o último pool que ela usou: o caso comum não passa por pthread_getspecific
+static _Thread_local ObjectPool* tls_pool;
+static _Thread_local unsigned long tls_serial;
+static _Thread_local ThreadCache* tls_cache;
+
+// Roda uma vez por objeto, quando ele é recortado da página: o id fica com ele por toda a vida
+static void init_object(void* obj, void* ctx) {
+    ObjectPool* pool = (ObjectPool*)ctx;
+    MyObject* o = (MyObject*)obj;
+    o->id = ++pool->next_id;
+    o->data[0] = '\0';
+}
+
+// Roda a cada devolução: o próximo a pegar o objeto não vê o conteúdo de quem o usou antes
+static inline void reset_object(MyObject* obj) {
+    obj->data[0] = '\0';
+}
+
+/* --- Depósito --- */
+
+static Magazine* depot_pop(ObjectPool* pool, atomic_uint_least64_t* stack) {
+    uint_least64_t top = atomic_load(stack);
+    uint_least64_t next;
+    Magazine* mag;
+
+    do {
+        uint32_t index = (uint32_t)top;
+        if (index == 0)
+            return NULL;
+        mag = &pool->magazines[index - 1];
+        // A arena nunca é liberada, então ler next de um magazine que já saiu é seguro; o contador invalida o CAS
+        next = ((top >> 32) + 1) << 32 | atomic_load(&mag->next);
+    } while (!atomic_compare_exchange_weak(stack, &top, next));
+    return mag;
+}
+
+static void depot_push(ObjectPool* pool, atomic_uint_least64_t* stack, Magazine* mag) {
+    uint_least64_t top = atomic_load(stack);
+    uint_least64_t next;
+    uint32_t index = (uint32_t)(mag - pool->magazines) + 1;
+
+    do {
+        atomic_store(&mag->next, (uint32_t)top);
+        next = ((top >> 32) + 1) << 32 | index;
+    } while (!atomic_compare_exchange_weak(stack, &top, next));
+}
+
+// Os vazios vão para uma pilha e os que têm algum objeto para a outra
+static void depot_put(ObjectPool* pool, Magazine* mag) {
+    depot_push(pool, mag->count > 0 ? &pool->full_top : &pool->empty_top, mag);
+}
+
+// Um magazine vazio, do depósito ou novo da arena; NULL com a arena esgotada
+static Magazine* empty_magazine(ObjectPool* pool) {
+    Magazine* mag = depot_pop(pool, &pool->empty_top);
+    if (mag != NULL)
+        return mag;
+
+    unsigned n = atomic_load(&pool->num_magazines);
+    do {
+        if (n >= MAX_MAGAZINES)
+            return NULL;
+    } while (!atomic_compare_exchange_weak(&pool->num_magazines, &n, n + 1));
+    mag = &pool->magazines[n];
+    mag->count = 0;
+    return mag;
+}
+
+/* --- Caches por thread --- */
+
+// Na saída da thread: os magazines voltam ao depósito, com os objetos que tiverem
+static void thread_exit(void* arg) {
+    ThreadCache* tc = (ThreadCache*)arg;
+    ObjectPool* pool = tc->pool;
+
+    if (tls_pool == pool)
+        tls_pool = NULL;
+    depot_put(pool, tc->loaded);
+    depot_put(pool, tc->previous);
+    pthread_mutex_lock(&(pool->caches_lock));
+    if (tc->prev != NULL)
+        tc->prev->next = tc->next;
+    else
+        pool->caches = tc->next;
+    if (tc->next != NULL)
+        tc->next->prev = tc->prev;
+    pthread_mutex_unlock(&(pool->caches_lock));
+    free(tc);
+}
+
+static ThreadCache* create_cache(ObjectPool* pool) {
+    ThreadCache* tc = (ThreadCache*)aligned_alloc(CACHE_LINE, SLAB_ROUND_UP(sizeof(ThreadCache), CACHE_LINE));
+    if (tc == NULL)
+        return NULL;
+    tc->loaded = empty_magazine(pool);
+    tc->previous = empty_magazine(pool);
+    if (tc->loaded == NULL || tc->previous == NULL) {
+        if (tc->loaded != NULL)
+            depot_put(pool, tc->loaded);
+        if (tc->previous != NULL)
+            depot_put(pool, tc->previous);
+        free(tc);
+        return NULL;
+    }
+    tc->pool = pool;
+    pthread_mutex_lock(&(pool->caches_lock));
+    tc->prev = NULL;
+    tc->next = pool->caches;
+    if (pool->caches != NULL)
+        pool->caches->prev = tc;
+    pool->caches = tc;
+    pthread_mutex_unlock(&(pool->caches_lock));
+    pthread_setspecific(pool->key, tc);
+    return tc;
+}
+
+// NULL só se faltar memória para o cache: aí a thread usa o slab direto, com o lock
+static inline ThreadCache* thread_cache(ObjectPool* pool) {
+    if (tls_pool == pool && tls_serial == pool->serial)
+        return tls_cache;
+
+    ThreadCache* tc = (ThreadCache*)pthread_getspecific(pool->key);
+    if (tc == NULL && (tc = create_cache(pool)) == NULL)
+        return NULL;
+    tls_pool = pool;
+    tls_serial = pool->serial;
+    tls_cache = tc;
+    return tc;
+}
+
+/* --- Pool --- */
+
 ObjectPool* create_pool() {
-    ObjectPool* pool = (ObjectPool*)malloc(sizeof(ObjectPool));
-    pool->index = -1;
-    for (int i = 0; i < POOL_SIZE; i++) {
-        pool->objects[i] = NULL;
+    ObjectPool* pool = (ObjectPool*)aligned_alloc(_Alignof(ObjectPool), sizeof(ObjectPool));
+    if (pool == NULL)
+        return NULL;
+    memset(pool, 0, sizeof(ObjectPool));
+    if (slab_cache_init(&pool->slab, sizeof(MyObject), CACHE_LINE, 0, SLAB_HUGEPAGES, init_object, NULL, pool) != 0) {
+        free(pool);
+        return NULL;
+    }
+
+    // Reserva de endereços só: as páginas da arena aparecem conforme os magazines são usados
+    pool->magazines = mmap(NULL, MAX_MAGAZINES * sizeof(Magazine), PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pool->magazines == MAP_FAILED) {
+        free(pool);
+        return NULL;
+    }
+    if (pthread_key_create(&(pool->key), thread_exit) != 0) {
+        munmap(pool->magazines, MAX_MAGAZINES * sizeof(Magazine));
+        free(pool);
+        return NULL;
     }
+    pthread_mutex_init(&(pool->slab_lock), NULL);
+    pthread_mutex_init(&(pool->caches_lock), NULL);
+    pool->serial = atomic_fetch_add(&pool_serial, 1) + 1;
     return pool;
 }
 
-MyObject* acquire_object(ObjectPool* pool) {
-    if (pool->index >= 0) {
-        return pool->objects[pool->index--];
+// Caminho lento de acquire_object: o magazine carregado está vazio
+static __attribute__((noinline)) MyObject* acquire_slow(ObjectPool* pool, ThreadCache* tc) {
+    Magazine* mag;
+
+    if (tc == NULL) {
+        pthread_mutex_lock(&(pool->slab_lock));
+        MyObject* obj = (MyObject*)slab_acquire(&pool->slab);
+        pthread_mutex_unlock(&(pool->slab_lock));
+        return obj;
+    }
+    if (tc->previous->count > 0) {
+        mag = tc->previous;
+        tc->previous = tc->loaded;
+        tc->loaded = mag;
+    } else if ((mag = depot_pop(pool, &pool->full_top)) != NULL) {
+        depot_push(pool, &pool->empty_top, tc->loaded);
+        tc->loaded = mag;
     } else {
-        return (MyObject*)malloc(sizeof(MyObject));
+        // Depósito sem cheios: enche o magazine com objetos novos, de uma vez sob o lock
+        mag = tc->loaded;
+        pthread_mutex_lock(&(pool->slab_lock));
+        while (mag->count < MAGAZINE_SIZE) {
+            void* obj = slab_acquire(&pool->slab);
+            if (obj == NULL)
+                break;
+            mag->rounds[mag->count++] = obj;
+        }
+        pthread_mutex_unlock(&(pool->slab_lock));
+        if (mag->count == 0)
+            return NULL;
     }
+    return (MyObject*)mag->rounds[--mag->count];
 }
 
-void release_object(ObjectPool* pool, MyObject* obj) {
-    if (pool->index < POOL_SIZE - 1) {
-        pool->objects[++pool->index] = obj;
+// Caminho lento de release_object: o magazine carregado está cheio
+static __attribute__((noinline)) void release_slow(ObjectPool* pool, ThreadCache* tc, MyObject* obj) {
+    Magazine* mag;
+
+    if (tc != NULL && tc->previous->count < MAGAZINE_SIZE) {
+        mag = tc->previous;
+        tc->previous = tc->loaded;
+        tc->loaded = mag;
+    } else if (tc != NULL && (mag = empty_magazine(pool)) != NULL) {
+        depot_push(pool, &pool->full_top, tc->previous);
+        tc->previous = tc->loaded;
+        tc->loaded = mag;
     } else {
-        free(obj);
+        // Sem cache ou com a arena esgotada: o objeto volta à lista do slab
+        pthread_mutex_lock(&(pool->slab_lock));
+        slab_release(&pool->slab, obj);
+        pthread_mutex_unlock(&(pool->slab_lock));
+        return;
+    }
+    mag->rounds[mag->count++] = obj;
+}
+
+static inline MyObject* acquire_object(ObjectPool* pool) {
+    ThreadCache* tc = thread_cache(pool);
+
+    if (tc != NULL && tc->loaded->count > 0)
+        return (MyObject*)tc->loaded->rounds[--tc->loaded->count];
+    return acquire_slow(pool, tc);
+}
+
+// De qualquer thread, não só da que adquiriu o objeto
+static inline void release_object(ObjectPool* pool, MyObject* obj) {
+    ThreadCache* tc = thread_cache(pool);
+
+    reset_object(obj);
+    if (tc != NULL && tc->loaded->count < MAGAZINE_SIZE) {
+        tc->loaded->rounds[tc->loaded->count++] = obj;
+        return;
     }
+    release_slow(pool, tc, obj);
 }
 
+/*
+ * Nenhuma outra thread pode estar usando o pool. As que o usaram e ainda
+ * vivem ficam com um cache que não vale mais e que não será mais consultado.
+ */
 void destroy_pool(ObjectPool* pool) {
-    for (int i = 0; i <= pool->index; i++) {
-        free(pool->objects[i]);
+    pthread_key_delete(pool->key);
+    while (pool->caches != NULL) {
+        ThreadCache* tc = pool->caches;
+        pool->caches = tc->next;
+        free(tc);
     }
+    if (tls_pool == pool)
+        tls_pool = NULL;
+    munmap(pool->magazines, MAX_MAGAZINES * sizeof(Magazine));
+    slab_cache_destroy(&pool->slab);
+    pthread_mutex_destroy(&(pool->slab_lock));
+    pthread_mutex_destroy(&(pool->caches_lock));
     free(pool);
 }
 
+/* --- Exemplo e benchmarks --- */
+
+#define BENCH_PAIRS (1 << 24) // pares acquire/release por rodada, divididos entre as threads
+#define BENCH_BURST 8         // objetos que cada thread segura ao mesmo tempo
+#define MAX_THREADS 64
+#define CROSS_PAIRS 4         // pares produtor/consumidor no teste entre threads
+#define CROSS_OBJECTS 200000  // objetos por par
+#define RING_SIZE 1024
+
+// O pool de antes, só que com um mutex na frente: a referência para a contenção
+typedef struct {
+    pthread_mutex_t lock;
+    SlabCache slab;
+} LockedPool;
+
+enum { BENCH_MAGAZINE, BENCH_LOCKED, BENCH_MALLOC };
+
+typedef struct {
+    int mode;
+    long pairs;
+    ObjectPool* pool;
+    LockedPool* locked;
+    pthread_barrier_t* start;
+} Bench;
+
+// Cada thread marca o próprio início e fim: o relógio de quem só espera não vê o trabalho já feito
+typedef struct {
+    Bench* bench;
+    struct timespec start;
+    struct timespec end;
+} BenchThread;
+
+static inline MyObject* bench_acquire(Bench* b) {
+    MyObject* obj;
+    switch (b->mode) {
+    case BENCH_MAGAZINE:
+        return acquire_object(b->pool);
+    case BENCH_LOCKED:
+        pthread_mutex_lock(&(b->locked->lock));
+        obj = (MyObject*)slab_acquire(&b->locked->slab);
+        pthread_mutex_unlock(&(b->locked->lock));
+        return obj;
+    default:
+        return (MyObject*)malloc(sizeof(MyObject));
+    }
+}
+
+static inline void bench_release(Bench* b, MyObject* obj) {
+    switch (b->mode) {
+    case BENCH_MAGAZINE:
+        release_object(b->pool, obj);
+        break;
+    case BENCH_LOCKED:
+        pthread_mutex_lock(&(b->locked->lock));
+        slab_release(&b->locked->slab, obj);
+        pthread_mutex_unlock(&(b->locked->lock));
+        break;
+    default:
+        free(obj);
+    }
+}
+
+static void* bench_worker(void* arg) {
+    BenchThread* t = (BenchThread*)arg;
+    Bench* b = t->bench;
+    MyObject* held[BENCH_BURST];
+
+    pthread_barrier_wait(b->start);
+    clock_gettime(CLOCK_MONOTONIC, &t->start);
+    for (long i = 0; i < b->pairs; i += BENCH_BURST) {
+        for (int j = 0; j < BENCH_BURST; j++) {
+            held[j] = bench_acquire(b);
+            held[j]->data[0] = (char)j;
+        }
+        for (int j = 0; j < BENCH_BURST; j++)
+            bench_release(b, held[j]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t->end);
+    return NULL;
+}
+
+static double between_s(const struct timespec* start, const struct timespec* end) {
+    return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static double elapsed_s(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return between_s(start, &now);
+}
+
+// Milhões de pares acquire/release por segundo, somando todas as threads, do primeiro início ao último fim
+static double run_bench(int mode, int num_threads, ObjectPool* pool, LockedPool* locked) {
+    pthread_t threads[MAX_THREADS];
+    BenchThread timing[MAX_THREADS];
+    pthread_barrier_t start;
+    Bench bench = {mode, BENCH_PAIRS / num_threads, pool, locked, &start};
+
+    pthread_barrier_init(&start, NULL, (unsigned)num_threads);
+    for (int i = 0; i < num_threads; i++) {
+        timing[i].bench = &bench;
+        pthread_create(&threads[i], NULL, bench_worker, &timing[i]);
+    }
+    for (int i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+    pthread_barrier_destroy(&start);
+
+    struct timespec first = timing[0].start, last = timing[0].end;
+    for (int i = 1; i < num_threads; i++) {
+        if (between_s(&timing[i].start, &first) > 0)
+            first = timing[i].start;
+        if (between_s(&last, &timing[i].end) > 0)
+            last = timing[i].end;
+    }
+    return (double)bench.pairs * num_threads / between_s(&first, &last) / 1e6;
+}
+
+// Fila de um produtor e um consumidor: o objeto é adquirido numa thread e liberado na outra
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_size_t head;
+    _Alignas(CACHE_LINE) atomic_size_t tail;
+    MyObject* slots[RING_SIZE];
+    ObjectPool* pool;
+    atomic_long errors;
+} Ring;
+
+static void* produce(void* arg) {
+    Ring* ring = (Ring*)arg;
+
+    for (long i = 0; i < CROSS_OBJECTS; i++) {
+        MyObject* obj = acquire_object(ring->pool);
+        if (obj->data[0] != '\0')
+            atomic_fetch_add(&ring->errors, 1); // reset não rodou
+        snprintf(obj->data, sizeof(obj->data), "%ld", i);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        while (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == RING_SIZE)
+            sched_yield();
+        ring->slots[tail % RING_SIZE] = obj;
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+static void* consume(void* arg) {
+    Ring* ring = (Ring*)arg;
+    char expected[50];
+
+    for (long i = 0; i < CROSS_OBJECTS; i++) {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        while (atomic_load_explicit(&ring->tail, memory_order_acquire) == head)
+            sched_yield();
+        MyObject* obj = ring->slots[head % RING_SIZE];
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+        snprintf(expected, sizeof(expected), "%ld", i);
+        if (strcmp(obj->data, expected) != 0)
+            atomic_fetch_add(&ring->errors, 1);
+        release_object(ring->pool, obj);
+    }
+    return NULL;
+}
+
+/*
+ * Com nenhuma outra thread usando o pool: confere que cada objeto recortado
+ * está livre exatamente uma vez, num magazine ou na lista do slab. Retorna
+ * quantos faltam ou sobram.
+ */
+static long audit_pool(ObjectPool* pool) {
+    unsigned char* seen = (unsigned char*)calloc((size_t)pool->next_id + 1, 1);
+    long found = 0, errors = 0;
+
+    if (seen == NULL)
+        return -1;
+#define AUDIT(o)                                                   \
+    do {                                                           \
+        MyObject* a = (MyObject*)(o);                              \
+        if (a->id < 1 || a->id > pool->next_id || seen[a->id]++)   \
+            errors++;                                              \
+        found++;                                                   \
+    } while (0)
+    for (uint32_t i = (uint32_t)atomic_load(&pool->full_top); i != 0; i = atomic_load(&pool->magazines[i - 1].next))
+        for (int j = 0; j < pool->magazines[i - 1].count; j++)
+            AUDIT(pool->magazines[i - 1].rounds[j]);
+    for (ThreadCache* tc = pool->caches; tc != NULL; tc = tc->next) {
+        for (int j = 0; j < tc->loaded->count; j++)
+            AUDIT(tc->loaded->rounds[j]);
+        for (int j = 0; j < tc->previous->count; j++)
+            AUDIT(tc->previous->rounds[j]);
+    }
+    for (SlabFree* f = pool->slab.free; f != NULL; f = f->next)
+        AUDIT((char*)f - pool->slab.link);
+#undef AUDIT
+    free(seen);
+    return errors + labs((long)pool->slab.carved - found);
+}
+
 int main() {
     ObjectPool* pool = create_pool();
+    if (pool == NULL)
+        return 1;
 
     MyObject* obj1 = acquire_object(pool);
-    obj1->id = 1;
     strcpy(obj1->data, "Objeto 1");
 
     MyObject* obj2 = acquire_object(pool);
-    obj2->id = 2;
     strcpy(obj2->data, "Objeto 2");
 
     printf("Obj1: ID=%d, Data=%s\n", obj1->id, obj1->data);
@@ -64,6 +541,49 @@ int main() {
     release_object(pool, obj1);
     release_object(pool, obj2);
 
+    // Volta o último liberado, já limpo por reset e com o id que init deu
+    MyObject* obj3 = acquire_object(pool);
+    printf("Obj3: ID=%d, Data='%s'\n", obj3->id, obj3->data);
+    release_object(pool, obj3);
+
+    // Adquiridos numa thread, liberados em outra
+    Ring* rings = (Ring*)aligned_alloc(_Alignof(Ring), CROSS_PAIRS * sizeof(Ring));
+    pthread_t producers[CROSS_PAIRS], consumers[CROSS_PAIRS];
+    struct timespec begin;
+    long errors = 0;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (int i = 0; i < CROSS_PAIRS; i++) {
+        atomic_init(&rings[i].head, 0);
+        atomic_init(&rings[i].tail, 0);
+        atomic_init(&rings[i].errors, 0);
+        rings[i].pool = pool;
+        pthread_create(&producers[i], NULL, produce, &rings[i]);
+        pthread_create(&consumers[i], NULL, consume, &rings[i]);
+    }
+    for (int i = 0; i < CROSS_PAIRS; i++) {
+        pthread_join(producers[i], NULL);
+        pthread_join(consumers[i], NULL);
+        errors += atomic_load(&rings[i].errors);
+    }
+    double s = elapsed_s(&begin);
+    printf("Entre threads: %d objetos em %.3f s, %ld erros; %zu recortados, %u magazines, auditoria: %ld\n",
+           CROSS_PAIRS * CROSS_OBJECTS, s, errors, pool->slab.carved, atomic_load(&pool->num_magazines),
+           audit_pool(pool));
+    free(rings);
+
+    // Contenção: cada thread adquire e libera BENCH_BURST objetos por vez
+    LockedPool locked;
+    pthread_mutex_init(&(locked.lock), NULL);
+    slab_cache_init(&locked.slab, sizeof(MyObject), CACHE_LINE, 0, SLAB_HUGEPAGES, NULL, NULL, NULL);
+    printf("\n%8s %12s %12s %12s   (M pares acquire/release por segundo)\n", "threads", "magazines", "mutex",
+           "malloc");
+    for (int n = 1; n <= MAX_THREADS; n *= 2)
+        printf("%8d %12.1f %12.1f %12.1f\n", n, run_bench(BENCH_MAGAZINE, n, pool, &locked),
+               run_bench(BENCH_LOCKED, n, pool, &locked), run_bench(BENCH_MALLOC, n, pool, &locked));
+    printf("auditoria depois dos benchmarks: %ld\n", audit_pool(pool));
+    slab_cache_destroy(&locked.slab);
+    pthread_mutex_destroy(&(locked.lock));
+
     destroy_pool(pool);
     return 0;
 }
@@ -0,0 +1,280 @@
+/*
+ * Alocador slab para os pools de objetos.
+ *
+ * Um SlabCache serve objetos de um único tamanho. Eles são recortados de
+ * páginas grandes e contíguas (SLAB_PAGE_SIZE, 2 MiB por padrão, com huge
+ * pages se pedido), alinhadas ao próprio tamanho. Os livres formam uma lista
+ * intrusiva: o ponteiro para o próximo fica dentro do objeto livre. Pegar e
+ * devolver um objeto é tirar e pôr na cabeça dessa lista, sem syscall e sem
+ * malloc. Só quando a lista e a página atual acabam é que se mapeia outra.
+ *
+ * Um SlabCache também representa um tipo: init roda uma vez, quando o
+ * objeto é recortado da página, e reset a cada devolução. Com init, o
+ * ponteiro da lista fica depois do objeto, para não sobrescrever o que init
+ * preparou.
+ *
+ * Um SlabAllocator junta caches para várias classes de tamanho e escolhe a
+ * classe por uma tabela, sem laço. Como as páginas são alinhadas, o cabeçalho
+ * da página de um objeto sai do próprio endereço: slab_free não precisa do
+ * tamanho.
+ *
+ * Nada aqui é thread-safe: cada cache pertence a uma thread, ou é protegido
+ * por quem o usa.
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define CACHE_LINE 64
+#define SLAB_PAGE_SIZE (2u << 20) // uma huge page de x86-64; potência de dois
+#define SLAB_GRANULE 8            // resolução da tabela de classes
+#define SLAB_HUGEPAGES 1          // flag: páginas de MAP_HUGETLB, ou ao menos transparentes
+
+#define SLAB_ROUND_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+typedef struct SlabFree {
+    struct SlabFree* next;
+} SlabFree;
+
+struct SlabCache;
+
+// No início de cada página, antes dos objetos
+typedef struct SlabPage {
+    struct SlabCache* cache;
+    struct SlabPage* next;
+} SlabPage;
+
+typedef struct SlabCache {
+    SlabFree* free;    // lista de livres; o campo mais usado na frente
+    size_t link;       // deslocamento do ponteiro da lista dentro do objeto
+    char* cursor;      // próximo objeto ainda não recortado da página atual
+    char* limit;
+    size_t stride;     // distância entre objetos: tamanho + link, arredondado ao alinhamento
+    void (*reset)(void* obj, void* ctx);
+    void (*init)(void* obj, void* ctx);
+    void* ctx;
+    size_t size;
+    size_t align;
+    size_t page_size;
+    int flags;
+    SlabPage* pages;
+    size_t num_pages;
+    size_t huge_pages; // quantas vieram de MAP_HUGETLB
+    size_t carved;     // objetos já recortados de alguma página
+} SlabCache;
+
+typedef struct {
+    SlabCache* classes;
+    int num_classes;
+    size_t max_size;
+    size_t page_size;
+    unsigned char* class_of; // (tamanho + SLAB_GRANULE - 1) / SLAB_GRANULE -> classe
+} SlabAllocator;
+
+/* --- Páginas --- */
+
+/*
+ * length bytes alinhados a length. Tenta o tamanho exato primeiro, que o
+ * kernel costuma devolver alinhado; senão mapeia o dobro e corta as sobras.
+ */
+static inline void* slab_map(size_t length, int hugetlb) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | (hugetlb ? MAP_HUGETLB : 0);
+    char* p = mmap(NULL, length, PROT_READ | PROT_WRITE, flags, -1, 0);
+
+    if (p == MAP_FAILED)
+        return NULL;
+    if (((uintptr_t)p & (length - 1)) == 0)
+        return p;
+    munmap(p, length);
+
+    p = mmap(NULL, 2 * length, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    char* aligned = (char*)SLAB_ROUND_UP((uintptr_t)p, length);
+    if (aligned > p)
+        munmap(p, (size_t)(aligned - p));
+    munmap(aligned + length, (size_t)(p + length - aligned));
+    return aligned;
+}
+
+static inline int slab_grow(SlabCache* cache) {
+    char* mem = NULL;
+    int hugetlb = 0;
+
+    if (cache->flags & SLAB_HUGEPAGES) {
+        // Huge pages reservadas, se houver; senão páginas comuns que o kernel pode juntar (THP)
+        mem = slab_map(cache->page_size, 1);
+        hugetlb = mem != NULL;
+    }
+    if (mem == NULL && (mem = slab_map(cache->page_size, 0)) == NULL)
+        return -1;
+#ifdef MADV_HUGEPAGE
+    if ((cache->flags & SLAB_HUGEPAGES) && !hugetlb)
+        madvise(mem, cache->page_size, MADV_HUGEPAGE);
+#endif
+
+    SlabPage* page = (SlabPage*)mem;
+    page->cache = cache;
+    page->next = cache->pages;
+    cache->pages = page;
+    cache->num_pages++;
+    cache->huge_pages += hugetlb;
+    cache->cursor = mem + SLAB_ROUND_UP(sizeof(SlabPage), cache->align);
+    cache->limit = mem + cache->page_size;
+    return 0;
+}
+
+// Caminho lento de slab_acquire, fora de linha para que o rápido fique em poucas instruções: recorta o
+// próximo objeto da página, mapeando outra se preciso
+static __attribute__((noinline)) void* slab_refill(SlabCache* cache) {
+    if ((size_t)(cache->limit - cache->cursor) < cache->stride && slab_grow(cache) != 0)
+        return NULL;
+    void* obj = cache->cursor;
+    cache->cursor += cache->stride;
+    cache->carved++;
+    if (cache->init != NULL)
+        cache->init(obj, cache->ctx);
+    return obj;
+}
+
+/* --- Caches --- */
+
+/*
+ * Um cache de objetos de size bytes, alinhados a align (uma potência de dois;
+ * CACHE_LINE deixa cada objeto nas suas próprias linhas). page_size 0 usa
+ * SLAB_PAGE_SIZE. init e reset podem ser NULL. Nenhuma página é mapeada
+ * antes do primeiro slab_acquire. Retorna -1 se os parâmetros não servirem.
+ */
+static inline int slab_cache_init(SlabCache* cache, size_t size, size_t align, size_t page_size, int flags,
+                           void (*init)(void*, void*), void (*reset)(void*, void*), void* ctx) {
+    memset(cache, 0, sizeof(SlabCache));
+    if (align < sizeof(SlabFree))
+        align = sizeof(SlabFree);
+    if (page_size == 0)
+        page_size = SLAB_PAGE_SIZE;
+    if ((align & (align - 1)) != 0 || (page_size & (page_size - 1)) != 0 || size == 0)
+        return -1;
+
+    cache->size = size;
+    cache->align = align;
+    cache->link = init != NULL ? SLAB_ROUND_UP(size, sizeof(SlabFree)) : 0;
+    cache->stride = SLAB_ROUND_UP(init != NULL ? cache->link + sizeof(SlabFree) : size, align);
+    cache->page_size = page_size;
+    cache->flags = flags;
+    cache->init = init;
+    cache->reset = reset;
+    cache->ctx = ctx;
+    if (SLAB_ROUND_UP(sizeof(SlabPage), align) + cache->stride > page_size)
+        return -1;
+    return 0;
+}
+
+static inline void* slab_acquire(SlabCache* cache) {
+    SlabFree* head = cache->free;
+
+    if (head != NULL) {
+        cache->free = head->next;
+        return (char*)head - cache->link;
+    }
+    return slab_refill(cache);
+}
+
+static inline void slab_release(SlabCache* cache, void* obj) {
+    if (cache->reset != NULL)
+        cache->reset(obj, cache->ctx);
+    SlabFree* node = (SlabFree*)((char*)obj + cache->link);
+    node->next = cache->free;
+    cache->free = node;
+}
+
+// Devolve todas as páginas ao sistema; objetos ainda em uso deixam de valer
+static inline void slab_cache_destroy(SlabCache* cache) {
+    SlabPage* page = cache->pages;
+
+    while (page != NULL) {
+        SlabPage* next = page->next;
+        munmap(page, cache->page_size);
+        page = next;
+    }
+    cache->pages = NULL;
+    cache->free = NULL;
+    cache->cursor = cache->limit = NULL;
+}
+
+// O cache de onde veio obj, pelo cabeçalho da página
+static inline SlabCache* slab_cache_of(const void* obj, size_t page_size) {
+    return ((SlabPage*)((uintptr_t)obj & ~((uintptr_t)page_size - 1)))->cache;
+}
+
+/* --- Classes de tamanho --- */
+
+/*
+ * Um alocador com num_classes classes, sizes em ordem crescente. Classes
+ * menores que align ficam alinhadas à menor potência de dois que as contém,
+ * para que nenhum objeto atravesse duas linhas de cache à toa.
+ */
+static inline int slab_allocator_init(SlabAllocator* alloc, const size_t* sizes, int num_classes, size_t align,
+                               size_t page_size, int flags) {
+    memset(alloc, 0, sizeof(SlabAllocator));
+    if (num_classes <= 0 || num_classes > 255)
+        return -1;
+    alloc->max_size = sizes[num_classes - 1];
+    alloc->page_size = page_size != 0 ? page_size : SLAB_PAGE_SIZE;
+    alloc->classes = (SlabCache*)calloc((size_t)num_classes, sizeof(SlabCache));
+    alloc->class_of = (unsigned char*)malloc(alloc->max_size / SLAB_GRANULE + 2);
+    if (alloc->classes == NULL || alloc->class_of == NULL)
+        goto fail;
+
+    for (int i = 0; i < num_classes; i++) {
+        size_t class_align = align;
+        if (i > 0 && sizes[i] <= sizes[i - 1])
+            goto fail;
+        while (class_align / 2 >= sizes[i] && class_align / 2 >= sizeof(SlabFree))
+            class_align /= 2;
+        if (slab_cache_init(&alloc->classes[i], sizes[i], class_align, alloc->page_size, flags, NULL, NULL,
+                            NULL) != 0)
+            goto fail;
+    }
+    alloc->num_classes = num_classes;
+
+    // Cada posição da tabela vai para a menor classe que cabe o maior tamanho que cai nela
+    for (size_t g = 0, c = 0; g <= alloc->max_size / SLAB_GRANULE + 1; g++) {
+        while (c < (size_t)num_classes - 1 && sizes[c] < g * SLAB_GRANULE)
+            c++;
+        alloc->class_of[g] = (unsigned char)c;
+    }
+    return 0;
+
+fail:
+    free(alloc->classes);
+    free(alloc->class_of);
+    memset(alloc, 0, sizeof(SlabAllocator));
+    return -1;
+}
+
+// NULL se size passar da maior classe: isso fica para quem chama decidir
+static inline void* slab_alloc(SlabAllocator* alloc, size_t size) {
+    if (size > alloc->max_size)
+        return NULL;
+    return slab_acquire(&alloc->classes[alloc->class_of[(size + SLAB_GRANULE - 1) / SLAB_GRANULE]]);
+}
+
+static inline void slab_free(SlabAllocator* alloc, void* obj) {
+    slab_release(slab_cache_of(obj, alloc->page_size), obj);
+}
+
+static inline void slab_allocator_destroy(SlabAllocator* alloc) {
+    for (int i = 0; i < alloc->num_classes; i++)
+        slab_cache_destroy(&alloc->classes[i]);
+    free(alloc->classes);
+    free(alloc->class_of);
+    memset(alloc, 0, sizeof(SlabAllocator));
+}
+
+#endif /* SLAB_H */
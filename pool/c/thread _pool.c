@@ -1,136 +1,1383 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
-#define THREAD_POOL_SIZE 4  // Número de threads no pool
-#define TASK_QUEUE_SIZE 10  // Tamanho máximo da fila de tarefas
+// Pontos de instrumentação USDT para perf / bpftrace (ver trace/): um nop enquanto nenhum tracer estiver ligado
+#if __has_include(<sys/sdt.h>) && !defined(NO_USDT)
+#include <sys/sdt.h>
+#define PROBE(name, ...) STAP_PROBEV(thread_pool, name, ##__VA_ARGS__)
+#else
+#define PROBE(name, ...) ((void)0)
+#endif
 
+#define DEQUE_INITIAL_SIZE 256   // capacidade inicial do deque de cada thread; dobra quando enche
+#define INJECT_QUEUE_SIZE 4096   // fila de cada nó para tarefas enviadas de fora do pool; potência de dois
+#define SPIN_ROUNDS 64           // voltas procurando trabalho antes de dormir
+#define INJECT_CHECK_INTERVAL 61 // a cada tantas buscas a fila do nó passa na frente do deque local
+#define CACHE_LINE 64
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() ((void)0)
+#endif
+
+// Modos de destroy_thread_pool
+#define POOL_DRAIN 1   // executa tudo o que já está na fila antes de parar
+#define POOL_DISCARD 2 // cancela o que ainda não começou
+
+#define POOL_ANY_NODE -1 // sem dica de afinidade: o nó de quem envia
+
+struct ThreadPool;
+
+/*
+ * Conjunto de tarefas esperadas juntas, com task_group_wait_all. Costuma
+ * viver na pilha de quem espera.
+ */
 typedef struct {
-    void (*function)(void*); // Ponteiro para a função que será executada
-    void* arg;               // Argumento da função
+    struct ThreadPool* pool;
+    atomic_long pending; // tarefas do grupo ainda não concluídas
+} TaskGroup;
+
+/*
+ * Uma tarefa é também o seu próprio futuro: o pool segura uma referência até
+ * terminar de executá-la, e add_task devolve outra para quem enviou.
+ */
+typedef struct Task {
+    void* (*function)(void*); // Ponteiro para a função que será executada
+    void* arg;                // Argumento da função
+    void* result;             // o que a função retornou; vale depois de concluída
+    struct ThreadPool* pool;
+    TaskGroup* group;         // NULL fora de um grupo
+    atomic_long pending;      // 1 até a tarefa terminar ou ser cancelada
+    atomic_int refs;
+    int cancelled;            // descartada por um POOL_DISCARD antes de começar
 } Task;
 
+typedef Task Future;
+
+/*
+ * Deque de Chase-Lev (na versão para memória fraca de Lê et al., 2013).
+ * Só a thread dona empilha e desempilha em `bottom`; as outras roubam em
+ * `top`, disputando com um CAS. Quando enche, o array dobra de tamanho; o
+ * antigo fica guardado até o destroy, porque um ladrão ainda pode estar lendo.
+ */
+typedef struct DequeArray {
+    long size;                   // potência de dois
+    struct DequeArray* retired;  // array anterior a este
+    _Atomic(Task*) slots[];
+} DequeArray;
+
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_long top;    // próxima tarefa a ser roubada
+    _Alignas(CACHE_LINE) atomic_long bottom; // próxima posição livre do dono
+    _Atomic(DequeArray*) array;
+} Deque;
+
+/*
+ * Fila MPMC sem locks (fila limitada de Vyukov): cada célula tem um
+ * número de sequência que diz se ela está livre para a volta atual de quem
+ * insere ou já pronta para quem retira.
+ */
+typedef struct {
+    atomic_size_t seq;
+    Task* task;
+} InjectCell;
+
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_size_t enqueue_pos;
+    _Alignas(CACHE_LINE) atomic_size_t dequeue_pos;
+    InjectCell* cells;
+    size_t mask;
+} InjectQueue;
+
+/*
+ * Cada thread fica presa a uma CPU. O deque começa numa linha de cache
+ * própria e o resto do Worker só é escrito pela dona, então threads vizinhas
+ * no array não disputam linhas.
+ */
 typedef struct {
-    pthread_mutex_t lock;
-    pthread_cond_t notify;
-    pthread_t threads[THREAD_POOL_SIZE];
-    Task task_queue[TASK_QUEUE_SIZE];
-    int queue_size;
-    int head;
-    int tail;
-    int count;
-    int shutdown;
+    Deque deque;
+    struct ThreadPool* pool;
+    pthread_t thread;
+    int index;
+    int node;       // índice em pool->nodes
+    int cpu;        // CPU a que está presa, -1 se não foi possível
+    unsigned rng;   // xorshift para sortear a vítima de um roubo
+    unsigned ticks; // buscas feitas, para consultar a fila do nó de tempos em tempos
+} Worker;
+
+/*
+ * Um nó NUMA com threads do pool. As threads de um nó são contíguas em
+ * pool->workers; cada nó tem a sua fila para tarefas de fora e o seu lugar
+ * para dormir, para que envios e despertares fiquem no nó.
+ */
+typedef struct {
+    InjectQueue inject;
+    _Alignas(CACHE_LINE) pthread_mutex_t sleep_lock;
+    pthread_cond_t work_available;
+    atomic_int sleepers;
+
+    // Só lidos depois da criação
+    _Alignas(CACHE_LINE) int id; // número do nó no sistema (nodeN no sysfs)
+    int first_worker;
+    int num_workers;
+    int* cpus; // CPUs do nó que o processo pode usar: uma por núcleo primeiro, depois as irmãs
+    int num_cpus;
+} Node;
+
+/*
+ * Os campos só lidos depois da criação vêm primeiro; cada grupo escrito
+ * durante a execução tem a sua linha de cache, para que quem espera espaço,
+ * quem espera um futuro e quem só consulta shutdown não se atrapalhem.
+ */
+typedef struct ThreadPool {
+    Worker* workers;
+    int num_threads;
+    Node* nodes;
+    int num_nodes;
+    int* cpu_order;           // as CPUs de todos os nós, na ordem de Node.cpus
+    short cpu_node[CPU_SETSIZE]; // índice em nodes para cada CPU, -1 se não houver
+
+    _Alignas(CACHE_LINE) atomic_int shutdown; // 0, POOL_DRAIN ou POOL_DISCARD
+
+    // Quem envia de fora espera aqui quando a fila do nó está cheia
+    _Alignas(CACHE_LINE) pthread_mutex_t space_lock;
+    pthread_cond_t space_available;
+    atomic_int space_waiters;
+
+    // Quem espera um futuro ou um grupo de fora do pool dorme aqui
+    _Alignas(CACHE_LINE) pthread_mutex_t done_lock;
+    pthread_cond_t task_done;
+    atomic_int done_waiters;
 } ThreadPool;
 
+// A thread do pool que está rodando, para que tarefas criadas por tarefas vão para o deque local
+static __thread Worker* current_worker;
+
 void* thread_worker(void* arg);
+static void stop_workers(ThreadPool* pool, int mode);
+static void free_pool(ThreadPool* pool, int deques);
+static void finish_task(Task* task, void* result, int cancelled);
 
-ThreadPool* create_thread_pool() {
-    ThreadPool* pool = (ThreadPool*)malloc(sizeof(ThreadPool));
-    pool->queue_size = TASK_QUEUE_SIZE;
-    pool->head = pool->tail = pool->count = 0;
-    pool->shutdown = 0;
-    pthread_mutex_init(&(pool->lock), NULL);
-    pthread_cond_init(&(pool->notify), NULL);
+/* --- Deque --- */
 
-    // Criar threads
-    for (int i = 0; i < THREAD_POOL_SIZE; i++) {
-        pthread_create(&(pool->threads[i]), NULL, thread_worker, (void*)pool);
-    }
-    return pool;
+static DequeArray* deque_array_create(long size) {
+    DequeArray* a = malloc(sizeof(DequeArray) + (size_t)size * sizeof(_Atomic(Task*)));
+    if (a == NULL)
+        return NULL;
+    a->size = size;
+    a->retired = NULL;
+    return a;
+}
+
+static int deque_init(Deque* q) {
+    DequeArray* a = deque_array_create(DEQUE_INITIAL_SIZE);
+    if (a == NULL)
+        return -1;
+    atomic_init(&q->top, 0);
+    atomic_init(&q->bottom, 0);
+    atomic_init(&q->array, a);
+    return 0;
 }
 
-void add_task(ThreadPool* pool, void (*function)(void*), void* arg) {
-    pthread_mutex_lock(&(pool->lock));
+// Só o dono chama: copia as tarefas vivas para um array com o dobro do tamanho
+static DequeArray* deque_grow(Deque* q, DequeArray* a, long top, long bottom) {
+    DequeArray* bigger = deque_array_create(a->size * 2);
+    if (bigger == NULL)
+        return NULL;
+    for (long i = top; i < bottom; i++)
+        atomic_store_explicit(&bigger->slots[i & (bigger->size - 1)],
+                              atomic_load_explicit(&a->slots[i & (a->size - 1)], memory_order_relaxed),
+                              memory_order_relaxed);
+    bigger->retired = a;
+    atomic_store_explicit(&q->array, bigger, memory_order_release);
+    return bigger;
+}
 
-    // Adiciona a tarefa à fila, se não estiver cheia
-    if (pool->count < pool->queue_size) {
-        Task task;
-        task.function = function;
-        task.arg = arg;
-        pool->task_queue[pool->tail] = task;
-        pool->tail = (pool->tail + 1) % pool->queue_size;
-        pool->count += 1;
+static int deque_push(Deque* q, Task* task) {
+    long bottom = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&q->top, memory_order_acquire);
+    DequeArray* a = atomic_load_explicit(&q->array, memory_order_relaxed);
 
-        // Notifica uma thread que há uma nova tarefa
-        pthread_cond_signal(&(pool->notify));
+    if (bottom - top > a->size - 1) {
+        a = deque_grow(q, a, top, bottom);
+        if (a == NULL)
+            return -1;
+    }
+    atomic_store_explicit(&a->slots[bottom & (a->size - 1)], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&q->bottom, bottom + 1, memory_order_relaxed);
+    return 0;
+}
+
+// O dono retira do fim (LIFO): a tarefa mais recente ainda está quente no cache
+static Task* deque_take(Deque* q) {
+    long bottom = atomic_load_explicit(&q->bottom, memory_order_relaxed) - 1;
+    DequeArray* a = atomic_load_explicit(&q->array, memory_order_relaxed);
+    atomic_store_explicit(&q->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&q->top, memory_order_relaxed);
+    Task* task = NULL;
+
+    if (top <= bottom) {
+        task = atomic_load_explicit(&a->slots[bottom & (a->size - 1)], memory_order_relaxed);
+        if (top == bottom) {
+            // Última tarefa: disputa com os ladrões
+            if (!atomic_compare_exchange_strong_explicit(&q->top, &top, top + 1, memory_order_seq_cst,
+                                                         memory_order_relaxed))
+                task = NULL;
+            atomic_store_explicit(&q->bottom, bottom + 1, memory_order_relaxed);
+        }
     } else {
-        printf("Fila de tarefas cheia. Tarefa descartada.\n");
+        atomic_store_explicit(&q->bottom, bottom + 1, memory_order_relaxed);
     }
-    
-    pthread_mutex_unlock(&(pool->lock));
+    return task;
 }
 
-void destroy_thread_pool(ThreadPool* pool) {
-    pthread_mutex_lock(&(pool->lock));
-    pool->shutdown = 1;
+// Outras threads roubam do início (FIFO). Retorna NULL se vazio; *lost indica que perdeu uma disputa
+static Task* deque_steal(Deque* q, int* lost) {
+    long top = atomic_load_explicit(&q->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&q->bottom, memory_order_acquire);
 
-    // Notificar todas as threads para finalizar
-    pthread_cond_broadcast(&(pool->notify));
-    pthread_mutex_unlock(&(pool->lock));
+    if (top >= bottom)
+        return NULL;
+    DequeArray* a = atomic_load_explicit(&q->array, memory_order_acquire);
+    Task* task = atomic_load_explicit(&a->slots[top & (a->size - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&q->top, &top, top + 1, memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        *lost = 1;
+        return NULL;
+    }
+    return task;
+}
 
-    // Aguarda todas as threads terminarem
-    for (int i = 0; i < THREAD_POOL_SIZE; i++) {
-        pthread_join(pool->threads[i], NULL);
+// O deque já deve estar vazio
+static void deque_destroy(Deque* q) {
+    DequeArray* a = atomic_load_explicit(&q->array, memory_order_relaxed);
+    while (a != NULL) {
+        DequeArray* retired = a->retired;
+        free(a);
+        a = retired;
     }
+}
 
-    pthread_mutex_destroy(&(pool->lock));
-    pthread_cond_destroy(&(pool->notify));
-    free(pool);
+/* --- Fila de cada nó --- */
+
+static int inject_init(InjectQueue* q, size_t size) {
+    q->cells = malloc(size * sizeof(InjectCell));
+    if (q->cells == NULL)
+        return -1;
+    for (size_t i = 0; i < size; i++)
+        atomic_init(&q->cells[i].seq, i);
+    q->mask = size - 1;
+    atomic_init(&q->enqueue_pos, 0);
+    atomic_init(&q->dequeue_pos, 0);
+    return 0;
 }
 
-void* thread_worker(void* arg) {
-    ThreadPool* pool = (ThreadPool*)arg;
+// Retorna 0 se a fila estiver cheia
+static int inject_push(InjectQueue* q, Task* task) {
+    size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    InjectCell* cell;
+
+    for (;;) {
+        cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+        }
+    }
+    cell->task = task;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return 1;
+}
 
-    while (1) {
-        Task task;
+static Task* inject_pop(InjectQueue* q) {
+    size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    InjectCell* cell;
 
-        pthread_mutex_lock(&(pool->lock));
+    for (;;) {
+        cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+        }
+    }
+    Task* task = cell->task;
+    atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+    return task;
+}
 
-        // Espera por uma tarefa ou pelo sinal de shutdown
-        while (pool->count == 0 && !pool->shutdown) {
-            pthread_cond_wait(&(pool->notify), &(pool->lock));
+/* --- Dormir e acordar --- */
+
+/*
+ * Depois de publicar count tarefas no nó node: acorda até count threads que
+ * estejam dormindo, primeiro nesse nó e, faltando, nos seguintes. A afinidade
+ * é uma preferência: trabalho parado espera menos que uma thread remota.
+ */
+static void notify_work(ThreadPool* pool, int node, long count) {
+    atomic_thread_fence(memory_order_seq_cst);
+    for (int i = 0; i < pool->num_nodes && count > 0; i++) {
+        Node* n = &pool->nodes[(node + i) % pool->num_nodes];
+        int sleepers = atomic_load_explicit(&n->sleepers, memory_order_relaxed);
+        if (sleepers == 0)
+            continue;
+        pthread_mutex_lock(&(n->sleep_lock));
+        if (count >= sleepers) {
+            pthread_cond_broadcast(&(n->work_available));
+        } else {
+            for (long k = 0; k < count; k++)
+                pthread_cond_signal(&(n->work_available));
         }
+        pthread_mutex_unlock(&(n->sleep_lock));
+        count -= sleepers;
+    }
+}
+
+// Depois de liberar uma célula de uma fila de nó: acorda quem esperava espaço
+static void notify_space(ThreadPool* pool) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&pool->space_waiters, memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&(pool->space_lock));
+        pthread_cond_broadcast(&(pool->space_available));
+        pthread_mutex_unlock(&(pool->space_lock));
+    }
+}
+
+static Task* inject_take(ThreadPool* pool, Node* node) {
+    Task* task = inject_pop(&node->inject);
+    if (task != NULL)
+        notify_space(pool);
+    return task;
+}
+
+// Tenta as threads [first, first + count) a partir de uma sorteada
+static Task* steal_range(Worker* self, int first, int count, int* lost) {
+    ThreadPool* pool = self->pool;
+
+    self->rng ^= self->rng << 13;
+    self->rng ^= self->rng >> 17;
+    self->rng ^= self->rng << 5;
+    int start = (int)(self->rng % (unsigned)count);
+    for (int i = 0; i < count; i++) {
+        Worker* victim = &pool->workers[first + (start + i) % count];
+        if (victim == self)
+            continue;
+        Task* task = deque_steal(&victim->deque, lost);
+        if (task != NULL) {
+            PROBE(steal, task->function, task->arg, victim->index);
+            return task;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Rouba primeiro das threads do próprio nó, cujos dados tendem a estar na
+ * memória local; só então das filas e threads dos outros nós, a começar pelo
+ * seguinte. Repete enquanto alguma disputa perdida indicar trabalho.
+ */
+static Task* steal_task(Worker* self) {
+    ThreadPool* pool = self->pool;
+    Node* home = &pool->nodes[self->node];
+    Task* task;
+    int lost;
+
+    if (pool->num_threads == 1)
+        return NULL;
+    do {
+        lost = 0;
+        if ((task = steal_range(self, home->first_worker, home->num_workers, &lost)) != NULL)
+            return task;
+        for (int i = 1; i < pool->num_nodes; i++) {
+            Node* node = &pool->nodes[(self->node + i) % pool->num_nodes];
+            if ((task = inject_take(pool, node)) != NULL)
+                return task;
+            if ((task = steal_range(self, node->first_worker, node->num_workers, &lost)) != NULL)
+                return task;
+        }
+    } while (lost);
+    return NULL;
+}
+
+static Task* find_task(Worker* self) {
+    ThreadPool* pool = self->pool;
+    Node* home = &pool->nodes[self->node];
+    Task* task;
+
+    // De vez em quando a fila do nó vem primeiro, para que tarefas de fora não esperem para sempre
+    if (++self->ticks % INJECT_CHECK_INTERVAL == 0 && (task = inject_take(pool, home)) != NULL)
+        return task;
+    if ((task = deque_take(&self->deque)) != NULL)
+        return task;
+    if ((task = inject_take(pool, home)) != NULL)
+        return task;
+    return steal_task(self);
+}
+
+// Última verificação sob o lock antes de dormir: quem publica depois disso vê sleepers > 0 e acorda
+static Task* wait_for_task(Worker* self) {
+    ThreadPool* pool = self->pool;
+    Node* home = &pool->nodes[self->node];
+    Task* task;
 
-        // Finaliza a thread se o pool estiver em shutdown
-        if (pool->shutdown) {
-            pthread_mutex_unlock(&(pool->lock));
+    pthread_mutex_lock(&(home->sleep_lock));
+    atomic_fetch_add_explicit(&home->sleepers, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    while ((task = find_task(self)) == NULL && !atomic_load_explicit(&pool->shutdown, memory_order_relaxed)) {
+        PROBE(park, self->index);
+        pthread_cond_wait(&(home->work_available), &(home->sleep_lock));
+    }
+    atomic_fetch_sub_explicit(&home->sleepers, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&(home->sleep_lock));
+    return task;
+}
+
+/* --- Conclusão e espera --- */
+
+// A thread do pool que está rodando, se for deste pool
+static Worker* local_worker(ThreadPool* pool) {
+    Worker* self = current_worker;
+    return self != NULL && self->pool == pool ? self : NULL;
+}
+
+static Task* task_create(ThreadPool* pool, void* (*function)(void*), void* arg, TaskGroup* group, int refs) {
+    Task* task = (Task*)malloc(sizeof(Task));
+    if (task == NULL)
+        return NULL;
+    task->function = function;
+    task->arg = arg;
+    task->result = NULL;
+    task->pool = pool;
+    task->group = group;
+    task->cancelled = 0;
+    atomic_init(&task->pending, 1);
+    atomic_init(&task->refs, refs);
+    return task;
+}
+
+static void task_release(Task* task) {
+    if (atomic_fetch_sub_explicit(&task->refs, 1, memory_order_acq_rel) == 1)
+        free(task);
+}
+
+// Desconta n de um contador de pendentes; quem o zera acorda quem espera de fora do pool
+static void complete(ThreadPool* pool, atomic_long* pending, long n) {
+    if (atomic_fetch_sub_explicit(pending, n, memory_order_acq_rel) != n)
+        return;
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&pool->done_waiters, memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&(pool->done_lock));
+        pthread_cond_broadcast(&(pool->task_done));
+        pthread_mutex_unlock(&(pool->done_lock));
+    }
+}
+
+// O resultado é publicado antes de pending zerar; o grupo pode sumir assim que o seu zerar
+static void finish_task(Task* task, void* result, int cancelled) {
+    ThreadPool* pool = task->pool;
+    TaskGroup* group = task->group;
+
+    task->result = result;
+    task->cancelled = cancelled;
+    complete(pool, &task->pending, 1);
+    if (group != NULL)
+        complete(pool, &group->pending, 1);
+    task_release(task);
+}
+
+// Em POOL_DISCARD, o que ainda não começou é cancelado em vez de executado
+static void run_task(Worker* self, Task* task) {
+    void* result = NULL;
+    int cancelled = atomic_load_explicit(&self->pool->shutdown, memory_order_relaxed) == POOL_DISCARD;
+
+    PROBE(dequeue, task->function, task->arg, self->index);
+    if (!cancelled) {
+        PROBE(execute_start, task->function, task->arg);
+        result = (*(task->function))(task->arg);
+        PROBE(execute_end, task->function, task->arg);
+    }
+    finish_task(task, result, cancelled);
+}
+
+/*
+ * Espera um contador de pendentes chegar a zero. Uma thread do pool não pode
+ * simplesmente dormir: prenderia a thread, e se todas esperassem, ninguém
+ * executaria as tarefas esperadas. Ela executa outras tarefas enquanto isso.
+ */
+static void wait_pending(ThreadPool* pool, atomic_long* pending) {
+    Worker* self = local_worker(pool);
+
+    if (self != NULL) {
+        int idle = 0;
+        while (atomic_load_explicit(pending, memory_order_acquire) > 0) {
+            Task* task = find_task(self);
+            if (task != NULL) {
+                run_task(self, task);
+                idle = 0;
+            } else if (++idle < SPIN_ROUNDS) {
+                cpu_relax();
+            } else {
+                sched_yield(); // a tarefa esperada está rodando em outra thread
+            }
+        }
+        return;
+    }
+
+    for (int spin = 0; spin < SPIN_ROUNDS; spin++) {
+        if (atomic_load_explicit(pending, memory_order_acquire) == 0)
+            return;
+        cpu_relax();
+    }
+    pthread_mutex_lock(&(pool->done_lock));
+    atomic_fetch_add_explicit(&pool->done_waiters, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    while (atomic_load_explicit(pending, memory_order_acquire) > 0)
+        pthread_cond_wait(&(pool->task_done), &(pool->done_lock));
+    atomic_fetch_sub_explicit(&pool->done_waiters, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&(pool->done_lock));
+}
+
+/* --- Topologia --- */
+
+// Lê uma lista do sysfs como "0-3,8-11"; retorna -1 se o arquivo não existir
+static int read_cpu_list(const char* path, cpu_set_t* set) {
+    char buf[4096];
+    FILE* f = fopen(path, "r");
+
+    CPU_ZERO(set);
+    if (f == NULL)
+        return -1;
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    char* p = buf;
+    for (;;) {
+        char* end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p)
+            break;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+        }
+        for (long c = first; c <= last && c < CPU_SETSIZE; c++)
+            CPU_SET(c, set);
+        if (*end != ',')
             break;
+        p = end + 1;
+    }
+    return 0;
+}
+
+// Se cpu é a primeira do seu núcleo físico; as outras são irmãs (hyperthreads) e dividem o núcleo
+static int core_leader(int cpu) {
+    char path[96];
+    cpu_set_t siblings;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+    if (read_cpu_list(path, &siblings) != 0)
+        return 1;
+    for (int c = 0; c < cpu; c++) {
+        if (CPU_ISSET(c, &siblings))
+            return 0;
+    }
+    return 1;
+}
+
+// Um nó com as CPUs de cpus: uma por núcleo primeiro, as irmãs no fim
+static void add_node(ThreadPool* pool, int id, const cpu_set_t* cpus, int* placed) {
+    Node* node = &pool->nodes[pool->num_nodes++];
+    int siblings[CPU_SETSIZE];
+    int num_siblings = 0;
+
+    node->id = id;
+    node->cpus = &pool->cpu_order[*placed];
+    node->num_cpus = 0;
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (!CPU_ISSET(c, cpus))
+            continue;
+        if (core_leader(c))
+            node->cpus[node->num_cpus++] = c;
+        else
+            siblings[num_siblings++] = c;
+    }
+    memcpy(&node->cpus[node->num_cpus], siblings, (size_t)num_siblings * sizeof(int));
+    node->num_cpus += num_siblings;
+    *placed += node->num_cpus;
+}
+
+/*
+ * Os nós NUMA com CPUs em que o processo pode rodar (respeitando taskset e
+ * cpusets), lidos do sysfs sem depender da libnuma. Sem o sysfs, tudo vira
+ * um nó só. Anota também o nó do sistema de cada CPU, em cpu_node.
+ */
+static int discover_nodes(ThreadPool* pool) {
+    cpu_set_t allowed, online, cpus;
+    char path[96];
+    int placed = 0;
+
+    for (int c = 0; c < CPU_SETSIZE; c++)
+        pool->cpu_node[c] = -1;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        CPU_ZERO(&allowed);
+        for (long c = 0; c < (n > 0 ? n : 1) && c < CPU_SETSIZE; c++)
+            CPU_SET(c, &allowed);
+    }
+    if (read_cpu_list("/sys/devices/system/node/online", &online) != 0)
+        CPU_ZERO(&online);
+
+    pool->cpu_order = (int*)malloc((size_t)CPU_COUNT(&allowed) * sizeof(int));
+    pool->nodes = aligned_alloc(_Alignof(Node), (size_t)(CPU_COUNT(&online) + 1) * sizeof(Node));
+    if (pool->cpu_order == NULL || pool->nodes == NULL)
+        return -1;
+    memset(pool->nodes, 0, (size_t)(CPU_COUNT(&online) + 1) * sizeof(Node));
+
+    for (int id = 0; id < CPU_SETSIZE; id++) {
+        if (!CPU_ISSET(id, &online))
+            continue;
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+        if (read_cpu_list(path, &cpus) != 0)
+            continue;
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &cpus))
+                pool->cpu_node[c] = (short)id;
         }
+        CPU_AND(&cpus, &cpus, &allowed);
+        if (CPU_COUNT(&cpus) > 0) // senão é um nó só de memória, ou fora da afinidade do processo
+            add_node(pool, id, &cpus, &placed);
+    }
+    if (placed < CPU_COUNT(&allowed)) {
+        // Sem NUMA no sysfs, ou CPUs que ele não lista: um nó só com todas
+        pool->num_nodes = 0;
+        placed = 0;
+        add_node(pool, 0, &allowed, &placed);
+    }
+    return 0;
+}
 
-        // Pega a próxima tarefa
-        task = pool->task_queue[pool->head];
-        pool->head = (pool->head + 1) % pool->queue_size;
-        pool->count -= 1;
+/*
+ * Distribui as threads pelos nós em rodízio, enquanto algum nó tiver CPU
+ * livre, e descarta os nós que ficaram sem thread. Depois disso cpu_node
+ * passa a dar o índice em nodes, e não o número do nó no sistema.
+ */
+static void place_workers(ThreadPool* pool, int num_threads) {
+    int k = 0, kept = 0, first = 0;
 
-        pthread_mutex_unlock(&(pool->lock));
+    for (int i = 0; i < num_threads; i++) {
+        for (int tries = 0; tries < pool->num_nodes && pool->nodes[k].num_workers >= pool->nodes[k].num_cpus;
+             tries++)
+            k = (k + 1) % pool->num_nodes;
+        pool->nodes[k].num_workers++;
+        k = (k + 1) % pool->num_nodes;
+    }
+    for (k = 0; k < pool->num_nodes; k++) {
+        if (pool->nodes[k].num_workers == 0)
+            continue;
+        pool->nodes[kept] = pool->nodes[k];
+        pool->nodes[kept].first_worker = first;
+        first += pool->nodes[kept].num_workers;
+        kept++;
+    }
+    pool->num_nodes = kept;
 
-        // Executa a tarefa fora do bloqueio
-        (*(task.function))(task.arg);
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        int index = -1;
+        for (k = 0; k < pool->num_nodes; k++) {
+            if (pool->nodes[k].id == pool->cpu_node[c])
+                index = k;
+        }
+        pool->cpu_node[c] = (short)index;
     }
-    pthread_exit(NULL);
 }
 
-// Função de exemplo que simula uma tarefa
-void example_task(void* arg) {
+/*
+ * O nó do sistema onde está a página de addr, ou -1 se ela ainda não foi
+ * tocada ou o kernel não souber dizer. Serve de dica para add_task_on, para
+ * que uma tarefa presa à memória rode perto dos seus dados.
+ */
+int memory_node(const void* addr) {
+#if defined(SYS_move_pages)
+    long page = sysconf(_SC_PAGESIZE);
+    void* pages[1] = {(void*)((uintptr_t)addr & ~(uintptr_t)(page - 1))};
+    int status = -1;
+
+    // Sem nós de destino, move_pages só informa onde cada página está
+    if (syscall(SYS_move_pages, 0, 1UL, pages, NULL, &status, 0) == 0 && status >= 0)
+        return status;
+#else
+    (void)addr;
+#endif
+    return -1;
+}
+
+// Índice do nó para uma dica (nó do sistema); sem dica, ou com um nó sem threads, o da CPU de quem chama
+static int pick_node(ThreadPool* pool, int hint) {
+    if (pool->num_nodes == 1)
+        return 0;
+    if (hint != POOL_ANY_NODE) {
+        for (int k = 0; k < pool->num_nodes; k++) {
+            if (pool->nodes[k].id == hint)
+                return k;
+        }
+    }
+    int cpu = sched_getcpu();
+    if (cpu >= 0 && cpu < CPU_SETSIZE && pool->cpu_node[cpu] >= 0)
+        return pool->cpu_node[cpu];
+    return 0;
+}
+
+/* --- Pool --- */
+
+// Presa a uma CPU desde a criação, para nem começar no nó errado
+static int start_worker(Worker* w) {
+    pthread_attr_t attr;
+    cpu_set_t set;
+    int ret;
+
+    pthread_attr_init(&attr);
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    if (pthread_attr_setaffinity_np(&attr, sizeof(set), &set) != 0)
+        w->cpu = -1;
+    ret = pthread_create(&(w->thread), &attr, thread_worker, w);
+    pthread_attr_destroy(&attr);
+    if (ret != 0 && w->cpu >= 0) {
+        // A CPU pode ter saído do cpuset desde discover_nodes: melhor solta que sem thread
+        w->cpu = -1;
+        ret = pthread_create(&(w->thread), NULL, thread_worker, w);
+    }
+    return ret;
+}
+
+/*
+ * num_threads 0 usa uma thread por CPU que o processo pode usar. As threads
+ * são distribuídas pelos nós NUMA e cada uma fica presa a uma CPU, um núcleo
+ * físico de cada vez antes de usar as irmãs.
+ */
+ThreadPool* create_thread_pool(int num_threads) {
+    ThreadPool* pool = aligned_alloc(_Alignof(ThreadPool), sizeof(ThreadPool));
+    if (pool == NULL)
+        return NULL;
+    memset(pool, 0, sizeof(ThreadPool));
+    if (discover_nodes(pool) != 0) {
+        free(pool->cpu_order);
+        free(pool->nodes);
+        free(pool);
+        return NULL;
+    }
+    if (num_threads <= 0) {
+        num_threads = 0;
+        for (int k = 0; k < pool->num_nodes; k++)
+            num_threads += pool->nodes[k].num_cpus;
+    }
+    place_workers(pool, num_threads);
+
+    atomic_init(&pool->shutdown, 0);
+    atomic_init(&pool->space_waiters, 0);
+    atomic_init(&pool->done_waiters, 0);
+    pthread_mutex_init(&(pool->space_lock), NULL);
+    pthread_cond_init(&(pool->space_available), NULL);
+    pthread_mutex_init(&(pool->done_lock), NULL);
+    pthread_cond_init(&(pool->task_done), NULL);
+
+    for (int k = 0; k < pool->num_nodes; k++) {
+        Node* node = &pool->nodes[k];
+        atomic_init(&node->sleepers, 0);
+        pthread_mutex_init(&(node->sleep_lock), NULL);
+        pthread_cond_init(&(node->work_available), NULL);
+    }
+    int queues = 0;
+    for (; queues < pool->num_nodes; queues++) {
+        if (inject_init(&pool->nodes[queues].inject, INJECT_QUEUE_SIZE) != 0)
+            break;
+    }
+    pool->workers = aligned_alloc(_Alignof(Worker), (size_t)num_threads * sizeof(Worker));
+    if (queues < pool->num_nodes || pool->workers == NULL) {
+        free_pool(pool, 0);
+        return NULL;
+    }
+    pool->num_threads = num_threads;
+
+    int deques = 0, threads = 0;
+    for (int k = 0; k < pool->num_nodes; k++) {
+        Node* node = &pool->nodes[k];
+        for (int j = 0; j < node->num_workers; j++) {
+            Worker* w = &pool->workers[node->first_worker + j];
+            w->pool = pool;
+            w->index = node->first_worker + j;
+            w->node = k;
+            w->cpu = node->cpus[j % node->num_cpus];
+            w->rng = 2463534242u + (unsigned)w->index * 2654435761u;
+            w->ticks = 0;
+        }
+    }
+    for (; deques < num_threads; deques++) {
+        if (deque_init(&pool->workers[deques].deque) != 0)
+            break;
+    }
+
+    // Criar threads
+    if (deques == num_threads) {
+        for (; threads < num_threads; threads++) {
+            if (start_worker(&pool->workers[threads]) != 0)
+                break;
+        }
+    }
+    if (threads < num_threads) {
+        // Desfaz só o que chegou a ser criado
+        pool->num_threads = threads;
+        stop_workers(pool, POOL_DISCARD);
+        free_pool(pool, deques);
+        return NULL;
+    }
+    return pool;
+}
+
+/*
+ * Publica uma tarefa sem acordar ninguém e retorna o índice do nó onde ela
+ * entrou. De dentro de uma tarefa do próprio pool, e sem dica para outro nó,
+ * vai para o deque local, que cresce sem limite; senão vai para a fila do nó
+ * e espera se ela estiver cheia. Retorna -1 sem memória ou se o pool parar
+ * enquanto espera.
+ */
+static int push_task(ThreadPool* pool, Worker* self, int hint, Task* task) {
+    if (self != NULL && (hint == POOL_ANY_NODE || pool->nodes[self->node].id == hint)) {
+        PROBE(enqueue, task->function, task->arg, 0);
+        return deque_push(&self->deque, task) == 0 ? self->node : -1;
+    }
+
+    int node = self != NULL && hint == POOL_ANY_NODE ? self->node : pick_node(pool, hint);
+    InjectQueue* q = &pool->nodes[node].inject;
+    PROBE(enqueue, task->function, task->arg, 1);
+    for (int spin = 0; !inject_push(q, task); spin++) {
+        if (spin < SPIN_ROUNDS) {
+            cpu_relax();
+            continue;
+        }
+        // Fila cheia: acorda todo mundo (num lote, ninguém foi avisado ainda) e espera espaço
+        PROBE(submit_wait, task->function, task->arg);
+        notify_work(pool, node, pool->num_threads);
+        int queued = 0;
+        pthread_mutex_lock(&(pool->space_lock));
+        atomic_fetch_add_explicit(&pool->space_waiters, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        while (!(queued = inject_push(q, task)) && !atomic_load_explicit(&pool->shutdown, memory_order_relaxed))
+            pthread_cond_wait(&(pool->space_available), &(pool->space_lock));
+        atomic_fetch_sub_explicit(&pool->space_waiters, 1, memory_order_relaxed);
+        pthread_mutex_unlock(&(pool->space_lock));
+        return queued ? node : -1;
+    }
+    return node;
+}
+
+// Depois do shutdown só as tarefas do próprio pool ainda podem criar outras
+static int accepting(ThreadPool* pool, Worker* self) {
+    return self != NULL || !atomic_load_explicit(&pool->shutdown, memory_order_relaxed);
+}
+
+static Task* enqueue(ThreadPool* pool, int hint, void* (*function)(void*), void* arg, TaskGroup* group, int refs) {
+    Worker* self = local_worker(pool);
+    if (!accepting(pool, self))
+        return NULL;
+    Task* task = task_create(pool, function, arg, group, refs);
+    if (task == NULL)
+        return NULL;
+    int node = push_task(pool, self, hint, task);
+    if (node < 0) {
+        free(task);
+        return NULL;
+    }
+    notify_work(pool, node, 1);
+    return task;
+}
+
+/*
+ * Enfileira uma tarefa e devolve o seu futuro, que quem chamou libera com
+ * future_release. Nenhuma tarefa é descartada por falta de espaço.
+ * Retorna NULL sem memória ou com o pool em shutdown.
+ */
+Future* add_task(ThreadPool* pool, void* (*function)(void*), void* arg) {
+    return enqueue(pool, POOL_ANY_NODE, function, arg, NULL, 2);
+}
+
+/*
+ * Como add_task, com uma dica de afinidade: node é um nó do sistema (por
+ * exemplo memory_node() dos dados da tarefa), e a tarefa entra na fila das
+ * threads desse nó. Se elas estiverem ocupadas e outras ociosas, uma thread
+ * de outro nó ainda pode pegá-la.
+ */
+Future* add_task_on(ThreadPool* pool, int node, void* (*function)(void*), void* arg) {
+    return enqueue(pool, node, function, arg, NULL, 2);
+}
+
+// Como add_task, para quem não quer o resultado: não há futuro a liberar
+int add_task_detached(ThreadPool* pool, void* (*function)(void*), void* arg) {
+    return enqueue(pool, POOL_ANY_NODE, function, arg, NULL, 1) != NULL ? 0 : -1;
+}
+
+/*
+ * Enfileira function(args[i]) para i < count e acorda as threads uma vez só,
+ * no fim. Com group, as tarefas entram no grupo. Retorna quantas entraram na
+ * fila: menos que count só sem memória ou com o pool em shutdown.
+ */
+long submit_batch(ThreadPool* pool, void* (*function)(void*), void* const* args, long count, TaskGroup* group) {
+    Worker* self = local_worker(pool);
+    long queued = 0;
+    int node = 0;
+
+    if (group != NULL)
+        atomic_fetch_add_explicit(&group->pending, count, memory_order_relaxed);
+    while (queued < count && accepting(pool, self)) {
+        Task* task = task_create(pool, function, args[queued], group, 1);
+        if (task == NULL)
+            break;
+        if ((node = push_task(pool, self, POOL_ANY_NODE, task)) < 0) {
+            free(task);
+            break;
+        }
+        queued++;
+    }
+    if (queued > 0)
+        notify_work(pool, node < 0 ? 0 : node, queued);
+    if (group != NULL && queued < count)
+        complete(pool, &group->pending, count - queued);
+    return queued;
+}
+
+/* --- Futuros e grupos --- */
+
+int future_done(Future* future) {
+    return atomic_load_explicit(&future->pending, memory_order_acquire) == 0;
+}
+
+// Espera a tarefa e devolve o que ela retornou (NULL se foi cancelada)
+void* future_get(Future* future) {
+    wait_pending(future->pool, &future->pending);
+    return future->result;
+}
+
+// Se a tarefa foi cancelada por um POOL_DISCARD em vez de executada
+int future_cancelled(Future* future) {
+    future_get(future);
+    return future->cancelled;
+}
+
+void future_release(Future* future) {
+    if (future != NULL)
+        task_release(future);
+}
+
+void task_group_init(TaskGroup* group, ThreadPool* pool) {
+    group->pool = pool;
+    atomic_init(&group->pending, 0);
+}
+
+int task_group_add(TaskGroup* group, void* (*function)(void*), void* arg) {
+    atomic_fetch_add_explicit(&group->pending, 1, memory_order_relaxed);
+    if (enqueue(group->pool, POOL_ANY_NODE, function, arg, group, 1) == NULL) {
+        complete(group->pool, &group->pending, 1);
+        return -1;
+    }
+    return 0;
+}
+
+// Espera todas as tarefas do grupo, inclusive as adicionadas por tarefas dele enquanto espera
+void task_group_wait_all(TaskGroup* group) {
+    wait_pending(group->pool, &group->pending);
+}
+
+/* --- Laços paralelos --- */
+
+typedef struct {
+    void (*for_body)(long begin, long end, void* ctx);
+    void (*reduce_body)(long begin, long end, void* partial, void* ctx);
+    void* ctx;
+} RangeJob;
+
+typedef struct {
+    const RangeJob* job;
+    long begin, end;
+    void* partial;
+} RangeChunk;
+
+static void* range_chunk_task(void* arg) {
+    RangeChunk* chunk = (RangeChunk*)arg;
+    const RangeJob* job = chunk->job;
+
+    if (job->reduce_body != NULL)
+        job->reduce_body(chunk->begin, chunk->end, chunk->partial, job->ctx);
+    else
+        job->for_body(chunk->begin, chunk->end, job->ctx);
+    return NULL;
+}
+
+// grain <= 0 escolhe uns quatro pedaços por thread, para equilibrar pedaços de custo desigual
+static long range_chunks(ThreadPool* pool, long begin, long end, long* grain) {
+    if (*grain <= 0) {
+        *grain = (end - begin) / ((long)pool->num_threads * 4);
+        if (*grain < 1)
+            *grain = 1;
+    }
+    return (end - begin + *grain - 1) / *grain;
+}
+
+// Um lote com um pedaço por tarefa; o que não entrar na fila roda aqui mesmo
+static int run_range(ThreadPool* pool, const RangeJob* job, long begin, long end, long grain, long chunks,
+                     unsigned char* partials, size_t size) {
+    RangeChunk* chunk = (RangeChunk*)malloc((size_t)chunks * sizeof(RangeChunk));
+    void** args = (void**)malloc((size_t)chunks * sizeof(void*));
+    if (chunk == NULL || args == NULL) {
+        free(chunk);
+        free(args);
+        return -1;
+    }
+    for (long i = 0; i < chunks; i++) {
+        chunk[i].job = job;
+        chunk[i].begin = begin + i * grain;
+        chunk[i].end = end - chunk[i].begin > grain ? chunk[i].begin + grain : end;
+        chunk[i].partial = partials != NULL ? partials + (size_t)i * size : NULL;
+        args[i] = &chunk[i];
+    }
+
+    TaskGroup group;
+    task_group_init(&group, pool);
+    for (long i = submit_batch(pool, range_chunk_task, args, chunks, &group); i < chunks; i++)
+        range_chunk_task(&chunk[i]);
+    task_group_wait_all(&group);
+    free(chunk);
+    free(args);
+    return 0;
+}
+
+/*
+ * Chama body(b, e, ctx) sobre pedaços de até grain índices que cobrem
+ * [begin, end), em paralelo, e volta quando todos terminarem. Pode ser
+ * chamado de dentro de uma tarefa. Retorna -1 sem memória.
+ */
+int parallel_for(ThreadPool* pool, long begin, long end, long grain, void (*body)(long begin, long end, void* ctx),
+                 void* ctx) {
+    if (end <= begin)
+        return 0;
+    long chunks = range_chunks(pool, begin, end, &grain);
+    if (chunks == 1) {
+        body(begin, end, ctx);
+        return 0;
+    }
+    RangeJob job = {body, NULL, ctx};
+    return run_range(pool, &job, begin, end, grain, chunks, NULL, 0);
+}
+
+/*
+ * Redução paralela sobre [begin, end). *result (de size bytes) entra com o
+ * elemento neutro: cada pedaço começa de uma cópia dele e body acumula ali;
+ * no fim, combine(result, parcial, ctx) junta os parciais em result na ordem
+ * dos índices, então combine só precisa ser associativa.
+ */
+int parallel_reduce(ThreadPool* pool, long begin, long end, long grain,
+                    void (*body)(long begin, long end, void* partial, void* ctx),
+                    void (*combine)(void* result, const void* partial, void* ctx), void* result, size_t size,
+                    void* ctx) {
+    if (end <= begin)
+        return 0;
+    long chunks = range_chunks(pool, begin, end, &grain);
+    unsigned char* partials = (unsigned char*)malloc((size_t)chunks * size);
+    if (partials == NULL)
+        return -1;
+    for (long i = 0; i < chunks; i++)
+        memcpy(partials + (size_t)i * size, result, size);
+
+    RangeJob job = {NULL, body, ctx};
+    if (run_range(pool, &job, begin, end, grain, chunks, partials, size) != 0) {
+        free(partials);
+        return -1;
+    }
+    for (long i = 0; i < chunks; i++)
+        combine(result, partials + (size_t)i * size, ctx);
+    free(partials);
+    return 0;
+}
+
+/* --- Shutdown --- */
+
+static void stop_workers(ThreadPool* pool, int mode) {
+    atomic_store(&pool->shutdown, mode);
+
+    // Notificar todas as threads para finalizar, e quem espera espaço na fila
+    for (int k = 0; k < pool->num_nodes; k++) {
+        pthread_mutex_lock(&(pool->nodes[k].sleep_lock));
+        pthread_cond_broadcast(&(pool->nodes[k].work_available));
+        pthread_mutex_unlock(&(pool->nodes[k].sleep_lock));
+    }
+    pthread_mutex_lock(&(pool->space_lock));
+    pthread_cond_broadcast(&(pool->space_available));
+    pthread_mutex_unlock(&(pool->space_lock));
+
+    // Aguarda todas as threads terminarem
+    for (int i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+}
+
+// O que sobrou nas filas (só se a criação falhou) é cancelado, para não deixar futuros esperando
+static void free_pool(ThreadPool* pool, int deques) {
+    Task* task;
+    for (int i = 0; i < deques; i++) {
+        while ((task = deque_take(&pool->workers[i].deque)) != NULL)
+            finish_task(task, NULL, 1);
+        deque_destroy(&pool->workers[i].deque);
+    }
+    for (int k = 0; k < pool->num_nodes; k++) {
+        Node* node = &pool->nodes[k];
+        if (node->inject.cells != NULL) {
+            while ((task = inject_pop(&node->inject)) != NULL)
+                finish_task(task, NULL, 1);
+            free(node->inject.cells);
+        }
+        pthread_mutex_destroy(&(node->sleep_lock));
+        pthread_cond_destroy(&(node->work_available));
+    }
+    free(pool->nodes);
+    free(pool->cpu_order);
+    free(pool->workers);
+    pthread_mutex_destroy(&(pool->space_lock));
+    pthread_cond_destroy(&(pool->space_available));
+    pthread_mutex_destroy(&(pool->done_lock));
+    pthread_cond_destroy(&(pool->task_done));
+    free(pool);
+}
+
+/*
+ * Para o pool. Novas tarefas de fora são recusadas desde já; as que já estão
+ * na fila, e as que elas criarem, são executadas (POOL_DRAIN) ou canceladas
+ * (POOL_DISCARD): seus futuros e grupos concluem de qualquer jeito, então
+ * ninguém fica esperando. Tarefas em execução sempre terminam.
+ */
+void destroy_thread_pool(ThreadPool* pool, int mode) {
+    stop_workers(pool, mode);
+    free_pool(pool, pool->num_threads);
+}
+
+// Depois do shutdown, cada thread sai quando não acha mais trabalho em fila nenhuma
+void* thread_worker(void* arg) {
+    Worker* self = (Worker*)arg;
+
+    current_worker = self;
+    for (;;) {
+        Task* task = find_task(self);
+
+        // Gira um pouco antes de dormir: com tarefas curtas, a próxima costuma chegar logo
+        for (int spin = 0; task == NULL && spin < SPIN_ROUNDS; spin++) {
+            cpu_relax();
+            task = find_task(self);
+        }
+        if (task == NULL && (task = wait_for_task(self)) == NULL)
+            break;
+        run_task(self, task);
+    }
+    current_worker = NULL;
+    return NULL;
+}
+
+// Função de exemplo que simula uma tarefa; o resultado volta pelo futuro
+void* example_task(void* arg) {
     int num = *((int*)arg);
-    printf("Processando tarefa %d na thread %ld\n", num, pthread_self());
+    printf("Processando tarefa %d na thread %lu\n", num, (unsigned long)pthread_self());
+    free(arg);
     sleep(1);  // Simula trabalho
+    return (void*)(intptr_t)(num * num);
+}
+
+// Fork-join: cada chamada entrega um ramo ao pool, calcula o outro e espera pelo grupo
+static ThreadPool* demo_pool;
+
+typedef struct {
+    int n;
+    long result;
+} FibArg;
+
+void* fib_task(void* arg) {
+    FibArg* fib = (FibArg*)arg;
+    if (fib->n < 2) {
+        fib->result = fib->n;
+        return NULL;
+    }
+    FibArg left = {fib->n - 1, 0}, right = {fib->n - 2, 0};
+    TaskGroup group;
+    task_group_init(&group, demo_pool);
+    if (task_group_add(&group, fib_task, &left) != 0)
+        fib_task(&left);
+    fib_task(&right);
+    task_group_wait_all(&group);
+    fib->result = left.result + right.result;
+    return NULL;
 }
 
-int main() {
-    ThreadPool* pool = create_thread_pool();
+static void square_range(long begin, long end, void* ctx) {
+    long* values = (long*)ctx;
+    for (long i = begin; i < end; i++)
+        values[i] = i * i;
+}
 
-    // Adiciona tarefas ao pool
+static void sum_range(long begin, long end, void* partial, void* ctx) {
+    const long* values = (const long*)ctx;
+    long sum = 0;
+    for (long i = begin; i < end; i++)
+        sum += values[i];
+    *(long*)partial += sum;
+}
+
+static void sum_combine(void* result, const void* partial, void* ctx) {
+    (void)ctx;
+    *(long*)result += *(const long*)partial;
+}
+
+// Percorre um bloco grande de memória: vale rodar no nó onde ele está
+typedef struct {
+    const long* values;
+    long n;
+    long sum;
+    int cpu;
+} SumArg;
+
+void* sum_task(void* arg) {
+    SumArg* a = (SumArg*)arg;
+    a->sum = 0;
+    for (long i = 0; i < a->n; i++)
+        a->sum += a->values[i];
+    a->cpu = sched_getcpu();
+    return NULL;
+}
+
+static atomic_long counted;
+
+void* count_task(void* arg) {
+    (void)arg;
+    atomic_fetch_add_explicit(&counted, 1, memory_order_relaxed);
+    return NULL;
+}
+
+static double elapsed_s(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char** argv) {
+    int num_threads = argc > 1 ? atoi(argv[1]) : 0; // 0: um por núcleo
+    ThreadPool* pool = create_thread_pool(num_threads);
+    if (pool == NULL) {
+        printf("Falha ao criar o pool\n");
+        return 1;
+    }
+    printf("Pool com %d threads em %d nó(s) NUMA\n", pool->num_threads, pool->num_nodes);
+    for (int k = 0; k < pool->num_nodes; k++) {
+        Node* node = &pool->nodes[k];
+        printf("  nó %d: CPUs", node->id);
+        for (int j = 0; j < node->num_workers; j++)
+            printf(" %d", pool->workers[node->first_worker + j].cpu);
+        printf("\n");
+    }
+
+    // Adiciona tarefas ao pool e espera cada resultado pelo futuro
+    Future* futures[10];
     for (int i = 0; i < 10; i++) {
         int* task_num = (int*)malloc(sizeof(int));
         *task_num = i;
-        add_task(pool, example_task, task_num);
+        futures[i] = add_task(pool, example_task, task_num);
+        if (futures[i] == NULL)
+            free(task_num);
+    }
+    for (int i = 0; i < 10; i++) {
+        if (futures[i] != NULL)
+            printf("Tarefa %d retornou %ld\n", i, (long)(intptr_t)future_get(futures[i]));
+        future_release(futures[i]);
+    }
+
+    // fib(30) ingênuo: 1,3 milhão de tarefas (fib(31) - 1), quase todas criadas dentro do pool
+    struct timespec start;
+    FibArg fib = {30, 0};
+    demo_pool = pool;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Future* root = add_task(pool, fib_task, &fib);
+    if (root != NULL) {
+        future_get(root);
+        future_release(root);
+        double s = elapsed_s(&start);
+        printf("fib(%d) = %ld em %.3f s (%.1f milhões de tarefas/s)\n", fib.n, fib.result, s, 1346268 / s / 1e6);
+    }
+
+    // parallel_for preenche, parallel_reduce soma
+    const long n = 1L << 20;
+    long* values = (long*)malloc((size_t)n * sizeof(long));
+    long sum = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (values != NULL && parallel_for(pool, 0, n, 0, square_range, values) == 0 &&
+        parallel_reduce(pool, 0, n, 0, sum_range, sum_combine, &sum, sizeof(sum), values) == 0)
+        printf("soma dos quadrados até %ld: %ld (esperado %ld) em %.3f s\n", n - 1, sum, (n - 1) * n * (2 * n - 1) / 6,
+               elapsed_s(&start));
+
+    // A dica de afinidade leva a tarefa para o nó onde os dados estão
+    if (values != NULL) {
+        SumArg near = {values, n, 0, -1};
+        int node = memory_node(values);
+        Future* f = add_task_on(pool, node, sum_task, &near);
+        if (f != NULL) {
+            future_get(f);
+            future_release(f);
+            int k = near.cpu >= 0 ? pool->cpu_node[near.cpu] : -1;
+            printf("dados no nó %d, somados na CPU %d (nó %d): %ld\n", node, near.cpu, k >= 0 ? pool->nodes[k].id : -1,
+                   near.sum);
+        }
     }
+    free(values);
 
-    // Dê tempo para as threads processarem as tarefas
-    sleep(5);
+    // Um milhão de tarefas vindas de fora, em lotes: um aviso por lote em vez de um por tarefa
+    enum { BATCH = 1024 };
+    const long external = 1000000;
+    void* args[BATCH] = {0};
+    TaskGroup group;
+    task_group_init(&group, pool);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long sent = 0; sent < external; sent += BATCH)
+        submit_batch(pool, count_task, args, external - sent < BATCH ? external - sent : BATCH, &group);
+    task_group_wait_all(&group);
+    double s = elapsed_s(&start);
+    printf("%ld tarefas de fora em %.3f s (%.1f milhões/s)\n", atomic_load(&counted), s, (double)external / s / 1e6);
 
-    destroy_thread_pool(pool);
+    // O shutdown com POOL_DRAIN executa o que ainda está na fila
+    atomic_store(&counted, 0);
+    for (int i = 0; i < 10000; i++)
+        add_task_detached(pool, count_task, NULL);
+    destroy_thread_pool(pool, POOL_DRAIN);
+    printf("%ld tarefas concluídas no shutdown\n", atomic_load(&counted));
     return 0;
 }